@@ -0,0 +1,170 @@
+/*
+ * Batch parsing and macros (see jcm_batch.h).
+ */
+#include <ctype.h>
+#include <stdio.h>
+
+#include "jcm_batch.h"
+#include "jcm_command.h"
+
+using namespace std;
+
+static string trim(const string &s) {
+	size_t begin = s.find_first_not_of(" \t\r\n");
+	if (begin == string::npos)
+		return "";
+	size_t end = s.find_last_not_of(" \t\r\n");
+	return s.substr(begin, end - begin + 1);
+}
+
+//the first word of a statement
+static string firstWord(const string &s) {
+	return s.substr(0, s.find_first_of(" \t"));
+}
+
+bool parseBatch(const string &text, vector<BatchStep> &steps, string &error) {
+	steps.clear();
+	vector<size_t> open;
+	size_t pos = 0;
+	while (pos <= text.size()) {
+		size_t semi = text.find(';', pos);
+		if (semi == string::npos)
+			semi = text.size();
+		string s = trim(text.substr(pos, semi - pos));
+		pos = semi + 1;
+		if (s.empty())
+			continue;
+
+		BatchStep step;
+		step.text = s;
+		step.match = 0;
+		string verb = firstWord(s);
+		if (verb == "set")
+			step.kind = BATCH_STEP_SET;
+		else if (verb == "repeat")
+			step.kind = BATCH_STEP_REPEAT;
+		else if (verb == "for")
+			step.kind = BATCH_STEP_FOR;
+		else if (verb == "end")
+			step.kind = BATCH_STEP_END;
+		else
+			step.kind = BATCH_STEP_COMMAND;
+
+		if (step.kind == BATCH_STEP_REPEAT || step.kind == BATCH_STEP_FOR)
+			open.push_back(steps.size());
+		else if (step.kind == BATCH_STEP_END) {
+			if (open.empty()) {
+				error = "Batch has an end without a repeat or for";
+				return false;
+			}
+			step.match = open.back();
+			steps[open.back()].match = steps.size();
+			open.pop_back();
+		}
+		steps.push_back(step);
+	}
+	if (!open.empty()) {
+		error = "Batch has a repeat or for without an end";
+		return false;
+	}
+	if (steps.empty()) {
+		error = "Batch is empty";
+		return false;
+	}
+	return true;
+}
+
+string substituteVariables(const string &text, const map<string, string> &vars) {
+	if (text.find('$') == string::npos)
+		return text;
+	string out;
+	for (size_t i = 0; i < text.size(); ) {
+		if (text[i] != '$') {
+			out += text[i++];
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < text.size() && (isalnum((unsigned char) text[end]) ||
+				text[end] == '_'))
+			end++;
+		map<string, string>::const_iterator it = vars.find(text.substr(i + 1, end - i - 1));
+		if (end > i + 1 && it != vars.end())
+			out += it->second;
+		else
+			out.append(text, i, end - i);
+		i = end;
+	}
+	return out;
+}
+
+bool expandBatchList(const string &list, vector<string> &values) {
+	values.clear();
+	Tokens parts;
+	if (!split(Token(list.data(), list.size()), ',', parts))
+		return false;
+	for (size_t i = 0; i < parts.size(); i++) {
+		const Token &p = parts[i];
+		size_t dash = p.find('-');
+		if (p.empty())
+			return false;
+		if (dash == p.length()) {
+			if (values.size() >= MAX_BATCH_LIST)
+				return false;
+			values.push_back(p.str());
+			continue;
+		}
+		u32 first, last;
+		if (!parseNumber(p.substr(0, dash), 16, first) ||
+				!parseNumber(p.substr(dash + 1), 16, last) || last < first ||
+				last - first >= MAX_BATCH_LIST - values.size())
+			return false;
+		for (uint64_t v = first; v <= last; v++) {
+			char hex[16];
+			snprintf(hex, sizeof hex, "%x", (u32) v);
+			values.push_back(hex);
+		}
+	}
+	return true;
+}
+
+MacroTable::MacroTable() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+MacroTable::~MacroTable() {
+	pthread_mutex_destroy(&lock);
+}
+
+bool MacroTable::define(const string &name, const string &body) {
+	pthread_mutex_lock(&lock);
+	bool ok = macros.size() < MAX_MACROS || macros.count(name) > 0;
+	if (ok)
+		macros[name] = body;
+	pthread_mutex_unlock(&lock);
+	return ok;
+}
+
+bool MacroTable::remove(const string &name) {
+	pthread_mutex_lock(&lock);
+	bool found = macros.erase(name) > 0;
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+bool MacroTable::find(const string &name, string &body) {
+	pthread_mutex_lock(&lock);
+	map<string, string>::iterator it = macros.find(name);
+	bool found = it != macros.end();
+	if (found)
+		body = it->second;
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+void MacroTable::names(vector<string> &out) {
+	out.clear();
+	pthread_mutex_lock(&lock);
+	for (map<string, string>::iterator it = macros.begin(); it != macros.end(); ++it)
+		out.push_back(it->first);
+	pthread_mutex_unlock(&lock);
+}
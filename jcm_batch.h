@@ -0,0 +1,129 @@
+/*
+ * Batches: many commands sent as one request ("batch CMD; CMD; ..."), run
+ * back to back on the device's executor while it holds the chain, with all
+ * their responses packed into one reply. A sequence like "write far X; read
+ * frame X; op injectfault normal ...; read crc; read status" then costs one
+ * round trip instead of one per command.
+ *
+ * Besides commands, a batch can hold:
+ *    set NAME VALUE       sets a variable; $NAME in later statements is
+ *                         replaced by VALUE
+ *    repeat N; ...; end   runs the statements up to end N times
+ *    for NAME LIST; ...; end
+ *                         runs them once for each value in LIST, which is
+ *                         comma separated words and hex ranges (e.g.
+ *                         "400-40f,1000"), with $NAME set to the value
+ * Macros are batches kept under a name ("macro define NAME BODY") and run
+ * with "macro run NAME (ARGS...)", where $1, $2, ... are the arguments.
+ *
+ * Statements are split at ';', so a batch can't echo a ';'.
+ */
+
+#ifndef JCM_BATCH
+#define JCM_BATCH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "XilinxTopLibrary.h"
+
+//most commands one batch may run, counting every pass of its loops
+#define MAX_BATCH_COMMANDS 100000
+//most statements of any kind one batch may run, counting every pass of its
+//loops, so loops that run no commands still end
+#define MAX_BATCH_STEPS 1000000
+//most bytes of responses one batch may collect
+#define MAX_BATCH_RESPONSE (64 * 1024 * 1024)
+//how deeply macros may run other macros
+#define MAX_BATCH_DEPTH 8
+//most values a "for" list may expand to
+#define MAX_BATCH_LIST 65536
+//most macros kept
+#define MAX_MACROS 256
+
+//Starts the response to a batch; numRecords records follow, each a
+//BatchRecordHeader and len bytes of what one of its commands sent
+struct BatchHeader {
+   //commands run
+   u32 numCommands;
+   //commands that failed
+   u32 numFailed;
+   //the command the batch stopped at (stop on error), or BATCH_NOT_STOPPED
+   u32 stoppedAt;
+   u32 numRecords;
+};
+
+#define BATCH_NOT_STOPPED 0xffffffff
+
+struct BatchRecordHeader {
+   //which command sent it, counting from 0 in the order they ran. A command
+   //that sends several responses has a record for each; one that sends
+   //nothing has none.
+   u32 command;
+   //PACKET_TYPE_* the response would have been sent as
+   u32 type;
+   u32 flags;
+   u32 len;
+};
+
+//set in BatchRecordHeader.flags if the command failed
+#define BATCH_RECORD_FAILED 0x1
+
+//kinds of BatchStep
+#define BATCH_STEP_COMMAND 0
+#define BATCH_STEP_SET 1
+#define BATCH_STEP_REPEAT 2
+#define BATCH_STEP_FOR 3
+#define BATCH_STEP_END 4
+
+//One statement of a batch
+struct BatchStep {
+   int kind;
+   //the statement, with its variables not yet replaced
+   std::string text;
+   //for repeat and for, the index of their end; for end, of its loop
+   size_t match;
+};
+
+//Splits a batch into its statements and pairs up its loops. Returns false,
+//with the reason in error, if it is malformed.
+bool parseBatch(const std::string &text, std::vector<BatchStep> &steps,
+   std::string &error);
+
+//Replaces every $NAME in text with the variable's value. Unknown variables
+//are left as they are.
+std::string substituteVariables(const std::string &text,
+   const std::map<std::string, std::string> &vars);
+
+//Expands a "for" list: up to MAX_TOKENS comma separated words, with hex
+//ranges ("400-40f") expanded to each hex number in them. Returns false if
+//it is malformed or longer than MAX_BATCH_LIST.
+bool expandBatchList(const std::string &list, std::vector<std::string> &values);
+
+//Macros, shared by every session and device
+class MacroTable {
+
+public:
+
+   MacroTable();
+   ~MacroTable();
+
+   //Adds or replaces a macro. Returns false if there are already MAX_MACROS.
+   bool define(const std::string &name, const std::string &body);
+   //Returns false if there is no such macro
+   bool remove(const std::string &name);
+   bool find(const std::string &name, std::string &body);
+   //every macro's name, in order
+   void names(std::vector<std::string> &out);
+
+private:
+
+   //protects macros
+   pthread_mutex_t lock;
+   std::map<std::string, std::string> macros;
+};
+
+#endif
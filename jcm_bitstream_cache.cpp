@@ -0,0 +1,212 @@
+/*
+ * Bit files staged in RAM (see jcm_bitstream_cache.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+
+#include "jcm_bitstream_cache.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+//Reads a whole file into data; returns false if it can't. If mustOwn is
+//set it also has to be a regular file (not a link) that this user owns.
+static bool readFile(const char *path, vector<char> &data, bool mustOwn = false) {
+	int fd = open(path, O_RDONLY | (mustOwn ? O_NOFOLLOW : 0));
+	if (fd == -1)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 &&
+		(!mustOwn || (S_ISREG(st.st_mode) && st.st_uid == geteuid()));
+	if (ok) {
+		data.resize(st.st_size);
+		size_t done = 0;
+		while (ok && done < data.size()) {
+			ssize_t n = read(fd, &data[done], data.size() - done);
+			ok = n > 0;
+			if (ok)
+				done += n;
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+BitstreamCache::BitstreamCache() {
+	pthread_mutex_init(&lock, NULL);
+	struct stat st;
+	stageDir = stat(BITSTREAM_STAGE_DIR, &st) == 0 && S_ISDIR(st.st_mode) ?
+		BITSTREAM_STAGE_DIR : BITSTREAM_STAGE_FALLBACK_DIR;
+}
+
+BitstreamCache::~BitstreamCache() {
+	clear();
+	pthread_mutex_destroy(&lock);
+}
+
+bool BitstreamCache::preload(const string &path, BitstreamEntry &entry,
+		string &error) {
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1) {
+		error = "Can't find " + path;
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	BitstreamEntry *e = find(path, st);
+	bool ok = true;
+	if (e != NULL)
+		entry = *e;
+	else
+		ok = stage(path, st, entry, error);
+	pthread_mutex_unlock(&lock);
+	return ok;
+}
+
+string BitstreamCache::lookup(const string &path, bool &hit, uint64_t &savedNs) {
+	hit = false;
+	savedNs = 0;
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1)
+		return path;
+
+	string staged = path;
+	pthread_mutex_lock(&lock);
+	BitstreamEntry *e = find(path, st);
+	BitstreamEntry fresh;
+	string error;
+	if (e != NULL)
+		hit = true;
+	else if (stage(path, st, fresh, error))
+		e = find(path, st);
+	else
+		fprintf(stderr, "bitstream cache: %s\n", error.c_str());
+	if (e != NULL) {
+		if (hit) {
+			savedNs = e->readNs > e->stagedReadNs ? e->readNs - e->stagedReadNs : 0;
+			e->hits++;
+			e->savedNs += savedNs;
+		}
+		e->lastUsedNs = monotonicNs();
+		staged = e->stagedPath;
+	}
+	pthread_mutex_unlock(&lock);
+	return staged;
+}
+
+void BitstreamCache::entries(vector<BitstreamEntry> &out) {
+	pthread_mutex_lock(&lock);
+	out = cached;
+	pthread_mutex_unlock(&lock);
+	sort(out.begin(), out.end(), [](const BitstreamEntry &a, const BitstreamEntry &b) {
+		return a.lastUsedNs > b.lastUsedNs;
+	});
+}
+
+void BitstreamCache::clear() {
+	pthread_mutex_lock(&lock);
+	while (!cached.empty())
+		removeAt(cached.size() - 1);
+	pthread_mutex_unlock(&lock);
+}
+
+BitstreamEntry * BitstreamCache::find(const string &path, const struct stat &st) {
+	for (size_t i = 0; i < cached.size(); i++) {
+		BitstreamEntry &e = cached[i];
+		if (e.path == path && e.size == (uint64_t) st.st_size &&
+				e.mtime.tv_sec == st.st_mtim.tv_sec &&
+				e.mtime.tv_nsec == st.st_mtim.tv_nsec &&
+				access(e.stagedPath.c_str(), R_OK) == 0)
+			return &e;
+	}
+	return NULL;
+}
+
+bool BitstreamCache::stage(const string &path, const struct stat &st,
+		BitstreamEntry &entry, string &error) {
+	vector<char> data;
+	uint64_t begin = monotonicNs();
+	if (!readFile(path.c_str(), data) || data.empty()) {
+		error = "Reading " + path + " failed";
+		return false;
+	}
+	entry.readNs = monotonicNs() - begin;
+
+	uint64_t h = FNV_OFFSET_BASIS;
+	for (size_t i = 0; i < data.size(); i++)
+		h = (h ^ (unsigned char) data[i]) * FNV_PRIME;
+
+	char name[64];
+	snprintf(name, sizeof name, "/" BITSTREAM_STAGE_PREFIX "%016llx.bit",
+		(unsigned long long) h);
+	entry.path = path;
+	entry.stagedPath = stageDir + name;
+	entry.mtime = st.st_mtim;
+	entry.size = data.size();
+	entry.hash = h;
+	entry.hits = 0;
+	entry.savedNs = 0;
+	entry.lastUsedNs = monotonicNs();
+
+	//the old entry for the file is stale (and its copy may be about to be
+	//rewritten); make room for the new one
+	for (size_t i = 0; i < cached.size(); i++)
+		if (cached[i].path == path) {
+			removeAt(i);
+			break;
+		}
+	if (cached.size() >= MAX_CACHED_BITSTREAMS) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < cached.size(); i++)
+			if (cached[i].lastUsedNs < cached[oldest].lastUsedNs)
+				oldest = i;
+		removeAt(oldest);
+	}
+
+	//The stage directory is shared with every other user, so a copy already
+	//there is only used if it is ours and holds exactly this bit file.
+	//Reading it is also what it costs to use, to work out what each use
+	//saves.
+	vector<char> staged;
+	begin = monotonicNs();
+	if (readFile(entry.stagedPath.c_str(), staged, true) && staged == data)
+		entry.stagedReadNs = monotonicNs() - begin;
+	else {
+		//written under a name nobody else can have made, then renamed over
+		//whatever is there, so a half written copy is never used
+		string tmpPath = stageDir + "/" BITSTREAM_STAGE_PREFIX "XXXXXX";
+		int fd = mkstemp(&tmpPath[0]);
+		bool ok = fd != -1 && fchmod(fd, 0644) == 0 &&
+			write(fd, &data[0], data.size()) == (ssize_t) data.size();
+		if (fd != -1)
+			close(fd);
+		if (!ok || rename(tmpPath.c_str(), entry.stagedPath.c_str()) == -1) {
+			if (fd != -1)
+				unlink(tmpPath.c_str());
+			error = "Staging " + path + " in " + stageDir + " failed";
+			return false;
+		}
+
+		begin = monotonicNs();
+		readFile(entry.stagedPath.c_str(), staged);
+		entry.stagedReadNs = monotonicNs() - begin;
+	}
+
+	cached.push_back(entry);
+	return true;
+}
+
+void BitstreamCache::removeAt(size_t i) {
+	string staged = cached[i].stagedPath;
+	cached.erase(cached.begin() + i);
+	for (size_t j = 0; j < cached.size(); j++)
+		if (cached[j].stagedPath == staged)
+			return;
+	unlink(staged.c_str());
+}
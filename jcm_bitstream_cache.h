@@ -0,0 +1,90 @@
+/*
+ * Bit files kept in RAM for "configure". Configuring reads the whole bit
+ * file, and from an SD card that read is a large part of every
+ * configuration, which a fault injection campaign repeats thousands of
+ * times. The first time a bit file is used (or "configure preload" names
+ * it) a copy is staged on tmpfs, and later configurations read the copy
+ * instead. Entries are keyed by the file's path, modification time and size,
+ * so a rebuilt bit file is staged again; staged copies are named by a hash
+ * of their contents, so the same bitstream under two names is kept once.
+ *
+ * XilinxTopLibrary only configures from a file, so it is the file that is
+ * cached rather than the library's parsed form of it.
+ */
+
+#ifndef JCM_BITSTREAM_CACHE
+#define JCM_BITSTREAM_CACHE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+//where staged copies go, if it exists (tmpfs on most systems)...
+#define BITSTREAM_STAGE_DIR "/dev/shm"
+//...and otherwise
+#define BITSTREAM_STAGE_FALLBACK_DIR "/tmp"
+#define BITSTREAM_STAGE_PREFIX "jcm_bitstream_"
+//bit files kept at once; the least recently used goes first
+#define MAX_CACHED_BITSTREAMS 8
+
+struct BitstreamEntry {
+   //the bit file, and its copy in RAM
+   std::string path;
+   std::string stagedPath;
+   //the bit file when it was staged
+   struct timespec mtime;
+   uint64_t size;
+   //FNV-1a of the contents
+   uint64_t hash;
+   //how long reading the bit file took, and reading the staged copy
+   uint64_t readNs;
+   uint64_t stagedReadNs;
+   //configurations that used the staged copy, and an estimate of the reading
+   //time that saved in all (readNs less stagedReadNs for each, both timed
+   //once when the file was staged)
+   uint64_t hits;
+   uint64_t savedNs;
+   //monotonicNs() of the last use, for eviction
+   uint64_t lastUsedNs;
+};
+
+class BitstreamCache {
+
+public:
+
+   BitstreamCache();
+   ~BitstreamCache();
+
+   //Stages a bit file (again, if it has changed). Returns false, with the
+   //reason in error, if it can't be read or staged.
+   bool preload(const std::string &path, BitstreamEntry &entry, std::string &error);
+   //The file to configure from for path: its staged copy, staged now if it
+   //isn't yet, or path itself if it can't be. hit is set if it was already
+   //staged, and savedNs to an estimate of the reading time the copy saves.
+   std::string lookup(const std::string &path, bool &hit, uint64_t &savedNs);
+   //every entry, most recently used first
+   void entries(std::vector<BitstreamEntry> &out);
+   //Drops every entry and its staged copy
+   void clear();
+
+private:
+
+   //Finds path's entry, if it is still current. The caller holds lock.
+   BitstreamEntry * find(const std::string &path, const struct stat &st);
+   //Stages path, replacing any old entry. The caller holds lock.
+   bool stage(const std::string &path, const struct stat &st,
+      BitstreamEntry &entry, std::string &error);
+   //Removes an entry, unlinking its staged copy unless another entry shares
+   //it. The caller holds lock.
+   void removeAt(size_t i);
+
+   //protects everything below
+   pthread_mutex_t lock;
+   std::string stageDir;
+   std::vector<BitstreamEntry> cached;
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Server side fault injection campaigns (see jcm_campaign.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jcm_campaign.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+static u32 usBetween(const struct timespec &a, const struct timespec &b) {
+	return (b.tv_sec - a.tv_sec) * 1000000 + (b.tv_nsec - a.tv_nsec) / 1000;
+}
+
+void runCampaign(JcmDevice *device, const CampaignConfig &config,
+		function<void(const CampaignRecord *records, int n)> deliver) {
+	int wordsPerFrame = device->getWordsPerFrame();
+	unsigned int seed = config.seed;
+	struct timespec dwell;
+	dwell.tv_sec = config.dwellUs / 1000000;
+	dwell.tv_nsec = (config.dwellUs % 1000000) * 1000;
+
+	vector<CampaignRecord> records;
+	records.reserve(CAMPAIGN_RECORDS_PER_CHUNK);
+
+	for (u32 i = 0; i < config.numInjections; i++) {
+		CampaignRecord r;
+		memset(&r, 0, sizeof r);
+		r.index = i;
+		r.frameAddress = config.targets[rand_r(&seed) % config.targets.size()];
+		r.word = rand_r(&seed) % wordsPerFrame;
+		//keep every flipped bit inside the chosen word
+		r.bit = rand_r(&seed) % (33 - config.numBits);
+		r.numBits = config.numBits;
+
+		struct timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+
+		if (!TIMED("jtag.injectFault", device->injectFault(r.frameAddress,
+				r.word, r.bit, r.numBits, false, true, config.jtagHZ)))
+			r.flags |= CAMPAIGN_INJECT_FAILED;
+		else {
+			if (config.dwellUs > 0)
+				nanosleep(&dwell, NULL);
+
+			if (config.observe & OBSERVE_CRC)
+				r.crc = TIMED("jtag.readCrc", device->readCrc(config.jtagHZ));
+			if (config.observe & OBSERVE_STATUS)
+				r.status = TIMED("jtag.readStatus",
+					device->readStatus(config.jtagHZ));
+			if (config.observe & OBSERVE_BSCAN) {
+				u32 *bscan = TIMED("jtag.readBscan",
+					device->readBscan(config.bscanNumber, 32, config.jtagHZ));
+				if (bscan != NULL)
+					r.bscan = bscan[0];
+			}
+			r.flags |= config.observe;
+
+			//flipping the same bits again puts the frame back
+			if (!TIMED("jtag.injectFault", device->injectFault(r.frameAddress,
+					r.word, r.bit, r.numBits, false, true, config.jtagHZ)))
+				r.flags |= CAMPAIGN_REPAIR_FAILED;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		r.elapsedUs = usBetween(begin, end);
+
+		records.push_back(r);
+		if (records.size() == CAMPAIGN_RECORDS_PER_CHUNK) {
+			deliver(&records[0], records.size());
+			records.clear();
+		}
+	}
+
+	if (!records.empty())
+		deliver(&records[0], records.size());
+}
@@ -0,0 +1,85 @@
+/*
+ * Fault injection campaigns run on the server. Each injection flips bits in
+ * a randomly chosen target frame, waits, observes the design (CRC, status,
+ * bscan), flips the bits back and records what happened, all without a round
+ * trip to the client. The random choices come from a seeded generator, so a
+ * campaign can be run again exactly.
+ */
+
+#ifndef JCM_CAMPAIGN
+#define JCM_CAMPAIGN
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+
+#include "jcm_device.h"
+
+//what to read after each injection (CampaignConfig.observe)
+#define OBSERVE_CRC 0x1
+#define OBSERVE_STATUS 0x2
+#define OBSERVE_BSCAN 0x4
+
+//set in CampaignRecord.flags (along with the OBSERVE_* bits read)
+#define CAMPAIGN_INJECT_FAILED 0x100
+#define CAMPAIGN_REPAIR_FAILED 0x200
+
+//max number of bits flipped by one injection
+#define CAMPAIGN_MAX_BITS 32
+//max number of injections in one campaign, so the length of the response
+//(a CampaignHeader and a CampaignRecord each) fits in its u32 header
+#define CAMPAIGN_MAX_INJECTIONS 100000000
+//number of records handed to deliver at a time
+#define CAMPAIGN_RECORDS_PER_CHUNK 256
+
+struct CampaignConfig {
+   CampaignConfig() : numInjections(0), seed(0), numBits(1), dwellUs(0),
+      observe(0), bscanNumber(1), jtagHZ(false) {}
+
+   u32 numInjections;
+   u32 seed;
+   //bits flipped by each injection
+   u32 numBits;
+   //time between injecting and observing, in microseconds
+   u32 dwellUs;
+   //OBSERVE_* bits
+   u32 observe;
+   //which bscan register OBSERVE_BSCAN reads (1-4)
+   int bscanNumber;
+   //frame addresses injections are picked from
+   std::vector<u32> targets;
+   bool jtagHZ;
+};
+
+//Starts the response to "op campaign"; numInjections records follow
+struct CampaignHeader {
+   u32 seed;
+   u32 numInjections;
+   u32 numTargets;
+   u32 recordSize;
+};
+
+//What happened on one injection (32 bytes)
+struct CampaignRecord {
+   u32 index;
+   u32 frameAddress;
+   uint16_t word;
+   uint8_t bit;
+   uint8_t numBits;
+   //OBSERVE_* bits for the values read, CAMPAIGN_*_FAILED on errors
+   u32 flags;
+   u32 crc;
+   u32 status;
+   //first word of the bscan register
+   u32 bscan;
+   //time from injecting to repairing, in microseconds
+   u32 elapsedUs;
+};
+
+//Runs the campaign, handing the records to deliver in chunks of up to
+//CAMPAIGN_RECORDS_PER_CHUNK as they are made. The caller must own the device
+//for the whole run.
+void runCampaign(JcmDevice *device, const CampaignConfig &config,
+   std::function<void(const CampaignRecord *records, int n)> deliver);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Frame encodings (see jcm_codec.h).
+ */
+#include <string.h>
+
+#include "jcm_codec.h"
+
+using namespace std;
+
+static const char *encodingNames[NUM_ENCODINGS] = { "raw", "rle", "xor", "lz" };
+
+int parseEncoding(const char *name) {
+	for (int i = 0; i < NUM_ENCODINGS; i++)
+		if (strcmp(name, encodingNames[i]) == 0)
+			return i;
+	return -1;
+}
+
+const char * encodingName(int encoding) {
+	if (encoding < 0 || encoding >= NUM_ENCODINGS)
+		return "unknown";
+	return encodingNames[encoding];
+}
+
+static inline void putVarint(vector<uint8_t> &out, size_t v) {
+	while (v >= 0x80) {
+		out.push_back((uint8_t) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t) v);
+}
+
+static inline bool getVarint(const uint8_t *&in, const uint8_t *end, size_t &v) {
+	v = 0;
+	for (int shift = 0; in < end && shift < 35; shift += 7) {
+		uint8_t b = *in++;
+		v |= (size_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+void encodeRle(const uint32_t *words, size_t numWords, vector<uint8_t> &out) {
+	size_t i = 0;
+	while (i < numWords) {
+		size_t zeros = i;
+		while (zeros < numWords && words[zeros] == 0)
+			zeros++;
+		size_t literals = zeros;
+		while (literals < numWords && words[literals] != 0)
+			literals++;
+
+		putVarint(out, zeros - i);
+		putVarint(out, literals - zeros);
+		size_t at = out.size();
+		out.resize(at + (literals - zeros) * sizeof(uint32_t));
+		memcpy(&out[at], words + zeros, (literals - zeros) * sizeof(uint32_t));
+		i = literals;
+	}
+}
+
+bool decodeRle(const uint8_t *in, size_t len, uint32_t *words, size_t numWords) {
+	const uint8_t *end = in + len;
+	size_t i = 0;
+	while (i < numWords) {
+		size_t zeros, literals;
+		if (!getVarint(in, end, zeros) || !getVarint(in, end, literals) ||
+				zeros > numWords - i || literals > numWords - i - zeros ||
+				(size_t) (end - in) < literals * sizeof(uint32_t))
+			return false;
+		memset(words + i, 0, zeros * sizeof(uint32_t));
+		i += zeros;
+		memcpy(words + i, in, literals * sizeof(uint32_t));
+		in += literals * sizeof(uint32_t);
+		i += literals;
+	}
+	return in == end;
+}
+
+//LZ4 block format limits: matches are at least 4 bytes, the last 5 bytes
+//are always literals and the last match starts at least 12 bytes from the
+//end
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static inline void putLength(vector<uint8_t> &out, size_t n) {
+	for (; n >= 255; n -= 255)
+		out.push_back(255);
+	out.push_back((uint8_t) n);
+}
+
+//Appends one sequence: the literals, then (unless it is the last sequence)
+//a match of matchLen bytes offset bytes back
+static void putSequence(vector<uint8_t> &out, const uint8_t *literals,
+		size_t numLiterals, size_t offset, size_t matchLen) {
+	size_t ml = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+	out.push_back((uint8_t) ((numLiterals < 15 ? numLiterals : 15) << 4 |
+		(ml < 15 ? ml : 15)));
+	if (numLiterals >= 15)
+		putLength(out, numLiterals - 15);
+	out.insert(out.end(), literals, literals + numLiterals);
+	if (matchLen == 0)
+		return;
+	out.push_back((uint8_t) offset);
+	out.push_back((uint8_t) (offset >> 8));
+	if (ml >= 15)
+		putLength(out, ml - 15);
+}
+
+void encodeLz(const uint8_t *in, size_t len, vector<uint8_t> &out) {
+	//positions of the last 4 byte sequence seen with each hash
+	int32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof table);
+
+	size_t ip = 0, anchor = 0;
+	if (len > LZ_MF_LIMIT) {
+		size_t matchLimit = len - LZ_LAST_LITERALS;
+		while (ip < len - LZ_MF_LIMIT) {
+			uint32_t seq = read32(in + ip);
+			uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+			int32_t ref = table[h];
+			table[h] = ip;
+			if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+				//skip ahead faster the longer nothing has matched, so data
+				//that doesn't compress goes through quickly
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			size_t matchLen = LZ_MIN_MATCH;
+			while (ip + matchLen < matchLimit && in[ref + matchLen] == in[ip + matchLen])
+				matchLen++;
+			putSequence(out, in + anchor, ip - anchor, ip - ref, matchLen);
+			ip += matchLen;
+			anchor = ip;
+		}
+	}
+	putSequence(out, in + anchor, len - anchor, 0, 0);
+}
+
+static inline bool getLength(const uint8_t *&in, const uint8_t *end, size_t &n) {
+	uint8_t b;
+	do {
+		if (in >= end)
+			return false;
+		b = *in++;
+		n += b;
+	} while (b == 255);
+	return true;
+}
+
+bool decodeLz(const uint8_t *in, size_t len, uint8_t *out, size_t outLen) {
+	const uint8_t *end = in + len;
+	size_t op = 0;
+	while (in < end) {
+		uint8_t token = *in++;
+		size_t numLiterals = token >> 4;
+		if (numLiterals == 15 && !getLength(in, end, numLiterals))
+			return false;
+		if ((size_t) (end - in) < numLiterals || outLen - op < numLiterals)
+			return false;
+		memcpy(out + op, in, numLiterals);
+		in += numLiterals;
+		op += numLiterals;
+		//the last sequence has no match
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return false;
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		size_t matchLen = token & 15;
+		if (matchLen == 15 && !getLength(in, end, matchLen))
+			return false;
+		matchLen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || outLen - op < matchLen)
+			return false;
+		//matches may overlap what they copy, so go a byte at a time
+		const uint8_t *from = out + op - offset;
+		for (size_t i = 0; i < matchLen; i++)
+			out[op + i] = from[i];
+		op += matchLen;
+	}
+	return op == outLen;
+}
+
+void encodeFrames(int encoding, const uint32_t *frames, size_t numWords,
+		const uint32_t *ref, vector<uint32_t> &scratch, vector<uint8_t> &out) {
+	switch (encoding) {
+	case ENCODING_RLE:
+		encodeRle(frames, numWords, out);
+		break;
+	case ENCODING_XOR:
+		scratch.resize(numWords);
+		for (size_t i = 0; i < numWords; i++)
+			scratch[i] = frames[i] ^ ref[i];
+		encodeRle(&scratch[0], numWords, out);
+		break;
+	case ENCODING_LZ:
+		encodeLz((const uint8_t *) frames, numWords * sizeof(uint32_t), out);
+		break;
+	default:
+		out.insert(out.end(), (const uint8_t *) frames,
+			(const uint8_t *) (frames + numWords));
+	}
+}
+
+bool decodeFrames(int encoding, const uint8_t *in, size_t len, const uint32_t *ref,
+		uint32_t *frames, size_t numWords) {
+	switch (encoding) {
+	case ENCODING_RLE:
+		return decodeRle(in, len, frames, numWords);
+	case ENCODING_XOR:
+		if (!decodeRle(in, len, frames, numWords))
+			return false;
+		for (size_t i = 0; i < numWords; i++)
+			frames[i] ^= ref[i];
+		return true;
+	case ENCODING_LZ:
+		return decodeLz(in, len, (uint8_t *) frames, numWords * sizeof(uint32_t));
+	default:
+		if (len != numWords * sizeof(uint32_t))
+			return false;
+		memcpy(frames, in, len);
+		return true;
+	}
+}
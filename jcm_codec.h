@@ -0,0 +1,76 @@
+/*
+ * Encodings for sending configuration frames to clients. Frames are mostly
+ * zeros, and a healthy device's frames are almost all identical to golden,
+ * so sending them raw wastes most of the link. A session picks one with
+ * "options encoding" and frame reads are then sent as a series of encoded
+ * blocks, one per pipeline chunk:
+ *
+ *    raw   the frame words as they are
+ *    rle   runs of zero words replaced by their length
+ *    xor   each frame XORed with its golden copy, then rle; a healthy device
+ *          comes out as little more than the run lengths
+ *    lz    LZ4 block format, for data that isn't made of zero runs
+ *
+ * Everything is little endian. The decoders are here too so the codecs can be
+ * checked against each other and benchmarked on the JCM ("op codecbench").
+ */
+
+#ifndef JCM_CODEC
+#define JCM_CODEC
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define ENCODING_RAW 0
+#define ENCODING_RLE 1
+#define ENCODING_XOR 2
+#define ENCODING_LZ 3
+#define NUM_ENCODINGS 4
+
+//set in EncodedBlockHeader.flags on the last block of a response
+#define ENCODED_FLAG_LAST 0x1
+//set on a block whose frames couldn't be read; its data decodes to zeros
+#define ENCODED_FLAG_READ_ERROR 0x2
+
+//Starts every encoded block (16 bytes), followed by the encoded data
+struct EncodedBlockHeader {
+   //how the data is encoded; an xor block falls back to rle when golden
+   //doesn't have every one of its frames
+   uint8_t encoding;
+   uint8_t flags;
+   uint16_t reserved;
+   //number of frames sent in earlier blocks of the same response
+   uint32_t firstFrame;
+   uint32_t numFrames;
+   //size of the frames once decoded
+   uint32_t rawBytes;
+};
+
+//The encoding called name, or -1
+int parseEncoding(const char *name);
+const char * encodingName(int encoding);
+
+//Zero run length encoding of numWords words: groups of a varint count of
+//zero words, a varint count of literal words, then the literal words.
+//Appends to out.
+void encodeRle(const uint32_t *words, size_t numWords, std::vector<uint8_t> &out);
+//Decodes exactly numWords words. Returns false if the data is malformed.
+bool decodeRle(const uint8_t *in, size_t len, uint32_t *words, size_t numWords);
+
+//Compresses len bytes into an LZ4 block (no frame header). Appends to out.
+void encodeLz(const uint8_t *in, size_t len, std::vector<uint8_t> &out);
+//Decompresses an LZ4 block that must come to exactly outLen bytes. Returns
+//false if the data is malformed.
+bool decodeLz(const uint8_t *in, size_t len, uint8_t *out, size_t outLen);
+
+//Encodes numWords words of frames with the given encoding and appends them
+//to out. ref is what xor encodes against (numWords words of golden) and is
+//only used by ENCODING_XOR. scratch holds the XORed words between calls.
+void encodeFrames(int encoding, const uint32_t *frames, size_t numWords,
+   const uint32_t *ref, std::vector<uint32_t> &scratch, std::vector<uint8_t> &out);
+//Reverses encodeFrames
+bool decodeFrames(int encoding, const uint8_t *in, size_t len, const uint32_t *ref,
+   uint32_t *frames, size_t numWords);
+
+#endif
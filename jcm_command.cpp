@@ -0,0 +1,109 @@
+/*
+ * Allocation free command tokenizing (see jcm_command.h).
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jcm_command.h"
+
+//slots in verbHash's table of verbs; a power of two, and well over
+//NUM_KNOWN_VERBS so the probes stay short
+#define VERB_TABLE_SIZE 256
+
+bool tokenize(const char *text, size_t len, Tokens &out) {
+	size_t i = 0;
+	while (i < len) {
+		while (i < len && isspace((unsigned char) text[i]))
+			i++;
+		if (i == len)
+			break;
+		size_t begin = i;
+		while (i < len && !isspace((unsigned char) text[i]))
+			i++;
+		if (!out.push(Token(text + begin, i - begin)))
+			return false;
+	}
+	return true;
+}
+
+bool split(const Token &s, char delimiter, Tokens &out) {
+	Token rest = s;
+	while (1) {
+		size_t d = rest.find(delimiter);
+		if (!out.push(rest.substr(0, d)))
+			return false;
+		if (d == rest.len)
+			return true;
+		rest = rest.substr(d + 1);
+	}
+}
+
+bool parseNumber(const Token &s, int base, uint32_t &value) {
+	Token digits = s;
+	if (base == 16 && (digits.startsWith("0x") || digits.startsWith("0X")))
+		digits = digits.substr(2);
+	if (digits.empty())
+		return false;
+
+	uint64_t v = 0;
+	for (size_t i = 0; i < digits.len; i++) {
+		char c = digits[i];
+		int d;
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (base == 16 && isxdigit((unsigned char) c))
+			d = tolower((unsigned char) c) - 'a' + 10;
+		else
+			return false;
+		v = v * base + d;
+		if (v > 0xffffffffULL)
+			return false;
+	}
+	value = v;
+	return true;
+}
+
+bool parseFloat(const Token &s, float &value) {
+	//strtof needs a terminated string
+	char buf[32];
+	if (s.empty() || s.len >= sizeof buf)
+		return false;
+	memcpy(buf, s.p, s.len);
+	buf[s.len] = '\0';
+	char *end;
+	value = strtof(buf, &end);
+	return *end == '\0';
+}
+
+uint64_t verbHash(const Token &t) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < t.len; i++)
+		h = (h ^ (unsigned char) t.p[i]) * 1099511628211ULL;
+
+	//every verb, by the low bits of its hash (open addressing), filled in the
+	//first time through
+	static const struct VerbTable {
+		VerbTable() {
+			memset(slots, 0, sizeof slots);
+			for (size_t i = 0; i < NUM_KNOWN_VERBS; i++) {
+				uint64_t vh = fnv1a(knownVerbs[i]);
+				size_t s = vh & (VERB_TABLE_SIZE - 1);
+				while (slots[s].verb != NULL)
+					s = (s + 1) & (VERB_TABLE_SIZE - 1);
+				slots[s].hash = vh;
+				slots[s].verb = knownVerbs[i];
+			}
+		}
+		struct {
+			uint64_t hash;
+			const char *verb;
+		} slots[VERB_TABLE_SIZE];
+	} table;
+
+	for (size_t s = h & (VERB_TABLE_SIZE - 1); table.slots[s].verb != NULL;
+			s = (s + 1) & (VERB_TABLE_SIZE - 1))
+		if (table.slots[s].hash == h)
+			return t == table.slots[s].verb ? h : 0;
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Splitting commands into words without copying them. A Token points into
+ * the command text instead of holding its own string, so tokenizing and
+ * dispatching a command does not allocate. Verbs are matched by switching on
+ * their hash, and the case labels are hashed at compile time. Every verb is
+ * listed in knownVerbs, and a word's hash is only switched on once the word
+ * has been compared with the verb of that hash, so a word that merely hashes
+ * the same as a verb can never run it; a case label that isn't listed does
+ * not compile.
+ */
+
+#ifndef JCM_COMMAND
+#define JCM_COMMAND
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+//max number of words in a command
+#define MAX_TOKENS 32
+
+//A word of a command. It points into the command text, which must outlive it.
+struct Token {
+   Token() : p(""), len(0) {}
+   Token(const char *p, size_t len) : p(p), len(len) {}
+
+   //A word may hold a NUL (it is whatever the client sent), so the lengths
+   //are compared first and the bytes after; s is never read past its end
+   bool operator==(const char *s) const {
+      return strlen(s) == len && memcmp(p, s, len) == 0;
+   }
+   bool operator!=(const char *s) const { return !(*this == s); }
+   char operator[](size_t i) const { return p[i]; }
+   size_t length() const { return len; }
+   bool empty() const { return len == 0; }
+
+   bool startsWith(const char *s) const {
+      size_t n = strlen(s);
+      return n <= len && memcmp(p, s, n) == 0;
+   }
+   //position of the first c, or len if there is none
+   size_t find(char c) const {
+      const char *f = (const char *) memchr(p, c, len);
+      return f == NULL ? len : f - p;
+   }
+   Token substr(size_t pos, size_t n = (size_t) -1) const {
+      if (pos > len)
+         pos = len;
+      return Token(p + pos, n < len - pos ? n : len - pos);
+   }
+   //a copy, for the few places that need a null terminated string
+   std::string str() const { return std::string(p, len); }
+
+   const char *p;
+   size_t len;
+};
+
+//The words of a command, in order
+class Tokens {
+
+public:
+
+   Tokens() : n(0) {}
+
+   size_t size() const { return n; }
+   //Out of range words are empty rather than undefined
+   const Token &operator[](size_t i) const { return i < n ? t[i] : none; }
+   const Token &back() const { return (*this)[n - 1]; }
+
+   //Adds a word; returns false if there are already MAX_TOKENS
+   bool push(const Token &token) {
+      if (n == MAX_TOKENS)
+         return false;
+      t[n++] = token;
+      return true;
+   }
+
+private:
+
+   Token t[MAX_TOKENS];
+   size_t n;
+   Token none;
+};
+
+//Splits text at white space. Returns false if it has more than MAX_TOKENS
+//words.
+bool tokenize(const char *text, size_t len, Tokens &out);
+
+//Splits a word at every delimiter (e.g. "crc,status"), keeping empty words.
+//Returns false if it has more than MAX_TOKENS parts.
+bool split(const Token &s, char delimiter, Tokens &out);
+
+//Parses a base 10 or base 16 (optionally 0x prefixed) number that fits in
+//32 bits. Returns false if the word is not one.
+bool parseNumber(const Token &s, int base, uint32_t &value);
+
+//Parses a decimal number, which may have a sign and a fraction (e.g.
+//"-1.5"). Returns false if the word is not one.
+bool parseFloat(const Token &s, float &value);
+
+//Every word that is switched on, as a command's verb or sub-verb
+constexpr const char *knownVerbs[] = {
+   "?", "batch", "blindscrub", "bscan", "campaign", "capture", "cmd",
+   "codecbench", "configure", "cor1", "crc", "crchw", "crclive", "crcsw",
+   "ctrl0", "devices", "echo", "events", "exit", "f", "far", "fault",
+   "fradlist", "frame", "glutmask", "golden", "help", "hwversion", "i",
+   "idcode", "injectfault", "job", "jobs", "macro", "numbramframes",
+   "numlogicframes", "numtotalframes", "o", "op", "option", "options", "prog",
+   "r", "read", "readback", "resend", "scrub", "setup", "start", "stats",
+   "status", "stop", "subscribe", "threshold", "unsubscribe", "w",
+   "wordsperframe", "write", "xadc"
+};
+#define NUM_KNOWN_VERBS (sizeof knownVerbs / sizeof knownVerbs[0])
+
+//64 bit FNV-1a hash
+constexpr uint64_t fnv1a(const char *s, uint64_t h = 14695981039346656037ULL) {
+   return *s == '\0' ? h : fnv1a(s + 1, (h ^ (unsigned char) *s) * 1099511628211ULL);
+}
+
+constexpr bool sameString(const char *a, const char *b) {
+   return *a == *b && (*a == '\0' || sameString(a + 1, b + 1));
+}
+
+constexpr bool isKnownVerb(const char *s, size_t i = 0) {
+   return i < NUM_KNOWN_VERBS &&
+      (sameString(s, knownVerbs[i]) || isKnownVerb(s, i + 1));
+}
+
+//The hash of a verb, for case labels. Two verbs in one switch that hash the
+//same, a verb missing from knownVerbs, or one that hashes to 0 don't
+//compile.
+constexpr uint64_t verbHash(const char *s) {
+   return isKnownVerb(s) && fnv1a(s) != 0 ? fnv1a(s) :
+      throw "verb missing from knownVerbs";
+}
+
+//The hash of the verb a word is, to switch on, or 0 if it is not one of
+//knownVerbs (even if it hashes the same as one)
+uint64_t verbHash(const Token &t);
+
+#endif
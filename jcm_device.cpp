@@ -0,0 +1,31 @@
+/*
+ * The real device, through XilinxTopLibrary (see jcm_device.h).
+ */
+#include "jcm_device.h"
+
+void JcmDevice::readRegisters(const int *regs, int n, u32 *values,
+		bool jtagHZ) {
+	for (int i = 0; i < n; i++) {
+		switch (regs[i]) {
+		case JCM_REG_FAR: values[i] = readFar(jtagHZ); break;
+		case JCM_REG_IDCODE: values[i] = readIdCode(jtagHZ); break;
+		case JCM_REG_CTRL0: values[i] = readCtrl0(); break;
+		case JCM_REG_CRC: values[i] = readCrc(jtagHZ); break;
+		case JCM_REG_CRCHW: values[i] = readCrcHw(jtagHZ); break;
+		case JCM_REG_CRCSW: values[i] = readCrcSw(jtagHZ); break;
+		case JCM_REG_CRCLIVE: values[i] = readCrcLive(); break;
+		case JCM_REG_STATUS: values[i] = readStatus(jtagHZ); break;
+		case JCM_REG_COR1: values[i] = readCor1(jtagHZ); break;
+		case JCM_REG_CMD: values[i] = readCmd(jtagHZ); break;
+		default: values[i] = 0;
+		}
+	}
+}
+
+XilinxJcmDevice::XilinxJcmDevice(const char *configFile) {
+	lib = new XilinxTopLibrary(configFile, configFile);
+}
+
+XilinxJcmDevice::~XilinxJcmDevice() {
+	delete lib;
+}
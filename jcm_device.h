@@ -0,0 +1,261 @@
+/*
+ * The fpga as the server sees it. JCMServer (and the scrubber and campaign
+ * runner) only talk to a JcmDevice, so the real board behind
+ * XilinxTopLibrary can be swapped for a simulated one (see
+ * jcm_sim_device.h) to profile and load test the server without hardware.
+ *
+ * The calls and their arguments are those of XilinxTopLibrary. Pointers
+ * returned by the read calls point into the device's own buffer and are only
+ * good until the next read.
+ */
+
+#ifndef JCM_DEVICE
+#define JCM_DEVICE
+
+#include <string>
+
+#include "XilinxTopLibrary.h"
+
+//configuration registers, for readRegisters()
+#define JCM_REG_FAR 0
+#define JCM_REG_IDCODE 1
+#define JCM_REG_CTRL0 2
+#define JCM_REG_CRC 3
+#define JCM_REG_CRCHW 4
+#define JCM_REG_CRCSW 5
+#define JCM_REG_CRCLIVE 6
+#define JCM_REG_STATUS 7
+#define JCM_REG_COR1 8
+#define JCM_REG_CMD 9
+#define JCM_NUM_REGS 10
+
+class JcmDevice {
+
+public:
+
+   virtual ~JcmDevice() {}
+
+   //Geometry
+   virtual int getWordsPerFrame() = 0;
+   virtual int getNumLogicFrames() = 0;
+   virtual int getNumBramFrames() = 0;
+   virtual int getTotalFrames() = 0;
+   //every frame address, logic frames first, in readback order
+   virtual u32 * getFrameAddressArray() = 0;
+   virtual void setActiveDeviceIndex(int index) = 0;
+
+   //Configuration memory
+   virtual u32 * readFrames(u32 frameAddress, int numFrames, bool jtagHZ) = 0;
+   virtual u32 * readFullDevice(const char *path, bool readBram,
+      bool clearGlutMask, bool issueCapture, bool jtagHZ) = 0;
+   //configures the device with a bit file ("" for the default one)
+   virtual bool configure(std::string bitFile) = 0;
+   virtual void blindScrub(bool a, bool b, bool jtagHZ) = 0;
+
+   //Fault injection
+   virtual bool injectFault(u32 frameAddress, int word, int bit, int numBits,
+      bool a, bool b, bool jtagHZ) = 0;
+   virtual bool injectRandomFault(int numBits, bool a, bool repairFault,
+      bool b, bool jtagHZ) = 0;
+   virtual void injectMultiFrameFault(u32 frameAddress, u32 commandReg,
+      bool jtagHZ) = 0;
+
+   //Configuration registers
+   virtual u32 readFar(bool jtagHZ) = 0;
+   virtual u32 readIdCode(bool jtagHZ) = 0;
+   virtual u32 readCtrl0() = 0;
+   virtual u32 readCrc(bool jtagHZ) = 0;
+   virtual u32 readCrcHw(bool jtagHZ) = 0;
+   virtual u32 readCrcSw(bool jtagHZ) = 0;
+   virtual u32 readCrcLive() = 0;
+   virtual u32 readStatus(bool jtagHZ) = 0;
+   virtual u32 readCor1(bool jtagHZ) = 0;
+   virtual u32 readCmd(bool jtagHZ) = 0;
+   virtual void writeFar(u32 value, bool jtagHZ) = 0;
+   virtual void writeCor1(u32 value, bool jtagHZ) = 0;
+   virtual void writeCrcSw(u32 value, bool jtagHZ) = 0;
+   virtual void setGlutMaskBit(bool jtagHZ) = 0;
+   virtual void clearGlutMaskBit(bool jtagHZ) = 0;
+   virtual void issueCapture(bool jtagHZ) = 0;
+   virtual void issueProg(u32 wbStarAddr, bool jtagHZ) = 0;
+   //Reads n registers (JCM_REG_*) into values, in one configuration port
+   //session where the device can. By default they are read one at a time.
+   virtual void readRegisters(const int *regs, int n, u32 *values,
+      bool jtagHZ);
+
+   //User logic and monitoring
+   virtual u32 * readBscan(int number, int numBits, bool jtagHZ) = 0;
+   virtual float readXadcTemp(u32 readCommand) = 0;
+   virtual float readXadcVoltage(u32 readCommand) = 0;
+   virtual float readXadcCurTemp() = 0;
+   virtual float readXadcVccInt() = 0;
+   virtual float readXadcVccAux() = 0;
+};
+
+//The real device, through XilinxTopLibrary
+class XilinxJcmDevice : public JcmDevice {
+
+public:
+
+   XilinxJcmDevice(const char *configFile);
+   ~XilinxJcmDevice();
+
+   int getWordsPerFrame() { return lib->getWordsPerFrame(); }
+   int getNumLogicFrames() { return lib->getNumLogicFrames(); }
+   int getNumBramFrames() { return lib->getNumBramFrames(); }
+   int getTotalFrames() { return lib->getTotalFrames(); }
+   u32 * getFrameAddressArray() { return lib->getFrameAddressArray(); }
+   void setActiveDeviceIndex(int index) { lib->setActiveDeviceIndex(index); }
+
+   u32 * readFrames(u32 frameAddress, int numFrames, bool jtagHZ) {
+      return lib->readFrames(frameAddress, numFrames, jtagHZ);
+   }
+   u32 * readFullDevice(const char *path, bool readBram, bool clearGlutMask,
+         bool issueCapture, bool jtagHZ) {
+      return lib->readFullDevice(path, readBram, clearGlutMask, issueCapture,
+         jtagHZ);
+   }
+   bool configure(std::string bitFile) {
+      return lib->getDevice()->configureDevice(bitFile);
+   }
+   void blindScrub(bool a, bool b, bool jtagHZ) { lib->blindScrub(a, b, jtagHZ); }
+
+   bool injectFault(u32 frameAddress, int word, int bit, int numBits, bool a,
+         bool b, bool jtagHZ) {
+      return lib->injectFault(frameAddress, word, bit, numBits, a, b, jtagHZ);
+   }
+   bool injectRandomFault(int numBits, bool a, bool repairFault, bool b,
+         bool jtagHZ) {
+      return lib->injectRandomFault(numBits, a, repairFault, b, jtagHZ);
+   }
+   void injectMultiFrameFault(u32 frameAddress, u32 commandReg, bool jtagHZ) {
+      lib->injectMultiFrameFault(frameAddress, commandReg, jtagHZ);
+   }
+
+   u32 readFar(bool jtagHZ) { return lib->readFar(jtagHZ); }
+   u32 readIdCode(bool jtagHZ) { return lib->readIdCode(jtagHZ); }
+   u32 readCtrl0() { return lib->readCtrl0(); }
+   u32 readCrc(bool jtagHZ) { return lib->readCrc(jtagHZ); }
+   u32 readCrcHw(bool jtagHZ) { return lib->readCrcHw(jtagHZ); }
+   u32 readCrcSw(bool jtagHZ) { return lib->readCrcSw(jtagHZ); }
+   u32 readCrcLive() { return lib->readCrcLive(); }
+   u32 readStatus(bool jtagHZ) { return lib->readStatus(jtagHZ); }
+   u32 readCor1(bool jtagHZ) { return lib->readCor1(jtagHZ); }
+   u32 readCmd(bool jtagHZ) { return lib->readCmd(jtagHZ); }
+   void writeFar(u32 value, bool jtagHZ) { lib->writeFar(value, jtagHZ); }
+   void writeCor1(u32 value, bool jtagHZ) { lib->writeCor1(value, jtagHZ); }
+   void writeCrcSw(u32 value, bool jtagHZ) { lib->writeCrcSw(value, jtagHZ); }
+   void setGlutMaskBit(bool jtagHZ) { lib->setGlutMaskBit(jtagHZ); }
+   void clearGlutMaskBit(bool jtagHZ) { lib->clearGlutMaskBit(jtagHZ); }
+   void issueCapture(bool jtagHZ) { lib->issueCapture(jtagHZ); }
+   void issueProg(u32 wbStarAddr, bool jtagHZ) { lib->issueProg(wbStarAddr, jtagHZ); }
+
+   u32 * readBscan(int number, int numBits, bool jtagHZ) {
+      return lib->readBscan(number, numBits, jtagHZ);
+   }
+   float readXadcTemp(u32 readCommand) { return lib->readXadcTemp(readCommand); }
+   float readXadcVoltage(u32 readCommand) {
+      return lib->readXadcVoltage(readCommand);
+   }
+   float readXadcCurTemp() { return lib->readXadcCurTemp(); }
+   float readXadcVccInt() { return lib->readXadcVccInt(); }
+   float readXadcVccAux() { return lib->readXadcVccAux(); }
+
+private:
+
+   XilinxTopLibrary *lib;
+};
+
+//One of several devices on a JTAG chain. Every call first makes this device
+//the chain's active one, so each device can be used as if it were alone.
+//The caller must hold the chain's lock, so no other member of the chain can
+//change the active device half way through a call.
+class ChainDevice : public JcmDevice {
+
+public:
+
+   //chain isn't owned
+   ChainDevice(JcmDevice *chain, int index) : chain(chain), index(index) {}
+
+   int getWordsPerFrame() { return select()->getWordsPerFrame(); }
+   int getNumLogicFrames() { return select()->getNumLogicFrames(); }
+   int getNumBramFrames() { return select()->getNumBramFrames(); }
+   int getTotalFrames() { return select()->getTotalFrames(); }
+   u32 * getFrameAddressArray() { return select()->getFrameAddressArray(); }
+   //the index is fixed; it's what tells the members of the chain apart
+   void setActiveDeviceIndex(int /*index*/) {}
+
+   u32 * readFrames(u32 frameAddress, int numFrames, bool jtagHZ) {
+      return select()->readFrames(frameAddress, numFrames, jtagHZ);
+   }
+   u32 * readFullDevice(const char *path, bool readBram, bool clearGlutMask,
+         bool issueCapture, bool jtagHZ) {
+      return select()->readFullDevice(path, readBram, clearGlutMask,
+         issueCapture, jtagHZ);
+   }
+   bool configure(std::string bitFile) { return select()->configure(bitFile); }
+   void blindScrub(bool a, bool b, bool jtagHZ) {
+      select()->blindScrub(a, b, jtagHZ);
+   }
+
+   bool injectFault(u32 frameAddress, int word, int bit, int numBits, bool a,
+         bool b, bool jtagHZ) {
+      return select()->injectFault(frameAddress, word, bit, numBits, a, b,
+         jtagHZ);
+   }
+   bool injectRandomFault(int numBits, bool a, bool repairFault, bool b,
+         bool jtagHZ) {
+      return select()->injectRandomFault(numBits, a, repairFault, b, jtagHZ);
+   }
+   void injectMultiFrameFault(u32 frameAddress, u32 commandReg, bool jtagHZ) {
+      select()->injectMultiFrameFault(frameAddress, commandReg, jtagHZ);
+   }
+
+   u32 readFar(bool jtagHZ) { return select()->readFar(jtagHZ); }
+   u32 readIdCode(bool jtagHZ) { return select()->readIdCode(jtagHZ); }
+   u32 readCtrl0() { return select()->readCtrl0(); }
+   u32 readCrc(bool jtagHZ) { return select()->readCrc(jtagHZ); }
+   u32 readCrcHw(bool jtagHZ) { return select()->readCrcHw(jtagHZ); }
+   u32 readCrcSw(bool jtagHZ) { return select()->readCrcSw(jtagHZ); }
+   u32 readCrcLive() { return select()->readCrcLive(); }
+   u32 readStatus(bool jtagHZ) { return select()->readStatus(jtagHZ); }
+   u32 readCor1(bool jtagHZ) { return select()->readCor1(jtagHZ); }
+   u32 readCmd(bool jtagHZ) { return select()->readCmd(jtagHZ); }
+   void writeFar(u32 value, bool jtagHZ) { select()->writeFar(value, jtagHZ); }
+   void writeCor1(u32 value, bool jtagHZ) { select()->writeCor1(value, jtagHZ); }
+   void writeCrcSw(u32 value, bool jtagHZ) { select()->writeCrcSw(value, jtagHZ); }
+   void setGlutMaskBit(bool jtagHZ) { select()->setGlutMaskBit(jtagHZ); }
+   void clearGlutMaskBit(bool jtagHZ) { select()->clearGlutMaskBit(jtagHZ); }
+   void issueCapture(bool jtagHZ) { select()->issueCapture(jtagHZ); }
+   void issueProg(u32 wbStarAddr, bool jtagHZ) {
+      select()->issueProg(wbStarAddr, jtagHZ);
+   }
+   void readRegisters(const int *regs, int n, u32 *values, bool jtagHZ) {
+      select()->readRegisters(regs, n, values, jtagHZ);
+   }
+
+   u32 * readBscan(int number, int numBits, bool jtagHZ) {
+      return select()->readBscan(number, numBits, jtagHZ);
+   }
+   float readXadcTemp(u32 readCommand) {
+      return select()->readXadcTemp(readCommand);
+   }
+   float readXadcVoltage(u32 readCommand) {
+      return select()->readXadcVoltage(readCommand);
+   }
+   float readXadcCurTemp() { return select()->readXadcCurTemp(); }
+   float readXadcVccInt() { return select()->readXadcVccInt(); }
+   float readXadcVccAux() { return select()->readXadcVccAux(); }
+
+private:
+
+   JcmDevice * select() {
+      chain->setActiveDeviceIndex(index);
+      return chain;
+   }
+
+   JcmDevice *chain;
+   int index;
+};
+
+#endif
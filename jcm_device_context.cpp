@@ -0,0 +1,64 @@
+/*
+ * Per-device state of the server (see jcm_device_context.h).
+ */
+#include <stdio.h>
+#include <unistd.h>
+
+#include "jcm_device_context.h"
+
+using namespace std;
+
+//base with the device number before its extension ("golden.1.jcm"), or
+//base itself for device 0
+static string devicePath(const char *base, int index) {
+	string path(base);
+	if (index == 0)
+		return path;
+	char n[16];
+	snprintf(n, sizeof n, ".%d", index);
+	size_t slash = path.rfind('/');
+	size_t dot = path.rfind('.');
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return path + n;
+	return path.insert(dot, n);
+}
+
+DeviceContext::DeviceContext(int index, const string &name, JcmDevice *device,
+		bool ownsDevice, TicketLock *chainLock, EventBus *events,
+		function<void(const XadcSample &)> onXadcSample) : index(index),
+		name(name), device(device), ownsDevice(ownsDevice), chainLock(chainLock),
+		commands(COMMAND_QUEUE_SIZE), jobs(JOB_QUEUE_SIZE) {
+	goldenPath = devicePath(GOLDEN_FILE, index);
+	readbackPath = devicePath(READBACK_FILE, index);
+
+	chainLock->lock();
+	pipeline = new FramePipeline(device->getWordsPerFrame());
+	geometry = new FrameGeometry(device);
+	chainLock->unlock();
+	printf("Device %d: %d frames (%d logic, %d bram)\n", index,
+		geometry->numFrames(), geometry->numLogicFrames(),
+		geometry->numBramFrames());
+	checksums = new FrameChecksums(geometry->numFrames());
+
+	//pick up the golden image from the last run, if there is one
+	golden = new GoldenImage();
+	mask = new GoldenImage();
+	if (access(goldenPath.c_str(), R_OK) == 0 && golden->load(goldenPath.c_str()))
+		printf("Device %d: loaded golden image %s (%d frames)\n", index,
+			goldenPath.c_str(), golden->numFrames());
+	scrubber = new Scrubber(device, chainLock, geometry, golden, mask, checksums,
+		events, index);
+	xadc = new XadcSampler(device, chainLock, onXadcSample);
+}
+
+DeviceContext::~DeviceContext() {
+	delete xadc;
+	delete scrubber;
+	delete checksums;
+	delete geometry;
+	delete mask;
+	delete golden;
+	delete pipeline;
+	if (ownsDevice)
+		delete device;
+}
@@ -0,0 +1,93 @@
+/*
+ * Everything the server keeps for one fpga. A server can drive several
+ * devices, on one JTAG chain or on several, and each gets a DeviceContext:
+ * the device, the lock of the chain it is on, its own golden image,
+ * scrubber and XADC sampler, an executor thread that runs the commands
+ * sent to it and a job thread that runs its background jobs. Devices on different chains work in parallel; devices on the
+ * same chain share the chain's TicketLock, which serves them in turn.
+ */
+
+#ifndef JCM_DEVICE_CONTEXT
+#define JCM_DEVICE_CONTEXT
+
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <functional>
+
+#include "jcm_device.h"
+#include "jcm_ticket_lock.h"
+#include "jcm_queue.h"
+#include "jcm_session.h"
+#include "jcm_pipeline.h"
+#include "jcm_golden.h"
+#include "jcm_scrubber.h"
+#include "jcm_xadc.h"
+#include "jcm_frame_checksums.h"
+#include "jcm_frame_geometry.h"
+#include "jcm_jobs.h"
+#include "jcm_events.h"
+
+//where "readback" and "readback file" leave the full device readback
+#define READBACK_FILE "/tmp/readBack.data"
+//Max number of commands waiting for one device's executor thread
+#define COMMAND_QUEUE_SIZE 256
+//max number of devices a server drives
+#define MAX_DEVICES 16
+
+class DeviceContext {
+
+public:
+
+   //device is the one to use: either a whole chain, or a ChainDevice on one
+   //(which the context then owns). chainLock is shared by every device on
+   //the chain. The scrubber publishes on events.
+   DeviceContext(int index, const std::string &name, JcmDevice *device,
+      bool ownsDevice, TicketLock *chainLock, EventBus *events,
+      std::function<void(const XadcSample &)> onXadcSample);
+   ~DeviceContext();
+
+   //the device's number, as in "@1 read far"
+   int index;
+   //what it was made from (its config file, or "sim")
+   std::string name;
+   JcmDevice *device;
+   bool ownsDevice;
+   //Held by whichever thread is using the chain: an executor for the length
+   //of each command, a scrubber or job for each chunk of frames it reads
+   TicketLock *chainLock;
+
+   //Device 0 uses GOLDEN_FILE and READBACK_FILE; the others get the same
+   //names with their number before the extension
+   std::string goldenPath;
+   std::string readbackPath;
+
+   //The device's frame layout, shared by everything that walks its frames
+   FrameGeometry *geometry;
+
+   //Overlaps reading frames from the fpga with sending them
+   FramePipeline *pipeline;
+   //Known good copy of the configuration frames
+   GoldenImage *golden;
+   //Bits to ignore when comparing against golden (same file format)
+   GoldenImage *mask;
+   //Checksum of every frame as last read, for "readback delta"
+   FrameChecksums *checksums;
+   Scrubber *scrubber;
+   XadcSampler *xadc;
+
+   //Commands sent to this device. The reactor pushes them here; the
+   //executor thread runs them in order.
+   BlockingQueue<Command> commands;
+   pthread_t executorTh;
+
+   //The CRC registers (JCM_REG_*) as last read by a command, so a read
+   //that finds one changed can publish it (executor thread only)
+   std::map<int, u32> lastCrc;
+
+   //Jobs ("job run") for this device, run one at a time by the job thread
+   BlockingQueue<std::shared_ptr<Job> > jobs;
+   pthread_t jobTh;
+};
+
+#endif
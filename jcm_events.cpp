@@ -0,0 +1,247 @@
+/*
+ * The event bus (see jcm_events.h).
+ */
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "jcm_events.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+static void * deliveryThreadStaticStub(void *b) {
+	return ((EventBus*) b)->deliveryThread();
+}
+
+const char * eventTypeName(int type) {
+	switch (type) {
+		case EVENT_UPSET: return "upset";
+		case EVENT_SCRUB_PASS: return "scrub";
+		case EVENT_BLIND_SCRUB: return "blind";
+		case EVENT_INJECTION: return "inject";
+		case EVENT_CRC_CHANGE: return "crc";
+		case EVENT_XADC_THRESHOLD: return "xadc";
+	}
+	return NULL;
+}
+
+EventBus::EventBus() : stopping(false), running(false), pending(false),
+		nextId(1), seq(0) {
+	pthread_mutex_init(&lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+EventBus::~EventBus() {
+	stop();
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+void EventBus::start(function<void()> wakeFn) {
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		onDelivered = wakeFn;
+		stopping = false;
+		running = true;
+		pthread_create(&deliveryTh, NULL, &deliveryThreadStaticStub, this);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void EventBus::stop() {
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(deliveryTh, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+u32 EventBus::subscribe(const void *owner, const string &name, u32 typeMask,
+		int device, EventSink sink) {
+	pthread_mutex_lock(&lock);
+	size_t i = 0;
+	while (i < subs.size() && subs[i].owner != owner)
+		i++;
+	if (i == subs.size() && subs.size() >= MAX_EVENT_SUBSCRIBERS) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	if (i == subs.size())
+		subs.push_back(Subscriber());
+	Subscriber &s = subs[i];
+	s.id = nextId++;
+	s.owner = owner;
+	s.name = name;
+	s.typeMask = typeMask;
+	s.device = device;
+	s.sink = sink;
+	s.queue.clear();
+	s.dropped = 0;
+	s.retryNs = 0;
+	s.totalDelivered = 0;
+	s.totalDropped = 0;
+	u32 id = s.id;
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+bool EventBus::unsubscribe(const void *owner) {
+	bool found = false;
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < subs.size(); i++)
+		if (subs[i].owner == owner) {
+			subs.erase(subs.begin() + i);
+			found = true;
+			break;
+		}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+void EventBus::publish(int type, int device, const void *payload, u32 len) {
+	Event e;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	e.h.type = type;
+	e.h.device = device;
+	e.h.timeUs = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	e.h.dropped = 0;
+	e.h.len = len < MAX_EVENT_PAYLOAD ? len : MAX_EVENT_PAYLOAD;
+	memcpy(e.payload, payload, e.h.len);
+
+	pthread_mutex_lock(&lock);
+	e.h.seq = seq++;
+	bool queued = false;
+	for (size_t i = 0; i < subs.size(); i++) {
+		Subscriber &s = subs[i];
+		if (!(s.typeMask & EVENT_MASK(type)) ||
+				(s.device != EVENT_ANY_DEVICE && s.device != device))
+			continue;
+		if (s.queue.size() >= EVENT_QUEUE_SIZE) {
+			s.dropped++;
+			s.totalDropped++;
+			continue;
+		}
+		e.h.dropped = s.dropped;
+		s.dropped = 0;
+		s.queue.push_back(e);
+		queued = true;
+	}
+	if (queued) {
+		pending = true;
+		pthread_cond_signal(&wake);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void EventBus::subscribers(vector<EventSubscriberInfo> &out) {
+	out.clear();
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < subs.size(); i++) {
+		Subscriber &s = subs[i];
+		EventSubscriberInfo info;
+		info.id = s.id;
+		info.name = s.name;
+		info.typeMask = s.typeMask;
+		info.device = s.device;
+		info.queued = s.queue.size();
+		info.delivered = s.totalDelivered;
+		info.dropped = s.totalDropped;
+		out.push_back(info);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+u32 EventBus::published() {
+	pthread_mutex_lock(&lock);
+	u32 n = seq;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+//Each subscriber gets everything it has waiting as one delivery, so a burst
+//of upsets costs one response rather than one each. The sinks only queue
+//on a session if it has room, so holding the lock while calling them keeps
+//publishers waiting no longer than the copying takes.
+bool EventBus::deliver() {
+	bool busy = false, delivered = false;
+	uint64_t now = monotonicNs();
+	for (size_t i = 0; i < subs.size(); ) {
+		Subscriber &s = subs[i];
+		if (s.queue.empty()) {
+			i++;
+			continue;
+		}
+		//one that had no room isn't asked again until EVENT_RETRY_MS later,
+		//however much is published meanwhile
+		if (now < s.retryNs) {
+			busy = true;
+			i++;
+			continue;
+		}
+		packed.clear();
+		for (size_t k = 0; k < s.queue.size(); k++) {
+			const Event &e = s.queue[k];
+			packed.insert(packed.end(), (const char *) &e.h,
+				(const char *) &e.h + sizeof e.h);
+			packed.insert(packed.end(), e.payload, e.payload + e.h.len);
+		}
+		int r = s.sink(packed);
+		if (r == EVENT_SINK_GONE) {
+			subs.erase(subs.begin() + i);
+			continue;
+		}
+		if (r == EVENT_SINK_BUSY) {
+			s.retryNs = now + EVENT_RETRY_MS * 1000000ULL;
+			busy = true;
+		}
+		else {
+			s.totalDelivered += s.queue.size();
+			s.queue.clear();
+			delivered = true;
+		}
+		i++;
+	}
+	if (delivered && onDelivered)
+		onDelivered();
+	return busy;
+}
+
+//Delivers whenever something is published, and every EVENT_RETRY_MS while
+//a subscriber has events it had no room for
+void * EventBus::deliveryThread() {
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		pending = false;
+		if (deliver()) {
+			struct timespec when;
+			clock_gettime(CLOCK_MONOTONIC, &when);
+			when.tv_nsec += EVENT_RETRY_MS * 1000000L;
+			if (when.tv_nsec >= 1000000000L) {
+				when.tv_sec++;
+				when.tv_nsec -= 1000000000L;
+			}
+			while (!stopping && !pending &&
+				pthread_cond_timedwait(&wake, &lock, &when) == 0);
+		}
+		else
+			while (!stopping && !pending)
+				pthread_cond_wait(&wake, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
@@ -0,0 +1,246 @@
+/*
+ * The event bus. Things that happen on a device are published as typed
+ * binary events: the scrubber finding and repairing an upset, finishing a
+ * pass or blind scrubbing, a fault being injected, a CRC register reading
+ * differently from the last time it was read, and an XADC value crossing a
+ * threshold set with "events threshold". Clients subscribe ("events
+ * subscribe") with a filter on event type and device, and are sent what
+ * matches as it happens instead of polling for it.
+ *
+ * Publishing never waits. Each subscriber has its own queue of up to
+ * EVENT_QUEUE_SIZE events; a delivery thread moves them to the subscriber's
+ * session whenever it has room, and a subscriber that falls behind misses
+ * events rather than holding up the scrubber. The events it misses are
+ * counted, and the count is sent with the next event it does get.
+ */
+
+#ifndef JCM_EVENTS
+#define JCM_EVENTS
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "XilinxTopLibrary.h"
+
+//event types
+#define EVENT_UPSET 1          //UpsetEvent
+#define EVENT_SCRUB_PASS 2     //ScrubPassEvent
+#define EVENT_BLIND_SCRUB 3    //BlindScrubEvent
+#define EVENT_INJECTION 4      //InjectionEvent
+#define EVENT_CRC_CHANGE 5     //CrcChangeEvent
+#define EVENT_XADC_THRESHOLD 6 //XadcThresholdEvent
+#define NUM_EVENT_TYPES 7
+
+//bit of a type mask for each type
+#define EVENT_MASK(type) (1u << (type))
+#define EVENT_ALL_TYPES (EVENT_MASK(NUM_EVENT_TYPES) - 2)
+//device filter that matches every device
+#define EVENT_ANY_DEVICE -1
+
+//events one subscriber can have waiting; more are dropped (and counted)
+#define EVENT_QUEUE_SIZE 1024
+//most subscribers at once
+#define MAX_EVENT_SUBSCRIBERS 64
+//largest payload of any event type
+#define MAX_EVENT_PAYLOAD 32
+//ms between attempts to deliver to a subscriber whose session is full
+#define EVENT_RETRY_MS 20
+
+//Starts every event; len bytes of the type's payload follow. A delivery
+//holds as many events as were waiting, back to back.
+struct EventHeader {
+   uint16_t type;
+   uint16_t device;
+   //counts every event published, on every device, so a gap shows events
+   //this subscriber's filter didn't match
+   u32 seq;
+   //when it happened, in microseconds since the epoch
+   uint64_t timeUs;
+   //events this subscriber missed just before this one, its queue being full
+   u32 dropped;
+   u32 len;
+};
+
+//what did something (in BlindScrubEvent and InjectionEvent)
+#define EVENT_SOURCE_COMMAND 0
+#define EVENT_SOURCE_SCRUBBER 1
+#define EVENT_SOURCE_JOB 2
+#define EVENT_SOURCE_CAMPAIGN 3
+
+//An upset bit found by the scrubber
+struct UpsetEvent {
+   u32 frameAddress;
+   u32 word;
+   u32 bit;
+   //EVENT_UPSET_REPAIRED if it was flipped back
+   u32 flags;
+};
+
+#define EVENT_UPSET_REPAIRED 0x1
+
+//A complete pass of the scrubber
+struct ScrubPassEvent {
+   //passes since the scrubber started, this one included
+   u32 pass;
+   u32 framesScanned;
+   u32 upsetBits;
+   u32 framesRepaired;
+   u32 readErrors;
+   u32 passUs;
+};
+
+struct BlindScrubEvent {
+   u32 source;
+};
+
+//A fault injected on purpose
+struct InjectionEvent {
+   //where, unless EVENT_INJECTION_RANDOM is set (the library picks the
+   //place and doesn't say)
+   u32 frameAddress;
+   u32 word;
+   u32 bit;
+   u32 numBits;
+   u32 source;
+   u32 flags;
+};
+
+#define EVENT_INJECTION_RANDOM 0x1
+#define EVENT_INJECTION_MULTIFRAME 0x2
+//flipped back again straight after (campaigns, "repairfault")
+#define EVENT_INJECTION_REPAIRED 0x4
+#define EVENT_INJECTION_FAILED 0x8
+
+//A CRC register (JCM_REG_*) read differently from the last time it was
+//read on the device
+struct CrcChangeEvent {
+   u32 reg;
+   u32 oldValue;
+   u32 newValue;
+};
+
+//XADC values thresholds can be set on
+#define EVENT_XADC_TEMP 0
+#define EVENT_XADC_VCCINT 1
+#define EVENT_XADC_VCCAUX 2
+#define NUM_EVENT_XADC_CHANNELS 3
+
+//where a value is relative to its thresholds
+#define EVENT_XADC_IN_RANGE 0
+#define EVENT_XADC_BELOW 1
+#define EVENT_XADC_ABOVE 2
+
+//An XADC value moving into, out of or across its range
+struct XadcThresholdEvent {
+   u32 channel;
+   //EVENT_XADC_* it is now
+   u32 state;
+   //degrees C or mV, as in XadcSample
+   float value;
+   float low;
+   float high;
+};
+
+//Hands a delivery (packed events) to a subscriber; returns EVENT_SINK_*
+typedef std::function<int(const std::vector<char> &events)> EventSink;
+
+#define EVENT_SINK_DELIVERED 0
+//no room just now; the events stay queued and delivery is tried again
+#define EVENT_SINK_BUSY 1
+//the subscriber has gone and is dropped
+#define EVENT_SINK_GONE 2
+
+//What "events status" shows of a subscriber
+struct EventSubscriberInfo {
+   u32 id;
+   std::string name;
+   u32 typeMask;
+   int device;
+   u32 queued;
+   uint64_t delivered;
+   uint64_t dropped;
+};
+
+class EventBus {
+
+public:
+
+   EventBus();
+   ~EventBus();
+
+   //Starts the delivery thread. wake is called after each round of
+   //deliveries.
+   void start(std::function<void()> wake);
+   //Stops the delivery thread and waits for it to exit. Events published
+   //from then on are queued but not delivered.
+   void stop();
+
+   //Subscribes owner (one subscription each; a new one replaces the old) to
+   //events of the types in typeMask from device, or every device if it is
+   //EVENT_ANY_DEVICE. Returns the subscription's id, or 0 if there are
+   //already MAX_EVENT_SUBSCRIBERS.
+   u32 subscribe(const void *owner, const std::string &name, u32 typeMask,
+      int device, EventSink sink);
+   //Returns false if owner has no subscription
+   bool unsubscribe(const void *owner);
+   //Queues an event for every subscriber it matches. Never waits for them.
+   void publish(int type, int device, const void *payload, u32 len);
+   void subscribers(std::vector<EventSubscriberInfo> &out);
+   //events published since the server started
+   u32 published();
+
+   //This needs to be public so the static stub function can access it.
+   void * deliveryThread();
+
+private:
+
+   struct Event {
+      EventHeader h;
+      char payload[MAX_EVENT_PAYLOAD];
+   };
+
+   struct Subscriber {
+      u32 id;
+      const void *owner;
+      std::string name;
+      u32 typeMask;
+      int device;
+      EventSink sink;
+      std::deque<Event> queue;
+      //events dropped since the last one queued
+      u32 dropped;
+      //monotonicNs() before which its sink isn't tried again
+      uint64_t retryNs;
+      uint64_t totalDelivered;
+      uint64_t totalDropped;
+   };
+
+   //Offers every subscriber its queued events. Returns true if any of
+   //them had no room. The caller holds lock.
+   bool deliver();
+
+   //protects everything below
+   pthread_mutex_t lock;
+   //signalled when there is something to deliver, or to stop
+   pthread_cond_t wake;
+   bool stopping;
+   bool running;
+   //set by publish() until the delivery thread has looked
+   bool pending;
+   std::function<void()> onDelivered;
+   std::vector<Subscriber> subs;
+   u32 nextId;
+   u32 seq;
+   //reused for each delivery
+   std::vector<char> packed;
+   pthread_t deliveryTh;
+};
+
+//the name of an event type, as in "events subscribe types", or NULL
+const char * eventTypeName(int type);
+
+#endif
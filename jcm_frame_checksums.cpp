@@ -0,0 +1,69 @@
+/*
+ * Per-frame checksums (see jcm_frame_checksums.h).
+ */
+#include "jcm_frame_checksums.h"
+
+using namespace std;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t frameChecksum(const u32 *frame, int numWords) {
+	uint64_t h = FNV_OFFSET_BASIS;
+	for (int i = 0; i < numWords; i++)
+		h = (h ^ frame[i]) * FNV_PRIME;
+	return h;
+}
+
+FrameChecksums::FrameChecksums(int numFrames) : epoch(1), sums(numFrames, 0),
+		changed(numFrames, 0) {
+	pthread_mutex_init(&lock, NULL);
+}
+
+FrameChecksums::~FrameChecksums() {
+	pthread_mutex_destroy(&lock);
+}
+
+u32 FrameChecksums::nextEpoch() {
+	pthread_mutex_lock(&lock);
+	u32 e = ++epoch;
+	pthread_mutex_unlock(&lock);
+	return e;
+}
+
+int FrameChecksums::update(int first, int numFrames, const u32 *frames,
+		int wordsPerFrame) {
+	//hash before taking the lock; only the comparison needs it
+	vector<uint64_t> now(numFrames);
+	for (int k = 0; k < numFrames; k++)
+		now[k] = frameChecksum(frames + k * wordsPerFrame, wordsPerFrame);
+
+	int n = 0;
+	pthread_mutex_lock(&lock);
+	for (int k = 0; k < numFrames && first + k < (int) sums.size(); k++) {
+		int i = first + k;
+		if (changed[i] == 0 || sums[i] != now[k]) {
+			sums[i] = now[k];
+			changed[i] = epoch;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+u32 FrameChecksums::changedIn(int index) {
+	pthread_mutex_lock(&lock);
+	u32 e = index >= 0 && index < (int) changed.size() ? changed[index] : 0;
+	pthread_mutex_unlock(&lock);
+	return e;
+}
+
+void FrameChecksums::changedSince(u32 since, vector<int> &indices) {
+	indices.clear();
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < changed.size(); i++)
+		if (changed[i] != 0 && changed[i] >= since)
+			indices.push_back(i);
+	pthread_mutex_unlock(&lock);
+}
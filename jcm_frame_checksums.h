@@ -0,0 +1,53 @@
+/*
+ * A checksum of every configuration frame, as it was last read, and the
+ * epoch in which each one last changed. Every frame read through the
+ * pipeline, and every frame the scrubber checks, is recorded, so the table
+ * always knows which frames have changed since a given point without
+ * keeping the frames themselves. "readback delta" uses it to send only the
+ * frames that changed since the epoch a client last saw, so capturing the
+ * device's state costs bandwidth in proportion to the upsets rather than to
+ * the size of the device.
+ */
+
+#ifndef JCM_FRAME_CHECKSUMS
+#define JCM_FRAME_CHECKSUMS
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "XilinxTopLibrary.h"
+
+//FNV-1a over the words of a frame. Each step is a bijection of the running
+//hash, so a change confined to one word always changes the checksum.
+uint64_t frameChecksum(const u32 *frame, int numWords);
+
+class FrameChecksums {
+
+public:
+
+   //numFrames is the length of the device's frame address array
+   FrameChecksums(int numFrames);
+   ~FrameChecksums();
+
+   //Starts a new epoch and returns it. Every change recorded from now on is
+   //tagged with it (or a later one).
+   u32 nextEpoch();
+   //Records numFrames frames, starting at first in the frame address array,
+   //as they were just read. Returns how many differ from the last read.
+   int update(int first, int numFrames, const u32 *frames, int wordsPerFrame);
+   //The epoch a frame last changed in, or 0 if it has never been read
+   u32 changedIn(int index);
+   //Lists the frames that changed in epoch since or later
+   void changedSince(u32 since, std::vector<int> &indices);
+
+private:
+
+   //protects everything below
+   pthread_mutex_t lock;
+   u32 epoch;
+   std::vector<uint64_t> sums;
+   std::vector<u32> changed;
+};
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Frame compare kernels (see jcm_frame_diff.h).
+ */
+#include <stddef.h>
+#include <atomic>
+
+#include "jcm_frame_diff.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DIFF_HAVE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define DIFF_HAVE_SSE2
+#endif
+
+using namespace std;
+
+//Adds the set bits of one differing word to upsets and returns how many
+//there were
+static inline int emitWord(uint32_t frameAddress, int word, uint32_t diff,
+		uint32_t now, vector<Upset> *upsets) {
+	int n = __builtin_popcount(diff);
+	if (upsets == NULL)
+		return n;
+	while (diff) {
+		int bit = __builtin_ctz(diff);
+		Upset u;
+		u.frameAddress = frameAddress;
+		u.word = word;
+		u.bit = bit;
+		u.value = (now >> bit) & 1;
+		upsets->push_back(u);
+		diff &= diff - 1; //clear lowest set bit
+	}
+	return n;
+}
+
+//Handles the words from index start to the end one at a time
+static inline int diffTail(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int start, int numWords,
+		vector<Upset> *upsets) {
+	int n = 0;
+	for (int w = start; w < numWords; w++) {
+		uint32_t diff = frame[w] ^ golden[w];
+		if (mask != NULL)
+			diff &= ~mask[w];
+		if (diff)
+			n += emitWord(frameAddress, w, diff, frame[w], upsets);
+	}
+	return n;
+}
+
+int diffFrameScalar(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int numWords,
+		vector<Upset> *upsets) {
+	return diffTail(frameAddress, frame, golden, mask, 0, numWords, upsets);
+}
+
+//Each vector version XORs a block of 16 words, ORs the result together and
+//moves on if it is zero, which is almost always the case. Only a block that
+//differs is stored back and handed to emitWord a word at a time.
+
+#ifdef DIFF_HAVE_NEON
+static int diffFrameNeon(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int numWords,
+		vector<Upset> *upsets) {
+	int n = 0, w = 0;
+	for (; w + 16 <= numWords; w += 16) {
+		uint32x4_t d[4];
+		for (int k = 0; k < 4; k++) {
+			d[k] = veorq_u32(vld1q_u32(frame + w + 4 * k),
+				vld1q_u32(golden + w + 4 * k));
+			if (mask != NULL)
+				d[k] = vbicq_u32(d[k], vld1q_u32(mask + w + 4 * k));
+		}
+		uint32x4_t any = vorrq_u32(vorrq_u32(d[0], d[1]), vorrq_u32(d[2], d[3]));
+		uint32x2_t half = vorr_u32(vget_low_u32(any), vget_high_u32(any));
+		if (vget_lane_u32(vpmax_u32(half, half), 0) == 0)
+			continue;
+
+		uint32_t diff[16];
+		for (int k = 0; k < 4; k++)
+			vst1q_u32(diff + 4 * k, d[k]);
+		for (int k = 0; k < 16; k++)
+			if (diff[k])
+				n += emitWord(frameAddress, w + k, diff[k], frame[w + k], upsets);
+	}
+	return n + diffTail(frameAddress, frame, golden, mask, w, numWords, upsets);
+}
+#endif
+
+#ifdef DIFF_HAVE_SSE2
+static int diffFrameSse2(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int numWords,
+		vector<Upset> *upsets) {
+	int n = 0, w = 0;
+	const __m128i zero = _mm_setzero_si128();
+	for (; w + 16 <= numWords; w += 16) {
+		__m128i d[4];
+		for (int k = 0; k < 4; k++) {
+			d[k] = _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *) (frame + w + 4 * k)),
+				_mm_loadu_si128((const __m128i *) (golden + w + 4 * k)));
+			if (mask != NULL)
+				d[k] = _mm_andnot_si128(
+					_mm_loadu_si128((const __m128i *) (mask + w + 4 * k)), d[k]);
+		}
+		__m128i any = _mm_or_si128(_mm_or_si128(d[0], d[1]), _mm_or_si128(d[2], d[3]));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xFFFF)
+			continue;
+
+		uint32_t diff[16];
+		for (int k = 0; k < 4; k++)
+			_mm_storeu_si128((__m128i *) (diff + 4 * k), d[k]);
+		for (int k = 0; k < 16; k++)
+			if (diff[k])
+				n += emitWord(frameAddress, w + k, diff[k], frame[w + k], upsets);
+	}
+	return n + diffTail(frameAddress, frame, golden, mask, w, numWords, upsets);
+}
+
+//Built for AVX2 but only called if the cpu has it
+__attribute__((target("avx2")))
+static int diffFrameAvx2(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int numWords,
+		vector<Upset> *upsets) {
+	int n = 0, w = 0;
+	for (; w + 16 <= numWords; w += 16) {
+		__m256i d[2];
+		for (int k = 0; k < 2; k++) {
+			d[k] = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *) (frame + w + 8 * k)),
+				_mm256_loadu_si256((const __m256i *) (golden + w + 8 * k)));
+			if (mask != NULL)
+				d[k] = _mm256_andnot_si256(
+					_mm256_loadu_si256((const __m256i *) (mask + w + 8 * k)), d[k]);
+		}
+		__m256i any = _mm256_or_si256(d[0], d[1]);
+		if (_mm256_testz_si256(any, any))
+			continue;
+
+		uint32_t diff[16];
+		for (int k = 0; k < 2; k++)
+			_mm256_storeu_si256((__m256i *) (diff + 8 * k), d[k]);
+		for (int k = 0; k < 16; k++)
+			if (diff[k])
+				n += emitWord(frameAddress, w + k, diff[k], frame[w + k], upsets);
+	}
+	return n + diffTail(frameAddress, frame, golden, mask, w, numWords, upsets);
+}
+#endif
+
+//the best vector version this cpu can run, and its name
+static DiffFunction bestSimd(const char **name) {
+#if defined(DIFF_HAVE_NEON)
+	*name = "neon";
+	return diffFrameNeon;
+#elif defined(DIFF_HAVE_SSE2)
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return diffFrameAvx2;
+	}
+	*name = "sse2";
+	return diffFrameSse2;
+#else
+	*name = "scalar";
+	return diffFrameScalar;
+#endif
+}
+
+void diffKernels(vector<pair<const char *, DiffFunction> > &out) {
+	out.clear();
+	out.push_back(make_pair("scalar", diffFrameScalar));
+#if defined(DIFF_HAVE_NEON)
+	out.push_back(make_pair("neon", diffFrameNeon));
+#elif defined(DIFF_HAVE_SSE2)
+	out.push_back(make_pair("sse2", diffFrameSse2));
+	if (__builtin_cpu_supports("avx2"))
+		out.push_back(make_pair("avx2", diffFrameAvx2));
+#endif
+}
+
+//"options diffkernel" changes these while other threads compare frames
+static atomic<const char *> kernelName(NULL);
+static atomic<DiffFunction> kernel(NULL);
+
+void setDiffKernel(int which) {
+	const char *name = "scalar";
+	DiffFunction f = which == DIFF_KERNEL_SCALAR ? diffFrameScalar : bestSimd(&name);
+	kernelName = name;
+	kernel = f;
+}
+
+const char * diffKernelName() {
+	if (kernel.load() == NULL)
+		setDiffKernel(DIFF_KERNEL_SIMD);
+	return kernelName;
+}
+
+int diffFrame(uint32_t frameAddress, const uint32_t *frame,
+		const uint32_t *golden, const uint32_t *mask, int numWords,
+		vector<Upset> *upsets) {
+	DiffFunction f = kernel;
+	if (f == NULL) {
+		setDiffKernel(DIFF_KERNEL_SIMD);
+		f = kernel;
+	}
+	return f(frameAddress, frame, golden, mask, numWords, upsets);
+}
@@ -0,0 +1,56 @@
+/*
+ * Compares configuration frames against their golden copies and reports
+ * every bit that differs. The comparison is vectorized (NEON on the JCM's
+ * ARM, SSE2/AVX2 on x86 hosts): whole blocks of words are XORed and skipped
+ * when they match, and only blocks that differ are picked apart bit by bit.
+ * diffFrameScalar is the plain reference the vector versions must agree with.
+ */
+
+#ifndef JCM_FRAME_DIFF
+#define JCM_FRAME_DIFF
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+//One bit that differs from the golden image
+struct Upset {
+   uint32_t frameAddress;
+   uint16_t word;
+   uint8_t bit;
+   //value the bit has now (golden has the opposite)
+   uint8_t value;
+};
+
+//Which implementation diffFrame uses
+#define DIFF_KERNEL_SCALAR 0
+#define DIFF_KERNEL_SIMD 1
+
+//Compares numWords words of frame against golden. Bits set in mask (which
+//may be NULL) are ignored, e.g. LUTRAM and BRAM bits that change on their
+//own. Each differing bit is appended to upsets (unless it is NULL). Returns
+//the number of differing bits.
+int diffFrame(uint32_t frameAddress, const uint32_t *frame,
+   const uint32_t *golden, const uint32_t *mask, int numWords,
+   std::vector<Upset> *upsets);
+
+//The scalar reference implementation of diffFrame
+int diffFrameScalar(uint32_t frameAddress, const uint32_t *frame,
+   const uint32_t *golden, const uint32_t *mask, int numWords,
+   std::vector<Upset> *upsets);
+
+//Signature of every implementation
+typedef int (*DiffFunction)(uint32_t frameAddress, const uint32_t *frame,
+   const uint32_t *golden, const uint32_t *mask, int numWords,
+   std::vector<Upset> *upsets);
+
+//Every implementation built in that this cpu can run, with its name, the
+//scalar one first, so they can be checked against each other
+void diffKernels(std::vector<std::pair<const char *, DiffFunction> > &out);
+
+//Chooses the implementation diffFrame uses (DIFF_KERNEL_SIMD by default)
+void setDiffKernel(int kernel);
+//Name of the implementation diffFrame currently uses
+const char * diffKernelName();
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Frame layout of a device (see jcm_frame_geometry.h).
+ */
+#include <string.h>
+
+#include "jcm_frame_geometry.h"
+
+using namespace std;
+
+FrameGeometry::FrameGeometry(JcmDevice *device) {
+	u32 *fradArray = device->getFrameAddressArray();
+	addresses.assign(fradArray, fradArray + device->getTotalFrames());
+	logicFrames = device->getNumLogicFrames();
+	bramFrames = device->getNumBramFrames();
+	index();
+}
+
+FrameInfo FrameGeometry::decompose(u32 frameAddress) {
+	FrameInfo f;
+	f.frameAddress = frameAddress;
+	f.blockType = (frameAddress >> FAR_BLOCK_SHIFT) & FAR_BLOCK_MASK;
+	f.bottom = (frameAddress >> FAR_BOTTOM_SHIFT) & FAR_BOTTOM_MASK;
+	f.row = (frameAddress >> FAR_ROW_SHIFT) & FAR_ROW_MASK;
+	f.column = (frameAddress >> FAR_COLUMN_SHIFT) & FAR_COLUMN_MASK;
+	f.minor = frameAddress & FAR_MINOR_MASK;
+	f.flags = 0;
+	return f;
+}
+
+void FrameGeometry::index() {
+	int n = addresses.size();
+
+	infos.resize(n);
+	for (int i = 0; i < n; i++) {
+		infos[i] = decompose(addresses[i]);
+		if (i >= logicFrames)
+			infos[i].flags |= FRAME_FLAG_BRAM;
+	}
+
+	runs.resize(n);
+	for (int i = n - 1; i >= 0; i--)
+		runs[i] = i + 1 < n && addresses[i + 1] == addresses[i] + 1 ?
+			runs[i + 1] + 1 : 1;
+
+	int bits = 1;
+	while ((1 << bits) < 2 * n)
+		bits++;
+	slots.assign(1 << bits, -1);
+	hashMask = (1u << bits) - 1;
+	hashShift = 32 - bits;
+	for (int i = 0; i < n; i++) {
+		u32 h = hash(addresses[i]);
+		//a repeated address keeps its first index
+		while (slots[h] >= 0 && addresses[slots[h]] != addresses[i])
+			h = (h + 1) & hashMask;
+		if (slots[h] < 0)
+			slots[h] = i;
+	}
+}
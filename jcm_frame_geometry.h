@@ -0,0 +1,121 @@
+/*
+ * The device's frame layout, worked out once when the server starts: the
+ * frame address array, where each frame address is in it (a hash table, so
+ * looking one up doesn't mean searching the array), each address split into
+ * its 7 series fields, and how many frames are logic and how many BRAM.
+ * Everything that walks or looks up frames (the server, the scrubber, the
+ * fault injector and the golden compare) shares one FrameGeometry per
+ * device, and none of them has to ask the device (or take its lock) to do
+ * so.
+ */
+
+#ifndef JCM_FRAME_GEOMETRY
+#define JCM_FRAME_GEOMETRY
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "jcm_device.h"
+
+//7 series frame address fields
+#define FAR_BLOCK_SHIFT 23
+#define FAR_BLOCK_MASK 0x7
+#define FAR_BOTTOM_SHIFT 22
+#define FAR_BOTTOM_MASK 0x1
+#define FAR_ROW_SHIFT 17
+#define FAR_ROW_MASK 0x1f
+#define FAR_COLUMN_SHIFT 7
+#define FAR_COLUMN_MASK 0x3ff
+#define FAR_MINOR_MASK 0x7f
+
+//set in FrameInfo.flags for the BRAM frames (those past the logic frames)
+#define FRAME_FLAG_BRAM 0x1
+
+//One frame, as sent by "read fradlist" (12 bytes)
+struct FrameInfo {
+   u32 frameAddress;
+   uint8_t blockType;
+   //1 for the bottom half of the device, 0 for the top
+   uint8_t bottom;
+   uint8_t row;
+   uint8_t minor;
+   uint16_t column;
+   uint16_t flags;
+};
+
+//Starts the response to "read fradlist"; numFrames FrameInfo follow, in
+//frame address array order
+struct FradListHeader {
+   u32 numFrames;
+   u32 numLogicFrames;
+   u32 numBramFrames;
+   u32 recordSize;
+};
+
+class FrameGeometry {
+
+public:
+
+   //Asks the device for its layout. The caller must own the device.
+   FrameGeometry(JcmDevice *device);
+
+   //Splits a frame address into its fields
+   static FrameInfo decompose(u32 frameAddress);
+
+   //Where frameAddress is in the frame address array, or -1
+   int indexOf(u32 frameAddress) const {
+      for (u32 h = hash(frameAddress); ; h = (h + 1) & hashMask) {
+         int32_t i = slots[h];
+         if (i < 0 || addresses[i] == frameAddress)
+            return i;
+      }
+   }
+   //The frame address array
+   const u32 * frameAddresses() const { return &addresses[0]; }
+   u32 frameAddress(int index) const { return addresses[index]; }
+   const FrameInfo & info(int index) const { return infos[index]; }
+   //How many frames from index on have consecutive addresses (so can be
+   //read with one readFrames), at most max
+   int runFrom(int index, int max) const {
+      int n = runs[index];
+      return n < max ? n : max;
+   }
+
+   int numFrames() const { return addresses.size(); }
+   int numLogicFrames() const { return logicFrames; }
+   int numBramFrames() const { return bramFrames; }
+   //the logic frames, or all of them
+   int numFrames(bool withBram) const {
+      return withBram ? numFrames() : logicFrames;
+   }
+   //if the first n frame addresses are the n in list, in the same order
+   bool hasPrefix(const u32 *list, int n) const {
+      return n <= numFrames() && (n == 0 ||
+         memcmp(list, &addresses[0], n * sizeof(u32)) == 0);
+   }
+
+private:
+
+   //Fills in everything else from addresses and the frame counts
+   void index();
+
+   u32 hash(u32 frameAddress) const {
+      return (frameAddress * 2654435761u) >> hashShift;
+   }
+
+   std::vector<u32> addresses;
+   std::vector<FrameInfo> infos;
+   //for each frame, how many frames from it on have consecutive addresses
+   std::vector<int> runs;
+   int logicFrames;
+   int bramFrames;
+
+   //open addressing hash table of indices into addresses, -1 if empty; a
+   //power of two at least twice the number of frames, so it is never full
+   std::vector<int32_t> slots;
+   u32 hashMask;
+   int hashShift;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Memory-mapped golden image store (see jcm_golden.h).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+
+#include "jcm_golden.h"
+
+using namespace std;
+
+static bool compareEntries(const GoldenIndexEntry &a, const GoldenIndexEntry &b) {
+	return a.frameAddress < b.frameAddress;
+}
+
+//size of the frame data section, and where it starts
+static size_t dataLength(int wordsPerFrame, int numFrames) {
+	return (size_t) numFrames * wordsPerFrame * sizeof(u32);
+}
+static size_t dataOffset(int numFrames) {
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t end = sizeof(GoldenHeader) +
+		numFrames * (sizeof(u32) + sizeof(GoldenIndexEntry));
+	return (end + pageSize - 1) / pageSize * pageSize;
+}
+
+GoldenImage::GoldenImage() : base(NULL), length(0), header(NULL), index(NULL) {
+	filePath[0] = '\0';
+}
+
+GoldenImage::~GoldenImage() {
+	unload();
+}
+
+void GoldenImage::unload() {
+	if (base != NULL)
+		munmap(base, length);
+	base = NULL;
+	length = 0;
+	header = NULL;
+	index = NULL;
+}
+
+bool GoldenImage::load(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror("golden open");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(GoldenHeader)) {
+		fprintf(stderr, "golden: %s is too short\n", path);
+		close(fd);
+		return false;
+	}
+
+	char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); //the mapping stays valid
+	if (map == MAP_FAILED) {
+		perror("golden mmap");
+		return false;
+	}
+
+	const GoldenHeader *h = (const GoldenHeader *) map;
+	size_t n = h->numFrames;
+	if (memcmp(h->magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC)) != 0 ||
+			h->version != GOLDEN_VERSION ||
+			h->farListOffset + n * sizeof(u32) > (size_t) st.st_size ||
+			h->indexOffset + n * sizeof(GoldenIndexEntry) > (size_t) st.st_size ||
+			h->dataOffset + dataLength(h->wordsPerFrame, n) > (size_t) st.st_size) {
+		fprintf(stderr, "golden: %s is not a valid golden image\n", path);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	unload();
+	base = map;
+	length = st.st_size;
+	header = h;
+	index = (const GoldenIndexEntry *) (base + h->indexOffset);
+	strncpy(filePath, path, sizeof filePath);
+	filePath[sizeof filePath - 1] = '\0';
+
+	//we'll be comparing against all of it, so start paging it in now
+	madvise(base + h->dataOffset, dataLength(h->wordsPerFrame, n), MADV_WILLNEED);
+	return true;
+}
+
+int GoldenImage::create(const char *path, u32 idCode, u32 flags,
+		int wordsPerFrame, int numFrames, const u32 *fradArray) {
+	GoldenHeader h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC));
+	h.version = GOLDEN_VERSION;
+	h.flags = flags;
+	h.idCode = idCode;
+	h.wordsPerFrame = wordsPerFrame;
+	h.numFrames = numFrames;
+	h.farListOffset = sizeof h;
+	h.indexOffset = h.farListOffset + numFrames * sizeof(u32);
+	h.dataOffset = dataOffset(numFrames);
+	h.captureTime = time(NULL);
+
+	vector<GoldenIndexEntry> entries(numFrames);
+	for (int i = 0; i < numFrames; i++) {
+		entries[i].frameAddress = fradArray[i];
+		entries[i].offset = h.dataOffset + i * wordsPerFrame * sizeof(u32);
+	}
+	sort(entries.begin(), entries.end(), compareEntries);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("golden create");
+		return -1;
+	}
+	if (pwrite(fd, &h, sizeof h, 0) != sizeof h ||
+			pwrite(fd, fradArray, numFrames * sizeof(u32), h.farListOffset) !=
+				(ssize_t) (numFrames * sizeof(u32)) ||
+			pwrite(fd, &entries[0], numFrames * sizeof(GoldenIndexEntry),
+				h.indexOffset) != (ssize_t) (numFrames * sizeof(GoldenIndexEntry)) ||
+			ftruncate(fd, h.dataOffset + dataLength(wordsPerFrame, numFrames)) == -1) {
+		perror("golden write");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool GoldenImage::writeFrames(int fd, int firstIndex, int numFrames,
+		const u32 *frames) {
+	GoldenHeader h;
+	if (pread(fd, &h, sizeof h, 0) != sizeof h)
+		return false;
+	size_t bytes = dataLength(h.wordsPerFrame, numFrames);
+	off_t offset = h.dataOffset + dataLength(h.wordsPerFrame, firstIndex);
+	return pwrite(fd, frames, bytes, offset) == (ssize_t) bytes;
+}
+
+const u32 * GoldenImage::frame(u32 frameAddress) {
+	if (header == NULL)
+		return NULL;
+	GoldenIndexEntry key;
+	key.frameAddress = frameAddress;
+	const GoldenIndexEntry *end = index + header->numFrames;
+	const GoldenIndexEntry *e = lower_bound(index, end, key, compareEntries);
+	if (e == end || e->frameAddress != frameAddress)
+		return NULL;
+	return (const u32 *) (base + e->offset);
+}
+
+const u32 * GoldenImage::frameAt(int i) {
+	if (header == NULL || i < 0 || (u32) i >= header->numFrames)
+		return NULL;
+	return (const u32 *) (base + header->dataOffset) + (size_t) i * header->wordsPerFrame;
+}
+
+const u32 * GoldenImage::frameAddresses() {
+	if (header == NULL)
+		return NULL;
+	return (const u32 *) (base + header->farListOffset);
+}
@@ -0,0 +1,99 @@
+/*
+ * The golden image: a known good copy of the device's configuration frames,
+ * kept in a file that is mapped into memory. A restarted server can compare
+ * against it right away instead of reading the whole device back first.
+ *
+ * File layout (all values in host byte order):
+ *    GoldenHeader
+ *    frame address list   numFrames u32, in frame address array order
+ *    index                numFrames GoldenIndexEntry, sorted by frame address
+ *    (padding up to a page boundary)
+ *    frame data           numFrames * wordsPerFrame u32, in list order
+ */
+
+#ifndef JCM_GOLDEN
+#define JCM_GOLDEN
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "XilinxTopLibrary.h"
+
+//default golden image file
+#define GOLDEN_FILE "golden.jcm"
+#define GOLDEN_MAGIC "JCMGOLD"
+#define GOLDEN_VERSION 1
+//set in GoldenHeader.flags if the image includes the BRAM frames
+#define GOLDEN_FLAG_BRAM 0x1
+
+struct GoldenHeader {
+   char magic[8];
+   u32 version;
+   u32 flags;
+   //id code of the device the image was read from
+   u32 idCode;
+   u32 wordsPerFrame;
+   u32 numFrames;
+   //file offsets of the frame address list, the index and the frame data
+   u32 farListOffset;
+   u32 indexOffset;
+   u32 dataOffset;
+   //when the image was captured (seconds since the epoch)
+   uint64_t captureTime;
+};
+
+//Maps a frame address to where its frame is in the file
+struct GoldenIndexEntry {
+   u32 frameAddress;
+   u32 offset;
+};
+
+class GoldenImage {
+
+public:
+
+   GoldenImage();
+   ~GoldenImage();
+
+   //Maps a golden image file into memory. Returns false (and prints why) if
+   //it doesn't exist or isn't a valid image.
+   bool load(const char *path);
+   //Unmaps the current image, if any.
+   void unload();
+   bool isLoaded() { return header != NULL; }
+
+   //Creates a golden image file for numFrames frames, writing everything
+   //but the frame data. Returns the open file descriptor (to fill the data
+   //in with writeFrames) or -1 on error.
+   static int create(const char *path, u32 idCode, u32 flags, int wordsPerFrame,
+      int numFrames, const u32 *fradArray);
+   //Writes numFrames frames starting at frame number firstIndex into a file
+   //returned by create(). Returns false on error.
+   static bool writeFrames(int fd, int firstIndex, int numFrames,
+      const u32 *frames);
+
+   //The golden copy of the frame at frameAddress, or NULL if the image has
+   //no such frame
+   const u32 * frame(u32 frameAddress);
+   //The golden copy of the index'th frame in the frame address list
+   const u32 * frameAt(int index);
+   //The frame address list
+   const u32 * frameAddresses();
+
+   int numFrames() { return header ? header->numFrames : 0; }
+   int wordsPerFrame() { return header ? header->wordsPerFrame : 0; }
+   const GoldenHeader * info() { return header; }
+   const char * path() { return filePath; }
+
+private:
+
+   //where the file is mapped, and how big it is
+   char *base;
+   size_t length;
+   //points to the start of the mapping when an image is loaded
+   const GoldenHeader *header;
+   const GoldenIndexEntry *index;
+   char filePath[256];
+};
+
+#endif
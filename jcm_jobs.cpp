@@ -0,0 +1,281 @@
+/*
+ * Background jobs (see jcm_jobs.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "jcm_jobs.h"
+#include "jcm_stats.h"
+#include "jcm_log.h"
+
+using namespace std;
+
+static void * watchdogThreadStaticStub(void *m) {
+	return ((JobManager*) m)->watchdogThread();
+}
+
+Job::Job(u32 id, int device, const string &command, u32 deadlineSeconds) :
+		id(id), device(device), command(command), deadlineSeconds(deadlineSeconds),
+		jtagHZ(false), state(JOB_QUEUED), cancelled(false), timedOut(false),
+		inBlockingCall(false), framesDone(0), framesTotal(0), bytes(0), startedNs(0),
+		endedNs(0), deadlineNs(0) {
+	submittedNs = monotonicNs();
+}
+
+//the output goes with the job, once nothing can ask for it any more
+Job::~Job() {
+	if (!outputPath.empty())
+		unlink(outputPath.c_str());
+}
+
+const char * jobStateName(int state) {
+	switch (state) {
+		case JOB_QUEUED: return "queued";
+		case JOB_RUNNING: return "running";
+		case JOB_DONE: return "done";
+		case JOB_FAILED: return "failed";
+		case JOB_CANCELLED: return "cancelled";
+		case JOB_TIMED_OUT: return "timed out";
+	}
+	return "unknown";
+}
+
+JobManager::JobManager() : stopping(false), running(false), nextId(1) {
+	pthread_mutex_init(&lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+JobManager::~JobManager() {
+	stop();
+	//each job takes its output with it
+	jobs.clear();
+	if (!outputDir.empty())
+		rmdir(outputDir.c_str());
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+void JobManager::start() {
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		stopping = false;
+		running = true;
+		pthread_create(&watchdogTh, NULL, &watchdogThreadStaticStub, this);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void JobManager::stop() {
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(watchdogTh, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+shared_ptr<Job> JobManager::create(int device, const string &command,
+		u32 deadlineSeconds) {
+	pthread_mutex_lock(&lock);
+	shared_ptr<Job> job = make_shared<Job>(nextId++, device, command, deadlineSeconds);
+	jobs[job->id] = job;
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+void JobManager::remove(u32 id) {
+	pthread_mutex_lock(&lock);
+	jobs.erase(id);
+	pthread_mutex_unlock(&lock);
+}
+
+shared_ptr<Job> JobManager::find(u32 id) {
+	pthread_mutex_lock(&lock);
+	map<u32, shared_ptr<Job> >::iterator it = jobs.find(id);
+	shared_ptr<Job> job = it == jobs.end() ? shared_ptr<Job>() : it->second;
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+void JobManager::list(vector<shared_ptr<Job> > &out) {
+	out.clear();
+	pthread_mutex_lock(&lock);
+	for (map<u32, shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end(); ++it)
+		out.push_back(it->second);
+	pthread_mutex_unlock(&lock);
+}
+
+bool JobManager::cancel(u32 id) {
+	shared_ptr<Job> job = find(id);
+	if (!job || job->finished())
+		return false;
+	job->cancelled = true;
+	return true;
+}
+
+void JobManager::started(Job &job) {
+	pthread_mutex_lock(&lock);
+	job.startedNs = monotonicNs();
+	job.deadlineNs = job.startedNs + job.deadlineSeconds * 1000000000ULL;
+	job.state = JOB_RUNNING;
+	pthread_mutex_unlock(&lock);
+}
+
+int JobManager::createOutput(Job &job) {
+	pthread_mutex_lock(&lock);
+	if (outputDir.empty()) {
+		//mkdtemp makes it 0700
+		char dir[] = JOB_OUTPUT_DIR_TEMPLATE;
+		if (mkdtemp(dir) != NULL)
+			outputDir = dir;
+		else
+			perror("mkdtemp");
+	}
+	string dir = outputDir;
+	pthread_mutex_unlock(&lock);
+	if (dir.empty())
+		return -1;
+
+	string path = dir + "/job_" + to_string(job.id) + "_XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd != -1)
+		job.outputPath = path;
+	return fd;
+}
+
+void JobManager::finish(const shared_ptr<Job> &job, int state, const string &result) {
+	pthread_mutex_lock(&lock);
+	job->result = result;
+	job->endedNs = monotonicNs();
+	job->inBlockingCall = false;
+	job->state = state;
+
+	//ids only grow, so the map is in age order
+	int finished = 0;
+	for (map<u32, shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end(); ++it)
+		if (it->second->finished())
+			finished++;
+	for (map<u32, shared_ptr<Job> >::iterator it = jobs.begin();
+			finished > MAX_FINISHED_JOBS && it != jobs.end(); ) {
+		if (it->second->finished()) {
+			jobs.erase(it++);
+			finished--;
+		}
+		else
+			++it;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+u32 JobManager::stuckJob(const vector<int> &devices, int &device) {
+	u32 id = 0;
+	pthread_mutex_lock(&lock);
+	for (map<u32, shared_ptr<Job> >::iterator it = jobs.begin();
+			id == 0 && it != jobs.end(); ++it) {
+		Job &j = *it->second;
+		if (j.state != JOB_RUNNING || !j.timedOut || !j.inBlockingCall)
+			continue;
+		for (size_t i = 0; i < devices.size(); i++)
+			if (devices[i] == j.device) {
+				id = j.id;
+				device = j.device;
+				break;
+			}
+	}
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+string JobManager::describe(Job &job) {
+	char line[256];
+	string s;
+	int state = job.state;
+	uint64_t now = monotonicNs();
+
+	snprintf(line, sizeof line, "job %u on device %d: %s\ncommand: %s\n", job.id,
+		job.device, jobStateName(state), job.command.c_str());
+	s += line;
+
+	u32 done = job.framesDone, total = job.framesTotal;
+	if (total > 0) {
+		snprintf(line, sizeof line, "frames: %u/%u (%.1f%%)\n", done, total,
+			100.0 * done / total);
+		s += line;
+	}
+	snprintf(line, sizeof line, "bytes: %llu\n", (unsigned long long) job.bytes);
+	s += line;
+
+	uint64_t started = job.startedNs;
+	if (started != 0) {
+		uint64_t ended = job.endedNs;
+		double elapsed = ((ended != 0 ? ended : now) - started) / 1e9;
+		snprintf(line, sizeof line, "elapsed: %.2f s\n", elapsed);
+		s += line;
+		//assumes the rest goes at the rate so far
+		if (state == JOB_RUNNING && done > 0 && total > done) {
+			snprintf(line, sizeof line, "eta: %.2f s\n", elapsed * (total - done) / done);
+			s += line;
+		}
+	}
+	uint64_t deadline = job.deadlineNs;
+	if (state < JOB_DONE && deadline == 0) {
+		snprintf(line, sizeof line, "deadline: %u s once it starts\n",
+			job.deadlineSeconds);
+		s += line;
+	}
+	else if (state < JOB_DONE) {
+		double left = deadline > now ? (deadline - now) / 1e9 : 0;
+		snprintf(line, sizeof line, "deadline in: %.1f s\n", left);
+		s += line;
+		if (job.timedOut && job.inBlockingCall)
+			s += "stuck: past its deadline in a call that can't be stopped\n";
+	}
+	else
+		s += "result: " + job.result + "\n";
+	return s;
+}
+
+//Flags every unfinished job that has passed its deadline, every
+//JOB_WATCHDOG_INTERVAL_MS. The worker stops the job at its next chunk.
+void * JobManager::watchdogThread() {
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		uint64_t now = monotonicNs();
+		for (map<u32, shared_ptr<Job> >::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+			Job &j = *it->second;
+			//queued jobs have no deadline yet
+			uint64_t deadline = j.deadlineNs;
+			if (!j.finished() && !j.timedOut && deadline != 0 && now >= deadline) {
+				j.timedOut = true;
+				logPrint(LOG_WARN, "job %u (%s) on device %d passed its deadline%s\n",
+					j.id, j.command.c_str(), j.device, j.inBlockingCall ?
+					", the device is stuck until it returns" : ", stopping it");
+			}
+		}
+
+		struct timespec when;
+		clock_gettime(CLOCK_MONOTONIC, &when);
+		when.tv_nsec += JOB_WATCHDOG_INTERVAL_MS * 1000000L;
+		if (when.tv_nsec >= 1000000000L) {
+			when.tv_sec++;
+			when.tv_nsec -= 1000000000L;
+		}
+		while (!stopping && pthread_cond_timedwait(&wake, &lock, &when) == 0);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
@@ -0,0 +1,154 @@
+/*
+ * Jobs: long operations (readbacks, large frame reads, golden captures,
+ * configuring, blind scrubs) run in the background on a device's job worker
+ * instead of on its executor. "job run" answers at once with the job's id;
+ * the client then polls its progress, cancels it, or fetches its result.
+ * The worker takes the chain lock one chunk at a time, like the scrubber, so
+ * the device keeps answering other commands (e.g. "read status") while a
+ * job runs.
+ *
+ * Every job has a deadline, counted from when it starts running (not from
+ * when it was queued). A watchdog thread cancels jobs that pass theirs; the
+ * worker notices between chunks. A single library call can't
+ * be interrupted, so a job stuck inside one (say, configure) is flagged
+ * instead, and commands for its device, and for every other device on its
+ * chain, fail straight away rather than queue up behind a chain that may
+ * never come back.
+ */
+
+#ifndef JCM_JOBS
+#define JCM_JOBS
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "XilinxTopLibrary.h"
+
+//job states
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+#define JOB_CANCELLED 4
+#define JOB_TIMED_OUT 5
+
+//finished jobs kept for "job status"/"job result"; the oldest go first
+#define MAX_FINISHED_JOBS 32
+//jobs waiting for one device's worker
+#define JOB_QUEUE_SIZE 16
+//seconds a job may run for unless it says otherwise
+#define JOB_DEFAULT_DEADLINE 600
+//how often the watchdog checks deadlines, in ms
+#define JOB_WATCHDOG_INTERVAL_MS 100
+//Jobs that produce data leave it in a file of their own (made with mkstemp)
+//in a directory only this user can get into, made from this template when
+//the first one runs. Nobody else can plant a file or link under the name a
+//job writes to.
+#define JOB_OUTPUT_DIR_TEMPLATE "/tmp/jcm_jobs_XXXXXX"
+
+struct Job {
+   Job(u32 id, int device, const std::string &command, u32 deadlineSeconds);
+   ~Job();
+
+   const u32 id;
+   //the device it runs on
+   const int device;
+   //what was asked for, without "job run"
+   const std::string command;
+   //how long it may run for
+   const u32 deadlineSeconds;
+   //file the job's data is written to, empty if it has none (set by the
+   //worker when it creates it)
+   std::string outputPath;
+   //the submitting session's jtagtohighz setting
+   bool jtagHZ;
+
+   std::atomic<int> state;
+   //set by "job cancel" or the watchdog; the worker stops at the next chunk
+   std::atomic<bool> cancelled;
+   std::atomic<bool> timedOut;
+   //set while the worker is inside a library call that can't be stopped
+   std::atomic<bool> inBlockingCall;
+
+   //progress
+   std::atomic<u32> framesDone;
+   std::atomic<u32> framesTotal;
+   std::atomic<uint64_t> bytes;
+
+   //monotonicNs() times; 0 until they happen
+   uint64_t submittedNs;
+   std::atomic<uint64_t> startedNs;
+   std::atomic<uint64_t> endedNs;
+   std::atomic<uint64_t> deadlineNs;
+
+   //if the worker should give up
+   bool stopping() { return cancelled || timedOut; }
+   bool finished() { return state >= JOB_DONE; }
+   //how it ended, or why it failed (only read once finished)
+   std::string result;
+};
+
+const char * jobStateName(int state);
+
+class JobManager {
+
+public:
+
+   JobManager();
+   ~JobManager();
+
+   //Starts and stops the watchdog
+   void start();
+   void stop();
+
+   //Creates a job and gives it the next id
+   std::shared_ptr<Job> create(int device, const std::string &command,
+      u32 deadlineSeconds);
+   //Takes a job that could not be queued back out
+   void remove(u32 id);
+   std::shared_ptr<Job> find(u32 id);
+   //every job still kept, oldest first
+   void list(std::vector<std::shared_ptr<Job> > &jobs);
+   //Asks a job to stop. Returns false if there is no such job or it has
+   //already finished.
+   bool cancel(u32 id);
+   //Called by the worker when it starts a job; its deadline starts now
+   void started(Job &job);
+   //Creates the file a job's data goes in and sets its outputPath. Returns
+   //the file opened for writing, or -1 if it can't be made.
+   int createOutput(Job &job);
+   //Called by the worker once a job is over
+   void finish(const std::shared_ptr<Job> &job, int state, const std::string &result);
+
+   //The id of a job on any of devices (those on one chain, which it holds)
+   //that is stuck in a library call past its deadline, or 0. device is set
+   //to the one it is on.
+   u32 stuckJob(const std::vector<int> &devices, int &device);
+
+   //A human readable report on a job
+   static std::string describe(Job &job);
+
+   //This needs to be public so the static stub function can access it.
+   void * watchdogThread();
+
+private:
+
+   //protects everything below
+   pthread_mutex_t lock;
+   //signalled to wake the watchdog early when stopping
+   pthread_cond_t wake;
+   bool stopping;
+   bool running;
+   u32 nextId;
+   std::map<u32, std::shared_ptr<Job> > jobs;
+   pthread_t watchdogTh;
+   //where job output goes, empty until the first job needs it
+   std::string outputDir;
+};
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * Load generator and end-to-end benchmark for the JCM server (see
+ * jcm_loadgen.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <deque>
+
+#include "jcm_loadgen.h"
+
+using namespace std;
+
+//the packet types the server sends (see jcm_server.h)
+#define PACKET_TYPE_TEXT 0x1
+#define PACKET_TYPE_BINARY 0x2
+#define PROTOCOL_V2_MAGIC "JCM2"
+
+//Everything the mix can be made of, and how often each is picked by default
+static void defaultMix(vector<MixEntry *> &mix, const char *frameAddress) {
+	string frame = string("read frame ") + frameAddress;
+	mix.push_back(new MixEntry("far", "read far", 10));
+	mix.push_back(new MixEntry("status", "read status", 10));
+	mix.push_back(new MixEntry("crc", "read crc", 5));
+	mix.push_back(new MixEntry("idcode", "read idcode", 5));
+	mix.push_back(new MixEntry("frame1", frame, 5));
+	mix.push_back(new MixEntry("frame16", frame + " -n 16", 3));
+	mix.push_back(new MixEntry("frame128", frame + " -n 128", 1));
+	mix.push_back(new MixEntry("xadc", "read xadc", 2));
+	mix.push_back(new MixEntry("inject", "op injectfault random 1 repairfault", 1));
+	mix.push_back(new MixEntry("readback", "readback stream", 1));
+}
+
+//Sets the weights from "name=weight,name=weight,...". Entries not named are
+//left out.
+static bool parseMix(vector<MixEntry *> &mix, const char *spec) {
+	for (size_t i = 0; i < mix.size(); i++)
+		mix[i]->weight = 0;
+
+	string s(spec);
+	size_t pos = 0;
+	while (pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if (end == string::npos)
+			end = s.size();
+		string item = s.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t eq = item.find('=');
+		string name = item.substr(0, eq);
+		int weight = eq == string::npos ? 1 : atoi(item.c_str() + eq + 1);
+		size_t i = 0;
+		while (i < mix.size() && mix[i]->name != name)
+			i++;
+		if (i == mix.size() || weight < 0) {
+			fprintf(stderr, "bad mix entry '%s'\n", item.c_str());
+			return false;
+		}
+		mix[i]->weight = weight;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	LoadConfig config;
+	const char *mixSpec = NULL;
+	const char *frameAddress = "0x00000000";
+
+	//Parse Command Line Options
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "-host") == 0 && hasValue)
+			config.host = argv[++i];
+		else if (strcmp(argv[i], "-port") == 0 && hasValue)
+			config.port = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0 && hasValue)
+			config.connections = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-depth") == 0 && hasValue)
+			config.depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-t") == 0 && hasValue)
+			config.seconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-mix") == 0 && hasValue)
+			mixSpec = argv[++i];
+		else if (strcmp(argv[i], "-far") == 0 && hasValue)
+			frameAddress = argv[++i];
+		else if (strcmp(argv[i], "-seed") == 0 && hasValue)
+			config.seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-json") == 0 && hasValue)
+			config.jsonPath = argv[++i];
+		else if (strcmp(argv[i], "-text") == 0)
+			config.textProtocol = true;
+		else {
+			printf("Drives a JCM server with a mix of commands and reports "
+			       "throughput and latency.\n"
+			       "-host HOST, -port PORT: server (default %s %s)\n"
+			       "-c N: connections (default %d)\n"
+			       "-depth N: requests in flight per connection (default %d)\n"
+			       "-t S: seconds to run (default %d)\n"
+			       "-mix NAME=WEIGHT,...: command mix; names are far, status, crc, "
+			       "idcode, frame1, frame16, frame128, xadc, inject, readback\n"
+			       "-far ADDR: frame address for the frame reads\n"
+			       "-seed N: seeds the choice of commands\n"
+			       "-json FILE: also writes the results as JSON (- for stdout)\n"
+			       "-text: use the original text protocol\n",
+			       LOADGEN_DEFAULT_HOST, LOADGEN_DEFAULT_PORT,
+			       LOADGEN_DEFAULT_CONNECTIONS, LOADGEN_DEFAULT_DEPTH,
+			       LOADGEN_DEFAULT_SECONDS);
+			return strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "-h") == 0 ? 0 : 1;
+		}
+	}
+	if (config.connections < 1 || config.depth < 1 ||
+			config.depth > LOADGEN_MAX_DEPTH || config.seconds < 1) {
+		fprintf(stderr, "-c, -depth (up to %d) and -t must be at least 1\n",
+			LOADGEN_MAX_DEPTH);
+		return 1;
+	}
+
+	vector<MixEntry *> mix;
+	defaultMix(mix, frameAddress);
+	if (mixSpec != NULL && !parseMix(mix, mixSpec))
+		return 1;
+
+	LoadGenerator gen(config, mix);
+	if (!gen.run())
+		return 1;
+	gen.report();
+	if (!config.jsonPath.empty() && !gen.writeJson(config.jsonPath.c_str())) {
+		perror("loadgen: json");
+		return 1;
+	}
+	return 0;
+}
+
+LoadGenerator::LoadGenerator(const LoadConfig &config, vector<MixEntry *> &mix) :
+		config(config), totalWeight(0), stopping(false), allBytes(0), errors(0),
+		connected(0), elapsedSeconds(0) {
+	//entries that are never picked are left out of the report too
+	for (size_t i = 0; i < mix.size(); i++) {
+		if (mix[i]->weight > 0) {
+			mix[i]->bytes = 0;
+			this->mix.push_back(mix[i]);
+			totalWeight += mix[i]->weight;
+		}
+		else
+			delete mix[i];
+	}
+	mix.clear();
+}
+
+LoadGenerator::~LoadGenerator() {
+	for (size_t i = 0; i < mix.size(); i++)
+		delete mix[i];
+}
+
+//a static stub function so a connection can run in a thread
+struct ConnectionArgs {
+	LoadGenerator *gen;
+	int index;
+};
+
+static void * connectionThreadStub(void *p) {
+	ConnectionArgs *args = (ConnectionArgs *) p;
+	args->gen->connectionThread(args->index);
+	return NULL;
+}
+
+bool LoadGenerator::run() {
+	if (totalWeight == 0) {
+		fprintf(stderr, "loadgen: the mix is empty\n");
+		return false;
+	}
+
+	vector<pthread_t> threads(config.connections);
+	vector<ConnectionArgs> args(config.connections);
+	uint64_t start = monotonicNs();
+	for (int i = 0; i < config.connections; i++) {
+		args[i].gen = this;
+		args[i].index = i;
+		pthread_create(&threads[i], NULL, connectionThreadStub, &args[i]);
+	}
+
+	sleep(config.seconds);
+	stopping = true;
+	for (int i = 0; i < config.connections; i++)
+		pthread_join(threads[i], NULL);
+	elapsedSeconds = (monotonicNs() - start) / 1e9;
+
+	if (connected == 0) {
+		fprintf(stderr, "loadgen: couldn't connect to %s:%s\n",
+			config.host.c_str(), config.port.c_str());
+		return false;
+	}
+	return true;
+}
+
+int LoadGenerator::connectToServer() {
+	struct addrinfo hints, *servinfo, *p;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int rv = getaddrinfo(config.host.c_str(), config.port.c_str(), &hints,
+		&servinfo);
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+
+	int fd = -1;
+	for (p = servinfo; p != NULL; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(servinfo);
+	if (fd == -1)
+		return -1;
+
+	//requests are small; don't let Nagle hold them back
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	if (!config.textProtocol &&
+			send(fd, PROTOCOL_V2_MAGIC, strlen(PROTOCOL_V2_MAGIC), 0) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//Sends all of len bytes
+static bool sendAll(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+//Receives exactly len bytes
+static bool recvAll(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool LoadGenerator::sendRequest(int fd, uint32_t id, int entry) {
+	const string &command = mix[entry]->command;
+	if (config.textProtocol) {
+		string line = command + "\n";
+		return sendAll(fd, line.data(), line.size());
+	}
+
+	//[u32 request id][u32 length][command text]
+	string request(2 * sizeof(uint32_t), '\0');
+	uint32_t header[2] = { id, (uint32_t) command.size() };
+	memcpy(&request[0], header, sizeof header);
+	request += command;
+	return sendAll(fd, request.data(), request.size());
+}
+
+bool LoadGenerator::readResponse(int fd, uint32_t &id, uint32_t &len) {
+	//[u32 type][u32 length], then [u32 request id] with the framed protocol
+	uint32_t header[3] = { 0, 0, 0 };
+	size_t headerLen = (config.textProtocol ? 2 : 3) * sizeof(uint32_t);
+	if (!recvAll(fd, (char *) header, headerLen))
+		return false;
+	if ((header[0] != PACKET_TYPE_TEXT && header[0] != PACKET_TYPE_BINARY) ||
+			header[1] > LOADGEN_MAX_RESPONSE)
+		return false;
+	len = header[1];
+	id = header[2];
+
+	static const size_t chunk = 64 * 1024;
+	vector<char> discard(min((size_t) len, chunk));
+	for (uint32_t left = len; left > 0; ) {
+		size_t n = min((size_t) left, chunk);
+		if (!recvAll(fd, &discard[0], n))
+			return false;
+		left -= n;
+	}
+	return true;
+}
+
+int LoadGenerator::pick(uint32_t &rng) {
+	//xorshift32
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	int r = rng % totalWeight;
+	size_t i = 0;
+	while (r >= mix[i]->weight)
+		r -= mix[i++]->weight;
+	return i;
+}
+
+//A request sent and not answered yet
+struct InFlight {
+	uint32_t id;
+	int entry;
+	uint64_t sentNs;
+};
+
+void LoadGenerator::connectionThread(int index) {
+	int fd = connectToServer();
+	if (fd == -1) {
+		errors++;
+		return;
+	}
+	connected++;
+
+	uint32_t rng = config.seed * 2654435761u + index + 1;
+	if (rng == 0)
+		rng = 1;
+	uint32_t nextId = 1;
+	//the server answers each connection's requests in order, so the oldest
+	//one in flight is the one being answered
+	deque<InFlight> inFlight;
+
+	while (true) {
+		while (!stopping && (int) inFlight.size() < config.depth) {
+			InFlight f;
+			f.id = nextId++;
+			f.entry = pick(rng);
+			f.sentNs = monotonicNs();
+			if (!sendRequest(fd, f.id, f.entry)) {
+				errors++;
+				close(fd);
+				return;
+			}
+			inFlight.push_back(f);
+		}
+		if (inFlight.empty())
+			break;
+
+		uint32_t id, len;
+		if (!readResponse(fd, id, len)) {
+			errors++;
+			break;
+		}
+		InFlight f = inFlight.front();
+		inFlight.pop_front();
+		if (!config.textProtocol && id != f.id) {
+			errors++;
+			break;
+		}
+
+		uint64_t ns = monotonicNs() - f.sentNs;
+		mix[f.entry]->latency.record(ns);
+		mix[f.entry]->bytes += len;
+		all.record(ns);
+		allBytes += len;
+	}
+
+	//say goodbye so the server closes its end cleanly
+	if (config.textProtocol)
+		sendAll(fd, "exit\n", 5);
+	close(fd);
+}
+
+void LoadGenerator::report() {
+	printf("%d connections, depth %d, %s protocol, %.1f s, %llu errors\n",
+		config.connections, config.depth, config.textProtocol ? "text" : "framed",
+		elapsedSeconds, (unsigned long long) errors.load());
+	printf("%-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "(us)", "count",
+		"req/s", "MB/s", "mean", "p50", "p99", "p999", "max");
+
+	for (size_t i = 0; i <= mix.size(); i++) {
+		const Histogram &h = i < mix.size() ? mix[i]->latency : all;
+		uint64_t bytes = i < mix.size() ? mix[i]->bytes.load() : allBytes.load();
+		uint64_t count = h.count();
+		printf("%-12s %10llu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			i < mix.size() ? mix[i]->name.c_str() : "all",
+			(unsigned long long) count, count / elapsedSeconds,
+			bytes / elapsedSeconds / 1e6, count ? h.sum() / 1000.0 / count : 0.0,
+			h.percentile(0.5) / 1000.0, h.percentile(0.99) / 1000.0,
+			h.percentile(0.999) / 1000.0, h.max() / 1000.0);
+	}
+}
+
+//One histogram as a JSON object, latencies in microseconds
+static void writeJsonHistogram(FILE *f, const Histogram &h, uint64_t bytes,
+		double seconds) {
+	uint64_t count = h.count();
+	fprintf(f, "{\"count\": %llu, \"rps\": %.3f, \"bytes\": %llu, "
+		"\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+		"\"p999_us\": %.3f, \"max_us\": %.3f}", (unsigned long long) count,
+		count / seconds, (unsigned long long) bytes,
+		count ? h.sum() / 1000.0 / count : 0.0, h.percentile(0.5) / 1000.0,
+		h.percentile(0.99) / 1000.0, h.percentile(0.999) / 1000.0,
+		h.max() / 1000.0);
+}
+
+bool LoadGenerator::writeJson(const char *path) {
+	bool toStdout = strcmp(path, "-") == 0;
+	FILE *f = toStdout ? stdout : fopen(path, "w");
+	if (f == NULL)
+		return false;
+
+	fprintf(f, "{\"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, "
+		"\"depth\": %d, \"protocol\": \"%s\", \"seconds\": %.3f, "
+		"\"errors\": %llu,\n \"all\": ", config.host.c_str(), config.port.c_str(),
+		config.connections, config.depth, config.textProtocol ? "text" : "framed",
+		elapsedSeconds, (unsigned long long) errors.load());
+	writeJsonHistogram(f, all, allBytes, elapsedSeconds);
+	fprintf(f, ",\n \"commands\": {");
+	for (size_t i = 0; i < mix.size(); i++) {
+		//command text has no quotes or backslashes to escape
+		fprintf(f, "%s\n  \"%s\": {\"command\": \"%s\", \"weight\": %d, "
+			"\"latency\": ", i ? "," : "", mix[i]->name.c_str(),
+			mix[i]->command.c_str(), mix[i]->weight);
+		writeJsonHistogram(f, mix[i]->latency, mix[i]->bytes, elapsedSeconds);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n }\n}\n");
+
+	if (toStdout)
+		return fflush(f) == 0;
+	return fclose(f) == 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Load generator and end-to-end benchmark for the JCM server. It opens a
+ * number of connections to a running server, keeps a fixed number of
+ * requests in flight on each one, picks every request from a weighted mix of
+ * commands, and times each one from when it is sent until its whole response
+ * has arrived. At the end it reports throughput and latency percentiles per
+ * command, as a table and optionally as JSON, so releases can be compared.
+ *
+ * It is a separate program: build it from jcm_loadgen.cpp and jcm_stats.cpp
+ * (it doesn't need XilinxTopLibrary). Point it at a server started with -sim
+ * to benchmark the server itself rather than the board.
+ */
+
+#ifndef JCM_LOADGEN
+#define JCM_LOADGEN
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "jcm_stats.h"
+
+#define LOADGEN_DEFAULT_HOST "127.0.0.1"
+#define LOADGEN_DEFAULT_PORT "3490"
+#define LOADGEN_DEFAULT_CONNECTIONS 4
+#define LOADGEN_DEFAULT_DEPTH 1
+#define LOADGEN_DEFAULT_SECONDS 10
+//max requests in flight on one connection
+#define LOADGEN_MAX_DEPTH 256
+//largest response we'll accept, anything bigger means we lost the framing
+#define LOADGEN_MAX_RESPONSE (256 * 1024 * 1024)
+
+//One kind of request in the mix
+struct MixEntry {
+   MixEntry(const std::string &name, const std::string &command, int weight) :
+      name(name), command(command), weight(weight) {}
+
+   //what it's called in -mix and in the report
+   std::string name;
+   //command text sent to the server
+   std::string command;
+   //relative number of times it is picked
+   int weight;
+   Histogram latency;
+   std::atomic<uint64_t> bytes;
+};
+
+struct LoadConfig {
+   LoadConfig() : host(LOADGEN_DEFAULT_HOST), port(LOADGEN_DEFAULT_PORT),
+      connections(LOADGEN_DEFAULT_CONNECTIONS), depth(LOADGEN_DEFAULT_DEPTH),
+      seconds(LOADGEN_DEFAULT_SECONDS), textProtocol(false), seed(1) {}
+
+   std::string host;
+   std::string port;
+   int connections;
+   //requests kept in flight on each connection
+   int depth;
+   int seconds;
+   //speak the original text protocol (responses matched in order) instead
+   //of the framed one (responses matched by request id)
+   bool textProtocol;
+   uint32_t seed;
+   //file to write the results to as JSON, "-" for stdout
+   std::string jsonPath;
+};
+
+class LoadGenerator {
+
+public:
+
+   //The mix is taken over; every entry must have a weight above 0
+   LoadGenerator(const LoadConfig &config, std::vector<MixEntry *> &mix);
+   ~LoadGenerator();
+
+   //Runs the benchmark for config.seconds. Returns false if it couldn't
+   //connect at all.
+   bool run();
+
+   //Prints the results as a table on stdout
+   void report();
+   //Writes the results as JSON
+   bool writeJson(const char *path);
+
+   //This needs to be public so the static stub function can access it.
+   //Runs one connection until the time is up.
+   void connectionThread(int index);
+
+private:
+
+   //Connects and, unless using the text protocol, sends the framed
+   //protocol's magic. Returns the socket, or -1.
+   int connectToServer();
+   //Sends one request picked from the mix
+   bool sendRequest(int fd, uint32_t id, int entry);
+   //Reads one response header and throws away its data. Returns the id
+   //(0 with the text protocol) and the data length.
+   bool readResponse(int fd, uint32_t &id, uint32_t &len);
+   //Picks a mix entry at random by weight
+   int pick(uint32_t &rng);
+
+   LoadConfig config;
+   std::vector<MixEntry *> mix;
+   int totalWeight;
+
+   //set when the time is up; connections stop sending and drain
+   std::atomic<bool> stopping;
+   //every request, whatever it was
+   Histogram all;
+   std::atomic<uint64_t> allBytes;
+   //connections lost, malformed or mismatched responses
+   std::atomic<uint64_t> errors;
+   std::atomic<int> connected;
+   double elapsedSeconds;
+};
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Asynchronous logging (see jcm_log.h). The ring is a bounded multi-producer
+ * queue in which each slot carries a sequence number saying whose turn it
+ * is, so producers only need a compare-and-swap to claim a slot.
+ */
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "jcm_log.h"
+
+using namespace std;
+
+//max bytes of formatted output written per batch (one whole ring)
+#define LOG_BATCH_SIZE (LOG_RING_SIZE * (LOG_MSG_SIZE + 40))
+
+Logger jcmLog;
+
+static const char *levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static void * writerThreadStaticStub(void *l) {
+	return ((Logger*) l)->writerThread();
+}
+
+Logger::Logger() : enqueuePos(0), dequeuePos(0), minLevel(LOG_INFO),
+		droppedCount(0), droppedReported(0), file(NULL), fileSize(0),
+		stopping(false), running(false) {
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq.store(i, memory_order_relaxed);
+	path[0] = '\0';
+	consoleBuf = new char[LOG_BATCH_SIZE];
+	fileBuf = new char[LOG_BATCH_SIZE];
+}
+
+Logger::~Logger() {
+	close();
+	delete [] fileBuf;
+	delete [] consoleBuf;
+}
+
+bool Logger::open(const char *p) {
+	if (running)
+		return false;
+	strncpy(path, p, sizeof path);
+	path[sizeof path - 1] = '\0';
+	file = fopen(path, "a");
+	if (file == NULL) {
+		perror("log open");
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	fileSize = ftell(file);
+
+	stopping.store(false);
+	running = true;
+	pthread_create(&writerTh, NULL, &writerThreadStaticStub, this);
+	return true;
+}
+
+void Logger::close() {
+	if (!running)
+		return;
+	stopping.store(true);
+	pthread_join(writerTh, NULL);
+	running = false;
+	if (file != NULL)
+		fclose(file);
+	file = NULL;
+}
+
+void Logger::log(int level, const char *fmt, va_list args) {
+	if (level < minLevel.load(memory_order_relaxed))
+		return;
+
+	//claim a slot
+	size_t pos = enqueuePos.load(memory_order_relaxed);
+	LogRecord *r;
+	while (1) {
+		r = &ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = r->seq.load(memory_order_acquire);
+		if (seq == pos) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+					memory_order_relaxed))
+				break;
+		}
+		//the writer hasn't read this slot since the last time around: full
+		else if ((long) (seq - pos) < 0) {
+			droppedCount.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = enqueuePos.load(memory_order_relaxed);
+	}
+
+	//The message is formatted now rather than by the writer, since the
+	//strings it refers to may be gone by the time the writer gets to it.
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	r->level = level;
+	int n = vsnprintf(r->text, sizeof r->text, fmt, args);
+	r->len = n < 0 ? 0 : n >= LOG_MSG_SIZE ? LOG_MSG_SIZE - 1 : n;
+	r->seq.store(pos + 1, memory_order_release);
+}
+
+void Logger::setLevel(int level) {
+	minLevel.store(level);
+}
+
+int Logger::level() {
+	return minLevel.load();
+}
+
+size_t Logger::dropped() {
+	return droppedCount.load();
+}
+
+void * Logger::writerThread() {
+	struct timespec interval;
+	interval.tv_sec = 0;
+	interval.tv_nsec = LOG_FLUSH_MS * 1000000L;
+
+	while (!stopping.load()) {
+		if (drain() == 0)
+			nanosleep(&interval, NULL);
+	}
+	//write out whatever was logged while stopping
+	while (drain() > 0);
+	return NULL;
+}
+
+size_t Logger::drain() {
+	size_t consoleLen = 0, fileLen = 0, n = 0;
+
+	size_t dropped = droppedCount.load(memory_order_relaxed);
+	if (dropped != droppedReported) {
+		fileLen += snprintf(fileBuf, LOG_BATCH_SIZE, "(%zu log messages dropped)\n",
+			dropped - droppedReported);
+		droppedReported = dropped;
+	}
+
+	for (; n < LOG_RING_SIZE; n++) {
+		LogRecord *r = &ring[dequeuePos & (LOG_RING_SIZE - 1)];
+		if (r->seq.load(memory_order_acquire) != dequeuePos + 1)
+			break;
+
+		//the console gets the message as it was logged...
+		memcpy(consoleBuf + consoleLen, r->text, r->len);
+		consoleLen += r->len;
+
+		//...the file gets one line per message, with the time and level
+		const char *text = r->text;
+		int len = r->len;
+		while (len > 0 && text[0] == '\n')
+			text++, len--;
+		while (len > 0 && text[len - 1] == '\n')
+			len--;
+		struct tm t;
+		localtime_r(&r->time.tv_sec, &t);
+		fileLen += strftime(fileBuf + fileLen, 32, "[%Y-%m-%d %H:%M:%S", &t);
+		fileLen += sprintf(fileBuf + fileLen, ".%03ld] %-5s %.*s\n",
+			r->time.tv_nsec / 1000000, levelNames[r->level], len, text);
+
+		r->seq.store(dequeuePos + LOG_RING_SIZE, memory_order_release);
+		dequeuePos++;
+	}
+
+	if (consoleLen > 0) {
+		fwrite(consoleBuf, 1, consoleLen, stdout);
+		fflush(stdout);
+	}
+	if (fileLen > 0 && file != NULL) {
+		fwrite(fileBuf, 1, fileLen, file);
+		fflush(file);
+		fileSize += fileLen;
+		if (fileSize >= LOG_MAX_FILE_SIZE)
+			rotate();
+	}
+	return n;
+}
+
+void Logger::rotate() {
+	char from[sizeof path + 8], to[sizeof path + 8];
+	fclose(file);
+	for (int i = LOG_MAX_OLD_FILES - 1; i >= 1; i--) {
+		snprintf(from, sizeof from, "%s.%d", path, i);
+		snprintf(to, sizeof to, "%s.%d", path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof to, "%s.1", path);
+	rename(path, to);
+
+	file = fopen(path, "a");
+	fileSize = 0;
+	if (file == NULL)
+		perror("log rotate");
+}
+
+void logPrint(int level, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	jcmLog.log(level, fmt, args);
+	va_end(args);
+}
+
+int parseLogLevel(const char *name) {
+	for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+		if (strcasecmp(name, levelNames[i]) == 0)
+			return i;
+	return -1;
+}
+
+const char * logLevelName(int level) {
+	return levelNames[level];
+}
@@ -0,0 +1,108 @@
+/*
+ * Asynchronous logging. Any thread can log without taking a lock or touching
+ * a file: the message is formatted into a fixed size record in a lock-free
+ * ring, and a background writer thread empties the ring every few
+ * milliseconds, writing whole batches to the console and the log file. The
+ * log file is rotated once it grows past LOG_MAX_FILE_SIZE. If the ring is
+ * full the message is dropped (and counted) rather than holding up the
+ * thread that logged it.
+ */
+
+#ifndef JCM_LOG
+#define JCM_LOG
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+
+//log levels; messages below the current level are dropped before formatting
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+//number of records in the ring (must be a power of 2)
+#define LOG_RING_SIZE 1024
+//longest message kept, in bytes (longer ones are cut short)
+#define LOG_MSG_SIZE 232
+//how often the writer thread empties the ring
+#define LOG_FLUSH_MS 20
+//the log file is renamed to .1 (.1 to .2, and so on) once it is this big...
+#define LOG_MAX_FILE_SIZE (4 * 1024 * 1024)
+//...and this many old files are kept
+#define LOG_MAX_OLD_FILES 3
+
+struct LogRecord {
+   //ring position this record is ready to be written (pos) or read (pos + 1)
+   std::atomic<size_t> seq;
+   struct timespec time;
+   int level;
+   int len;
+   char text[LOG_MSG_SIZE];
+};
+
+class Logger {
+
+public:
+
+   Logger();
+   ~Logger();
+
+   //Opens (appending to) the log file and starts the writer thread.
+   //Messages logged before this are kept in the ring until then.
+   bool open(const char *path);
+   //Writes out everything logged so far and stops the writer thread.
+   void close();
+
+   void log(int level, const char *fmt, va_list args);
+
+   void setLevel(int level);
+   int level();
+   //Number of messages dropped because the ring was full
+   size_t dropped();
+
+   //This needs to be public so the static stub function can access it.
+   void * writerThread();
+
+private:
+
+   //Formats and writes out every record in the ring; returns how many
+   size_t drain();
+   //Moves the current log file aside and starts a new one
+   void rotate();
+
+   LogRecord ring[LOG_RING_SIZE];
+   //next position producers write to
+   std::atomic<size_t> enqueuePos;
+   //next position the writer reads from (writer thread only)
+   size_t dequeuePos;
+   std::atomic<int> minLevel;
+   std::atomic<size_t> droppedCount;
+   //dropped count last reported in the log
+   size_t droppedReported;
+
+   char path[256];
+   FILE *file;
+   size_t fileSize;
+   std::atomic<bool> stopping;
+   bool running;
+   pthread_t writerTh;
+   //batch of formatted output (writer thread only)
+   char *consoleBuf;
+   char *fileBuf;
+};
+
+//The server's log, usable from every thread
+extern Logger jcmLog;
+
+//Logs a printf style message at the given level
+void logPrint(int level, const char *fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+
+//parses "debug", "info", "warn" or "error"; returns -1 for anything else
+int parseLogLevel(const char *name);
+const char * logLevelName(int level);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Two stage frame pipeline (see jcm_pipeline.h).
+ */
+#include "jcm_pipeline.h"
+
+static void * consumerThreadStaticStub(void *p) {
+	return ((FramePipeline*) p)->consumerThread();
+}
+
+FramePipeline::FramePipeline(int wordsPerFrame) :
+	freeChunks(PIPELINE_BUFFERS), fullChunks(PIPELINE_BUFFERS + 1), finished(1) {
+	for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+		chunks[i].words.resize(PIPELINE_CHUNK_FRAMES * wordsPerFrame);
+		chunks[i].check.resize(PIPELINE_CHUNK_FRAMES * wordsPerFrame);
+		freeChunks.push(&chunks[i]);
+	}
+	pthread_create(&consumerTh, NULL, &consumerThreadStaticStub, this);
+}
+
+FramePipeline::~FramePipeline() {
+	fullChunks.close();
+	pthread_join(consumerTh, NULL);
+}
+
+void FramePipeline::run(std::function<bool(FrameChunk &)> read,
+		std::function<void(FrameChunk &)> consume) {
+	this->consume = consume;
+
+	FrameChunk *chunk;
+	while (freeChunks.pop(chunk)) {
+		chunk->verify = false;
+		if (!read(*chunk)) {
+			freeChunks.push(chunk);
+			break;
+		}
+		fullChunks.push(chunk);
+	}
+
+	//wait for the pipeline thread to get through everything we read
+	int done;
+	fullChunks.push(NULL);
+	finished.pop(done);
+	this->consume = NULL;
+}
+
+void * FramePipeline::consumerThread() {
+	FrameChunk *chunk;
+	while (fullChunks.pop(chunk)) {
+		if (chunk == NULL) {
+			finished.push(1);
+			continue;
+		}
+		consume(*chunk);
+		freeChunks.push(chunk);
+	}
+	return NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ * A two stage pipeline for moving frames off the device. The calling thread
+ * (the executor, which owns the JTAG connection) reads chunk N+1 while the
+ * pipeline's own thread checks and sends chunk N, so a large read takes
+ * about as long as the slower of JTAG and the network instead of both added
+ * together. Chunks come from a small pool of buffers that is reused, so
+ * memory use doesn't depend on how many frames are read.
+ */
+
+#ifndef JCM_PIPELINE
+#define JCM_PIPELINE
+
+#include <pthread.h>
+#include <vector>
+#include <functional>
+
+#include "XilinxTopLibrary.h"
+#include "jcm_queue.h"
+
+//number of chunk buffers in the pool; two would be enough to overlap the
+//stages, a third absorbs jitter in either one
+#define PIPELINE_BUFFERS 3
+//max number of frames in a chunk
+#define PIPELINE_CHUNK_FRAMES 64
+
+//One chunk of frames travelling through the pipeline
+struct FrameChunk {
+   //index (into the frame address array) of the first frame in the chunk
+   int firstIndex;
+   //number of frames in the chunk
+   int numFrames;
+   //false if reading the frames from the device failed
+   bool ok;
+   //the frames as read, PIPELINE_CHUNK_FRAMES frames long
+   std::vector<u32> words;
+   //a second read of the same frames, if the reader wants them verified
+   std::vector<u32> check;
+   bool verify;
+};
+
+class FramePipeline {
+
+public:
+
+   FramePipeline(int wordsPerFrame);
+   ~FramePipeline();
+
+   //Runs one transfer. read is called on this thread to fill each chunk and
+   //returns false once there is nothing left to read; consume is called on
+   //the pipeline thread with each filled chunk, in order. Returns once every
+   //chunk has been consumed.
+   void run(std::function<bool(FrameChunk &)> read,
+      std::function<void(FrameChunk &)> consume);
+
+   //These need to be public so the static stub function can access them.
+   //Runs the pipeline thread, which consumes filled chunks.
+   void * consumerThread();
+
+private:
+
+   FrameChunk chunks[PIPELINE_BUFFERS];
+   //empty chunks ready to be read into
+   BlockingQueue<FrameChunk *> freeChunks;
+   //filled chunks waiting to be consumed; NULL marks the end of a run
+   BlockingQueue<FrameChunk *> fullChunks;
+   //the pipeline thread pushes here once it has consumed the end of a run
+   BlockingQueue<int> finished;
+
+   //what to do with each chunk during the current run
+   std::function<void(FrameChunk &)> consume;
+
+   pthread_t consumerTh;
+};
+
+#endif
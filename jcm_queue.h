@@ -0,0 +1,125 @@
+/*
+ * A bounded, blocking FIFO queue used to hand work between the server's
+ * threads. Producers sleep while the queue is full and consumers sleep while
+ * it is empty, so an idle server does not burn any CPU waiting.
+ */
+
+#ifndef JCM_QUEUE
+#define JCM_QUEUE
+
+#include <pthread.h>
+#include <deque>
+
+template <typename T>
+class BlockingQueue {
+
+public:
+
+   BlockingQueue(size_t capacity = 16);
+   ~BlockingQueue();
+
+   //Adds an item to the back of the queue, blocking while it is full.
+   //Returns false (and drops the item) if the queue has been closed.
+   bool push(const T &item);
+
+   //Like push(), but returns false instead of blocking if the queue is full.
+   bool tryPush(const T &item);
+
+   //Removes the item at the front of the queue, blocking while it is empty.
+   //Returns false once the queue is closed and everything has been drained.
+   bool pop(T &item);
+
+   //Wakes every waiting thread. Later pushes fail, pops drain what is left.
+   void close();
+
+   //Empties the queue and lets it be used again after close().
+   void reopen();
+
+private:
+
+   std::deque<T> items;
+   size_t capacity;
+   bool closed;
+
+   pthread_mutex_t lock;
+   pthread_cond_t notEmpty;
+   pthread_cond_t notFull;
+};
+
+template <typename T>
+BlockingQueue<T>::BlockingQueue(size_t capacity) :
+   capacity(capacity), closed(false) {
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&notEmpty, NULL);
+   pthread_cond_init(&notFull, NULL);
+}
+
+template <typename T>
+BlockingQueue<T>::~BlockingQueue() {
+   pthread_cond_destroy(&notFull);
+   pthread_cond_destroy(&notEmpty);
+   pthread_mutex_destroy(&lock);
+}
+
+template <typename T>
+bool BlockingQueue<T>::push(const T &item) {
+   pthread_mutex_lock(&lock);
+   while (!closed && items.size() >= capacity)
+      pthread_cond_wait(&notFull, &lock);
+   if (closed) {
+      pthread_mutex_unlock(&lock);
+      return false;
+   }
+   items.push_back(item);
+   pthread_cond_signal(&notEmpty);
+   pthread_mutex_unlock(&lock);
+   return true;
+}
+
+template <typename T>
+bool BlockingQueue<T>::tryPush(const T &item) {
+   pthread_mutex_lock(&lock);
+   if (closed || items.size() >= capacity) {
+      pthread_mutex_unlock(&lock);
+      return false;
+   }
+   items.push_back(item);
+   pthread_cond_signal(&notEmpty);
+   pthread_mutex_unlock(&lock);
+   return true;
+}
+
+template <typename T>
+bool BlockingQueue<T>::pop(T &item) {
+   pthread_mutex_lock(&lock);
+   while (!closed && items.empty())
+      pthread_cond_wait(&notEmpty, &lock);
+   if (items.empty()) {
+      pthread_mutex_unlock(&lock);
+      return false;
+   }
+   item = items.front();
+   items.pop_front();
+   pthread_cond_signal(&notFull);
+   pthread_mutex_unlock(&lock);
+   return true;
+}
+
+template <typename T>
+void BlockingQueue<T>::close() {
+   pthread_mutex_lock(&lock);
+   closed = true;
+   pthread_cond_broadcast(&notEmpty);
+   pthread_cond_broadcast(&notFull);
+   pthread_mutex_unlock(&lock);
+}
+
+template <typename T>
+void BlockingQueue<T>::reopen() {
+   pthread_mutex_lock(&lock);
+   items.clear();
+   closed = false;
+   pthread_mutex_unlock(&lock);
+}
+
+#endif
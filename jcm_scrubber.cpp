@@ -0,0 +1,268 @@
+/*
+ * Background readback scrubber (see jcm_scrubber.h).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "jcm_scrubber.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+static void * scrubThreadStaticStub(void *s) {
+	return ((Scrubber*) s)->scrubThread();
+}
+
+static double msBetween(const struct timespec &a, const struct timespec &b) {
+	return (b.tv_sec - a.tv_sec) * 1000.0 + (b.tv_nsec - a.tv_nsec) / 1000000.0;
+}
+
+Scrubber::Scrubber(JcmDevice *device, TicketLock *deviceLock,
+		const FrameGeometry *geometry, GoldenImage *golden, GoldenImage *mask,
+		FrameChecksums *checksums, EventBus *events, int deviceIndex) :
+		device(device), deviceLock(deviceLock), geometry(geometry), golden(golden),
+		mask(mask), checksums(checksums), events(events), deviceIndex(deviceIndex),
+		stopping(false) {
+	pthread_mutex_init(&lock, NULL);
+	//sleeps are timed on the monotonic clock, so changing the time of day
+	//doesn't upset the scan rate
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attr);
+	pthread_condattr_destroy(&attr);
+	memset(&st, 0, sizeof st);
+}
+
+Scrubber::~Scrubber() {
+	stop();
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+bool Scrubber::start(const ScrubConfig &c) {
+	pthread_mutex_lock(&lock);
+	if (st.running) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	config = c;
+	memset(&st, 0, sizeof st);
+	st.running = true;
+	st.mode = c.mode;
+	stopping = false;
+	pthread_create(&scrubTh, NULL, &scrubThreadStaticStub, this);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+void Scrubber::stop() {
+	pthread_mutex_lock(&lock);
+	if (!st.running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(scrubTh, NULL);
+
+	pthread_mutex_lock(&lock);
+	st.running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+ScrubStats Scrubber::stats() {
+	pthread_mutex_lock(&lock);
+	ScrubStats s = st;
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+bool Scrubber::sleepUntil(const struct timespec &when) {
+	pthread_mutex_lock(&lock);
+	while (!stopping && pthread_cond_timedwait(&wake, &lock, &when) == 0);
+	bool keepGoing = !stopping;
+	pthread_mutex_unlock(&lock);
+	return keepGoing;
+}
+
+void * Scrubber::scrubThread() {
+	int numFrames = geometry->numFrames(config.readBram);
+	unsigned int seed = time(NULL);
+
+	vector<int> order(numFrames);
+	for (int i = 0; i < numFrames; i++)
+		order[i] = i;
+	if (config.order == SCRUB_ORDER_REVERSE)
+		reverse(order.begin(), order.end());
+
+	struct timespec lastBlind;
+	clock_gettime(CLOCK_MONOTONIC, &lastBlind);
+
+	while (1) {
+		//a new random order every pass
+		if (config.order == SCRUB_ORDER_RANDOM)
+			for (int i = numFrames - 1; i > 0; i--)
+				swap(order[i], order[rand_r(&seed) % (i + 1)]);
+
+		struct timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		if (!scrubPass(order))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ms = msBetween(begin, end);
+		pthread_mutex_lock(&lock);
+		st.passes++;
+		st.lastPassMs = ms;
+		if (st.passes == 1 || ms < st.minPassMs)
+			st.minPassMs = ms;
+		if (ms > st.maxPassMs)
+			st.maxPassMs = ms;
+		st.lastPassUpsetBits = passUpsetBits;
+		st.lastPassFramesRepaired = passFramesRepaired;
+		ScrubPassEvent pass;
+		pass.pass = st.passes;
+		pthread_mutex_unlock(&lock);
+
+		pass.framesScanned = numFrames;
+		pass.upsetBits = passUpsetBits;
+		pass.framesRepaired = passFramesRepaired;
+		pass.readErrors = passReadErrors;
+		pass.passUs = (u32) (ms * 1000);
+		events->publish(EVENT_SCRUB_PASS, deviceIndex, &pass, sizeof pass);
+
+		//hybrid mode also rewrites the whole device every blindInterval
+		if (config.mode == SCRUB_HYBRID &&
+				msBetween(lastBlind, end) >= config.blindInterval * 1000.0) {
+			deviceLock->lock();
+			TIMED("jtag.blindScrub",
+				device->blindScrub(false, true, config.jtagHZ));
+			deviceLock->unlock();
+			clock_gettime(CLOCK_MONOTONIC, &lastBlind);
+			BlindScrubEvent blind;
+			blind.source = EVENT_SOURCE_SCRUBBER;
+			events->publish(EVENT_BLIND_SCRUB, deviceIndex, &blind, sizeof blind);
+
+			pthread_mutex_lock(&lock);
+			st.blindScrubs++;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return NULL;
+}
+
+bool Scrubber::scrubPass(vector<int> &order) {
+	int numFrames = order.size();
+	struct timespec begin;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	passUpsetBits = 0;
+	passFramesRepaired = 0;
+	passReadErrors = 0;
+
+	int i = 0;
+	while (i < numFrames) {
+		//frames that are next to each other in both the visiting order and
+		//the address space can be read in one go
+		int n = 1;
+		while (i + n < numFrames && n < SCRUB_CHUNK_FRAMES &&
+				order[i + n] == order[i + n - 1] + 1)
+			n++;
+		n = geometry->runFrom(order[i], n);
+
+		scrubChunk(order[i], n);
+		i += n;
+
+		pthread_mutex_lock(&lock);
+		st.framesScanned += n;
+		bool stop = stopping;
+		pthread_mutex_unlock(&lock);
+		if (stop)
+			return false;
+
+		//hold the scan rate by sleeping until the next frame is due
+		if (config.framesPerSecond > 0) {
+			double dueMs = i * 1000.0 / config.framesPerSecond;
+			struct timespec due = begin;
+			due.tv_sec += (time_t) (dueMs / 1000);
+			due.tv_nsec += (long) ((dueMs - (time_t) (dueMs / 1000) * 1000.0) * 1000000);
+			if (due.tv_nsec >= 1000000000) {
+				due.tv_sec++;
+				due.tv_nsec -= 1000000000;
+			}
+			if (!sleepUntil(due))
+				return false;
+		}
+	}
+	return true;
+}
+
+void Scrubber::scrubChunk(int first, int numFrames) {
+	const u32 *fradArray = geometry->frameAddresses();
+	int wordsPerFrame = device->getWordsPerFrame();
+	int readErrors = 0, framesRepaired = 0, upsetBits = 0;
+
+	TicketLockGuard guard(*deviceLock);
+	TIMED("jtag.clearGlutMaskBit", device->clearGlutMaskBit(config.jtagHZ));
+	u32 *frames = TIMED("jtag.readFrames",
+		device->readFrames(fradArray[first], numFrames, config.jtagHZ));
+	if (frames == NULL)
+		readErrors = numFrames;
+	else
+		checksums->update(first, numFrames, frames, wordsPerFrame);
+
+	for (int k = 0; frames != NULL && k < numFrames; k++) {
+		u32 frameAddress = fradArray[first + k];
+		const u32 *goldenFrame = golden->frame(frameAddress);
+		if (goldenFrame == NULL)
+			continue;
+
+		upsets.clear();
+		int n = diffFrame(frameAddress, frames + k * wordsPerFrame, goldenFrame,
+			mask->frame(frameAddress), wordsPerFrame, &upsets);
+		if (n > 0) {
+			repairFrame(upsets);
+			upsetBits += n;
+			framesRepaired++;
+
+			//record what the frame holds now it has been repaired
+			repaired.assign(frames + k * wordsPerFrame,
+				frames + (k + 1) * wordsPerFrame);
+			for (size_t u = 0; u < upsets.size(); u++)
+				repaired[upsets[u].word] ^= 1u << upsets[u].bit;
+			checksums->update(first + k, 1, &repaired[0], wordsPerFrame);
+		}
+	}
+
+	passUpsetBits += upsetBits;
+	passFramesRepaired += framesRepaired;
+	passReadErrors += readErrors;
+	if (upsetBits > 0 || readErrors > 0) {
+		pthread_mutex_lock(&lock);
+		st.totalUpsetBits += upsetBits;
+		st.totalFramesRepaired += framesRepaired;
+		st.readErrors += readErrors;
+		if (upsetBits > 0)
+			st.lastUpsetTime = time(NULL);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+//The library has no way to write a frame we supply, but injectFault flips
+//bits in place, so flipping each upset bit again puts it back to golden.
+void Scrubber::repairFrame(vector<Upset> &upsets) {
+	for (size_t i = 0; i < upsets.size(); i++) {
+		UpsetEvent e;
+		e.frameAddress = upsets[i].frameAddress;
+		e.word = upsets[i].word;
+		e.bit = upsets[i].bit;
+		e.flags = TIMED("jtag.injectFault", device->injectFault(e.frameAddress,
+			e.word, e.bit, 1, false, true, config.jtagHZ)) ? EVENT_UPSET_REPAIRED : 0;
+		events->publish(EVENT_UPSET, deviceIndex, &e, sizeof e);
+	}
+}
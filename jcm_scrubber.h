@@ -0,0 +1,142 @@
+/*
+ * Background readback scrubbing. A scrubber thread walks the frame address
+ * list, reads each frame back, compares it to the golden image and repairs
+ * only the frames that differ. In hybrid mode it also runs a blind scrub
+ * every so often. It shares the device with the command executor through
+ * the device lock, taking it one small chunk of frames at a time, so client
+ * commands keep running while it scrubs. Every upset it finds, every pass
+ * and every blind scrub is published on the event bus.
+ */
+
+#ifndef JCM_SCRUBBER
+#define JCM_SCRUBBER
+
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+
+#include "jcm_device.h"
+#include "jcm_ticket_lock.h"
+#include "jcm_golden.h"
+#include "jcm_frame_diff.h"
+#include "jcm_frame_checksums.h"
+#include "jcm_frame_geometry.h"
+#include "jcm_events.h"
+
+//scrubbing modes
+#define SCRUB_READBACK 1
+#define SCRUB_HYBRID 2
+
+//orders the frames can be visited in on each pass
+#define SCRUB_ORDER_SEQUENTIAL 0
+#define SCRUB_ORDER_REVERSE 1
+#define SCRUB_ORDER_RANDOM 2
+
+//max number of frames read (and the device lock held) at once
+#define SCRUB_CHUNK_FRAMES 16
+//default number of seconds between blind scrubs in hybrid mode
+#define SCRUB_DEFAULT_BLIND_INTERVAL 60
+
+struct ScrubConfig {
+   ScrubConfig() : mode(SCRUB_READBACK), order(SCRUB_ORDER_SEQUENTIAL),
+      framesPerSecond(0), blindInterval(SCRUB_DEFAULT_BLIND_INTERVAL),
+      readBram(false), jtagHZ(false) {}
+
+   int mode;
+   int order;
+   //max number of frames to scan per second, 0 for as fast as possible
+   u32 framesPerSecond;
+   //seconds between blind scrubs (hybrid mode only)
+   u32 blindInterval;
+   //if the BRAM frames are scrubbed too
+   bool readBram;
+   bool jtagHZ;
+};
+
+struct ScrubStats {
+   bool running;
+   int mode;
+   //number of complete passes over the device
+   u32 passes;
+   //how long passes took, in ms. A pass is the longest an upset can go
+   //unnoticed.
+   double lastPassMs;
+   double minPassMs;
+   double maxPassMs;
+   //frames read back, in total
+   u32 framesScanned;
+   //upset bits found and frames repaired in the last complete pass
+   u32 lastPassUpsetBits;
+   u32 lastPassFramesRepaired;
+   //upset bits found and frames repaired since scrubbing started
+   u32 totalUpsetBits;
+   u32 totalFramesRepaired;
+   u32 blindScrubs;
+   //frames that could not be read
+   u32 readErrors;
+   //when the last upset was found (seconds since the epoch), 0 if never
+   time_t lastUpsetTime;
+};
+
+class Scrubber {
+
+public:
+
+   //Every frame checked is recorded in checksums, as read and (if it was
+   //repaired) as repaired. Events are published as coming from deviceIndex.
+   Scrubber(JcmDevice *device, TicketLock *deviceLock,
+      const FrameGeometry *geometry, GoldenImage *golden, GoldenImage *mask,
+      FrameChecksums *checksums, EventBus *events, int deviceIndex);
+   ~Scrubber();
+
+   //Starts scrubbing in the background. Returns false if it already is.
+   bool start(const ScrubConfig &config);
+   //Stops scrubbing and waits for the scrubber thread to exit.
+   void stop();
+   //A copy of the current statistics
+   ScrubStats stats();
+
+   //This needs to be public so the static stub function can access it.
+   void * scrubThread();
+
+private:
+
+   //Makes one pass over the device. Returns false if stopped part way.
+   bool scrubPass(std::vector<int> &order);
+   //Reads, checks and repairs numFrames frames starting at position i in
+   //the frame address array. Holds the device lock while doing so.
+   void scrubChunk(int i, int numFrames);
+   //Flips every upset bit in a frame back, publishing each
+   void repairFrame(std::vector<Upset> &upsets);
+   //Sleeps until the given time (CLOCK_MONOTONIC). Returns false if told to
+   //stop while sleeping.
+   bool sleepUntil(const struct timespec &when);
+
+   JcmDevice *device;
+   TicketLock *deviceLock;
+   const FrameGeometry *geometry;
+   GoldenImage *golden;
+   GoldenImage *mask;
+   FrameChecksums *checksums;
+   EventBus *events;
+   int deviceIndex;
+
+   //protects everything below
+   pthread_mutex_t lock;
+   //signalled to wake the scrubber thread early when stopping
+   pthread_cond_t wake;
+   bool stopping;
+   ScrubConfig config;
+   ScrubStats st;
+   pthread_t scrubTh;
+
+   //counts for the pass in progress (scrubber thread only)
+   u32 passUpsetBits;
+   u32 passFramesRepaired;
+   u32 passReadErrors;
+   std::vector<Upset> upsets;
+   //a frame as it is once repaired
+   std::vector<u32> repaired;
+};
+
+#endif
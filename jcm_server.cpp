@@ -4,7 +4,6 @@
  *
  * Author: Ryan West
  */
-#include "XilinxTopLibrary.h"
 #include "jcm_server.h"
 
 // /* Catch Signal Handler functio */
@@ -16,6 +15,9 @@
 int main(int argc, char *argv[]) {
 
 	CppUtils * utl = new CppUtils();
+	vector<DeviceSpec> devices;
+	//devices given with the same config file are on the same chain
+	map<string, JcmDevice *> chainsByConfig;
 
 	//Parse Command Line Options
 	for(int i = 1; i < argc; i++){
@@ -24,41 +26,118 @@ int main(int argc, char *argv[]) {
 				utl->compare(argv[i], "-help") == 0 ||
 				utl->compare(argv[i], "--help") == 0){
 			printf("This program runs a server that runs a variety of basic JCM"
-			       "functions, which is controlled by a separate client.\n");
+			       "functions, which is controlled by a separate client.\n"
+			       "-prometheus FILE: writes statistics to FILE every %d seconds\n"
+			       "-device CONFIG (INDEX): adds the device at INDEX on the chain "
+			       "set up by CONFIG; repeat for more devices\n"
+			       "-sim (FILE): adds a simulated fpga on a chain of its own, "
+			       "set up by FILE (see jcm_sim_device.h)\n"
+			       "Devices are numbered from 0 in the order given; commands "
+			       "starting with @N go to device N.\n",
+			       STATS_EXPORT_INTERVAL);
 			return 0;
 		}
+		else if (utl->compare(argv[i], "-prometheus") == 0 && i + 1 < argc)
+			jcmStats.startExport(argv[++i], STATS_EXPORT_INTERVAL);
+		else if (utl->compare(argv[i], "-device") == 0 && i + 1 < argc) {
+			DeviceSpec d;
+			d.name = argv[++i];
+			d.chainIndex = 0;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				d.chainIndex = atoi(argv[++i]);
+			if (chainsByConfig.count(d.name) == 0)
+				chainsByConfig[d.name] = new XilinxJcmDevice(d.name.c_str());
+			d.chain = chainsByConfig[d.name];
+			devices.push_back(d);
+		}
+		else if (utl->compare(argv[i], "-sim") == 0) {
+			SimConfig simConfig;
+			DeviceSpec d;
+			d.name = "sim";
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				d.name = string("sim ") + argv[++i];
+				if (!simConfig.load(argv[i]))
+					return 1;
+			}
+			d.chain = new SimulatedDevice(simConfig);
+			d.chainIndex = 0;
+			devices.push_back(d);
+		}
 	}
 
 	delete utl;
-	JCMServer * server = new JCMServer();
+	if (devices.empty()) {
+		DeviceSpec d;
+		d.name = "config_files/zedboard_rev_d_config.txt";
+		d.chain = new XilinxJcmDevice(d.name.c_str());
+		d.chainIndex = 0;
+		devices.push_back(d);
+	}
+	if (devices.size() > MAX_DEVICES) {
+		printf("At most %d devices are supported\n", MAX_DEVICES);
+		return 1;
+	}
+	JCMServer * server = new JCMServer(devices);
 	server->start();
 	delete server;
 	printf("Exited JCMServer->start()\n");
 	return 0;
 }
 
-JCMServer::JCMServer(){
+thread_local DeviceContext * JCMServer::ctx = NULL;
+thread_local Session * JCMServer::cur = NULL;
+thread_local u32 JCMServer::curRequestId = 0;
+thread_local BatchCapture * JCMServer::capture = NULL;
+thread_local bool JCMServer::cmdFailed = false;
+thread_local bool JCMServer::onExecutor = false;
+thread_local bool JCMServer::holdsChain = false;
+
+JCMServer::JCMServer(const vector<DeviceSpec> &devices) {
 		util = new CppUtils();
-		xTopLib = new XilinxTopLibrary("config_files/zedboard_rev_d_config.txt", "config_files/zedboard_rev_d_config.txt");
+		pthread_mutex_init(&xadcSubsLock, NULL);
+
+		//one lock per chain, shared by every device on it
+		for (size_t i = 0; i < devices.size(); i++)
+			if (find(chains.begin(), chains.end(), devices[i].chain) == chains.end()) {
+				chains.push_back(devices[i].chain);
+				chainLocks.push_back(new TicketLock());
+			}
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			JcmDevice *chain = devices[i].chain;
+			int c = find(chains.begin(), chains.end(), chain) - chains.begin();
+			int members = 0;
+			for (size_t j = 0; j < devices.size(); j++)
+				if (devices[j].chain == chain)
+					members++;
+
+			//a device that isn't alone on its chain (or isn't the first on
+			//it) selects itself before every call
+			JcmDevice *device = chain;
+			if (members > 1 || devices[i].chainIndex != 0)
+				device = new ChainDevice(chain, devices[i].chainIndex);
+			int index = i;
+			contexts.push_back(new DeviceContext(index, devices[i].name, device,
+				device != chain, chainLocks[c], &eventBus,
+				[this, index](const XadcSample &s) { deliverXadcSample(index, s); }));
+		}
 }
 
 JCMServer::~JCMServer(){
+	for (size_t i = 0; i < contexts.size(); i++)
+		delete contexts[i];
+	for (size_t i = 0; i < chains.size(); i++) {
+		delete chains[i];
+		delete chainLocks[i];
+	}
+	pthread_mutex_destroy(&xadcSubsLock);
 	delete util;
-	delete xTopLib;
 }
 
 void JCMServer::print(const char* fmt, ...) {
-	int ret;
 	va_list vargs;
 	va_start(vargs, fmt);
-	//printf like normal
-	ret = vprintf(fmt, vargs);
-	if (ret <= 0)
-		fprintf(stderr, "error: print() return value is %d\n", ret);
-	//also print to file
-	ret = vfprintf(logFilePtr, fmt, vargs);
-	if (ret <= 0)
-		fprintf(stderr, "error: print() return value is %d\n", ret);
+	jcmLog.log(LOG_INFO, fmt, vargs);
 	va_end(vargs);
 }
 
@@ -70,151 +149,324 @@ void * JCMServer::get_in_addr(struct sockaddr *sa){
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-//takes a command and parses it by white space into a vector.
-vector<string> JCMServer::parseByWhiteSpace(string command){
-
-  stringstream iss(command);
-  vector<string> v;
-  string tmp;
-
-  while (iss >> tmp)
-    v.push_back(tmp);
-
-	return v;
+//Sends a FradListHeader and a FrameInfo for every frame, from the layout
+//worked out at startup
+void JCMServer::sendFrameList() {
+	FradListHeader h;
+	h.numFrames = ctx->geometry->numFrames();
+	h.numLogicFrames = ctx->geometry->numLogicFrames();
+	h.numBramFrames = ctx->geometry->numBramFrames();
+	h.recordSize = sizeof(FrameInfo);
+	vector<char> out(sizeof h + h.numFrames * sizeof(FrameInfo));
+	memcpy(&out[0], &h, sizeof h);
+	if (h.numFrames > 0)
+		memcpy(&out[sizeof h], &ctx->geometry->info(0), h.numFrames * sizeof(FrameInfo));
+	sendToBuf(&out[0], out.size());
 }
 
 //Returns a string of the values from the device (frames)
-void JCMServer::readInFramesFromDevice(vector<string> c) {
+//Syntax: "read frame ADDR ((-n) [# frames])"
+void JCMServer::readInFramesFromDevice(const Tokens &c) {
 	if (c.size() <= 2){
-		sendStrToBuf(readErr2Str);
+		sendErrToBuf(readErr2Str);
 		return;
 	}
 
-	u32 beginFrameAddress;
-	int numFrames = 1;
-
-	try {
-		//read specific # of frames if command: "read frame ADDR [# frames]"
-		if (c.size() == 4) {
-			//convert string to base 10 int
-			numFrames = stoi(c[3], nullptr, 10);
-		} //if no number specified, default to reading 1 frame
-		beginFrameAddress = stoi(c[2], nullptr, 16);
-	}
-	catch (const invalid_argument& ia) {
-		sendStrToBuf(readErr2Str);
+	u32 beginFrameAddress, n = 1;
+
+	//read specific # of frames if command: "read frame ADDR [# frames]"
+	bool ok = true;
+	if (c.size() == 5 && c[3] == "-n")
+		ok = parseNumber(c[4], 10, n);
+	else if (c.size() == 4)
+		ok = parseNumber(c[3], 10, n);
+	//if no number specified, default to reading 1 frame
+	if (!ok || !parseNumber(c[2], 16, beginFrameAddress) || n > INT_MAX) {
+		sendErrToBuf(readErr2Str);
 		return;
 	}
-	catch (const out_of_range& oor) {
-		sendStrToBuf("Address out of range");
-	}
+	int numFrames = n;
+
+	int numWordsPerFrame = ctx->device->getWordsPerFrame();
+	int numBytesPerFrame = numWordsPerFrame * sizeof(u32);
 
-	int numWordsPerFrame = xTopLib->getWordsPerFrame();
-	int numBytesPerFrame = numWordsPerFrame * 32; //4 char word has 8*4 bytes.
+	if (numFrames < 1) {
+		sendErrToBuf(readErr2Str);
+		return;
+	}
 
-	if (numFrames < 1 || beginFrameAddress < 0) {
-		sendStrToBuf(readErr2Str);
+	//large reads go through the pipeline, so the next chunk is read from the
+	//device while the last one is sent
+	int index = ctx->geometry->indexOf(beginFrameAddress);
+	int encoding = cur->encoding;
+	if (numFrames >= PIPELINE_MIN_FRAMES && index >= 0) {
+		if (index + numFrames > ctx->geometry->numFrames()) {
+			sendErrToBuf("Frame range runs past the end of the device");
+			return;
+		}
+		if (encoding != ENCODING_RAW) {
+			readFramesEncoded(index, numFrames);
+			return;
+		}
+		beginStream(numFrames * numBytesPerFrame);
+		readFramesPipelined(index, numFrames);
 		return;
 	}
 
-	// clear glut mask to see if that changes things
-	xTopLib->clearGlutMaskBit(jtagHZ);
-	static u32 * frames = xTopLib->readFrames(beginFrameAddress, numFrames, jtagHZ);
-		xTopLib->clearGlutMaskBit(jtagHZ);
-	static u32 * frame2 = xTopLib->readFrames(beginFrameAddress, numFrames, jtagHZ);
+	TIMED("jtag.clearGlutMaskBit", ctx->device->clearGlutMaskBit(cur->jtagHZ));
+	u32 * frames = TIMED("jtag.readFrames",
+		ctx->device->readFrames(beginFrameAddress, numFrames, cur->jtagHZ));
+	if (frames == NULL) {
+		sendErrToBuf("Reading frames failed");
+		return;
+	}
+	if (index >= 0)
+		ctx->checksums->update(index, min(numFrames,
+			ctx->geometry->numFrames() - index), frames, numWordsPerFrame);
+
+	//integrity test: read again and compare. The first read is kept, as
+	//the device reuses its buffer for the second.
+	vector<u32> first;
+	if (cur->verifyReads) {
+		first.assign(frames, frames + numFrames * numWordsPerFrame);
+		TIMED("jtag.clearGlutMaskBit", ctx->device->clearGlutMaskBit(cur->jtagHZ));
+		u32 * frame2 = TIMED("jtag.readFrames",
+			ctx->device->readFrames(beginFrameAddress, numFrames, cur->jtagHZ));
+		int differ = 0;
+		if (frame2 != NULL)
+			differ = diffFrame(beginFrameAddress, &first[0], frame2, NULL,
+				first.size(), NULL);
+		if (differ > 0)
+			print("read frame: %d bits differed between reads\n", differ);
+		frames = &first[0];
+	}
 
-	//integrity test PASSED
-	for (int i = 0; i < 1; i++) {
-			xTopLib->clearGlutMaskBit(jtagHZ);
-		frames = xTopLib->readFrames(beginFrameAddress, numFrames, jtagHZ);
-			xTopLib->clearGlutMaskBit(jtagHZ);
-		frame2 = xTopLib->readFrames(beginFrameAddress, numFrames, jtagHZ);
+	if (encoding != ENCODING_RAW) {
+		EncodeBuffers buf;
+		sendEncodedFrames(encoding, frames, numFrames, index, 0, ENCODED_FLAG_LAST,
+			buf);
+		rememberNoResend();
+		return;
+	}
+	sendToBuf(frames, numFrames * numBytesPerFrame);
+}
 
-		for (u32 j = 0; j < numFrames * numWordsPerFrame; j++) {
-			if (frames[j] != frame2[j]) {
-				printf("At index [%d], 1: %d, 2: %d\n", j, frames[j], frame2[j]);
-				print("Error different\n");
-				//break;
-			}
+void JCMServer::sendEncodedFrames(int encoding, const u32 *frames, int numFrames,
+		int firstIndex, u32 firstFrame, uint8_t flags, EncodeBuffers &buf) {
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	size_t numWords = (size_t) numFrames * wordsPerFrame;
+
+	//frames that couldn't be read are zeros, which are sent as a run rather
+	//than XORed into a copy of golden that looks like real data
+	if (flags & ENCODED_FLAG_READ_ERROR)
+		encoding = ENCODING_RLE;
+
+	//xor needs golden's copy of every frame, otherwise the block is rle
+	if (encoding == ENCODING_XOR) {
+		const u32 *fradArray = ctx->geometry->frameAddresses();
+		bool haveGolden = firstIndex >= 0 &&
+			ctx->golden->wordsPerFrame() == wordsPerFrame;
+		buf.ref.resize(numWords);
+		for (int i = 0; haveGolden && i < numFrames; i++) {
+			const u32 *goldenFrame = ctx->golden->frame(fradArray[firstIndex + i]);
+			if (goldenFrame == NULL)
+				haveGolden = false;
+			else
+				memcpy(&buf.ref[i * wordsPerFrame], goldenFrame,
+					wordsPerFrame * sizeof(u32));
 		}
-		print(".");
-		if (i % 10 == 0)
-			fflush(stdout);
+		if (!haveGolden)
+			encoding = ENCODING_RLE;
 	}
 
+	uint64_t begin = monotonicNs();
+	EncodedBlockHeader h;
+	h.encoding = encoding;
+	h.flags = flags;
+	h.reserved = 0;
+	h.firstFrame = firstFrame;
+	h.numFrames = numFrames;
+	h.rawBytes = numWords * sizeof(u32);
+	buf.block.assign((uint8_t *) &h, (uint8_t *) (&h + 1));
+	encodeFrames(encoding, frames, numWords, buf.ref.empty() ? NULL : &buf.ref[0],
+		buf.scratch, buf.block);
+	STAT_HISTOGRAM("frames.encode")->record(monotonicNs() - begin);
+
+	Response r;
+	r.header[0] = PACKET_TYPE_ENCODED;
+	r.header[1] = buf.block.size();
+	r.header[2] = curRequestId;
+	r.data.assign(buf.block.begin(), buf.block.end());
+	queueResponse(r);
+}
 
+//Like a raw stream, except each chunk is encoded on the pipeline thread
+//(while the next one is read) and sent as a block of its own.
+void JCMServer::readFramesEncoded(int firstIndex, int numFrames) {
+	int encoding = cur->encoding;
+	int end = firstIndex + numFrames;
+	EncodeBuffers buf;
+	readFramesPipelined(firstIndex, numFrames, [&](FrameChunk &chunk) {
+		uint8_t flags = chunk.firstIndex + chunk.numFrames == end ?
+			ENCODED_FLAG_LAST : 0;
+		if (!chunk.ok)
+			flags |= ENCODED_FLAG_READ_ERROR;
+		sendEncodedFrames(encoding, &chunk.words[0], chunk.numFrames,
+			chunk.firstIndex, chunk.firstIndex - firstIndex, flags, buf);
+	});
+	rememberNoResend();
+}
 
-	sendToBuf(frames, sizeof(u32) * numFrames * numBytesPerFrame);
+void JCMServer::readFramesPipelined(int firstIndex, int numFrames,
+		function<void(FrameChunk &)> deliver) {
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	int next = firstIndex, end = firstIndex + numFrames;
+	bool verify = cur->verifyReads;
+	int failed = 0, differ = 0;
+	//the pipeline thread sends on behalf of this executor's command
+	DeviceContext *dc = ctx;
+	Session *session = cur;
+	u32 requestId = curRequestId;
+	BatchCapture *batch = capture;
+
+	ctx->pipeline->run(
+		//executor thread: only talks to the device
+		[&](FrameChunk &chunk) -> bool {
+			if (next >= end)
+				return false;
+			//the sends behind this chunk can't wait for a slow client, so
+			//wait here, where the chain lock can be let go
+			waitForBacklog();
+
+			//frame addresses that follow each other can be read in one go
+			int n = ctx->geometry->runFrom(next, min(end - next, PIPELINE_CHUNK_FRAMES));
+			chunk.firstIndex = next;
+			chunk.numFrames = n;
+			next += n;
+
+			size_t bytes = n * wordsPerFrame * sizeof(u32);
+			TIMED("jtag.clearGlutMaskBit",
+				ctx->device->clearGlutMaskBit(cur->jtagHZ));
+			u32 *frames = TIMED("jtag.readFrames",
+				ctx->device->readFrames(fradArray[chunk.firstIndex], n, cur->jtagHZ));
+			chunk.ok = frames != NULL;
+			if (chunk.ok)
+				memcpy(&chunk.words[0], frames, bytes);
+
+			if (chunk.ok && verify) {
+				TIMED("jtag.clearGlutMaskBit",
+					ctx->device->clearGlutMaskBit(cur->jtagHZ));
+				frames = TIMED("jtag.readFrames",
+					ctx->device->readFrames(fradArray[chunk.firstIndex], n, cur->jtagHZ));
+				chunk.verify = frames != NULL;
+				if (chunk.verify)
+					memcpy(&chunk.check[0], frames, bytes);
+			}
+			return true;
+		},
+		//pipeline thread: checks and sends what was just read
+		[&](FrameChunk &chunk) {
+			ctx = dc;
+			cur = session;
+			curRequestId = requestId;
+			capture = batch;
+			size_t words = chunk.numFrames * wordsPerFrame;
+			if (!chunk.ok) {
+				//the client is still owed the full length, so send zeros
+				failed += chunk.numFrames;
+				memset(&chunk.words[0], 0, words * sizeof(u32));
+			}
+			else {
+				if (chunk.verify)
+					differ += diffFrame(fradArray[chunk.firstIndex], &chunk.words[0],
+						&chunk.check[0], NULL, words, NULL);
+				ctx->checksums->update(chunk.firstIndex, chunk.numFrames,
+					&chunk.words[0], wordsPerFrame);
+			}
+			if (deliver)
+				deliver(chunk);
+			else
+				sendChunk(&chunk.words[0], words * sizeof(u32));
+		});
+
+	//zeros went out in their place, but a batch still needs to know the read
+	//failed; this is the executor thread, whose cmdFailed the batch reads
+	if (failed > 0) {
+		print("read frames: reading %d frames failed\n", failed);
+		cmdFailed = true;
+	}
+	if (differ > 0)
+		print("read frames: %d bits differed between reads\n", differ);
 }
 
-//Converts a string to an int
-int JCMServer::getInt(string s, int base) {
-	int i;
+//Converts a word to an int
+int JCMServer::getInt(const Token &s, int base) {
+	u32 i;
 
 	if (base != 10 && base != 16)
-		print("Programmer cannot call getInt without 10 or 16\n");
-
-	//make sure this is only numeric
-	for (int j = 0; j < s.length(); j++)
-		if ((base == 10 && !(s[j] >= '0' && s[j] <= '9')) ||
-		   (base == 16 && !isxdigit(s[j]))) {
-			sendStrToBuf(writeErr2Str);
-			throw invalid_argument("NAN");
-		}
+		logPrint(LOG_ERROR, "Programmer cannot call getInt without 10 or 16\n");
 
-	try {
-		i = stoi(s, nullptr, base);
-	}
-	catch (const invalid_argument& ia) {
-		print("SHOULD\n");
-		sendStrToBuf(writeErr2Str);
-		throw std::invalid_argument("NAN");
-	}
-	catch (const out_of_range& ia) {
-		sendStrToBuf(writeErr2Str);
-		throw std::invalid_argument("NAN");
+	//make sure this is only numeric and fits
+	if (!parseNumber(s, base, i)) {
+		sendErrToBuf(writeErr2Str);
+		throw invalid_argument("NAN");
 	}
 	return i;
 }
 
 //handles reading and writing of the bscan.
-void JCMServer::interpretBscanCommand(vector<string> c, bool read) {
+void JCMServer::interpretBscanCommand(const Tokens &c, bool read) {
 	if (read) {
 		if (c.size() != 4) {
-			sendStrToBuf(readErr2Str);
+			sendErrToBuf(readErr2Str);
 			return;
 		}
 	}
 	//if not reading, we are writing instead and it needs 3 additional args
 	else if (c.size() != 5) {
-		sendStrToBuf(readErr2Str);
+		sendErrToBuf(readErr2Str);
 		return;
 	}
 
 	int bscanNumber, bscanNumBytes, bscanNumWords;
 	u32 * regValue;
-	try {
-			//convert strings to base 10 int
-			bscanNumber = stoi(c[2], nullptr, 10);
-			bscanNumBytes = stoi(c[3], nullptr, 10); //used in reading
-			bscanNumWords = stoi(c[3], nullptr, 10); //used in writing
-
-	//		if (!read) //register to write to if writing
-		//		*regValue = (u32*) stoi(c[4], nullptr, 16);
-	}
-	catch (const invalid_argument& ia) {
-		sendStrToBuf(readErr2Str);
+	u32 number, numBytes;
+	//convert words to base 10 int
+	if (!parseNumber(c[2], 10, number) || !parseNumber(c[3], 10, numBytes) ||
+			numBytes > INT_MAX / 32) {
+		sendErrToBuf(readErr2Str);
 		return;
 	}
+	bscanNumber = number;
+	bscanNumBytes = numBytes; //used in reading
+	bscanNumWords = numBytes; //used in writing
+
+	//if (!read) //register to write to if writing
+	//	*regValue = (u32*) stoi(c[4], nullptr, 16);
 
 	if (bscanNumber < 1 || bscanNumber > 4) {
-		sendStrToBuf("Invalid Bscan number (must be 1-4)");
+		sendErrToBuf("Invalid Bscan number (must be 1-4)");
 		return;
 	}
 
 	if (read) {
-		u32 * bScanResult = xTopLib->readBscan(bscanNumber,
-					bscanNumBytes * 32, jtagHZ);
+		//the device reads the scan chain into its frame buffer, so it can't
+		//hold more words than the device has
+		int maxWords = ctx->device->getTotalFrames() * ctx->device->getWordsPerFrame();
+		if (bscanNumBytes < 1 || bscanNumBytes > maxWords) {
+			char buffer[64];
+			snprintf(buffer, sizeof buffer,
+				"Invalid Bscan length (must be 1-%d words)", maxWords);
+			sendErrToBuf(buffer);
+			return;
+		}
+		u32 * bScanResult = TIMED("jtag.readBscan", ctx->device->readBscan(bscanNumber,
+					bscanNumBytes * 32, cur->jtagHZ));
+		if (bScanResult == NULL) {
+			sendErrToBuf("Reading the Bscan failed");
+			return;
+		}
 
 		sendToBuf(bScanResult, bscanNumBytes);
 		//stringstream ss;
@@ -226,203 +478,2160 @@ void JCMServer::interpretBscanCommand(vector<string> c, bool read) {
 	//for writing
 	else {
 	//	sv->xTopLib->writeBscan(bscanNumber, bscanNumWords, regValue, sv->jtagHZ);
-		sendStrToBuf("Bscan write not implemented");
+		sendErrToBuf("Bscan write not implemented");
 	}
 }
 
-void JCMServer::interpretXadcCommand(vector<string> c) {
-	static float f;
+void JCMServer::interpretXadcCommand(const Tokens &c) {
+	float f;
+	//while the sampler is running, answer from its latest sample
+	XadcSample s;
+	bool sampled = ctx->xadc->running() && ctx->xadc->latest(s);
 
 	//if command is just "read xadc", print a summary of all
 	if (c.size() <= 2) {
-		string tmp;
-		char buffer[50];
-
-		float temperature = xTopLib->readXadcTemp(JCM_XILINX_READ_TEMP);
-		sprintf(buffer, "xadc temp = %.1f C\n", temperature);
-		tmp += buffer;
-		float maxtemperature = xTopLib->readXadcTemp(JCM_XILINX_READ_MAX_TEMP);
-		sprintf(buffer, "xadc temp Max = %.1f C\n", maxtemperature);
-		tmp += buffer;
-		float voltage = xTopLib->readXadcVoltage(JCM_XILINX_READ_VCCINT);
-		sprintf(buffer, "xadc Vccint = %.1f mV\n", voltage);
-		tmp += buffer;
-		float maxvoltage = xTopLib->readXadcVoltage(JCM_XILINX_READ_MAX_VCCINT);
-		sprintf(buffer, "xadc Vccint Max = %.1f mV\n", maxvoltage);
-		tmp += buffer;
-		voltage = xTopLib->readXadcVoltage(JCM_XILINX_READ_VCCAUX);
-		sprintf(buffer, "xadc Vccaux = %.1f mV\n", voltage);
-		tmp += buffer;
-		maxvoltage = xTopLib->readXadcVoltage(JCM_XILINX_READ_MAX_VCCAUX);
-		sprintf(buffer, "xadc Vccaux Max = %.1f mV", maxvoltage);
-		tmp += buffer;
-
-		sendStrToBuf(tmp.c_str());
+		if (!sampled)
+			XadcSampler::readDevice(ctx->device, s);
+
+		char buffer[256];
+		snprintf(buffer, sizeof buffer, "xadc temp = %.1f C\n"
+			"xadc temp Max = %.1f C\nxadc Vccint = %.1f mV\n"
+			"xadc Vccint Max = %.1f mV\nxadc Vccaux = %.1f mV\n"
+			"xadc Vccaux Max = %.1f mV", s.temp, s.maxTemp, s.vccInt,
+			s.maxVccInt, s.vccAux, s.maxVccAux);
+		sendStrToBuf(buffer);
 	}
 	else if (c[2] == "curtemp")
-		sendToBuf(&(f = xTopLib->readXadcCurTemp()), sizeof(float));
+		sendToBuf(&(f = sampled ? s.temp : TIMED("jtag.readXadcCurTemp",
+			ctx->device->readXadcCurTemp())), sizeof(float));
 	else if (c[2] == "vccint") {
-		sendToBuf(&(f = xTopLib->readXadcVccInt()), sizeof(float));
+		sendToBuf(&(f = sampled ? s.vccInt : TIMED("jtag.readXadcVccInt",
+			ctx->device->readXadcVccInt())), sizeof(float));
+	}
+	else if (c[2] == "vccaux") {
+		sendToBuf(&(f = sampled ? s.vccAux : TIMED("jtag.readXadcVccAux",
+			ctx->device->readXadcVccAux())), sizeof(float));
+	}
+	//Syntax: "read xadc history (N)"
+	else if (c[2] == "history") {
+		u32 n = XADC_HISTORY;
+		if (c.size() >= 4 && !parseNumber(c[3], 10, n)) {
+			sendErrToBuf(invalidArgsStr);
+			return;
+		}
+		vector<XadcSample> samples;
+		ctx->xadc->history(n, samples);
+		if (samples.empty())
+			sendErrToBuf("No XADC samples yet");
+		else
+			sendToBuf(&samples[0], samples.size() * sizeof(XadcSample));
+	}
+	//these require a u32 "readCommand"... not sure what that iss
+	// else if (c[2] == "temp") {
+	// 	sprintf(sv->sharedBuf, "xadc Temperature: %.1f C",
+	// 					sv->xTopLib->readXadcTemp());
+	// }
+	// else if (c[2] == "voltage") {
+	// 	sprintf(sv->sharedBuf, "xadc Voltage: %.1f mV",
+	// 					sv->xTopLib->readXadcVoltage());
+	// }
+	else {
+		sendErrToBuf("Unkown XADC register");
+	}
+}
+
+//copies the data into a new response, queues it on the current session and
+//wakes the reactor to send it.
+void JCMServer::sendToBuf(void *data, int len, char header){
+	Response r;
+	r.header[0] = header;
+	r.header[1] = len;
+	r.header[2] = curRequestId;
+	r.data.assign((char *) data, (char *) data + len);
+	rememberResponse(r);
+	queueResponse(r);
+}
+
+void JCMServer::rememberResponse(const Response &r){
+	//"resend" after a batch sends the whole batch's response
+	if (capture)
+		return;
+	pthread_mutex_lock(&cur->lock);
+	cur->lastResponse = r;
+	pthread_mutex_unlock(&cur->lock);
+}
+
+void JCMServer::queueResponse(Response &r){
+	if (capture) {
+		captureResponse(r);
+		return;
+	}
+	waitForBacklog();
+	lockSession();
+	if (!cur->closed && !cur->closing) {
+		r.queuedNs = monotonicNs();
+		cur->outQueue.push_back(r);
+		cur->outBytes += r.data.size();
+	}
+	pthread_mutex_unlock(&cur->lock);
+	wakeReactor();
+}
+
+//Waits until no other device is streaming a response to the current
+//session. The caller must hold cur->lock.
+void JCMServer::waitForStream(){
+	while (cur->streamOwner != -1 && cur->streamOwner != ctx->index && !cur->closed)
+		pthread_cond_wait(&cur->streamDone, &cur->lock);
+}
+
+//Takes cur->lock once no other device is streaming to the current session.
+//The stream may be held up by its client, so an executor lets go of its
+//chain lock while it waits; cur->lock is never held while taking the chain
+//lock.
+void JCMServer::lockSession(){
+	pthread_mutex_lock(&cur->lock);
+	while (holdsChain && cur->streamOwner != -1 && cur->streamOwner != ctx->index &&
+			!cur->closed) {
+		pthread_mutex_unlock(&cur->lock);
+		ctx->chainLock->unlock();
+		pthread_mutex_lock(&cur->lock);
+		waitForStream();
+		pthread_mutex_unlock(&cur->lock);
+		ctx->chainLock->lock();
+		//another device may have started streaming while we took it back
+		pthread_mutex_lock(&cur->lock);
+	}
+	waitForStream();
+}
+
+//If the current session's client has MAX_SESSION_BACKLOG bytes waiting,
+//waits for it to read some, and disconnects it if it doesn't within
+//SLOW_CLIENT_TIMEOUT. Only the executor waits, and it lets go of its chain
+//lock first, so a client that stops reading holds up none of the chain's
+//other sessions, scrubbers or samplers. The pipeline thread never waits
+//here (the executor would be stuck behind it with the chain held); the
+//executor waits before reading each chunk instead.
+void JCMServer::waitForBacklog(){
+	if (!onExecutor || capture != NULL)
+		return;
+	pthread_mutex_lock(&cur->lock);
+	bool backlogged = cur->outBytes >= MAX_SESSION_BACKLOG && !cur->closed &&
+		!cur->closing;
+	pthread_mutex_unlock(&cur->lock);
+	if (!backlogged)
+		return;
+
+	if (holdsChain)
+		ctx->chainLock->unlock();
+	pthread_mutex_lock(&cur->lock);
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SLOW_CLIENT_TIMEOUT;
+
+	while (cur->outBytes >= MAX_SESSION_BACKLOG && !cur->closed && !cur->closing &&
+			pthread_cond_timedwait(&cur->drained, &cur->lock, &deadline) == 0);
+
+	//the client stopped reading; drop what it has waiting and have the
+	//reactor disconnect it
+	if (cur->outBytes >= MAX_SESSION_BACKLOG && !cur->closed && !cur->closing) {
+		logPrint(LOG_WARN, "%s stopped reading, disconnecting\n", cur->clientAddr);
+		cur->outQueue.clear();
+		cur->outBytes = 0;
+		cur->closing = true;
+	}
+	pthread_mutex_unlock(&cur->lock);
+	if (holdsChain)
+		ctx->chainLock->lock();
+}
+
+//Called once the executor has finished a command, which ends any stream it
+//started
+void JCMServer::endStream(){
+	pthread_mutex_lock(&cur->lock);
+	if (cur->streamOwner == ctx->index) {
+		cur->streamOwner = -1;
+		pthread_cond_broadcast(&cur->streamDone);
+	}
+	pthread_mutex_unlock(&cur->lock);
+}
+
+void JCMServer::sendStrToBuf(const char* s) {
+	sendToBuf((void *) s, strlen(s), PACKET_TYPE_TEXT);
+}
+
+void JCMServer::sendErrToBuf(const char* s) {
+	cmdFailed = true;
+	sendStrToBuf(s);
+}
+
+void JCMServer::beginStream(u32 totalLen, char header){
+	//the session is ours until the command finishes (a batch's stream is
+	//only part of its response, which is sent whole)
+	if (!capture) {
+		lockSession();
+		cur->streamOwner = ctx->index;
+		pthread_mutex_unlock(&cur->lock);
+	}
+
+	//just the header; the data follows in continuation responses
+	Response r;
+	r.header[0] = header;
+	r.header[1] = totalLen;
+	r.header[2] = curRequestId;
+	queueResponse(r);
+	rememberNoResend();
+}
+
+void JCMServer::rememberNoResend(){
+	static const char *noResendStr = "A streamed response cannot be resent";
+	Response noResend;
+	noResend.header[0] = PACKET_TYPE_TEXT;
+	noResend.data.assign(noResendStr, noResendStr + strlen(noResendStr));
+	rememberResponse(noResend);
+}
+
+void JCMServer::sendChunk(void *data, int len){
+	if (len <= 0)
+		return;
+	Response r;
+	r.header[0] = PACKET_TYPE_BINARY;
+	r.continuation = true;
+	r.data.assign((char *) data, (char *) data + len);
+	queueResponse(r);
+}
+
+void JCMServer::sendFileToBuf(int fd, size_t len, char header){
+	Response r;
+	r.header[0] = header;
+	r.header[1] = len;
+	r.header[2] = curRequestId;
+	r.file = make_shared<ResponseFile>(fd, 0, len);
+	struct stat st;
+	if (fstat(fd, &st) == 0)
+		r.file->modified = st.st_mtim;
+	rememberResponse(r);
+	queueResponse(r);
+}
+
+void JCMServer::interpretReadCommand(const Tokens &c) {
+		//sendToBuf copies the data into the queued response, so these only
+		//hold a value long enough to take its address.
+		u32 v;
+		int k;
+		if (c.size() < 2) {
+			sendErrToBuf(readErr1Str);
+			return;
+		}
+		if (c[1].find(',') < c[1].length()) {
+			readRegisterList(c[1]);
+			return;
+		}
+		switch (verbHash(c[1])) {
+		case verbHash("help"):
+		case verbHash("?"):
+			sendStrToBuf(helpReadString);
+			break;
+		case verbHash("far"):
+			sendToBuf(&(v = TIMED("jtag.readFar",
+				ctx->device->readFar(cur->jtagHZ))), sizeof(u32));
+			break;
+		case verbHash("idcode"):
+			sendToBuf(&(v = TIMED("jtag.readIdCode",
+				ctx->device->readIdCode(cur->jtagHZ))), sizeof(u32));
+			break;
+		case verbHash("ctrl0"):
+			sendToBuf(&(v = TIMED("jtag.readCtrl0",
+				ctx->device->readCtrl0())), sizeof(u32));
+			break;
+		case verbHash("crc"):
+			v = TIMED("jtag.readCrc",
+				ctx->device->readCrc(cur->jtagHZ));
+			noteCrc(JCM_REG_CRC, v);
+			sendToBuf(&v, sizeof(u32));
+			break;
+		case verbHash("crchw"):
+			v = TIMED("jtag.readCrcHw",
+				ctx->device->readCrcHw(cur->jtagHZ));
+			noteCrc(JCM_REG_CRCHW, v);
+			sendToBuf(&v, sizeof(u32));
+			break;
+		case verbHash("crcsw"):
+			v = TIMED("jtag.readCrcSw",
+				ctx->device->readCrcSw(cur->jtagHZ));
+			noteCrc(JCM_REG_CRCSW, v);
+			sendToBuf(&v, sizeof(u32));
+			break;
+		case verbHash("crclive"):
+			v = TIMED("jtag.readCrcLive",
+				ctx->device->readCrcLive());
+			noteCrc(JCM_REG_CRCLIVE, v);
+			sendToBuf(&v, sizeof(u32));
+			break;
+		case verbHash("status"):
+			sendToBuf(&(v = TIMED("jtag.readStatus",
+				ctx->device->readStatus(cur->jtagHZ))), sizeof(u32));
+			break;
+		case verbHash("cor1"):
+			sendToBuf(&(v = TIMED("jtag.readCor1",
+				ctx->device->readCor1(cur->jtagHZ))), sizeof(u32));
+			break;
+		case verbHash("cmd"):
+			sendToBuf(&(v = TIMED("jtag.readCmd",
+				ctx->device->readCmd(cur->jtagHZ))), sizeof(u32));
+			break;
+		case verbHash("numlogicframes"):
+			sendToBuf(&(k = ctx->geometry->numLogicFrames()), sizeof(k));
+			logPrint(LOG_DEBUG, "num logic frames: %d\n", k);
+			break;
+		case verbHash("numbramframes"):
+			sendToBuf(&(k = ctx->geometry->numBramFrames()), sizeof(k));
+			logPrint(LOG_DEBUG, "num bram frames: %d\n", k);
+			break;
+		case verbHash("numtotalframes"):
+			sendToBuf(&(k = ctx->geometry->numFrames()), sizeof(k));
+			logPrint(LOG_DEBUG, "num total frames: %d\n", k);
+			break;
+		case verbHash("wordsperframe"):
+			sendToBuf(&(k = ctx->device->getWordsPerFrame()), sizeof(k));
+			logPrint(LOG_DEBUG, "num words per frames: %d\n", k);
+			break;
+		case verbHash("xadc"):
+			interpretXadcCommand(c);
+			break;
+		case verbHash("frame"):
+			readInFramesFromDevice(c);
+			break;
+		case verbHash("bscan"):
+			interpretBscanCommand(c, true);
+			break;
+		case verbHash("fradlist"): {
+			sendFrameList();
+			break;
+		}
+		case verbHash("hwversion"):
+			/*in order to print hardware version, function must be changed*/
+			break;
+		default:
+			sendErrToBuf(readErr0Str);
+		}
+}
+
+//Syntax: "read REG,REG,..."
+void JCMServer::readRegisterList(const Token &list) {
+	Tokens names;
+	if (!split(list, ',', names)) {
+		sendErrToBuf("Too many registers");
+		return;
+	}
+
+	int regs[MAX_TOKENS];
+	for (size_t i = 0; i < names.size(); i++) {
+		switch (verbHash(names[i])) {
+		case verbHash("far"): regs[i] = JCM_REG_FAR; break;
+		case verbHash("idcode"): regs[i] = JCM_REG_IDCODE; break;
+		case verbHash("ctrl0"): regs[i] = JCM_REG_CTRL0; break;
+		case verbHash("crc"): regs[i] = JCM_REG_CRC; break;
+		case verbHash("crchw"): regs[i] = JCM_REG_CRCHW; break;
+		case verbHash("crcsw"): regs[i] = JCM_REG_CRCSW; break;
+		case verbHash("crclive"): regs[i] = JCM_REG_CRCLIVE; break;
+		case verbHash("status"): regs[i] = JCM_REG_STATUS; break;
+		case verbHash("cor1"): regs[i] = JCM_REG_COR1; break;
+		case verbHash("cmd"): regs[i] = JCM_REG_CMD; break;
+		default:
+			sendErrToBuf(readErr0Str);
+			return;
+		}
+	}
+
+	//all read while we hold the device, so nothing else touches it between
+	//them
+	u32 values[MAX_TOKENS];
+	TIMED("jtag.readRegisters", ctx->device->readRegisters(regs, names.size(),
+		values, cur->jtagHZ));
+	for (size_t i = 0; i < names.size(); i++)
+		noteCrc(regs[i], values[i]);
+	sendToBuf(values, names.size() * sizeof(u32));
+}
+
+//Syntax: "readback (stream|file) (bram)"
+void JCMServer::interpretReadbackCommand(const Tokens &c) {
+	//NOTE: this are default values from jcm_full_readback, and should perhaps
+	//be constants somewhere!
+	bool readBram = false, clearGlutMask = true, issueCapture = false;
+	if (c.size() >= 3 && c[2] == "bram")
+		readBram = true;
+
+	if (c.size() >= 2 && c[1] == "stream") {
+		streamReadback(readBram);
+		return;
+	}
+	if (c.size() >= 2 && c[1] == "delta") {
+		u32 since = 0;
+		bool cached = false;
+		readBram = false;
+		for (size_t i = 2; i < c.size(); i++) {
+			if (c[i] == "bram")
+				readBram = true;
+			else if (c[i] == "cached")
+				cached = true;
+			else if (!parseNumber(c[i], 10, since)) {
+				sendErrToBuf("usage: readback delta (EPOCH) (bram) (cached)");
+				return;
+			}
+		}
+		sendReadbackDelta(since, readBram, cached);
+		return;
+	}
+
+	// Perform readback
+	TIMED("jtag.readFullDevice", ctx->device->readFullDevice(ctx->readbackPath.c_str(),
+			readBram, clearGlutMask, issueCapture, cur->jtagHZ));
+	//NOTE XilinxUtils->readFullDevice returns a pointer to data; even if the
+	//fpga is off, the jcm_full_readback.elf will not throw an error. The server
+	//doesn't either since this should be handled in that function.
+	if (c.size() < 2) {
+		sendStrToBuf("Readback complete(?)");
+		return;
+	}
+	if (c[1] != "file") {
+		sendErrToBuf("usage: readback (stream|file|delta) (bram)");
+		return;
+	}
+
+	//send the file straight from the page cache
+	struct stat st;
+	int fd = open(ctx->readbackPath.c_str(), O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror("readback open");
+		if (fd != -1)
+			close(fd);
+		sendErrToBuf("Readback failed: could not open the readback file");
+		return;
+	}
+	sendFileToBuf(fd, st.st_size);
+}
+
+//Reads the device back through the pipeline and sends the frames as they
+//are read, so the whole readback never has to be held in memory (or written
+//to a file) first.
+void JCMServer::streamReadback(bool readBram) {
+	int numFrames = ctx->geometry->numFrames(readBram);
+	u32 bytesPerFrame = ctx->device->getWordsPerFrame() * sizeof(u32);
+
+	if (cur->encoding != ENCODING_RAW)
+		readFramesEncoded(0, numFrames);
+	else {
+		beginStream(numFrames * bytesPerFrame);
+		readFramesPipelined(0, numFrames);
+	}
+	print("readback: streamed %d frames (%s)\n", numFrames,
+		encodingName(cur->encoding));
+}
+
+//Sends the frames whose checksum changed in epoch since or later, after
+//either reading the whole device (updating every checksum on the way) or,
+//if cached, going only by what the checksums already say changed (which is
+//only as fresh as the last scrub pass or readback). The response is streamed
+//a run of frames at a time, so the changed frames are read once more to
+//send them rather than being kept from the full read.
+void JCMServer::sendReadbackDelta(u32 since, bool readBram, bool cached) {
+	int numFrames = ctx->geometry->numFrames(readBram);
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+	size_t recordWords = 1 + wordsPerFrame;
+
+	DeltaHeader h;
+	h.since = since;
+	h.wordsPerFrame = wordsPerFrame;
+	h.readErrors = 0;
+
+	//only the checksums are wanted from the full read
+	if (!cached)
+		readFramesPipelined(0, numFrames, [&](FrameChunk &chunk) {
+			if (!chunk.ok)
+				h.readErrors += chunk.numFrames;
+		});
+	vector<int> changed;
+	ctx->checksums->changedSince(since, changed);
+	while (!changed.empty() && changed.back() >= numFrames)
+		changed.pop_back();
+	h.numFrames = changed.size();
+	//we have held the chain since the checksums were read, so the scrubber
+	//can't have recorded anything we didn't see; whatever changes from here
+	//on (the chain is let go while a slow client catches up) is tagged with
+	//the new epoch, including a frame that changes again before it is sent
+	//below, which is then sent again next time too
+	h.epoch = ctx->checksums->nextEpoch();
+
+	print("readback delta: %u frames changed since epoch %u (%s), now epoch %u\n",
+		h.numFrames, since, cached ? "cached" : "full read", h.epoch);
+	beginStream(sizeof h + changed.size() * recordWords * sizeof(u32));
+	sendChunk(&h, sizeof h);
+
+	vector<u32> records(PIPELINE_CHUNK_FRAMES * recordWords);
+	int failed = 0;
+	for (size_t j = 0; j < changed.size(); ) {
+		//changed frames whose addresses follow each other are read in one go
+		int first = changed[j];
+		int max = ctx->geometry->runFrom(first, PIPELINE_CHUNK_FRAMES);
+		int n = 1;
+		while (n < max && j + n < changed.size() && changed[j + n] == first + n)
+			n++;
+		j += n;
+
+		TIMED("jtag.clearGlutMaskBit", ctx->device->clearGlutMaskBit(cur->jtagHZ));
+		u32 *frames = TIMED("jtag.readFrames",
+			ctx->device->readFrames(fradArray[first], n, cur->jtagHZ));
+		if (frames != NULL)
+			ctx->checksums->update(first, n, frames, wordsPerFrame);
+		else
+			failed += n;
+		//the client is still owed a record for each frame, so one that
+		//can't be read is sent as zeros with its address flagged
+		for (int k = 0; k < n; k++) {
+			u32 *record = &records[k * recordWords];
+			record[0] = fradArray[first + k];
+			if (frames != NULL)
+				memcpy(&record[1], &frames[k * wordsPerFrame], wordsPerFrame * sizeof(u32));
+			else {
+				record[0] |= DELTA_FRAME_READ_ERROR;
+				memset(&record[1], 0, wordsPerFrame * sizeof(u32));
+			}
+		}
+		sendChunk(&records[0], n * recordWords * sizeof(u32));
+	}
+	if (failed > 0) {
+		print("readback delta: reading %d changed frames failed\n", failed);
+		cmdFailed = true;
+	}
+}
+
+//Syntax: "golden (info|capture|load|frame) ..."
+void JCMServer::interpretGoldenCommand(const Tokens &c) {
+	if (c.size() < 2 || c[1] == "info") {
+		const GoldenHeader *h = ctx->golden->info();
+		if (h == NULL) {
+			sendErrToBuf("No golden image loaded");
+			return;
+		}
+		time_t captured = h->captureTime;
+		struct tm t;
+		char when[32];
+		strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&captured, &t));
+		//the path goes in separately, so a long one isn't cut short
+		char buffer[128];
+		snprintf(buffer, sizeof buffer, "\nframes: %u (%s)\nwords per frame: %u\n"
+			"idcode: %08x\ncaptured: %s", h->numFrames, h->flags & GOLDEN_FLAG_BRAM ?
+			"with bram" : "logic only", h->wordsPerFrame, h->idCode, when);
+		string info = string("Golden image ") + ctx->golden->path() + buffer;
+		sendStrToBuf(info.c_str());
+	}
+	else if (c[1] == "help" || c[1] == "?")
+		sendStrToBuf(helpGoldenString);
+	else if (c[1] == "capture") {
+		string path = ctx->goldenPath;
+		bool readBram = false;
+		for (size_t i = 2; i < c.size(); i++) {
+			if (c[i] == "bram")
+				readBram = true;
+			else
+				path = c[i].str();
+		}
+		captureGolden(path.c_str(), readBram);
+	}
+	else if (c[1] == "load") {
+		string path = c.size() >= 3 ? c[2].str() : ctx->goldenPath;
+		if (ctx->golden->load(path.c_str()))
+			sendStrToBuf("Golden image loaded");
+		else
+			sendErrToBuf("Loading golden image failed");
+	}
+	else if (c[1] == "frame") {
+		u32 frameAddress;
+		if (c.size() < 3) {
+			sendErrToBuf(invalidArgsStr);
+			return;
+		}
+		try { frameAddress = getInt(c[2], 16); }
+		catch (invalid_argument& ia) {
+			logPrint(LOG_WARN, "golden frame parseint failed.\n");
+			return;
+		}
+		const u32 *frame = ctx->golden->frame(frameAddress);
+		if (frame == NULL)
+			sendErrToBuf("Frame not in golden image");
+		else
+			sendToBuf((void *) frame, ctx->golden->wordsPerFrame() * sizeof(u32));
+	}
+	else if (c[1] == "compare")
+		compareToGolden(c.size() >= 3 && c[2] == "bram");
+	else if (c[1] == "mask") {
+		if (c.size() < 3)
+			sendErrToBuf(invalidArgsStr);
+		else if (c[2] == "off") {
+			ctx->mask->unload();
+			sendStrToBuf("Mask off");
+		}
+		else if (ctx->mask->load(c[2].str().c_str()))
+			sendStrToBuf("Mask loaded");
+		else
+			sendErrToBuf("Loading mask failed");
+	}
+	else
+		sendErrToBuf("Unknown golden command");
+}
+
+//Reads the device back through the pipeline and compares each chunk against
+//golden on the pipeline thread while the next one is read.
+void JCMServer::compareToGolden(bool readBram) {
+	if (!ctx->golden->isLoaded()) {
+		sendErrToBuf("No golden image loaded");
+		return;
+	}
+	int numFrames = ctx->geometry->numFrames(readBram);
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	if (ctx->golden->wordsPerFrame() != wordsPerFrame) {
+		sendErrToBuf("Golden image is for a different device");
+		return;
+	}
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+
+	CompareSummary summary;
+	memset(&summary, 0, sizeof summary);
+	vector<Upset> upsets;
+
+	//a golden image captured from this device lists its frames in the same
+	//order, so they can be found by index instead of searched for
+	bool sameOrder = ctx->geometry->hasPrefix(ctx->golden->frameAddresses(),
+		min(numFrames, ctx->golden->numFrames()));
+
+	readFramesPipelined(0, numFrames, [&](FrameChunk &chunk) {
+		//unreadable frames arrive as zeros, which aren't upsets
+		if (!chunk.ok) {
+			summary.readErrors += chunk.numFrames;
+			return;
+		}
+		for (int i = 0; i < chunk.numFrames; i++) {
+			int index = chunk.firstIndex + i;
+			u32 frameAddress = fradArray[index];
+			const u32 *goldenFrame = sameOrder && index < ctx->golden->numFrames() ?
+				ctx->golden->frameAt(index) : ctx->golden->frame(frameAddress);
+			if (goldenFrame == NULL)
+				continue;
+			//only list upsets while there is room; keep counting after
+			bool room = upsets.size() < MAX_REPORTED_UPSETS;
+			int n = diffFrame(frameAddress, &chunk.words[i * wordsPerFrame],
+				goldenFrame, ctx->mask->frame(frameAddress), wordsPerFrame,
+				room ? &upsets : NULL);
+			summary.framesCompared++;
+			if (n > 0) {
+				summary.framesDiffering++;
+				summary.upsetBits += n;
+			}
+		}
+	});
+	if (upsets.size() > MAX_REPORTED_UPSETS)
+		upsets.resize(MAX_REPORTED_UPSETS);
+	summary.numRecords = upsets.size();
+
+	print("golden compare: %u frames, %u differ, %u bits, %u unreadable (%s)\n",
+		summary.framesCompared, summary.framesDiffering, summary.upsetBits,
+		summary.readErrors, diffKernelName());
+	vector<char> out(sizeof summary + upsets.size() * sizeof(Upset));
+	memcpy(&out[0], &summary, sizeof summary);
+	if (!upsets.empty())
+		memcpy(&out[sizeof summary], &upsets[0], upsets.size() * sizeof(Upset));
+	sendToBuf(&out[0], out.size());
+}
+
+//Reads the device back through the pipeline, writing the frames straight
+//into a new golden image file, then loads it. The file is written under a
+//temporary name so a failed capture never replaces a good image.
+void JCMServer::captureGolden(const char *path, bool readBram) {
+	int numFrames = ctx->geometry->numFrames(readBram);
+	string tmpPath = string(path) + ".tmp";
+
+	int fd = GoldenImage::create(tmpPath.c_str(), TIMED("jtag.readIdCode",
+		ctx->device->readIdCode(cur->jtagHZ)),
+		readBram ? GOLDEN_FLAG_BRAM : 0, ctx->device->getWordsPerFrame(), numFrames,
+		ctx->geometry->frameAddresses());
+	if (fd == -1) {
+		sendErrToBuf("Creating golden image file failed");
+		return;
+	}
+
+	bool ok = true, readFailed = false;
+	readFramesPipelined(0, numFrames, [&](FrameChunk &chunk) {
+		//a frame that couldn't be read arrives as zeros, which must not
+		//become its golden copy
+		if (!chunk.ok)
+			readFailed = true;
+		else if (ok && !GoldenImage::writeFrames(fd, chunk.firstIndex,
+				chunk.numFrames, &chunk.words[0]))
+			ok = false;
+	});
+	close(fd);
+
+	if (readFailed || !ok || rename(tmpPath.c_str(), path) == -1 ||
+			!ctx->golden->load(path)) {
+		unlink(tmpPath.c_str());
+		sendErrToBuf(readFailed ? "Capturing golden image failed: frames could "
+			"not be read" : "Capturing golden image failed");
+		return;
+	}
+	print("golden: captured %d frames into %s\n", numFrames, path);
+	sendStrToBuf("Golden image captured");
+}
+
+//Syntax: "configure preload FILE" or "configure cache (clear)"
+void JCMServer::interpretBitstreamCommand(const Tokens &c) {
+	char line[512];
+	if (c[1] == "preload") {
+		if (c.size() != 3) {
+			sendErrToBuf("usage: configure preload FILE");
+			return;
+		}
+		BitstreamEntry e;
+		string error;
+		if (!bitstreams.preload(c[2].str(), e, error)) {
+			sendErrToBuf(error.c_str());
+			return;
+		}
+		snprintf(line, sizeof line, "%s staged as %s (%llu bytes, hash %016llx)\n"
+			"reading it: %.2f ms, reading the copy: %.2f ms", e.path.c_str(),
+			e.stagedPath.c_str(), (unsigned long long) e.size,
+			(unsigned long long) e.hash, e.readNs / 1e6, e.stagedReadNs / 1e6);
+		sendStrToBuf(line);
+	}
+	else if (c[2] == "clear") {
+		bitstreams.clear();
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else if (c.size() == 2) {
+		vector<BitstreamEntry> entries;
+		bitstreams.entries(entries);
+		if (entries.empty()) {
+			sendStrToBuf("No bit files staged");
+			return;
+		}
+		string list;
+		uint64_t saved = 0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			BitstreamEntry &e = entries[i];
+			snprintf(line, sizeof line, "%s: %llu bytes, hash %016llx, %llu uses, "
+				"about %.1f ms saved\n", e.path.c_str(), (unsigned long long) e.size,
+				(unsigned long long) e.hash, (unsigned long long) e.hits,
+				e.savedNs / 1e6);
+			list += line;
+			saved += e.savedNs;
+		}
+		//what a use saves is measured once, when the file is staged, so these
+		//are estimates rather than timings of each configuration
+		snprintf(line, sizeof line, "total saved: about %.1f ms (estimated from "
+			"one timed read of each)", saved / 1e6);
+		list += line;
+		sendStrToBuf(list.c_str());
+	}
+	else
+		sendErrToBuf("usage: configure cache (clear)");
+}
+
+//Syntax: "batch (stop) STATEMENT; STATEMENT; ..."
+void JCMServer::interpretBatchCommand(const string &command, const Tokens &c) {
+	if (capture) {
+		sendErrToBuf("Batches can't run batches; use a macro");
+		return;
+	}
+	bool stopOnError = c[1] == "stop";
+	size_t first = stopOnError ? 2 : 1;
+	if (first >= c.size()) {
+		sendErrToBuf("usage: batch (stop) CMD; CMD; ...");
+		return;
+	}
+	const char *body = c[first].p;
+	map<string, string> vars;
+	sendBatch(string(body, command.data() + command.size() - body), vars,
+		stopOnError);
+}
+
+//Syntax: "macro (define NAME BODY|run (stop) NAME (ARGS)|show NAME|
+//delete NAME|list)"
+void JCMServer::interpretMacroCommand(const string &command, const Tokens &c) {
+	if (c.size() < 2 || c[1] == "list") {
+		vector<string> names;
+		macros.names(names);
+		string list;
+		for (size_t i = 0; i < names.size(); i++)
+			list += (i ? "\n" : "") + names[i];
+		sendStrToBuf(names.empty() ? "No macros" : list.c_str());
+		return;
+	}
+	if (c[1] == "define") {
+		if (c.size() < 4) {
+			sendErrToBuf("usage: macro define NAME CMD; CMD; ...");
+			return;
+		}
+		const char *body = c[3].p;
+		string text(body, command.data() + command.size() - body);
+		vector<BatchStep> steps;
+		string error;
+		if (!parseBatch(text, steps, error))
+			sendErrToBuf(error.c_str());
+		else if (!macros.define(c[2].str(), text))
+			sendErrToBuf("Too many macros");
+		else
+			sendStrToBuf(genericSuccessReponse);
+		return;
+	}
+	if (c[1] == "run") {
+		//runs inside a batch go through runBatchCommand instead
+		if (capture) {
+			sendErrToBuf("Batches can't run batches; use a macro");
+			return;
+		}
+		bool stopOnError = c[2] == "stop";
+		size_t n = stopOnError ? 3 : 2;
+		string body;
+		if (n >= c.size() || !macros.find(c[n].str(), body)) {
+			sendErrToBuf("No such macro");
+			return;
+		}
+		map<string, string> vars;
+		for (size_t i = n + 1; i < c.size(); i++)
+			vars[to_string(i - n)] = c[i].str();
+		sendBatch(body, vars, stopOnError);
+		return;
+	}
+
+	string body;
+	if (c.size() < 3 || !macros.find(c[2].str(), body))
+		sendErrToBuf("No such macro");
+	else if (c[1] == "show")
+		sendStrToBuf(body.c_str());
+	else if (c[1] == "delete") {
+		macros.remove(c[2].str());
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else
+		sendErrToBuf("Unknown macro command");
+}
+
+//Every command of the batch runs with the chain held (this executor holds
+//it throughout), so the batch runs at JTAG speed. Their responses are
+//collected into one: a BatchHeader and a record for each response.
+void JCMServer::sendBatch(const string &text, map<string, string> &vars,
+		bool stopOnError) {
+	vector<BatchStep> steps;
+	string error;
+	if (!parseBatch(text, steps, error)) {
+		sendErrToBuf(error.c_str());
+		return;
+	}
+
+	BatchCapture batch;
+	BatchHeader h;
+	h.numCommands = 0;
+	h.numFailed = 0;
+	h.stoppedAt = BATCH_NOT_STOPPED;
+	capture = &batch;
+	runBatch(steps, vars, stopOnError, 0, h);
+	capture = NULL;
+	h.numRecords = batch.numRecords;
+
+	print("batch: %u commands, %u failed%s, %zu bytes of responses\n",
+		h.numCommands, h.numFailed, h.stoppedAt != BATCH_NOT_STOPPED ?
+		", stopped" : "", batch.out.size());
+	vector<char> out(sizeof h + batch.out.size());
+	memcpy(&out[0], &h, sizeof h);
+	if (!batch.out.empty())
+		memcpy(&out[sizeof h], &batch.out[0], batch.out.size());
+	sendToBuf(&out[0], out.size());
+}
+
+bool JCMServer::runBatch(const vector<BatchStep> &steps, map<string, string> &vars,
+		bool stopOnError, int depth, BatchHeader &h) {
+	//the loops the statement being run is in, innermost last
+	struct Loop {
+		size_t start;
+		//for a for, its variable, values and the next one; for a repeat,
+		//the passes left
+		string var;
+		vector<string> values;
+		size_t next;
+		u32 remaining;
+	};
+	vector<Loop> loops;
+
+	for (size_t pc = 0; pc < steps.size(); pc++) {
+		if (++capture->steps > MAX_BATCH_STEPS)
+			return failBatch("Batch ran too many statements", true, h);
+		const BatchStep &step = steps[pc];
+		string text = substituteVariables(step.text, vars);
+		Tokens t;
+		if (!tokenize(text.data(), text.size(), t))
+			return failBatch(invalidArgsStr, true, h);
+
+		switch (step.kind) {
+		case BATCH_STEP_COMMAND:
+			if (!runBatchCommand(text, stopOnError, depth, h))
+				return false;
+			break;
+		case BATCH_STEP_SET: {
+			if (t.size() < 2)
+				return failBatch("usage: set NAME VALUE", true, h);
+			const char *value = t[2].p;
+			vars[t[1].str()] = t.size() < 3 ? "" :
+				string(value, text.data() + text.size() - value);
+			break;
+		}
+		case BATCH_STEP_REPEAT: {
+			Loop l;
+			l.start = pc;
+			l.next = 0;
+			if (t.size() != 2 || !parseNumber(t[1], 10, l.remaining))
+				return failBatch("usage: repeat N; ...; end", true, h);
+			if (l.remaining == 0)
+				pc = step.match;
+			else {
+				l.remaining--;
+				loops.push_back(l);
+			}
+			break;
+		}
+		case BATCH_STEP_FOR: {
+			Loop l;
+			l.start = pc;
+			l.next = 1;
+			l.remaining = 0;
+			if (t.size() != 3 || !expandBatchList(t[2].str(), l.values))
+				return failBatch("usage: for NAME A,B,FIRST-LAST,...; ...; end", true, h);
+			l.var = t[1].str();
+			if (l.values.empty())
+				pc = step.match;
+			else {
+				vars[l.var] = l.values[0];
+				loops.push_back(l);
+			}
+			break;
+		}
+		case BATCH_STEP_END: {
+			Loop &l = loops.back();
+			if (l.next > 0 && l.next < l.values.size()) {
+				vars[l.var] = l.values[l.next++];
+				pc = l.start;
+			}
+			else if (l.next == 0 && l.remaining > 0) {
+				l.remaining--;
+				pc = l.start;
+			}
+			else
+				loops.pop_back();
+			break;
+		}
+		}
+	}
+	return true;
+}
+
+bool JCMServer::runBatchCommand(const string &text, bool stopOnError, int depth,
+		BatchHeader &h) {
+	Tokens t;
+	tokenize(text.data(), text.size(), t);
+
+	//a macro's commands are the batch's own, so it isn't a command itself
+	if (t[0] == "macro" && t[1] == "run") {
+		bool stop = t[2] == "stop";
+		size_t n = stop ? 3 : 2;
+		string body;
+		vector<BatchStep> steps;
+		string error;
+		if (depth + 1 >= MAX_BATCH_DEPTH)
+			return failBatch("Macros nested too deeply", true, h);
+		if (n >= t.size() || !macros.find(t[n].str(), body))
+			return failBatch("No such macro", stopOnError || stop, h);
+		if (!parseBatch(body, steps, error))
+			return failBatch(error.c_str(), true, h);
+		map<string, string> args;
+		for (size_t i = n + 1; i < t.size(); i++)
+			args[to_string(i - n)] = t[i].str();
+		return runBatch(steps, args, stopOnError || stop, depth + 1, h);
+	}
+
+	if (h.numCommands >= MAX_BATCH_COMMANDS)
+		return failBatch("Batch ran too many commands", true, h);
+	if (capture->overflowed)
+		return failBatch("Batch responses too large", true, h);
+
+	capture->command = h.numCommands++;
+	capture->commandRecords.clear();
+	cmdFailed = false;
+	if (t[0] == "exit" || t[0] == "batch" || t[0][0] == '@')
+		sendErrToBuf("Can't be run in a batch");
+	else
+		interpretCommand(text);
+
+	if (!cmdFailed)
+		return true;
+	h.numFailed++;
+	for (size_t i = 0; i < capture->commandRecords.size(); i++) {
+		BatchRecordHeader r;
+		memcpy(&r, &capture->out[capture->commandRecords[i]], sizeof r);
+		r.flags |= BATCH_RECORD_FAILED;
+		memcpy(&capture->out[capture->commandRecords[i]], &r, sizeof r);
+	}
+	if (!stopOnError)
+		return true;
+	h.stoppedAt = capture->command;
+	return false;
+}
+
+//The error is added even if the responses have overflowed, so the client
+//always learns why the batch stopped
+bool JCMServer::failBatch(const char *error, bool stop, BatchHeader &h) {
+	BatchRecordHeader r;
+	r.command = h.numCommands++;
+	r.type = PACKET_TYPE_TEXT;
+	r.flags = BATCH_RECORD_FAILED;
+	r.len = strlen(error);
+	capture->out.insert(capture->out.end(), (char *) &r, (char *) (&r + 1));
+	capture->out.insert(capture->out.end(), error, error + r.len);
+	capture->numRecords++;
+	h.numFailed++;
+	if (!stop)
+		return true;
+	h.stoppedAt = r.command;
+	return false;
+}
+
+void JCMServer::captureResponse(const Response &r) {
+	BatchCapture &b = *capture;
+	size_t len = r.file ? r.file->length : r.data.size();
+	if (b.overflowed || b.out.size() + sizeof(BatchRecordHeader) + len >
+			MAX_BATCH_RESPONSE) {
+		b.overflowed = true;
+		return;
+	}
+
+	BatchRecordHeader h;
+	if (!r.continuation) {
+		h.command = b.command;
+		h.type = r.header[0];
+		h.flags = 0;
+		h.len = 0;
+		b.commandRecords.push_back(b.out.size());
+		b.out.insert(b.out.end(), (char *) &h, (char *) (&h + 1));
+		b.numRecords++;
+	}
+	if (b.commandRecords.empty() || len == 0)
+		return;
+
+	size_t at = b.out.size();
+	b.out.resize(at + len);
+	if (!r.file)
+		memcpy(&b.out[at], &r.data[0], len);
+	else if (pread(r.file->fd, &b.out[at], len, r.file->offset) != (ssize_t) len) {
+		perror("batch pread");
+		memset(&b.out[at], 0, len);
+	}
+	size_t last = b.commandRecords.back();
+	memcpy(&h, &b.out[last], sizeof h);
+	h.len += len;
+	memcpy(&b.out[last], &h, sizeof h);
+}
+
+//Syntax: "job (run|status|cancel|result|list) ..." or "jobs"
+void JCMServer::interpretJobCommand(const string &command, const Tokens &c) {
+	if (c[0] == "jobs" || c.size() < 2 || c[1] == "list") {
+		vector<shared_ptr<Job> > jobs;
+		jobManager.list(jobs);
+		if (jobs.empty()) {
+			sendStrToBuf("No jobs");
+			return;
+		}
+		string list;
+		for (size_t i = 0; i < jobs.size(); i++) {
+			Job &j = *jobs[i];
+			char line[256];
+			u32 done = j.framesDone, total = j.framesTotal;
+			snprintf(line, sizeof line, "%s%u: device %d, %s, %s", i ? "\n" : "",
+				j.id, j.device, jobStateName(j.state), j.command.c_str());
+			list += line;
+			if (total > 0 && !j.finished()) {
+				snprintf(line, sizeof line, " (%.0f%%)", 100.0 * done / total);
+				list += line;
+			}
+		}
+		sendStrToBuf(list.c_str());
+		return;
+	}
+	if (c[1] == "run") {
+		submitJob(command, c);
+		return;
+	}
+
+	u32 id;
+	if (c.size() < 3 || !parseNumber(c[2], 10, id)) {
+		sendErrToBuf("usage: job (run (deadline S) COMMAND|status N|cancel N|"
+			"result N|list)");
+		return;
+	}
+	shared_ptr<Job> job = jobManager.find(id);
+	if (!job) {
+		sendErrToBuf("No such job");
+		return;
+	}
+	if (c[1] == "status")
+		sendStrToBuf(JobManager::describe(*job).c_str());
+	else if (c[1] == "cancel") {
+		if (jobManager.cancel(id))
+			sendStrToBuf("Job cancelling");
+		else
+			sendErrToBuf("Job has already finished");
+	}
+	else if (c[1] == "result") {
+		if (!job->finished()) {
+			sendErrToBuf("Job has not finished");
+			return;
+		}
+		if (job->state != JOB_DONE) {
+			string s = string("Job ") + jobStateName(job->state) + ": " + job->result;
+			sendErrToBuf(s.c_str());
+			return;
+		}
+		if (job->outputPath.empty()) {
+			sendStrToBuf(job->result.c_str());
+			return;
+		}
+		struct stat st;
+		int fd = open(job->outputPath.c_str(), O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			perror("job result open");
+			if (fd != -1)
+				close(fd);
+			sendErrToBuf("Job's output is gone");
+			return;
+		}
+		sendFileToBuf(fd, st.st_size);
+	}
+	else
+		sendErrToBuf("Unknown job command");
+}
+
+//Syntax: "job run (deadline S) COMMAND..."
+void JCMServer::submitJob(const string &command, const Tokens &c) {
+	u32 deadline = JOB_DEFAULT_DEADLINE;
+	size_t first = 2;
+	if (c[first] == "deadline") {
+		if (!parseNumber(c[first + 1], 10, deadline) || deadline == 0) {
+			sendErrToBuf(invalidArgsStr);
+			return;
+		}
+		first += 2;
+	}
+	if (first >= c.size()) {
+		sendErrToBuf("usage: job run (deadline S) COMMAND");
+		return;
+	}
+
+	//the job's own words, checked now so a bad one fails straight away
+	Tokens words;
+	for (size_t i = first; i < c.size(); i++)
+		words.push(c[i]);
+	JobPlan plan;
+	string error;
+	if (!planJob(words, plan, error)) {
+		sendErrToBuf(error.c_str());
+		return;
+	}
+
+	const char *text = c[first].p;
+	shared_ptr<Job> job = jobManager.create(ctx->index,
+		string(text, command.data() + command.size() - text), deadline);
+	job->jtagHZ = cur->jtagHZ;
+	if (!ctx->jobs.tryPush(job)) {
+		jobManager.remove(job->id);
+		sendErrToBuf("Too many jobs waiting for this device");
+		return;
+	}
+	print("job %u (%s) queued on device %d, deadline %u s\n", job->id,
+		job->command.c_str(), ctx->index, deadline);
+	char reply[64];
+	snprintf(reply, sizeof reply, "Job %u queued", job->id);
+	sendStrToBuf(reply);
+}
+
+bool JCMServer::planJob(const Tokens &c, JobPlan &plan, string &error) {
+	plan.firstIndex = 0;
+	plan.numFrames = 0;
+	plan.readBram = false;
+
+	if (c[0] == "configure" && c.size() <= 2 && c[1] != "preload" &&
+			c[1] != "cache") {
+		plan.kind = JOB_KIND_CONFIGURE;
+		plan.path = c[1].str();
+	}
+	else if (c[0] == "op" && c[1] == "scrub" && c[2] == "blind" && c.size() == 3)
+		plan.kind = JOB_KIND_BLIND_SCRUB;
+	else if (c[0] == "readback" && (c.size() == 1 || (c.size() == 2 && c[1] == "bram"))) {
+		plan.kind = JOB_KIND_READ;
+		plan.readBram = c.size() == 2;
+		plan.numFrames = ctx->geometry->numFrames(plan.readBram);
+	}
+	else if (c[0] == "golden" && c[1] == "capture") {
+		plan.kind = JOB_KIND_GOLDEN;
+		plan.path = ctx->goldenPath;
+		for (size_t i = 2; i < c.size(); i++) {
+			if (c[i] == "bram")
+				plan.readBram = true;
+			else
+				plan.path = c[i].str();
+		}
+		plan.numFrames = ctx->geometry->numFrames(plan.readBram);
+	}
+	else if ((c[0] == "read" || c[0] == "r") && c[1] == "frame") {
+		u32 frameAddress, n = 1;
+		bool ok = c.size() >= 3 && c.size() <= 5;
+		if (c.size() == 5 && c[3] == "-n")
+			ok = parseNumber(c[4], 10, n);
+		else if (c.size() == 4)
+			ok = parseNumber(c[3], 10, n);
+		if (!ok || !parseNumber(c[2], 16, frameAddress) || n < 1 || n > INT_MAX) {
+			error = readErr2Str;
+			return false;
+		}
+		plan.kind = JOB_KIND_READ;
+		plan.firstIndex = ctx->geometry->indexOf(frameAddress);
+		plan.numFrames = n;
+		if (plan.firstIndex < 0) {
+			error = "No such frame address";
+			return false;
+		}
+		if (plan.firstIndex + plan.numFrames > ctx->geometry->numFrames()) {
+			error = "Frame range runs past the end of the device";
+			return false;
+		}
+	}
+	else {
+		error = "Only configure, readback (bram), read frame, golden capture and "
+			"op scrub blind can be run as jobs";
+		return false;
+	}
+	return true;
+}
+
+//Runs each job from the device's queue. Jobs aren't tied to a session: they
+//send nothing, and leave their outcome in the Job for "job status" and
+//"job result".
+void * JCMServer::jobThread(DeviceContext *dc) {
+	ctx = dc;
+	cur = NULL;
+	shared_ptr<Job> job;
+	while (dc->jobs.pop(job)) {
+		if (job->stopping())
+			jobManager.finish(job, job->timedOut ? JOB_TIMED_OUT : JOB_CANCELLED,
+				"stopped before it started");
+		else
+			runJob(job);
+		job.reset();
+	}
+	return NULL;
+}
+
+void JCMServer::runJob(const shared_ptr<Job> &job) {
+	Tokens c;
+	JobPlan plan;
+	string result;
+	tokenize(job->command.data(), job->command.size(), c);
+	if (!planJob(c, plan, result)) {
+		jobManager.finish(job, JOB_FAILED, result);
+		return;
+	}
+
+	jobManager.started(*job);
+	bool ok = false;
+	switch (plan.kind) {
+	case JOB_KIND_READ: {
+		int fd = jobManager.createOutput(*job);
+		if (fd == -1) {
+			result = "Creating the job's output file failed";
+			break;
+		}
+		int wordsPerFrame = ctx->device->getWordsPerFrame();
+		ok = readJobFrames(*job, plan.firstIndex, plan.numFrames,
+			[&](int /*index*/, int n, const u32 *frames) -> bool {
+				size_t bytes = n * wordsPerFrame * sizeof(u32);
+				return write(fd, frames, bytes) == (ssize_t) bytes;
+			}, result);
+		close(fd);
+		if (ok)
+			result = "Read " + to_string(plan.numFrames) + " frames";
+		break;
+	}
+	case JOB_KIND_GOLDEN: {
+		string tmpPath = plan.path + ".tmp";
+		u32 idCode;
+		{
+			TicketLockGuard guard(*ctx->chainLock);
+			idCode = TIMED("jtag.readIdCode", ctx->device->readIdCode(job->jtagHZ));
+		}
+		int fd = GoldenImage::create(tmpPath.c_str(), idCode,
+			plan.readBram ? GOLDEN_FLAG_BRAM : 0, ctx->device->getWordsPerFrame(),
+			plan.numFrames, ctx->geometry->frameAddresses());
+		if (fd == -1) {
+			result = "Creating golden image file failed";
+			break;
+		}
+		ok = readJobFrames(*job, 0, plan.numFrames,
+			[&](int index, int n, const u32 *frames) -> bool {
+				return GoldenImage::writeFrames(fd, index, n, frames);
+			}, result);
+		close(fd);
+		if (ok) {
+			//the golden image is only used under the chain lock
+			TicketLockGuard guard(*ctx->chainLock);
+			ok = rename(tmpPath.c_str(), plan.path.c_str()) == 0 &&
+				ctx->golden->load(plan.path.c_str());
+			result = ok ? "Golden image captured" : "Loading golden image failed";
+		}
+		if (!ok)
+			unlink(tmpPath.c_str());
+		break;
+	}
+	//these are one library call each, which can't be stopped part way
+	case JOB_KIND_CONFIGURE: {
+		string bitFile = "";
+		bool cached;
+		uint64_t savedNs;
+		if (!plan.path.empty())
+			bitFile = bitstreams.lookup(plan.path, cached, savedNs);
+		TicketLockGuard guard(*ctx->chainLock);
+		job->inBlockingCall = true;
+		ok = TIMED("jtag.configureDevice", ctx->device->configure(bitFile));
+		job->inBlockingCall = false;
+		result = ok ? "Finished full configuration" : "Full configuration failed";
+		break;
+	}
+	case JOB_KIND_BLIND_SCRUB: {
+		TicketLockGuard guard(*ctx->chainLock);
+		job->inBlockingCall = true;
+		TIMED("jtag.blindScrub", ctx->device->blindScrub(false, true, job->jtagHZ));
+		job->inBlockingCall = false;
+		BlindScrubEvent blind;
+		blind.source = EVENT_SOURCE_JOB;
+		eventBus.publish(EVENT_BLIND_SCRUB, ctx->index, &blind, sizeof blind);
+		ok = true;
+		result = "Blind scrub finished";
+		break;
+	}
+	}
+
+	int state = ok ? JOB_DONE : job->timedOut ? JOB_TIMED_OUT :
+		job->cancelled ? JOB_CANCELLED : JOB_FAILED;
+	jobManager.finish(job, state, result);
+	print("job %u (%s) on device %d %s after %.2f s: %s\n", job->id,
+		job->command.c_str(), ctx->index, jobStateName(state),
+		(job->endedNs - job->startedNs) / 1e9, result.c_str());
+}
+
+//Reads like readFramesPipelined, but takes the chain lock for each chunk
+//only, so the device's other commands (and the scrubber) go on between them
+bool JCMServer::readJobFrames(Job &job, int firstIndex, int numFrames,
+		function<bool(int index, int n, const u32 *frames)> write, string &error) {
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	vector<u32> chunk(PIPELINE_CHUNK_FRAMES * wordsPerFrame);
+
+	job.framesTotal = numFrames;
+	for (int next = firstIndex, end = firstIndex + numFrames; next < end; ) {
+		if (job.stopping()) {
+			char s[96];
+			snprintf(s, sizeof s, "%s after %d of %d frames", job.timedOut ?
+				"passed its deadline" : "cancelled", next - firstIndex, numFrames);
+			error = s;
+			return false;
+		}
+		int n = ctx->geometry->runFrom(next, min(end - next, PIPELINE_CHUNK_FRAMES));
+		size_t bytes = n * wordsPerFrame * sizeof(u32);
+		bool ok;
+		{
+			TicketLockGuard guard(*ctx->chainLock);
+			TIMED("jtag.clearGlutMaskBit", ctx->device->clearGlutMaskBit(job.jtagHZ));
+			u32 *frames = TIMED("jtag.readFrames",
+				ctx->device->readFrames(fradArray[next], n, job.jtagHZ));
+			ok = frames != NULL;
+			if (ok)
+				memcpy(&chunk[0], frames, bytes);
+		}
+		if (!ok) {
+			char s[64];
+			snprintf(s, sizeof s, "reading frames from %08x failed", fradArray[next]);
+			error = s;
+			return false;
+		}
+		ctx->checksums->update(next, n, &chunk[0], wordsPerFrame);
+		if (!write(next - firstIndex, n, &chunk[0])) {
+			error = "writing the frames failed";
+			return false;
+		}
+		next += n;
+		job.framesDone += n;
+		job.bytes += bytes;
+	}
+	return true;
+}
+
+void JCMServer::interpretOperationCommand(const Tokens &c) {
+	if (c.size() < 2) {
+		sendErrToBuf(sendErr1Str);
+		return;
+	}
+	switch (verbHash(c[1])) {
+	case verbHash("help"):
+	case verbHash("?"):
+		sendStrToBuf(sendHelpStr);
+		break;
+	case verbHash("capture"):
+		TIMED("jtag.issueCapture", ctx->device->issueCapture(cur->jtagHZ));
+		sendStrToBuf(genericSuccessReponse);
+		break;
+	case verbHash("prog"): {
+
+		u32 WBStarAddr = 0;
+
+		try {
+			//If no address provided, default to zero
+			if (c.size() >= 3)
+				WBStarAddr = getInt(c[2], 16);
+		}
+		catch (invalid_argument& ia) {
+			logPrint(LOG_WARN, "issueProg parseint failed.\n");
+			return;
+		}
+
+		TIMED("jtag.issueProg", ctx->device->issueProg(WBStarAddr, cur->jtagHZ));
+		sendStrToBuf(genericSuccessReponse);
+		break;
+	}
+	case verbHash("injectfault"):
+	case verbHash("i"):
+		interpretInjectFaultCommand(c);
+		break;
+	case verbHash("scrub"):
+		interpretScrubCommand(c);
+		break;
+	case verbHash("campaign"):
+		interpretCampaignCommand(c);
+		break;
+	case verbHash("xadc"):
+		interpretXadcOpCommand(c);
+		break;
+	case verbHash("codecbench"):
+		runCodecBench(c);
+		break;
+	default:
+		sendErrToBuf(sendErr0Str);
+	}
+}
+
+//Syntax: "op xadc start (MS)|stop|status|subscribe (window MS)|unsubscribe"
+void JCMServer::interpretXadcOpCommand(const Tokens &c) {
+	if (c.size() < 3) {
+		sendErrToBuf("Specify xadc option");
+		return;
+	}
+
+	switch (verbHash(c[2])) {
+	case verbHash("start"): {
+		u32 interval = XADC_DEFAULT_INTERVAL_MS;
+		if (c.size() >= 4 && (!parseNumber(c[3], 10, interval) ||
+				interval < XADC_MIN_INTERVAL_MS)) {
+			sendErrToBuf("usage: op xadc start (ms between samples, at least "
+				"10)");
+			return;
+		}
+		//restart at the new rate. The sampler may be waiting for the device
+		//lock, which we hold.
+		ctx->chainLock->unlock();
+		ctx->xadc->stop();
+		ctx->xadc->start(interval);
+		ctx->chainLock->lock();
+		sendStrToBuf(genericSuccessReponse);
+		break;
+	}
+	case verbHash("stop"):
+		ctx->chainLock->unlock();
+		ctx->xadc->stop();
+		ctx->chainLock->lock();
+		sendStrToBuf(genericSuccessReponse);
+		break;
+	case verbHash("status"): {
+		pthread_mutex_lock(&xadcSubsLock);
+		size_t numSubs = 0;
+		for (size_t i = 0; i < xadcSubs.size(); i++)
+			if (xadcSubs[i].device == ctx->index)
+				numSubs++;
+		pthread_mutex_unlock(&xadcSubsLock);
+		char status[128];
+		if (ctx->xadc->running())
+			snprintf(status, sizeof status, "xadc sampler: every %u ms\n"
+				"subscribers: %zu", ctx->xadc->interval(), numSubs);
+		else
+			snprintf(status, sizeof status, "xadc sampler: stopped\n"
+				"subscribers: %zu", numSubs);
+		sendStrToBuf(status);
+		break;
+	}
+	//Every sample (or summary) is sent as its own binary response with the
+	//id of the subscribe request, until unsubscribed
+	case verbHash("subscribe"): {
+		XadcSubscription sub;
+		sub.session = cur->shared_from_this();
+		sub.device = ctx->index;
+		sub.requestId = curRequestId;
+		sub.windowMs = 0;
+		if (c.size() >= 4 && (c[3] != "window" || c.size() < 5 ||
+				!parseNumber(c[4], 10, sub.windowMs))) {
+			sendErrToBuf("usage: op xadc subscribe (window MS)");
+			return;
+		}
+
+		//a session has at most one subscription per device; a new one
+		//replaces it
+		pthread_mutex_lock(&xadcSubsLock);
+		size_t i = 0;
+		while (i < xadcSubs.size() && (xadcSubs[i].session.get() != cur ||
+				xadcSubs[i].device != ctx->index))
+			i++;
+		if (i == xadcSubs.size())
+			xadcSubs.push_back(sub);
+		else
+			xadcSubs[i] = sub;
+		pthread_mutex_unlock(&xadcSubsLock);
+		sendStrToBuf(ctx->xadc->running() ? "Subscribed to xadc samples" :
+			"Subscribed to xadc samples (the sampler is stopped)");
+		break;
+	}
+	case verbHash("unsubscribe"):
+		pthread_mutex_lock(&xadcSubsLock);
+		for (size_t i = 0; i < xadcSubs.size(); i++)
+			if (xadcSubs[i].session.get() == cur &&
+					xadcSubs[i].device == ctx->index) {
+				xadcSubs.erase(xadcSubs.begin() + i);
+				break;
+			}
+		pthread_mutex_unlock(&xadcSubsLock);
+		sendStrToBuf(genericSuccessReponse);
+		break;
+	default:
+		sendErrToBuf("Unknown xadc command");
+	}
+}
+
+void JCMServer::deliverXadcSample(int device, const XadcSample &sample) {
+	pthread_mutex_lock(&xadcSubsLock);
+	for (size_t i = 0; i < xadcSubs.size(); ) {
+		XadcSubscription &sub = xadcSubs[i];
+		if (sub.device != device) {
+			i++;
+			continue;
+		}
+		Response r;
+		if (sub.windowMs == 0)
+			r.data.assign((char *) &sample, (char *) &sample + sizeof sample);
+		else {
+			//a sample past the end of the window closes it and starts the next
+			if (sub.window.count() > 0 && sample.timeUs - sub.window.startUs() >=
+					(uint64_t) sub.windowMs * 1000) {
+				XadcSummary summary = sub.window.summary();
+				r.data.assign((char *) &summary, (char *) &summary + sizeof summary);
+				sub.window.reset();
+			}
+			sub.window.add(sample);
+		}
+		r.header[0] = PACKET_TYPE_BINARY;
+		r.header[1] = r.data.size();
+		r.header[2] = sub.requestId;
+
+		//never wait for a subscriber: if it isn't keeping up, or a stream
+		//to it is in progress, it misses samples
+		bool gone = false;
+		if (!r.data.empty())
+			offerResponse(sub.session.get(), r, gone);
+		if (gone)
+			xadcSubs.erase(xadcSubs.begin() + i);
+		else
+			i++;
+	}
+	bool any = !xadcSubs.empty();
+
+	//published once the lock is released
+	vector<XadcThresholdEvent> crossed;
+	for (size_t i = 0; i < xadcThresholds.size(); i++) {
+		XadcThreshold &t = xadcThresholds[i];
+		if (t.device != device)
+			continue;
+		float value = t.channel == EVENT_XADC_TEMP ? sample.temp :
+			t.channel == EVENT_XADC_VCCINT ? sample.vccInt : sample.vccAux;
+		u32 state = value < t.low ? EVENT_XADC_BELOW : value > t.high ?
+			EVENT_XADC_ABOVE : EVENT_XADC_IN_RANGE;
+		if (state == t.state)
+			continue;
+		t.state = state;
+		XadcThresholdEvent e;
+		e.channel = t.channel;
+		e.state = state;
+		e.value = value;
+		e.low = t.low;
+		e.high = t.high;
+		crossed.push_back(e);
+	}
+	pthread_mutex_unlock(&xadcSubsLock);
+	if (any)
+		wakeReactor();
+	for (size_t i = 0; i < crossed.size(); i++)
+		eventBus.publish(EVENT_XADC_THRESHOLD, device, &crossed[i], sizeof crossed[i]);
+}
+
+bool JCMServer::offerResponse(Session *s, Response &r, bool &gone) {
+	pthread_mutex_lock(&s->lock);
+	gone = s->closed || s->closing;
+	bool queued = !gone && s->outBytes < MAX_SESSION_BACKLOG && s->streamOwner == -1;
+	if (queued) {
+		r.queuedNs = monotonicNs();
+		s->outQueue.push_back(r);
+		s->outBytes += r.data.size();
+	}
+	pthread_mutex_unlock(&s->lock);
+	return queued;
+}
+
+//Syntax: "events subscribe (types T,T,...) (device N|all)|unsubscribe|status|
+//threshold temp|vccint|vccaux LOW HIGH|off"
+void JCMServer::interpretEventsCommand(const Tokens &c) {
+	if (c.size() < 2) {
+		sendErrToBuf("Specify subscribe, unsubscribe, status or threshold");
+		return;
+	}
+
+	switch (verbHash(c[1])) {
+	case verbHash("subscribe"):
+		subscribeEvents(c);
+		break;
+	case verbHash("unsubscribe"):
+		if (eventBus.unsubscribe(cur))
+			sendStrToBuf(genericSuccessReponse);
+		else
+			sendErrToBuf("Not subscribed to events");
+		break;
+	case verbHash("status"): {
+		char line[256];
+		snprintf(line, sizeof line, "events published: %u", eventBus.published());
+		string status = line;
+
+		vector<EventSubscriberInfo> subs;
+		eventBus.subscribers(subs);
+		for (size_t i = 0; i < subs.size(); i++) {
+			const EventSubscriberInfo &info = subs[i];
+			string types;
+			for (int t = 1; t < NUM_EVENT_TYPES; t++)
+				if (info.typeMask & EVENT_MASK(t))
+					types += string(types.empty() ? "" : ",") + eventTypeName(t);
+			char device[16];
+			snprintf(device, sizeof device, "device %d", info.device);
+			snprintf(line, sizeof line, "\nsubscriber %u (%s): %s from %s, %u "
+				"queued, %llu delivered, %llu dropped", info.id, info.name.c_str(),
+				types.c_str(), info.device == EVENT_ANY_DEVICE ? "every device" :
+				device, info.queued, (unsigned long long) info.delivered,
+				(unsigned long long) info.dropped);
+			status += line;
+		}
+
+		static const char *channels[] = { "temp", "vccint", "vccaux" };
+		static const char *states[] = { "in range", "below", "above" };
+		pthread_mutex_lock(&xadcSubsLock);
+		for (size_t i = 0; i < xadcThresholds.size(); i++) {
+			const XadcThreshold &t = xadcThresholds[i];
+			snprintf(line, sizeof line, "\nthreshold on device %d: %s %.1f to %.1f "
+				"(%s)", t.device, channels[t.channel], t.low, t.high, states[t.state]);
+			status += line;
+		}
+		pthread_mutex_unlock(&xadcSubsLock);
+		sendStrToBuf(status.c_str());
+		break;
+	}
+	case verbHash("threshold"):
+		setXadcThreshold(c);
+		break;
+	default:
+		sendErrToBuf("Unknown events command");
+	}
+}
+
+//Every delivery is sent as its own binary response with the id of the
+//subscribe request: EventHeaders, each followed by its payload
+void JCMServer::subscribeEvents(const Tokens &c) {
+	u32 typeMask = EVENT_ALL_TYPES;
+	int device = EVENT_ANY_DEVICE;
+
+	//options come in pairs
+	bool ok = c.size() % 2 == 0;
+	for (unsigned int i = 2; ok && i + 1 < c.size(); i += 2) {
+		if (c[i] == "types") {
+			Tokens names;
+			ok = split(c[i + 1], ',', names);
+			typeMask = 0;
+			for (unsigned int n = 0; ok && n < names.size(); n++) {
+				int t = 1;
+				while (t < NUM_EVENT_TYPES && names[n] != eventTypeName(t))
+					t++;
+				ok = t < NUM_EVENT_TYPES;
+				typeMask |= EVENT_MASK(t);
+			}
+		}
+		else if (c[i] == "device" && c[i + 1] != "all") {
+			u32 n;
+			ok = parseNumber(c[i + 1], 10, n) && n < contexts.size();
+			device = n;
+		}
+		else
+			ok = c[i] == "device";
+	}
+	if (!ok) {
+		sendErrToBuf("usage: events subscribe (types upset,scrub,blind,inject,crc,"
+			"xadc) (device N|all)");
+		return;
+	}
+
+	//the session stays alive as long as the subscription does
+	shared_ptr<Session> session = cur->shared_from_this();
+	u32 requestId = curRequestId;
+	u32 id = eventBus.subscribe(cur, cur->clientAddr, typeMask, device,
+		[this, session, requestId](const vector<char> &events) {
+			Response r;
+			r.header[0] = PACKET_TYPE_BINARY;
+			r.header[1] = events.size();
+			r.header[2] = requestId;
+			r.data = events;
+			bool gone;
+			if (offerResponse(session.get(), r, gone))
+				return EVENT_SINK_DELIVERED;
+			return gone ? EVENT_SINK_GONE : EVENT_SINK_BUSY;
+		});
+	if (id == 0) {
+		sendErrToBuf("Too many event subscribers");
+		return;
+	}
+	char reply[64];
+	snprintf(reply, sizeof reply, "Subscribed to events (subscriber %u)", id);
+	sendStrToBuf(reply);
+}
+
+//Syntax: "events threshold temp|vccint|vccaux LOW HIGH|off"
+void JCMServer::setXadcThreshold(const Tokens &c) {
+	int channel = c.size() < 3 ? -1 : c[2] == "temp" ? EVENT_XADC_TEMP :
+		c[2] == "vccint" ? EVENT_XADC_VCCINT : c[2] == "vccaux" ?
+		EVENT_XADC_VCCAUX : -1;
+	bool off = c.size() == 4 && c[3] == "off";
+	XadcThreshold t;
+	t.device = ctx->index;
+	t.channel = channel;
+	t.state = EVENT_XADC_IN_RANGE;
+	if (channel < 0 || (!off && c.size() != 5)) {
+		sendErrToBuf("usage: events threshold temp|vccint|vccaux LOW HIGH|off");
+		return;
+	}
+	if (!off && (!parseFloat(c[3], t.low) || !parseFloat(c[4], t.high) ||
+			t.low > t.high)) {
+		sendErrToBuf("usage: events threshold temp|vccint|vccaux LOW HIGH|off "
+			"(LOW no more than HIGH)");
+		return;
+	}
+
+	//one range per value per device; a new one replaces it
+	pthread_mutex_lock(&xadcSubsLock);
+	size_t i = 0;
+	while (i < xadcThresholds.size() && (xadcThresholds[i].device != t.device ||
+			xadcThresholds[i].channel != t.channel))
+		i++;
+	if (off && i < xadcThresholds.size())
+		xadcThresholds.erase(xadcThresholds.begin() + i);
+	else if (!off && i == xadcThresholds.size())
+		xadcThresholds.push_back(t);
+	else if (!off)
+		xadcThresholds[i] = t;
+	pthread_mutex_unlock(&xadcSubsLock);
+	sendStrToBuf(off || ctx->xadc->running() ? genericSuccessReponse :
+		"Threshold set (the xadc sampler is stopped, so nothing is checked)");
+}
+
+void JCMServer::noteCrc(int reg, u32 value) {
+	if (reg != JCM_REG_CRC && reg != JCM_REG_CRCHW && reg != JCM_REG_CRCSW &&
+			reg != JCM_REG_CRCLIVE)
+		return;
+	map<int, u32>::iterator it = ctx->lastCrc.find(reg);
+	if (it != ctx->lastCrc.end() && it->second != value) {
+		CrcChangeEvent e;
+		e.reg = reg;
+		e.oldValue = it->second;
+		e.newValue = value;
+		eventBus.publish(EVENT_CRC_CHANGE, ctx->index, &e, sizeof e);
+	}
+	ctx->lastCrc[reg] = value;
+}
+
+void JCMServer::publishInjection(u32 frameAddress, u32 word, u32 bit, u32 numBits,
+		u32 source, u32 flags) {
+	InjectionEvent e;
+	e.frameAddress = frameAddress;
+	e.word = word;
+	e.bit = bit;
+	e.numBits = numBits;
+	e.source = source;
+	e.flags = flags;
+	eventBus.publish(EVENT_INJECTION, ctx->index, &e, sizeof e);
+}
+
+void JCMServer::interpretScrubCommand(const Tokens &c) {
+	if (c.size() < 3)
+		sendErrToBuf("Specify scrub option");
+	else if (c[2] == "blind") {
+		//IT WILL PROBABLY STALL HERE
+		TIMED("jtag.blindScrub", ctx->device->blindScrub(false, true, cur->jtagHZ));
+		BlindScrubEvent blind;
+		blind.source = EVENT_SOURCE_COMMAND;
+		eventBus.publish(EVENT_BLIND_SCRUB, ctx->index, &blind, sizeof blind);
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else if (c[2] == "readback")
+		startScrubber(c, SCRUB_READBACK);
+	else if (c[2] == "hybrid")
+		startScrubber(c, SCRUB_HYBRID);
+	else if (c[2] == "stop") {
+		//the scrubber may be waiting for the device lock, which we hold
+		ctx->chainLock->unlock();
+		ctx->scrubber->stop();
+		ctx->chainLock->lock();
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else if (c[2] == "status")
+		sendScrubStatus();
+	else
+		sendErrToBuf("Unknown scrub command");
+}
+
+//Syntax: "op scrub [readback|hybrid] (rate N) (order sequential|reverse|random)
+//(blind S) (bram)"
+void JCMServer::startScrubber(const Tokens &c, int mode) {
+	if (!ctx->golden->isLoaded()) {
+		sendErrToBuf("No golden image loaded");
+		return;
+	}
+
+	ScrubConfig config;
+	config.mode = mode;
+	config.jtagHZ = cur->jtagHZ;
+
+	bool ok = true;
+	for (unsigned int i = 3; ok && i < c.size(); i++) {
+		if (c[i] == "bram")
+			config.readBram = true;
+		else if (c[i] == "rate" && i + 1 < c.size())
+			ok = parseNumber(c[++i], 10, config.framesPerSecond);
+		else if (c[i] == "blind" && i + 1 < c.size())
+			ok = parseNumber(c[++i], 10, config.blindInterval);
+		else if (c[i] == "order") {
+			i++;
+			if (c[i] == "sequential")
+				config.order = SCRUB_ORDER_SEQUENTIAL;
+			else if (c[i] == "reverse")
+				config.order = SCRUB_ORDER_REVERSE;
+			else if (c[i] == "random")
+				config.order = SCRUB_ORDER_RANDOM;
+			else
+				ok = false;
+		}
+		else
+			ok = false;
 	}
-	else if (c[2] == "vccaux") {
-		sendToBuf(&(f = xTopLib->readXadcVccAux()), sizeof(float));
+	if (!ok) {
+		sendErrToBuf(invalidArgsStr);
+		return;
 	}
-	//these require a u32 "readCommand"... not sure what that iss
-	// else if (c[2] == "temp") {
-	// 	sprintf(sv->sharedBuf, "xadc Temperature: %.1f C",
-	// 					sv->xTopLib->readXadcTemp());
-	// }
-	// else if (c[2] == "voltage") {
-	// 	sprintf(sv->sharedBuf, "xadc Voltage: %.1f mV",
-	// 					sv->xTopLib->readXadcVoltage());
-	// }
-	else {
-		sendStrToBuf("Unkown XADC register");
+
+	if (config.readBram && ctx->golden->numFrames() < ctx->geometry->numFrames()) {
+		sendErrToBuf("Golden image has no BRAM frames");
+		return;
 	}
-}
 
-void JCMServer::sendToBuf(void *data, int len, char header){
-	sendDataPtr = data;
-	//printf("\tsendToBuf: void* data: %d\n\t", (int*)sendDataPtr);
-	sendDataLen = len;
-	sendDataHeader[0] = header;
-	//length of response (in sendDataHeader[1]) is determined in sender thread
+	if (ctx->scrubber->start(config))
+		sendStrToBuf(genericSuccessReponse);
+	else
+		sendErrToBuf("Scrubber already running (use 'op scrub stop')");
 }
 
-void JCMServer::sendStrToBuf(const char* s) {
-	sendToBuf((void *) s, strlen(s), PACKET_TYPE_TEXT);
+void JCMServer::sendScrubStatus() {
+	ScrubStats st = ctx->scrubber->stats();
+	char lastUpset[32] = "never";
+	if (st.lastUpsetTime != 0) {
+		struct tm t;
+		strftime(lastUpset, sizeof lastUpset, "%Y-%m-%d %H:%M:%S",
+			localtime_r(&st.lastUpsetTime, &t));
+	}
+
+	char status[512];
+	snprintf(status, sizeof status, "scrubber: %s\npasses: %u\n"
+		"pass time (ms): last %.1f, min %.1f, max %.1f\nframes scanned: %u\n"
+		"upset bits: last pass %u, total %u\n"
+		"frames repaired: last pass %u, total %u\n"
+		"blind scrubs: %u\nread errors: %u\nlast upset: %s",
+		!st.running ? "stopped" : st.mode == SCRUB_HYBRID ? "hybrid" : "readback",
+		st.passes, st.lastPassMs, st.minPassMs, st.maxPassMs, st.framesScanned,
+		st.lastPassUpsetBits, st.totalUpsetBits, st.lastPassFramesRepaired,
+		st.totalFramesRepaired, st.blindScrubs, st.readErrors, lastUpset);
+	sendStrToBuf(status);
 }
 
-void JCMServer::interpretReadCommand(vector<string> c) {
-		//these static vars are necessary because without them, the void pointer
-		//sendDataPtr would point to a temporary value returned from a Xilinx
-		//Top Library function, and when the value is deleted, the pointer would
-		//point to nothing. Thus, persistent static vars are required to keep the
-		//data until the next command.
-	   static u32 v;
-		static int k;
-		if (c.size() < 2)
-			sendStrToBuf(readErr1Str);
-		else if (c[1] == "help" || c[1] == "?")
-			sendStrToBuf(helpReadString);
-		else if(c[1] == "far")
-			sendToBuf(&(v = xTopLib->readFar(jtagHZ)), sizeof(u32));
-		else if(c[1] == "idcode")
-			sendToBuf(&(v = xTopLib->readIdCode(jtagHZ)), sizeof(u32));
-		else if(c[1] == "ctrl0")
-			sendToBuf(&(v = xTopLib->readCtrl0()), sizeof(u32));
-		else if(c[1] == "crc")
-			sendToBuf(&(v = xTopLib->readCrc(jtagHZ)), sizeof(u32));
-		else if(c[1] == "crchw")
-			sendToBuf(&(v = xTopLib->readCrcHw(jtagHZ)), sizeof(u32));
-		else if(c[1] == "crcsw")
-			sendToBuf(&(v = xTopLib->readCrcSw(jtagHZ)), sizeof(u32));
-		else if(c[1] == "crclive")
-			sendToBuf(&(v = xTopLib->readCrcLive()), sizeof(u32));
-		else if(c[1] == "status")
-			sendToBuf(&(v = xTopLib->readStatus(jtagHZ)), sizeof(u32));
-		else if(c[1] == "cor1")
-			sendToBuf(&(v = xTopLib->readCor1(jtagHZ)), sizeof(u32));
-		else if(c[1] == "cmd")
-			sendToBuf(&(v = xTopLib->readCmd(jtagHZ)), sizeof(u32));
-		else if (c[1] == "numlogicframes") {
-			sendToBuf(&(k = xTopLib->getNumLogicFrames()), sizeof(k));
-			printf("num logic frames: %d\n", k);
-		}
-		else if (c[1] == "numbramframes") {
-			sendToBuf(&(k = xTopLib->getNumBramFrames()), sizeof(k));
-			printf("num bram frames: %d\n", k);
-		}
-		else if (c[1] == "numtotalframes") {
-			sendToBuf(&(k = xTopLib->getTotalFrames()), sizeof(k));
-			printf("num total frames: %d\n", k);
-		}
-		else if (c[1] == "wordsperframe") {
-			sendToBuf(&(k = xTopLib->getWordsPerFrame()), sizeof(k));
-			printf("num words per frames: %d\n", k);
-		}
-		else if(c[1] == "xadc")
-			interpretXadcCommand(c);
-		else if(c[1] == "frame")
-			readInFramesFromDevice(c);
-		else if (c[1] == "bscan")
-			interpretBscanCommand(c, true);
-		else if (c[1] == "fradlist"){
-			static u32 * fradArray = xTopLib->getFrameAddressArray();
-			sendToBuf(fradArray, sizeof(u32));
+//Syntax: "op codecbench (bram)"
+//Reads the device once, then runs each encoding over the frames in
+//pipeline sized chunks, the way a read sends them, and checks that every
+//chunk decodes back to what was read.
+void JCMServer::runCodecBench(const Tokens &c) {
+	bool readBram = c.size() >= 3 && c[2] == "bram";
+	int numFrames = ctx->geometry->numFrames(readBram);
+	int wordsPerFrame = ctx->device->getWordsPerFrame();
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+	size_t chunkWords = (size_t) PIPELINE_CHUNK_FRAMES * wordsPerFrame;
+
+	//frames that couldn't be read would only be zeros, which flatter every
+	//codec, so they are left out; indices says where each one kept came from
+	vector<u32> frames;
+	vector<int> indices;
+	int unreadable = 0;
+	readFramesPipelined(0, numFrames, [&](FrameChunk &chunk) {
+		if (!chunk.ok) {
+			unreadable += chunk.numFrames;
+			return;
 		}
-		else if (c[1] == "hwversion")
-			{ /*in order to print hardware version, function must be changed*/ }
-		else
-			sendStrToBuf(readErr0Str);
-}
+		frames.insert(frames.end(), chunk.words.begin(),
+			chunk.words.begin() + chunk.numFrames * wordsPerFrame);
+		for (int i = 0; i < chunk.numFrames; i++)
+			indices.push_back(chunk.firstIndex + i);
+	});
+	//the rest doesn't need the chain, so let the scrubbers have it
+	ctx->chainLock->unlock();
+
+	if (frames.empty()) {
+		ctx->chainLock->lock();
+		sendErrToBuf("Reading frames failed");
+		return;
+	}
 
-void JCMServer::interpretOperationCommand(vector<string> c) {
-	if (c.size() < 2)
-		sendStrToBuf(sendErr1Str);
-	else if (c[1] == "help" || c[1] == "?")
-		sendStrToBuf(sendHelpStr);
-	else if (c[1] == "capture") {
-		xTopLib->issueCapture(jtagHZ);
-		sendStrToBuf(genericSuccessReponse);
+	vector<u32> ref(frames.size());
+	bool haveGolden = ctx->golden->wordsPerFrame() == wordsPerFrame;
+	for (size_t i = 0; haveGolden && i < indices.size(); i++) {
+		const u32 *goldenFrame = ctx->golden->frame(fradArray[indices[i]]);
+		if (goldenFrame == NULL)
+			haveGolden = false;
+		else
+			memcpy(&ref[i * wordsPerFrame], goldenFrame, wordsPerFrame * sizeof(u32));
 	}
-	else if (c[1] == "prog") {
 
-		u32 WBStarAddr = 0;
+	double rawBytes = frames.size() * sizeof(u32);
+	double linkBytesPerMs = CODEC_BENCH_LINK_MBIT * 1000.0 / 8;
+	char line[128];
+	snprintf(line, sizeof line, "%d frames, %.0f bytes", (int) indices.size(),
+		rawBytes);
+	string report = line;
+	if (unreadable > 0) {
+		snprintf(line, sizeof line, " (%d frames couldn't be read, left out)",
+			unreadable);
+		report += line;
+	}
+	snprintf(line, sizeof line, "\n%-4s %10s %6s %9s %9s %8s\n", "enc", "bytes",
+		"ratio", "enc MB/s", "dec MB/s", "send ms");
+	report += line;
+
+	vector<vector<uint8_t> > blocks((frames.size() + chunkWords - 1) / chunkWords);
+	vector<u32> scratch, decoded(frames.size());
+	for (int e = 0; e < NUM_ENCODINGS; e++) {
+		if (e == ENCODING_XOR && !haveGolden) {
+			report += "xor  (needs a golden image of the whole device)\n";
+			continue;
+		}
 
-		try {
-			//If no address provided, default to zero
-			if (c.size() >= 3)
-				WBStarAddr = getInt(c[2], 16);
+		//best of a few runs, so a stray context switch doesn't count
+		uint64_t encodeNs = UINT64_MAX, decodeNs = UINT64_MAX;
+		size_t encodedBytes = 0;
+		bool ok = true;
+		for (int rep = 0; rep < CODEC_BENCH_REPS; rep++) {
+			uint64_t begin = monotonicNs();
+			for (size_t b = 0; b < blocks.size(); b++) {
+				size_t offset = b * chunkWords;
+				blocks[b].clear();
+				encodeFrames(e, &frames[offset], min(chunkWords, frames.size() - offset),
+					&ref[offset], scratch, blocks[b]);
+			}
+			uint64_t encoded = monotonicNs();
+			for (size_t b = 0; b < blocks.size(); b++) {
+				size_t offset = b * chunkWords;
+				if (!decodeFrames(e, &blocks[b][0], blocks[b].size(), &ref[offset],
+						&decoded[offset], min(chunkWords, frames.size() - offset)))
+					ok = false;
+			}
+			uint64_t end = monotonicNs();
+			encodeNs = min(encodeNs, encoded - begin);
+			decodeNs = min(decodeNs, end - encoded);
 		}
-		catch (invalid_argument& ia) {
-			print("issueProg parseint failed.\n");
-			return;
+		ok = ok && decoded == frames;
+
+		encodedBytes = 0;
+		for (size_t b = 0; b < blocks.size(); b++)
+			encodedBytes += sizeof(EncodedBlockHeader) + blocks[b].size();
+		//encoding and sending overlap in a real read, so this is the worst
+		//case
+		double sendMs = encodeNs / 1e6 + encodedBytes / linkBytesPerMs;
+		snprintf(line, sizeof line, "%-4s %10zu %5.1fx %9.1f %9.1f %8.1f%s\n",
+			encodingName(e), encodedBytes, rawBytes / encodedBytes,
+			rawBytes / 1e6 / (encodeNs / 1e9), rawBytes / 1e6 / (decodeNs / 1e9),
+			sendMs, ok ? "" : "  DECODE MISMATCH");
+		report += line;
+	}
+	snprintf(line, sizeof line, "(send ms: encoding plus sending at %d Mbit/s)",
+		CODEC_BENCH_LINK_MBIT);
+	report += line;
+
+	ctx->chainLock->lock();
+	sendStrToBuf(report.c_str());
+}
+
+//Syntax: "op campaign N (seed S) (bits B) (dwell US)
+//(observe crc,status,bscanK) (targets logic|all|FAR-FAR,...)"
+void JCMServer::interpretCampaignCommand(const Tokens &c) {
+	if (c.size() < 3) {
+		sendErrToBuf(invalidArgsStr);
+		return;
+	}
+
+	CampaignConfig config;
+	config.seed = time(NULL);
+	config.jtagHZ = cur->jtagHZ;
+	Token targets("logic", 5);
+
+	//options come in pairs
+	bool ok = parseNumber(c[2], 10, config.numInjections) && c.size() % 2 == 1;
+	for (unsigned int i = 3; ok && i + 1 < c.size(); i += 2) {
+		if (c[i] == "seed")
+			ok = parseNumber(c[i + 1], 10, config.seed);
+		else if (c[i] == "bits")
+			ok = parseNumber(c[i + 1], 10, config.numBits);
+		else if (c[i] == "dwell")
+			ok = parseNumber(c[i + 1], 10, config.dwellUs);
+		else if (c[i] == "targets")
+			targets = c[i + 1];
+		else if (c[i] == "observe") {
+			Tokens hooks;
+			ok = split(c[i + 1], ',', hooks);
+			for (unsigned int h = 0; ok && h < hooks.size(); h++) {
+				u32 bscanNumber = 1;
+				if (hooks[h] == "crc")
+					config.observe |= OBSERVE_CRC;
+				else if (hooks[h] == "status")
+					config.observe |= OBSERVE_STATUS;
+				else if (hooks[h].startsWith("bscan")) {
+					config.observe |= OBSERVE_BSCAN;
+					if (hooks[h].length() > 5)
+						ok = parseNumber(hooks[h].substr(5), 10, bscanNumber);
+					config.bscanNumber = bscanNumber;
+				}
+				else
+					ok = false;
+			}
 		}
+		else
+			ok = false;
+	}
 
-		xTopLib->issueProg(WBStarAddr, jtagHZ);
-		sendStrToBuf(genericSuccessReponse);
+	if (!ok || config.numBits < 1 || config.numBits > CAMPAIGN_MAX_BITS ||
+			config.bscanNumber < 1 || config.bscanNumber > 4 ||
+			!parseCampaignTargets(targets, config.targets)) {
+		sendErrToBuf(invalidArgsStr);
+		return;
 	}
-	else if (c[1] == "injectfault" || c[1] == "i")
-		interpretInjectFaultCommand(c);
-	else if (c[1] == "scrub")
-		interpretScrubCommand(c);
-	else
-		sendStrToBuf(sendErr0Str);
+	if (config.numInjections > CAMPAIGN_MAX_INJECTIONS) {
+		char err[64];
+		snprintf(err, sizeof err, "At most %d injections per campaign",
+			CAMPAIGN_MAX_INJECTIONS);
+		sendErrToBuf(err);
+		return;
+	}
+
+	CampaignHeader header;
+	header.seed = config.seed;
+	header.numInjections = config.numInjections;
+	header.numTargets = config.targets.size();
+	header.recordSize = sizeof(CampaignRecord);
+
+	print("campaign: %u injections over %u frames, seed %u\n",
+		config.numInjections, header.numTargets, config.seed);
+	beginStream(sizeof header + config.numInjections * sizeof(CampaignRecord));
+	sendChunk(&header, sizeof header);
+	runCampaign(ctx->device, config, [this](const CampaignRecord *records, int n) {
+		for (int i = 0; i < n; i++)
+			publishInjection(records[i].frameAddress, records[i].word, records[i].bit,
+				records[i].numBits, EVENT_SOURCE_CAMPAIGN,
+				(records[i].flags & CAMPAIGN_INJECT_FAILED ? EVENT_INJECTION_FAILED : 0) |
+				(records[i].flags & CAMPAIGN_REPAIR_FAILED ? 0 : EVENT_INJECTION_REPAIRED));
+		sendChunk((void *) records, n * sizeof(CampaignRecord));
+	});
 }
 
-void JCMServer::interpretScrubCommand(vector<string> c) {
-	if (c.size() < 3)
-		sendStrToBuf("Specify scrub option");
-	else if (c[2] == "blind") {
-		//IT WILL PROBABLY STALL HERE
-		xTopLib->blindScrub(false, true, jtagHZ);
-		sendStrToBuf(genericSuccessReponse);
-	}
-	else if (c[2] == "readback") {
-		sendStrToBuf("Not yet implemented");
+bool JCMServer::parseCampaignTargets(const Token &s, vector<u32> &targets) {
+	const u32 *fradArray = ctx->geometry->frameAddresses();
+	int numFrames = ctx->geometry->numFrames();
+
+	if (s == "logic" || s == "all") {
+		targets.assign(fradArray, fradArray + ctx->geometry->numFrames(s == "all"));
+		return true;
 	}
-	else if (c[2] == "hybrid") {
-		sendStrToBuf("Not yet implemented");
+
+	Tokens ranges;
+	if (!split(s, ',', ranges))
+		return false;
+	for (unsigned int i = 0; i < ranges.size(); i++) {
+		size_t dash = ranges[i].find('-');
+		u32 low, high;
+		if (!parseNumber(ranges[i].substr(0, dash), 16, low))
+			return false;
+		//a single frame address must be one the device has
+		if (dash == ranges[i].length()) {
+			if (ctx->geometry->indexOf(low) < 0)
+				return false;
+			targets.push_back(low);
+			continue;
+		}
+		if (!parseNumber(ranges[i].substr(dash + 1), 16, high))
+			return false;
+		for (int k = 0; k < numFrames; k++)
+			if (fradArray[k] >= low && fradArray[k] <= high)
+				targets.push_back(fradArray[k]);
 	}
-	else
-		sendStrToBuf("Unknown scrub command");
+	return !targets.empty();
 }
 
-void JCMServer::interpretInjectFaultCommand(vector<string> c) {
+void JCMServer::interpretInjectFaultCommand(const Tokens &c) {
 
 	if (c.size() < 3) {
-		sendStrToBuf(invalidArgsStr);
+		sendErrToBuf(invalidArgsStr);
 		return;
 	}
 
 	//type of fault (if not standard) is specified after 'injectfault'
 	if (c[2] == "spartan")
-		sendStrToBuf("Not yet implemented (maybe never)");
+		sendErrToBuf("Not yet implemented (maybe never)");
 	//Syntax: "op injectfault multiframe [frame address] [command reg value]"
 	else if (c[2] == "multiframe") {
 		if (c.size() < 5) {
-			sendStrToBuf(invalidArgsStr);
+			sendErrToBuf(invalidArgsStr);
 			return;
 		}
 		u32 frad = 0, commandReg = 0;
@@ -431,41 +2640,48 @@ void JCMServer::interpretInjectFaultCommand(vector<string> c) {
 			commandReg = getInt(c[4], 16);
 		}
 		catch (invalid_argument& ia) {
-			print("multiframe injectfault parseint failed.\n");
+			logPrint(LOG_WARN, "multiframe injectfault parseint failed.\n");
 			return;
 		}
 
-		xTopLib->injectMultiFrameFault(frad, commandReg, jtagHZ);
+		TIMED("jtag.injectMultiFrameFault",
+			ctx->device->injectMultiFrameFault(frad, commandReg, cur->jtagHZ));
+		publishInjection(frad, 0, 0, 0, EVENT_SOURCE_COMMAND,
+			EVENT_INJECTION_MULTIFRAME);
 		//function returns void, so no way to determine success.
 		sendStrToBuf(genericSuccessReponse);
 	}
 	//Syntax: "op injectfault random [faultInjectionSize] (repairFault)"
 	else if (c[2] == "random" || c[2] == "r") {
 		if (c.size() < 4) {
-			sendStrToBuf("usage: op injectfault random [# bits to inject]");
+			sendErrToBuf("usage: op injectfault random [# bits to inject]");
 			return;
 		}
 		int faultInjectionSize = 1;
 		bool repairFault = false;
 		try { faultInjectionSize = getInt(c[3], 10); }
 		catch (invalid_argument& ia) {
-			print("random injectfault parseint failed.\n");
+			logPrint(LOG_WARN, "random injectfault parseint failed.\n");
 			return;
 		}
 		if (c.size() == 5 && c[4] == "repairfault")
 			repairFault = true;
 
-		bool success = xTopLib->injectRandomFault(faultInjectionSize, true,
-			repairFault, false, jtagHZ);
+		bool success = TIMED("jtag.injectRandomFault",
+			ctx->device->injectRandomFault(faultInjectionSize, true, repairFault,
+			false, cur->jtagHZ));
+		publishInjection(0, 0, 0, faultInjectionSize, EVENT_SOURCE_COMMAND,
+			EVENT_INJECTION_RANDOM | (repairFault ? EVENT_INJECTION_REPAIRED : 0) |
+			(success ? 0 : EVENT_INJECTION_FAILED));
 		if (success)
 			sendStrToBuf("random fault injection succeeded");
 		else
-			sendStrToBuf("random fault injection failed");
+			sendErrToBuf("random fault injection failed");
 	}
 	//Syntax: "op injectfault normal [frameAddress] [wordNum] [bitNum] [numBits]"
 	else if (c[2] == "normal" || c[2] == "n") {
 		if (c.size() != 7) {
-			sendStrToBuf("usage: op injectfault normal [address] [word]"
+			sendErrToBuf("usage: op injectfault normal [address] [word]"
 				"[bit] [# bits to inject]");
 			return;
 		}
@@ -478,153 +2694,312 @@ void JCMServer::interpretInjectFaultCommand(vector<string> c) {
 			numBits = getInt(c[6], 10);
 		}
 		catch (invalid_argument& ia) {
-			print("normal injectfault parseint failed.\n");
+			logPrint(LOG_WARN, "normal injectfault parseint failed.\n");
 			return;
 		}
 
-		bool success = xTopLib->injectFault(frameAddress, wordNum, bitNum,
-			numBits, false, true, jtagHZ);
+		if (ctx->geometry->indexOf(frameAddress) < 0) {
+			sendErrToBuf("No such frame address");
+			return;
+		}
+		bool success = TIMED("jtag.injectFault", ctx->device->injectFault(frameAddress,
+			wordNum, bitNum, numBits, false, true, cur->jtagHZ));
+		publishInjection(frameAddress, wordNum, bitNum, numBits, EVENT_SOURCE_COMMAND,
+			success ? 0 : EVENT_INJECTION_FAILED);
 		if (success)
 			sendStrToBuf("normal fault injection succeeded");
 		else
-			sendStrToBuf("normal fault injection failed");
+			sendErrToBuf("normal fault injection failed");
 	}
 	else
-		sendStrToBuf(faultErr0Str);
+		sendErrToBuf(faultErr0Str);
 }
 
-void JCMServer::interpretWriteCommand(vector<string> c) {
-	if (c.size() < 2)
-		sendStrToBuf(writeErr1Str);
-	else if (c[1] == "help" || c[1] == "?")
+void JCMServer::interpretWriteCommand(const Tokens &c) {
+	if (c.size() < 2) {
+		sendErrToBuf(writeErr1Str);
+		return;
+	}
+	if (c[1] == "help" || c[1] == "?") {
 		sendStrToBuf(helpWriteString);
-	else if (c.size() < 3)
-		sendStrToBuf(writeErr2Str);
-	else if (c[1] == "bscan")
+		return;
+	}
+	if (c.size() < 3) {
+		sendErrToBuf(writeErr2Str);
+		return;
+	}
+	switch (verbHash(c[1])) {
+	case verbHash("bscan"):
 		//interpretBscanCommand(sv, c, sv->jtagHZ);
-		sendStrToBuf(writeErr0Str); //Not yet implemented
-	else if (c[1] == "far") {
+		sendErrToBuf(writeErr0Str); //Not yet implemented
+		break;
+	case verbHash("far"): {
 		u32 farVal;
 		try { farVal = getInt(c[2], 16); }
 		catch (invalid_argument& ia) {
-			print("w FAR parse int failed.\n");
+			logPrint(LOG_WARN, "w FAR parse int failed.\n");
 			return;
 		}
-		xTopLib->writeFar(farVal, jtagHZ);
+		TIMED("jtag.writeFar", ctx->device->writeFar(farVal, cur->jtagHZ));
 		sendStrToBuf(genericSuccessReponse);
+		break;
 	}
-	else if (c[1] == "cor1") {
+	case verbHash("cor1"): {
 		u32 vall;
 		try { vall = getInt(c[2], 16); }
 		catch (invalid_argument& ia) {
-			print("w COR parse int failed.\n");
+			logPrint(LOG_WARN, "w COR parse int failed.\n");
 			return;
 		}
-		xTopLib->writeCor1(vall, jtagHZ);
+		TIMED("jtag.writeCor1", ctx->device->writeCor1(vall, cur->jtagHZ));
 		sendStrToBuf(genericSuccessReponse);
+		break;
 	}
-	else if (c[1] == "crcsw") {
+	case verbHash("crcsw"): {
 		u32 vall;
 		try { vall = getInt(c[2], 16); }
 		catch (invalid_argument& ia) {
-			print("w CrcSw parse int failed.\n");
+			logPrint(LOG_WARN, "w CrcSw parse int failed.\n");
 			return;
 		}
-		xTopLib->writeCrcSw(vall, jtagHZ);
+		TIMED("jtag.writeCrcSw", ctx->device->writeCrcSw(vall, cur->jtagHZ));
 		sendStrToBuf(genericSuccessReponse);
+		break;
 	}
-	else if (c[1] == "glutmask") {
+	case verbHash("glutmask"):
 		if (c[2] != "0" && c[2] != "1"  && c[2] != "set" && c[2] != "clear")
-			sendStrToBuf(glutmaskErr);
+			sendErrToBuf(glutmaskErr);
 		else {
 			bool setMask = false;
 			if (c[2] == "1" || c[2] == "set")
 				setMask = true;
 
 			if (setMask) {
-				xTopLib->setGlutMaskBit(jtagHZ);
+				TIMED("jtag.setGlutMaskBit",
+					ctx->device->setGlutMaskBit(cur->jtagHZ));
 				sendStrToBuf("Glut mask bit SET");
 			}
 			else {
-				xTopLib->clearGlutMaskBit(jtagHZ);
+				TIMED("jtag.clearGlutMaskBit",
+					ctx->device->clearGlutMaskBit(cur->jtagHZ));
 				sendStrToBuf("Glut mask bit CLEARED");
 			}
 		}
+		break;
+	default:
+		sendErrToBuf(writeErr0Str);
 	}
-	else
-		sendStrToBuf(writeErr0Str);
 }
 
-void JCMServer::interpretOptionsCommand(vector<string> c) {
+void JCMServer::interpretOptionsCommand(const Tokens &c) {
 	if (c.size() < 2)
-		sendStrToBuf(optErr1Str);
+		sendErrToBuf(optErr1Str);
 	else if (c[1] == "?" || c[1] == "help")
 		sendStrToBuf(helpOptionsString);
 	else if (c[1] == "view") {
-		//Possible issue: s is deleted when function ends so bad outupt
-		//(pointer to garbage)
-		static string s;
-		if (jtagHZ)
-			s += "Jtag to High-Z:\tON";
-		else
-			s += "Jtag to High-Z:\tOFF";
-		sendStrToBuf(s.c_str());
+		char view[96];
+		snprintf(view, sizeof view, "Jtag to High-Z:\t%s\nVerify reads:\t%s\n"
+			"Encoding:\t%s", cur->jtagHZ ? "ON" : "OFF",
+			cur->verifyReads ? "ON" : "OFF", encodingName(cur->encoding));
+		sendStrToBuf(view);
 	}
 	else if (c[1] == "jtagtohighz") {
 		if (c.size() < 3 || !(c[2] == "on" || c[2] == "off"))
-			sendStrToBuf(invalidArgsStr);
+			sendErrToBuf(invalidArgsStr);
 		else {
 			if (c[2] == "on") {
-				jtagHZ = true;
+				cur->jtagHZ = true;
 				sendStrToBuf("Jtag to High-Z ON");
 			}
 			else {
-				jtagHZ = false;
+				cur->jtagHZ = false;
 				sendStrToBuf("Jtag to High-Z OFF");
 			}
 		}
 	}
+	else if (c[1] == "verifyreads") {
+		if (c.size() < 3 || !(c[2] == "on" || c[2] == "off"))
+			sendErrToBuf(invalidArgsStr);
+		else {
+			cur->verifyReads = c[2] == "on";
+			sendStrToBuf(cur->verifyReads ? "Verify reads ON" : "Verify reads OFF");
+		}
+	}
+	else if (c[1] == "diffkernel") {
+		if (c.size() < 3 || !(c[2] == "simd" || c[2] == "scalar"))
+			sendErrToBuf(invalidArgsStr);
+		else {
+			setDiffKernel(c[2] == "simd" ? DIFF_KERNEL_SIMD : DIFF_KERNEL_SCALAR);
+			char kernel[64];
+			snprintf(kernel, sizeof kernel, "Frame compare kernel: %s",
+				diffKernelName());
+			sendStrToBuf(kernel);
+		}
+	}
+	else if (c[1] == "loglevel") {
+		int level = c.size() < 3 ? -1 : parseLogLevel(c[2].str().c_str());
+		if (level < 0)
+			sendErrToBuf(invalidArgsStr);
+		else {
+			jcmLog.setLevel(level);
+			char msg[32];
+			snprintf(msg, sizeof msg, "Log level %s", logLevelName(level));
+			sendStrToBuf(msg);
+		}
+	}
+	else if (c[1] == "encoding") {
+		int encoding = c.size() < 3 ? -1 : parseEncoding(c[2].str().c_str());
+		if (encoding < 0)
+			sendErrToBuf(invalidArgsStr);
+		else {
+			cur->encoding = encoding;
+			char msg[32];
+			snprintf(msg, sizeof msg, "Encoding %s", encodingName(encoding));
+			sendStrToBuf(msg);
+		}
+	}
+	//picks the device this session's commands go to when they don't say.
+	//The reactor has already set it (parseCommands()), before routing the
+	//commands that followed; a batch's commands are all routed by then.
 	else if (c[1] == "activedevice") {
-		if (c.size() < 3) {
-			sendStrToBuf(invalidArgsStr);
+		u32 n;
+		if (c.size() < 3 || !parseNumber(c[2], 10, n) || n >= contexts.size()) {
+			sendErrToBuf(invalidArgsStr);
+			return;
+		}
+		if (capture) {
+			sendErrToBuf("Can't be run in a batch");
 			return;
 		}
-		for (int i = 0; i < c[2].length(); i++)
-			if (!isdigit(c[2][i])) {
-				sendStrToBuf(invalidArgsStr);
-				return;
-			}
-		xTopLib->setActiveDeviceIndex(getInt(c[2], 10));
-		//sprintf(sv->sharedBuf, "Active device index set to %s", c[2].c_str());
 		sendStrToBuf("Active device index set");
 	}
 	else
-		sendStrToBuf(optErr0Str);
+		sendErrToBuf(optErr0Str);
 }
 
 //takes a string sent by the client and interprets it, carrying out instructions.f
-void JCMServer::interpretCommand(string command){
+void JCMServer::interpretCommand(const string &command){
 
-	vector<string> c = parseByWhiteSpace(command);
+	uint64_t begin = monotonicNs();
+	Tokens c;
+	if (!tokenize(command.data(), command.size(), c)) {
+		sendErrToBuf(invalidArgsStr);
+		return;
+	}
+	uint64_t parsed = monotonicNs();
+	STAT_HISTOGRAM("cmd.parse")->record(parsed - begin);
 
 	if (c.size() < 1) {
-		sendStrToBuf("interpretCommand: command vector was null or 0 size\n");
+		sendErrToBuf("interpretCommand: command vector was null or 0 size\n");
 		return;
 	}
 
+	bool known = dispatchCommand(command, c);
+
+	//time each command under its verb, and its sub-verb if it has them
+	char name[STATS_MAX_NAME];
+	int len;
+	if (!known)
+		len = snprintf(name, sizeof name, "cmd.unknown");
+	//register lists are all timed together, not one histogram per list
+	else if (c.size() >= 2 && c[1].find(',') < c[1].length())
+		len = snprintf(name, sizeof name, "cmd.%.*s list", (int) c[0].len, c[0].p);
+	else if (c.size() >= 2 && hasSubVerbs(c[0]))
+		len = snprintf(name, sizeof name, "cmd.%.*s %.*s", (int) c[0].len, c[0].p,
+			(int) c[1].len, c[1].p);
+	else
+		len = snprintf(name, sizeof name, "cmd.%.*s", (int) c[0].len, c[0].p);
+	if (len >= (int) sizeof name)
+		len = sizeof name - 1;
+	jcmStats.histogram(name, len)->record(monotonicNs() - parsed);
+}
+
+void JCMServer::sendDeviceList() {
+	string list;
+	for (size_t i = 0; i < contexts.size(); i++) {
+		DeviceContext *dc = contexts[i];
+		char line[256];
+		//the other devices' golden images belong to their executors; only
+		//the scrubber (which has its own lock) is safe to ask about here
+		snprintf(line, sizeof line, "%s%zu: %s, scrubber %s%s", i ? "\n" : "",
+			i, dc->name.c_str(), dc->scrubber->stats().running ? "running" :
+			"stopped", cur->device == (int) i ? " (this session's default)" : "");
+		list += line;
+	}
+	sendStrToBuf(list.c_str());
+}
+
+//Whether the second word of a command with this verb picks what it does
+bool JCMServer::hasSubVerbs(const Token &verb) {
+	switch (verbHash(verb)) {
+	case verbHash("read"):
+	case verbHash("r"):
+	case verbHash("write"):
+	case verbHash("w"):
+	case verbHash("op"):
+	case verbHash("options"):
+	case verbHash("option"):
+	case verbHash("o"):
+	case verbHash("golden"):
+	case verbHash("readback"):
+	case verbHash("stats"):
+	case verbHash("job"):
+	case verbHash("macro"):
+	case verbHash("events"):
+		return true;
+	default:
+		return false;
+	}
+}
+
+//Carries out a command; returns false if the verb is unknown
+bool JCMServer::dispatchCommand(const string &command, const Tokens &c){
+
 	//NOTE: Do NOT include a trailing \n at the end of replies; this is handled by
 	// the client
 
-	//This is the only case where nothing is written to the buffer. The previous
-	//data is resent (in the case of a send error)
-	if (command == "resend")
-		return;
-	else if (c[0] == "?" || c[0] == "help")
+	switch (verbHash(c[0])) {
+	//The previous response is queued again (in the case of a send error)
+	case verbHash("resend"): {
+		pthread_mutex_lock(&cur->lock);
+		Response last = cur->lastResponse;
+		pthread_mutex_unlock(&cur->lock);
+		if (!last.file) {
+			sendToBuf(last.data.data(), last.data.size(), last.header[0]);
+			break;
+		}
+		//a file response is sent from the same file again, as long as it
+		//hasn't been rewritten since (e.g. by another readback)
+		struct stat st;
+		if (fstat(last.file->fd, &st) == -1 ||
+				(size_t) st.st_size < last.file->offset + last.file->length ||
+				st.st_mtim.tv_sec != last.file->modified.tv_sec ||
+				st.st_mtim.tv_nsec != last.file->modified.tv_nsec) {
+			sendErrToBuf("The file sent last has changed and cannot be resent");
+			break;
+		}
+		last.header[2] = curRequestId;
+		queueResponse(last);
+		break;
+	}
+	case verbHash("?"):
+	case verbHash("help"):
 		sendStrToBuf(helpString);
-	else if(c[0] == "setup")
-		sendStrToBuf("Not yet implemented");
-	else if(c[0] == "configure"){
+		break;
+	case verbHash("setup"):
+		sendErrToBuf("Not yet implemented");
+		break;
+	case verbHash("configure"): {
+		if (c[1] == "preload" || c[1] == "cache") {
+			interpretBitstreamCommand(c);
+			break;
+		}
+		//a bit file given by name is configured from its copy in RAM
 		string alternateBitFile = "";
+		bool cached = false;
+		uint64_t savedNs = 0;
+		if (c.size() >= 2)
+			alternateBitFile = bitstreams.lookup(c[1].str(), cached, savedNs);
 		//possible solution to redirect stdout to a buffer then send it to user:
 		//Issue: must be POSIX-compliant (doesn't work so probably isn't)
 		//
@@ -635,210 +3010,564 @@ void JCMServer::interpretCommand(string command){
 		//}
 		//auto old = stdout; //save old stdout stream
 		//stdout = fp; //reassign stdout to the new buffer stream (redirects output)
-		bool success = xTopLib->getDevice()->configureDevice(alternateBitFile);
+		bool success = TIMED("jtag.configureDevice",
+			ctx->device->configure(alternateBitFile));
 		//fclose(fp); //close the temporary stream
 		//stdout = old; //restore stdout
 		//print("Buffer:%s\n", buffer);
-		if (success)
+		if (success && cached) {
+			char reply[128];
+			snprintf(reply, sizeof reply, "Finished full configuration (bit file "
+				"from RAM, an estimated %.1f ms of reading saved)", savedNs / 1e6);
+			sendStrToBuf(reply);
+		}
+		//lookup() hands back the name itself if it couldn't stage the file
+		else if (success && c.size() >= 2 && alternateBitFile != c[1].str())
+			sendStrToBuf("Finished full configuration (bit file now staged in RAM)");
+		else if (success)
 			sendStrToBuf("Finished full configuration");
 		else
-			sendStrToBuf("Full configuration failed");
-	}
-	else if(c[0] == "readback"){
-		//NOTE: this are default values from jcm_full_readback, and should perhaps
-		//be constants somewhere!
-		bool readBram = false, clearGlutMask = true, issueCapture = false;
-
-		// Perform readback (path should be constant!)
-		xTopLib->readFullDevice("/tmp/readBack.data", readBram, clearGlutMask,
-				issueCapture, jtagHZ);
-		//NOTE XilinxUtils->readFullDevice returns a pointer to data; even if the
-		//fpga is off, the jcm_full_readback.elf will not throw an error. The server
-		//doesn't either since this should be handled in that function.
-		sendStrToBuf("Readback complete(?)");
+			sendErrToBuf("Full configuration failed");
+		break;
 	}
-	else if(c[0] == "scrub")  //this will need to be changed to support -b -c -h
-		sendStrToBuf("Not yet implemented");
-	else if(c[0] == "fault")
-		sendStrToBuf("Not yet implemented");
+	case verbHash("readback"):
+		interpretReadbackCommand(c);
+		break;
+	case verbHash("golden"):
+		interpretGoldenCommand(c);
+		break;
+	case verbHash("scrub"):  //this will need to be changed to support -b -c -h
+	case verbHash("fault"):
+		sendErrToBuf("Not yet implemented");
+		break;
 	// all read commands are handled by another function
-	else if(c[0] == "read" || c[0] == "r")
+	case verbHash("read"):
+	case verbHash("r"):
 		interpretReadCommand(c);
-	else if(c[0] == "write" || c[0] == "w")
+		break;
+	case verbHash("write"):
+	case verbHash("w"):
 		interpretWriteCommand(c);
-	else if(c[0] == "op") //op for operation
+		break;
+	case verbHash("op"): //op for operation
 		interpretOperationCommand(c);
+		break;
 	//the echo command returns all text after "echo " in the command
-	else if(c[0] == "echo"){
-		//I still need to enable this for new functionality
-		static string echoResponse;     //ASK why this can't be done in one line.
-		echoResponse = command.substr(5);
+	case verbHash("echo"):
 		if (command.size() >= 6)
-			sendStrToBuf(echoResponse.c_str());
+			sendToBuf((void *) (command.data() + 5), command.size() - 5,
+				PACKET_TYPE_TEXT);
 		else
-		   sendStrToBuf(err0Str);
-	}
-	else if (c[0] == "options" || c[0] == "option" || c[0] == "o")
+		   sendErrToBuf(err0Str);
+		break;
+	case verbHash("options"):
+	case verbHash("option"):
+	case verbHash("o"):
 		interpretOptionsCommand(c);
-	else if(c[0] == "exit")
-		exitThread = true;//Don't respond on exit or else seg fault (writing from)
-	else
-		sendStrToBuf(err0Str);
+		break;
+	case verbHash("exit"):
+		//Don't respond on exit; the reactor closes the connection once
+		//everything already queued has been sent
+		pthread_mutex_lock(&cur->lock);
+		cur->closing = true;
+		pthread_mutex_unlock(&cur->lock);
+		wakeReactor();
+		break;
+	case verbHash("stats"):
+		interpretStatsCommand(c);
+		break;
+	case verbHash("devices"):
+		sendDeviceList();
+		break;
+	case verbHash("job"):
+	case verbHash("jobs"):
+		interpretJobCommand(command, c);
+		break;
+	case verbHash("batch"):
+		interpretBatchCommand(command, c);
+		break;
+	case verbHash("macro"):
+		interpretMacroCommand(command, c);
+		break;
+	case verbHash("events"):
+		interpretEventsCommand(c);
+		break;
+	default:
+		if (c[0][0] == '@') {
+			sendErrToBuf("No such device");
+			return true;
+		}
+		sendErrToBuf(err0Str);
 		//sprintf(sv->sharedBuf, "Unknown command");
+		return false;
+	}
+	return true;
+}
+
+//Syntax: "stats (reset|export FILE (SECONDS)|export off)"
+void JCMServer::interpretStatsCommand(const Tokens &c) {
+	if (c.size() < 2) {
+		string report = jcmStats.report();
+		char line[64];
+		snprintf(line, sizeof line, "log messages dropped: %zu", jcmLog.dropped());
+		report += line;
+		sendStrToBuf(report.c_str());
+	}
+	else if (c[1] == "reset") {
+		jcmStats.reset();
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else if (c[1] == "export" && c[2] == "off") {
+		jcmStats.stopExport();
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else if (c[1] == "export" && c.size() >= 3) {
+		u32 interval = STATS_EXPORT_INTERVAL;
+		if (c.size() >= 4 && !parseNumber(c[3], 10, interval)) {
+			sendErrToBuf(invalidArgsStr);
+			return;
+		}
+		jcmStats.startExport(c[2].str().c_str(), interval);
+		sendStrToBuf(genericSuccessReponse);
+	}
+	else
+		sendErrToBuf("usage: stats (reset|export FILE (seconds)|export off)");
 }
 
 
-//The sender and listener static stub functions are needed because the pthread
-//library requires a normal pointer to a function as the new thread's starting
-//point. A pointer to a member of an object will not work. These simply calll
+//A device's executor or job thread: the server and the device it runs
+//commands (or jobs) for
+struct ExecutorArgs {
+	JCMServer *server;
+	DeviceContext *dc;
+};
+
+//The executor static stub function is needed because the pthread library
+//requires a normal pointer to a function as the new thread's starting
+//point. A pointer to a member of an object will not work. This simply calls
 //the correct object method. Possible change by not using Pthread library.
-static void * senderThreadStaticStub(void *s) {
-	((JCMServer*) s)->senderThread();
-}
-static void * listenerThreadStaticStub(void *s) {
-	((JCMServer*) s)->listenerThread();
+static void * executorThreadStaticStub(void *p) {
+	ExecutorArgs *args = (ExecutorArgs *) p;
+	return args->server->executorThread(args->dc);
 }
 
-//other child process does the talking.
-void * JCMServer::listenerThread(){
-  while (!exitThread){
-    char command[MAXDATASIZE];
-	 memset(command, 0, sizeof command);
-    int numbytes = 0;
+static void * jobThreadStaticStub(void *p) {
+	ExecutorArgs *args = (ExecutorArgs *) p;
+	return args->server->jobThread(args->dc);
+}
 
-    //receiving endF
-    if ((numbytes = recv(new_fd, command, MAXDATASIZE-1, 0)) == -1){
-      perror("recv");
-		break;
-    }
-	 //if the other person shut down (recv returns a 0 for this)
-	 if (numbytes == 0) {
-		 exitThread = true;
-		 break;
-	 }
+//Runs the commands sent to one device one at a time, in the order they were
+//received, no matter which client sent them. Each command holds the chain
+//lock while it runs, so device accesses can never interleave on the chain
+//with those of other commands, of commands for the other devices on it, or
+//of the background scrubbers and samplers. (The lock is let go between
+//accesses while a command waits for a slow client; see waitForBacklog.) Job commands don't touch the chain, so
+//they are answered without waiting for it, and once a job on the chain is
+//stuck past its deadline the device's other commands fail instead of
+//waiting behind it.
+void * JCMServer::executorThread(DeviceContext *dc){
+	ctx = dc;
+	onExecutor = true;
+	//a job stuck on any device of the chain holds the chain lock, so it
+	//blocks this device's commands as surely as one of its own
+	vector<int> chain;
+	for (size_t i = 0; i < contexts.size(); i++)
+		if (contexts[i]->chainLock == dc->chainLock)
+			chain.push_back(i);
+	Command command;
+	while (dc->commands.pop(command)) {
+		cur = command.session.get();
+		curRequestId = command.requestId;
+
+		//skip commands from clients that have already disconnected
+		pthread_mutex_lock(&cur->lock);
+		bool closed = cur->closed;
+		pthread_mutex_unlock(&cur->lock);
+
+		if (!closed) {
+			STAT_HISTOGRAM("cmd.queue")->record(monotonicNs() - command.receivedNs);
+			print("Got '%s' from %s for device %d\n", command.text.c_str(),
+				cur->clientAddr, dc->index);
+			Token verb(command.text.data(), min(command.text.find(' '),
+				command.text.size()));
+			u32 stuck;
+			int stuckDevice;
+			//these don't touch the device, so they needn't wait for it
+			if (verb == "job" || verb == "jobs" || verb == "events")
+				interpretCommand(command.text);
+			else if ((stuck = jobManager.stuckJob(chain, stuckDevice)) != 0) {
+				char reply[128];
+				if (stuckDevice == dc->index)
+					snprintf(reply, sizeof reply, "Device %d is stuck in job %u, past "
+						"its deadline", dc->index, stuck);
+				else
+					snprintf(reply, sizeof reply, "Device %d's chain is held by job %u "
+						"on device %d, stuck past its deadline", dc->index, stuck,
+						stuckDevice);
+				sendErrToBuf(reply);
+			}
+			else {
+				dc->chainLock->lock();
+				holdsChain = true;
+				interpretCommand(command.text);
+				holdsChain = false;
+				dc->chainLock->unlock();
+			}
+			endStream();
+		}
+		cur = NULL;
+		command.session.reset();
+		//lets the reactor read from any client it stopped reading from
+		wakeReactor();
+	}
+	return NULL;
+}
 
-    command[numbytes] = '\0';
-    if (numbytes > 0)
-       print("Got '%s'"/* from %s*/, command); //clientAddr);
+void JCMServer::wakeReactor(){
+	uint64_t one = 1;
+	if (write(wakeFd, &one, sizeof one) == -1 && errno != EAGAIN)
+		perror("eventfd write");
+}
 
-	 fflush(stdout);
+void JCMServer::acceptClients(int sockfd){
+	struct sockaddr_storage their_addr; // connector's address information.
+	socklen_t sin_size;
+	char s[INET6_ADDRSTRLEN];
 
-    while (!readyToProcessCommand); //wait until other thread is readyToProcessCommand
-	 	readyToProcessCommand = false;
+	while (1) {
+		sin_size = sizeof their_addr;
+		int new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size,
+			SOCK_NONBLOCK);
+		if (new_fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
 
- 	 interpretCommand((string)command);
-	 //lets the sender send data now
-	 readyToSendData = true;
-  }
+		inet_ntop(their_addr.ss_family,
+				get_in_addr((struct sockaddr *)&their_addr),
+				s, sizeof s);
+
+		//every response is written with a single call, so waiting to
+		//coalesce small segments (Nagle) only adds latency
+		int yes = 1;
+		setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = new_fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			close(new_fd);
+			continue;
+		}
+		sessions[new_fd] = make_shared<Session>(new_fd, s);
+		sessions[new_fd]->events = EPOLLIN;
+		print("Got connection from %s\n", s);
+	}
 }
 
-//this thread creates the listener and will send any data produced by listener
-void* JCMServer::senderThread(){
+void JCMServer::readSession(shared_ptr<Session> s){
+	char buf[MAXDATASIZE];
+
+	while (!s->stalled) {
+		int numbytes = recv(s->fd, buf, MAXDATASIZE, 0);
+		if (numbytes == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			perror("recv");
+			closeSession(s->fd);
+			return;
+		}
+		//if the other person shut down (recv returns a 0 for this)
+		if (numbytes == 0) {
+			closeSession(s->fd);
+			return;
+		}
+		s->inBuf.append(buf, numbytes);
+
+		//the first bytes a client sends tell us which protocol it speaks
+		if (s->protocol == PROTOCOL_UNKNOWN) {
+			size_t n = min(s->inBuf.size(), (size_t) PROTOCOL_V2_MAGIC_LEN);
+			if (s->inBuf.compare(0, n, PROTOCOL_V2_MAGIC, n) != 0)
+				s->protocol = PROTOCOL_TEXT;
+			else if (n == PROTOCOL_V2_MAGIC_LEN) {
+				s->protocol = PROTOCOL_V2;
+				s->inBuf.erase(0, PROTOCOL_V2_MAGIC_LEN);
+				print("%s is using protocol v2\n", s->clientAddr);
+			}
+		}
 
-	//set up file logging (cannot call print() until here)
-	logFilePtr = fopen(fileName, "a");
+		//Old clients don't terminate their commands, they send one per
+		//send(). Until a client uses '\n', each read is one whole command.
+		if (s->protocol == PROTOCOL_TEXT && !s->sawNewline) {
+			if (memchr(buf, '\n', numbytes) != NULL)
+				s->sawNewline = true;
+			else
+				s->inBuf += '\n';
+		}
 
-	print("Got connection from %s\n", clientAddr);
+		if (!parseCommands(s)) {
+			closeSession(s->fd);
+			return;
+		}
+	}
+}
 
-	//create listener thread
-	pthread_t listenerTh;
-	int *th2rv = (int*) pthread_create(&listenerTh, NULL, &listenerThreadStaticStub, this);
+bool JCMServer::parseCommands(shared_ptr<Session> s){
+	string &in = s->inBuf;
+	size_t pos = 0;
+
+	s->stalled = false;
+	while (pos < in.size()) {
+		Command c;
+		c.session = s;
+		c.requestId = 0;
+		c.receivedNs = monotonicNs();
+		size_t next;
+
+		if (s->protocol == PROTOCOL_V2) {
+			//[u32 request id][u32 length][length bytes of command text]
+			if (in.size() - pos < PROTOCOL_V2_REQUEST_HEADER_LEN)
+				break;
+			u32 len;
+			memcpy(&c.requestId, &in[pos], sizeof(u32));
+			memcpy(&len, &in[pos + sizeof(u32)], sizeof(u32));
+			if (len > MAX_REQUEST_SIZE) {
+				print("Request of %u bytes from %s is too long\n", len,
+					s->clientAddr);
+				return false;
+			}
+			if (in.size() - pos - PROTOCOL_V2_REQUEST_HEADER_LEN < len)
+				break;
+			c.text.assign(in, pos + PROTOCOL_V2_REQUEST_HEADER_LEN, len);
+			next = pos + PROTOCOL_V2_REQUEST_HEADER_LEN + len;
+		}
+		else if (s->protocol == PROTOCOL_TEXT) {
+			size_t nl = in.find('\n', pos);
+			if (nl == string::npos) {
+				if (in.size() - pos > MAX_REQUEST_SIZE) {
+					print("Command from %s is too long\n", s->clientAddr);
+					return false;
+				}
+				break;
+			}
+			c.text.assign(in, pos, nl - pos);
+			if (!c.text.empty() && c.text[c.text.size() - 1] == '\r')
+				c.text.erase(c.text.size() - 1);
+			next = nl + 1;
+			//ignore blank lines
+			if (c.text.empty()) {
+				pos = next;
+				continue;
+			}
+		}
+		else
+			break;
 
-	//commands that the user can input on the server (on the jcm)
-   while (!exitThread)
-		sendIfReady();
+		//"@N command" is for device N; anything else goes to the session's
+		//device. An unknown device is left for the executor to complain about.
+		int target = s->device;
+		if (c.text[0] == '@') {
+			size_t end = c.text.find(' ');
+			if (end == string::npos)
+				end = c.text.size();
+			u32 n;
+			if (parseNumber(Token(c.text.data() + 1, end - 1), 10, n) &&
+					n < contexts.size()) {
+				target = n;
+				c.text.erase(0, min(end + 1, c.text.size()));
+			}
+		}
 
-  print("\nClient '%s' has disconnected\n\n", clientAddr);
-  fclose(logFilePtr);
-  //close(sv->new_fd);
+		//picking the session's device changes where the commands after it
+		//go, so it is done here, as it is read; the executor only answers
+		Tokens t;
+		u32 n;
+		if (tokenize(c.text.data(), c.text.size(), t) && t.size() >= 3 &&
+				(t[0] == "options" || t[0] == "option" || t[0] == "o") &&
+				t[1] == "activedevice" && parseNumber(t[2], 10, n) &&
+				n < contexts.size())
+			s->device = n;
+
+		//if the executor is this far behind, stop reading from this client
+		//until it catches up (it wakes us after every command)
+		if (!contexts[target]->commands.tryPush(c)) {
+			s->stalled = true;
+			break;
+		}
+		pos = next;
+	}
+	in.erase(0, pos);
+	updateEvents(s.get());
+	return true;
 }
 
-void JCMServer::sendIfReady(){
-	readyToProcessCommand = true;
+void JCMServer::updateEvents(Session *s){
+	pthread_mutex_lock(&s->lock);
+	bool pending = !s->outQueue.empty();
+	pthread_mutex_unlock(&s->lock);
 
-	//if other thread has made data, get it (and lock other thread from
-	//overwriting data until finished getting)
-	if (!readyToSendData)
+	//don't read while stalled, and only ask about EPOLLOUT while there is
+	//something left to write
+	u32 events = (s->stalled ? 0 : (u32) EPOLLIN) | (pending ? (u32) EPOLLOUT : 0);
+	if (events == s->events)
 		return;
 
-	readyToSendData = false; //now finished, no new data to send
-	readyToProcessCommand = false;
-
-	int toSendTotalLength = sendDataLen;
-	int toSendCurrentLength = MAXDATASIZE;
-	int currentDataIndex = 0;
-	int numSendIterations = 0;
-	string header_str = "invalid header";
-	int testDataIndex = 0;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.fd = s->fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev) == -1)
+		perror("epoll_ctl");
+	s->events = events;
+}
 
-	//calculate number of packets needed to send all data
-	while (testDataIndex < toSendTotalLength) {
-		//if we're on the last iteration, probably won't be a full length packet
-		if (testDataIndex + MAXDATASIZE > toSendTotalLength)
-			toSendCurrentLength = toSendTotalLength - testDataIndex;
-		testDataIndex += MAXDATASIZE;
-		numSendIterations++;
-	}
-	toSendCurrentLength = MAXDATASIZE; //reset this
-	//length is second byte of header packet
-	//sendDataHeader[1] = numSendIterations;
-	sendDataHeader[1] = toSendTotalLength;
+bool JCMServer::flushSession(Session *s){
+	bool ok = true, corked = false;
+	//v2 clients also get the id of the request being answered
+	size_t headerLen = (s->protocol == PROTOCOL_V2 ? 3 : 2) * sizeof(u32);
+	struct iovec iov[MAX_IOVECS];
+	int one = 1, zero = 0;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->outQueue.empty()) {
+		Response &front = s->outQueue.front();
+		size_t frontHeaderLen = front.continuation ? 0 : headerLen;
+		ssize_t sent;
+		size_t offered = 0;
+
+		if (front.file && s->outOffset >= frontHeaderLen) {
+			//the header is out; send the file from the page cache
+			size_t done = s->outOffset - frontHeaderLen;
+			off_t fileOffset = front.file->offset + done;
+			offered = front.file->length - done;
+			sent = sendfile(s->fd, front.file->fd, &fileOffset, offered);
+			if (sent == 0) {
+				print("sendfile: file for %s ended early\n", s->clientAddr);
+				ok = false;
+				break;
+			}
+		}
+		else {
+			//gather the unsent header and data of as many queued responses
+			//as fit, so they all go out in one system call. A file response
+			//ends the batch, since its data is sent with sendfile().
+			int n = 0;
+			size_t offset = s->outOffset;
+			deque<Response>::iterator it;
+			for (it = s->outQueue.begin();
+					it != s->outQueue.end() && n + 2 <= MAX_IOVECS; it++) {
+				size_t hl = it->continuation ? 0 : headerLen;
+				if (offset < hl) {
+					iov[n].iov_base = (char *) it->header + offset;
+					iov[n].iov_len = hl - offset;
+					offered += iov[n++].iov_len;
+					offset = hl;
+				}
+				if (it->file)
+					break;
+				if (offset - hl < it->data.size()) {
+					iov[n].iov_base = &it->data[offset - hl];
+					iov[n].iov_len = it->data.size() - (offset - hl);
+					offered += iov[n++].iov_len;
+				}
+				offset = 0;
+			}
 
-	//Send the header packet only (just two ints (8 bytes): 1st for type, 2nd
-	//for number of subsequent packets (usually one))
-	if ((send(new_fd, (void*) sendDataHeader, 8, MSG_NOSIGNAL)) == -1){
-		perror("send");
-		exitThread = true; //used to be BREAK. MAY CAUSE PROBLEMS.
-		return;
-	}
-	if (sendDataHeader[0] == PACKET_TYPE_TEXT)
-		header_str = "txt";
-	else if (sendDataHeader[0] == PACKET_TYPE_BINARY)
-		header_str = "bin";
-	else
-		print("Invalid header value: %d\n", sendDataHeader[0]);
-
-	// this is simply a busy cycle to allow the client to read the
-	// the header so before we overwrite it with more data
-	// Not a great solution.
-	if (toSendTotalLength > MAXDATASIZE)
-		for (int i = 0; i < 4000000; i++);
-
-	//Actually send the data, in 1024 byte increments
-	while (currentDataIndex < toSendTotalLength) {
-		//if we're on the last iteration, probably won't be a full length packet
-		if (currentDataIndex + MAXDATASIZE > toSendTotalLength)
-			toSendCurrentLength = toSendTotalLength - currentDataIndex;
-
-			int *ptrVal = static_cast<int*>(sendDataPtr + currentDataIndex);
-
-			//printf("\tvoid* data: %d\n\t", *ptrVal);
-			 //print("currentDataIndex: %d\ntoSendCurrentLen: %d"
-			// , currentDataIndex, toSendCurrentLength);
-			//Sprint("\n\t\tSTRING: %s\n", (u32*)sv->sendDataPtr);
-
-			//send data from other thread
-		if ((send(new_fd, (sendDataPtr + currentDataIndex),
-				 toSendCurrentLength, MSG_NOSIGNAL)) == -1){
+			struct msghdr msg;
+			memset(&msg, 0, sizeof msg);
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+			sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+		if (sent == -1) {
+			//the socket is full; epoll tells us when there is room again
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 			perror("send");
-			exitThread = true; //used to be BREAK. MAY CAUSE PROBLEMS.
-			return;
+			ok = false;
+			break;
+		}
+
+		//retire every response that went out completely
+		size_t left = sent;
+		while (!s->outQueue.empty()) {
+			Response &r = s->outQueue.front();
+			size_t hl = r.continuation ? 0 : headerLen;
+			size_t bodyLen = r.file ? r.file->length : r.data.size();
+			size_t unsent = hl + bodyLen - s->outOffset;
+			//only data held in memory counts towards the backlog
+			size_t memLen = r.file ? 0 : bodyLen;
+			size_t dataSent = s->outOffset > hl ? s->outOffset - hl : 0;
+			if (left < unsent) {
+				s->outOffset += left;
+				if (memLen && s->outOffset > hl)
+					s->outBytes -= s->outOffset - hl - dataSent;
+				break;
+			}
+			if (memLen)
+				s->outBytes -= memLen - dataSent;
+			left -= unsent;
+			if (!r.continuation)
+				logPrint(LOG_DEBUG, "Sent %d bytes (%s) to %s\n", (int) r.header[1],
+					r.header[0] == PACKET_TYPE_TEXT ? "txt" : "bin", s->clientAddr);
+			//from being queued to the last byte going to the kernel
+			STAT_HISTOGRAM("cmd.send")->record(monotonicNs() - r.queuedNs);
+			s->outQueue.pop_front();
+			s->outOffset = 0;
 		}
+		//the kernel took less than offered, so the socket buffer is full
+		if ((size_t) sent < offered)
+			break;
 
-		currentDataIndex += MAXDATASIZE;
+		//More to send after this call. Cork the socket so the pieces are
+		//packed into full segments; uncorking below pushes out the tail.
+		if (!s->outQueue.empty() && !corked) {
+			setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof one);
+			corked = true;
+		}
 	}
-	print(", Packets sent: %d (%s)\n", numSendIterations, header_str.c_str());
-	//sendDataPtr = nullptr;
+	if (s->closing && s->outQueue.empty())
+		ok = false;
+	pthread_cond_broadcast(&s->drained);
+	pthread_mutex_unlock(&s->lock);
+
+	if (corked)
+		setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof zero);
+	if (ok)
+		updateEvents(s);
+	return ok;
+}
+
+void JCMServer::closeSession(int fd){
+	map<int, shared_ptr<Session> >::iterator it = sessions.find(fd);
+	if (it == sessions.end())
+		return;
+	Session *s = it->second.get();
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	pthread_mutex_lock(&s->lock);
+	s->closed = true;
+	s->outQueue.clear();
+	s->outBytes = 0;
+	pthread_cond_broadcast(&s->drained);
+	pthread_cond_broadcast(&s->streamDone);
+	pthread_mutex_unlock(&s->lock);
+	close(fd);
+	eventBus.unsubscribe(s);
+
+	print("\nClient '%s' has disconnected\n\n", s->clientAddr);
+	//the executor may still hold the session for a queued command; it is
+	//freed once the last reference goes away
+	sessions.erase(it);
 }
 
 int JCMServer::start(){
-	int sockfd, new_fd; //the socket file descriptor we listen on
+	int sockfd; //the socket file descriptor we listen on
 	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr_storage their_addr; // connector's address information.
-	socklen_t sin_size;
-	struct sigaction sa;
 	int yes=1;
-	char s[INET6_ADDRSTRLEN];
 	int rv;
 
 	//First, set up the hints struct and getaddrinfo
@@ -855,7 +3584,7 @@ int JCMServer::start(){
 
 	//With this set up, loop through all the results and bind to the first we can
 	for(p = servinfo; p != NULL; p = p->ai_next) {
-			if ((sockfd = socket(p->ai_family, p->ai_socktype,
+			if ((sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
 							p->ai_protocol)) == -1) {
 					perror("server: socket");
 					continue;
@@ -891,38 +3620,112 @@ int JCMServer::start(){
       return 3;
   }
 
+	//start the log writer (anything print()ed before now is written out
+	//once it starts)
+	jcmLog.open(fileName);
+
+	//The reactor waits on the listening socket, every client socket and the
+	//eventfd the executor uses to say it has queued a response.
+	if ((epfd = epoll_create1(0)) == -1 ||
+			(wakeFd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("epoll/eventfd");
+		return 4;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = sockfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+	ev.data.fd = wakeFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+	vector<ExecutorArgs> executors(contexts.size());
+	jobManager.start();
+	eventBus.start([this]() { wakeReactor(); });
+	for (size_t i = 0; i < contexts.size(); i++) {
+		executors[i].server = this;
+		executors[i].dc = contexts[i];
+		pthread_create(&contexts[i]->executorTh, NULL, &executorThreadStaticStub,
+			&executors[i]);
+		pthread_create(&contexts[i]->jobTh, NULL, &jobThreadStaticStub,
+			&executors[i]);
+		contexts[i]->xadc->start(XADC_DEFAULT_INTERVAL_MS);
+	}
+
   printf("JCM server started. Waiting for connections...\n\n");
 
+	//Here, a single thread accepts clients, reads their commands and writes
+	//their responses. It only sleeps in epoll_wait, so any number of idle
+	//clients cost nothing.
+	struct epoll_event events[MAX_EVENTS];
+	while(1) {  // main event loop
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
 
-	int *senderThRV; //sender thread return value
-	pthread_t senderTh;
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == sockfd)
+				acceptClients(sockfd);
+			//the executor queued responses; send whatever we can
+			else if (fd == wakeFd) {
+				uint64_t count;
+				while (read(wakeFd, &count, sizeof count) > 0);
+
+				vector<int> done;
+				map<int, shared_ptr<Session> >::iterator it;
+				for (it = sessions.begin(); it != sessions.end(); it++) {
+					//the executor has made room; queue what we held back
+					if (it->second->stalled && !parseCommands(it->second))
+						done.push_back(it->first);
+					else if (!flushSession(it->second.get()))
+						done.push_back(it->first);
+				}
+				for (size_t j = 0; j < done.size(); j++)
+					closeSession(done[j]);
+			}
+			else {
+				map<int, shared_ptr<Session> >::iterator it = sessions.find(fd);
+				if (it == sessions.end())
+					continue;
+				shared_ptr<Session> s = it->second;
 
-	//Here, the server listens for clients, and creates a new thread to handle
-	//each client that connects.
-	while(1) {  // main accept() loop
-			sin_size = sizeof their_addr;
-			new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-			if (new_fd == -1) {
-					perror("accept");
+				if (events[i].events & EPOLLIN)
+					readSession(s);
+				if (s->closed)
+					continue;
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					closeSession(fd);
 					continue;
+				}
+				if (!flushSession(s.get()))
+					closeSession(fd);
 			}
-
-			this->new_fd = new_fd;
-
-			inet_ntop(their_addr.ss_family,
-					get_in_addr((struct sockaddr *)&their_addr),
-					s, sizeof s);
-			strcpy(clientAddr, s); //copies client address string
-			exitThread = false;
-			readyToProcessCommand = true;
-
-			//create sender thread which will later create listener thread
-			senderThRV = (int*) pthread_create(&senderTh, NULL,
-				&senderThreadStaticStub, (JCMServer *)this);
-			//close(new_fd);  // parent doesn't need this
+		}
 	}
 
-	pthread_join(senderTh, NULL);
-	print("All threads ended, exiting.");
+	//jobs still running stop at their next chunk
+	vector<shared_ptr<Job> > jobs;
+	jobManager.list(jobs);
+	for (size_t i = 0; i < jobs.size(); i++)
+		jobManager.cancel(jobs[i]->id);
+	for (size_t i = 0; i < contexts.size(); i++) {
+		contexts[i]->commands.close();
+		contexts[i]->jobs.close();
+	}
+	for (size_t i = 0; i < contexts.size(); i++) {
+		pthread_join(contexts[i]->executorTh, NULL);
+		pthread_join(contexts[i]->jobTh, NULL);
+		contexts[i]->xadc->stop();
+	}
+	jobManager.stop();
+	eventBus.stop();
+	print("All threads ended, exiting.\n");
+	jcmLog.close();
   return 0;
 }
\ No newline at end of file
@@ -10,12 +10,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -27,85 +29,357 @@
 #include <stdarg.h> //for printf redirection and va_arg
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <sstream>  // for istringstream
 #include <iostream>  // for cout
 
 #include <string.h>
 #include "CppUtils.h"
+#include "jcm_queue.h"
+#include "jcm_command.h"
+#include "jcm_log.h"
+#include "jcm_stats.h"
+#include "jcm_session.h"
+#include "jcm_device.h"
+#include "jcm_sim_device.h"
+#include "jcm_pipeline.h"
+#include "jcm_golden.h"
+#include "jcm_ticket_lock.h"
+#include "jcm_scrubber.h"
+#include "jcm_campaign.h"
+#include "jcm_xadc.h"
+#include "jcm_device_context.h"
+#include "jcm_frame_diff.h"
+#include "jcm_codec.h"
+#include "jcm_jobs.h"
+#include "jcm_batch.h"
+#include "jcm_bitstream_cache.h"
+#include "jcm_events.h"
 
 #define DEFAULT_PORT "3490"  //the default port to connect to
-#define BACKLOG 10     //max number of connections at once
-#define MAXDATASIZE 1024 //max number of bytes we can send at oncee
+#define BACKLOG 10     //max number of pending connections
+#define MAX_EVENTS 32  //max number of epoll events handled per wakeup
+#define MAXDATASIZE 1024 //max number of bytes we receive at once
+#define MAX_REQUEST_SIZE 65536 //max length of a single command
+#define MAX_IOVECS 64 //max number of buffers handed to a single sendmsg()
+
+//Once a client has this many response bytes waiting, the executor waits for
+//it to read some before queueing more (letting go of the chain lock while it
+//does)...
+#define MAX_SESSION_BACKLOG (4 * 1024 * 1024)
+//...and gives up on it (disconnecting it) if it doesn't within this many
+//seconds, so one stuck client can't hold up its own commands for long.
+#define SLOW_CLIENT_TIMEOUT 30
 
 #define LOG_FILE "jcm.log"
+//max number of upset bits listed in the response to "golden compare"
+#define MAX_REPORTED_UPSETS 65536
+
+//Starts the response to "golden compare"; numRecords Upset records follow
+struct CompareSummary {
+   u32 framesCompared;
+   u32 framesDiffering;
+   u32 upsetBits;
+   u32 numRecords;
+   //frames that could not be read (and so weren't compared)
+   u32 readErrors;
+};
+
+//Starts the response to "readback delta"; numFrames records follow, each
+//the frame's address then its wordsPerFrame words. A frame that changed but
+//then couldn't be read to send it has DELTA_FRAME_READ_ERROR set in its
+//address and zeros for its words.
+#define DELTA_FRAME_READ_ERROR 0x80000000
+struct DeltaHeader {
+   //pass this as the epoch to the next "readback delta" to get only what
+   //changes after this one
+   u32 epoch;
+   //the epoch asked for
+   u32 since;
+   u32 numFrames;
+   u32 wordsPerFrame;
+   //frames that could not be read (and so weren't checked)
+   u32 readErrors;
+};
+
+//"read frame" requests for fewer frames than this are read in one go
+//instead of through the pipeline
+#define PIPELINE_MIN_FRAMES 8
 
 
 //Packet headers that define the packet type
 #define PACKET_TYPE_TEXT 0x1
 #define PACKET_TYPE_BINARY 0x2
+//Frames sent with the session's encoding: an EncodedBlockHeader and the
+//encoded frames. A read sends as many as it takes, the last one flagged
+//ENCODED_FLAG_LAST, all with the request's id. Frames that couldn't be
+//read come in blocks flagged ENCODED_FLAG_READ_ERROR.
+#define PACKET_TYPE_ENCODED 0x3
+
+//link speed "op codecbench" estimates transfer times for, in Mbit/s
+#define CODEC_BENCH_LINK_MBIT 100
+//times each encoding is run over the frames by "op codecbench"
+#define CODEC_BENCH_REPS 3
+
+//What a job does
+#define JOB_KIND_READ 0       //reads frames into its output file
+#define JOB_KIND_GOLDEN 1     //captures a golden image
+#define JOB_KIND_CONFIGURE 2
+#define JOB_KIND_BLIND_SCRUB 3
+
+//A job's command, worked out when it is submitted (and again when it runs)
+struct JobPlan {
+   int kind;
+   //the frames to read, by index into the frame address array
+   int firstIndex;
+   int numFrames;
+   bool readBram;
+   //golden image file to capture into
+   string path;
+};
+
+//Collects the responses of a batch's commands instead of queueing them
+struct BatchCapture {
+   BatchCapture() : numRecords(0), command(0), steps(0), overflowed(false) {}
+
+   //BatchRecordHeaders, each followed by its data
+   vector<char> out;
+   u32 numRecords;
+   //the command running, and where each of its records starts in out
+   u32 command;
+   vector<size_t> commandRecords;
+   //statements run, in the batch and the macros it runs
+   u32 steps;
+   //set once out would pass MAX_BATCH_RESPONSE; nothing more is kept
+   bool overflowed;
+};
+
+//Reused while encoding the frames of one response
+struct EncodeBuffers {
+   //golden copies of the frames being encoded, for ENCODING_XOR
+   vector<u32> ref;
+   vector<u32> scratch;
+   //the block being built
+   vector<uint8_t> block;
+};
+
+//A device given on the command line: the chain it is on (shared by every
+//device on the chain) and its index on the chain
+struct DeviceSpec {
+   JcmDevice *chain;
+   int chainIndex;
+   //what it was made from, for "devices"
+   string name;
+};
+
+//A session streaming XADC samples ("op xadc subscribe")
+struct XadcSubscription {
+   shared_ptr<Session> session;
+   //the device the samples are from
+   int device;
+   //id of the subscribe request, sent back with every sample
+   u32 requestId;
+   //ms covered by each summary, 0 to send every sample as it is taken
+   u32 windowMs;
+   XadcWindow window;
+};
+
+//An XADC value's range on one device ("events threshold"); crossing it
+//publishes an EVENT_XADC_THRESHOLD
+struct XadcThreshold {
+   int device;
+   //EVENT_XADC_TEMP, EVENT_XADC_VCCINT or EVENT_XADC_VCCAUX
+   int channel;
+   float low;
+   float high;
+   //EVENT_XADC_* as of the last sample
+   u32 state;
+};
 
 class  JCMServer {
 
 public:
 
-   JCMServer();
+   //The server takes ownership of the chains. Devices are numbered in the
+   //order given.
+   JCMServer(const vector<DeviceSpec> &devices);
    ~JCMServer();
 
    //Starts the JCM Server.
    int start();
 
-   //These need to be public so the static stub functions can access them.
-   //Better if they were private.
-   //Runs the sender thread, which sends whatever data is placed in sendDataPtr.
-   void * senderThread();
-   //Runs the listener thread, which receives commands from the client, runs
-   //them, and puts the result in sendDataPtr (along with header type/length).
-   void * listenerThread();
+   //This needs to be public so the static stub function can access it.
+   //Better if it were private.
+   //Runs a device's executor thread, the only thread that runs commands on
+   //it. It runs each command from the device's queue and queues the result
+   //on its session.
+   void * executorThread(DeviceContext *dc);
+   //Runs a device's jobs, one at a time, in the order they were submitted
+   void * jobThread(DeviceContext *dc);
 
    //FUNCTIONS
 private:
 
-   void sendIfReady();
-
-   //prints to both the console screen AND the log file
+   //accepts every pending connection and creates a session for each
+   void acceptClients(int sockfd);
+   //reads whatever a client has sent and queues its commands
+   void readSession(shared_ptr<Session> s);
+   //splits a session's received bytes into commands and queues them. Returns
+   //false if the client broke the protocol and should be disconnected.
+   bool parseCommands(shared_ptr<Session> s);
+   //registers the epoll events a session currently needs
+   void updateEvents(Session *s);
+   //writes as much of a session's queued responses as the socket will take
+   //without blocking, gathering as many as fit into each sendmsg(). Returns
+   //false once the session should be closed.
+   bool flushSession(Session *s);
+   //removes a session from epoll and closes its socket
+   void closeSession(int fd);
+   //wakes the reactor thread (so it flushes any new responses)
+   void wakeReactor();
+   //queues a response on the current session, first waiting for the client
+   //to read if too much is already waiting
+   void queueResponse(Response &r);
+
+   //prints to both the console screen AND the log file (at LOG_INFO). The
+   //message is written out later by the log's writer thread.
    void print(const char * fmt, ...);
 
-   //top method that interprets all commands,
-   void interpretCommand(string command);
+   //top method that interprets all commands. The words of the command are
+   //tokens pointing into command, so it isn't copied.
+   void interpretCommand(const string &command);
+   //carries out a tokenized command; returns false if the verb is unknown
+   bool dispatchCommand(const string &command, const Tokens &c);
+   //if the second word of commands with this verb is a sub-verb
+   bool hasSubVerbs(const Token &verb);
+   //sends or exports the latency statistics
+   void interpretStatsCommand(const Tokens &c);
    //interprets all commands associated with reading a register or frame
-   void interpretReadCommand(vector<string> c);
+   void interpretReadCommand(const Tokens &c);
+   //reads a comma separated list of registers (e.g. "far,status,crc") and
+   //sends their values as packed u32s, in the order given
+   void readRegisterList(const Token &list);
 
    //interprets all commands associated with reading the XADC values
-   void interpretXadcCommand(vector<string> c);
+   void interpretXadcCommand(const Tokens &c);
+   //interprets "op xadc ..." (sampling and subscriptions)
+   void interpretXadcOpCommand(const Tokens &c);
+   //hands a new sample from a device to every session subscribed to it,
+   //and publishes any threshold it crosses (sampler thread)
+   void deliverXadcSample(int device, const XadcSample &sample);
+   //queues a response on a session only if it can be without waiting: not
+   //if the client is behind, or another device is streaming to it. gone is
+   //set if the session is closed or closing.
+   bool offerResponse(Session *s, Response &r, bool &gone);
+   //lists the devices
+   void sendDeviceList();
+
+   //sends the device's frame layout ("read fradlist")
+   void sendFrameList();
 
    //interprets all commands associated with reading frames
-   void readInFramesFromDevice(vector<string> c);
+   void readInFramesFromDevice(const Tokens &c);
+   //sends numFrames frames as one PACKET_TYPE_ENCODED block. firstIndex is
+   //where they are in the frame address array (-1 if unknown) and
+   //firstFrame how many frames of the response came before them. flags
+   //are ENCODED_FLAG_*.
+   void sendEncodedFrames(int encoding, const u32 *frames, int numFrames,
+      int firstIndex, u32 firstFrame, uint8_t flags, EncodeBuffers &buf);
+   //reads numFrames frames through the pipeline and sends them encoded
+   void readFramesEncoded(int firstIndex, int numFrames);
 
    //interprets all commands associated with reading from the bscan
    //Read is true if reading and false if writing
-   void interpretBscanCommand(vector<string> c, bool read);
+   void interpretBscanCommand(const Tokens &c, bool read);
 
    //interprets all commands associated with writing a register or frame
-   void interpretWriteCommand(vector<string> c);
+   void interpretWriteCommand(const Tokens &c);
 
    //interprets all operation commands
-   void interpretOperationCommand(vector<string> c);
+   void interpretOperationCommand(const Tokens &c);
 
    //interprets option commands such as changing jtag to high-Z
-   void interpretOptionsCommand(vector<string> c);
+   void interpretOptionsCommand(const Tokens &c);
 
    //interprets fault injection commands
-   void interpretInjectFaultCommand(vector<string> c);
+   void interpretInjectFaultCommand(const Tokens &c);
 
    //interprets scrubbing commands
-   void interpretScrubCommand(vector<string> c);
-
-   //parses a command string into a vector, separated by white space
-   vector<string> parseByWhiteSpace(string command);
-
-   //converts a string to an int of base 10 or 16
-   int getInt(string s, int base);
+   void interpretScrubCommand(const Tokens &c);
+   //starts the background scrubber in readback or hybrid mode
+   void startScrubber(const Tokens &c, int mode);
+   //sends the scrubber's statistics
+   void sendScrubStatus();
+
+   //reads the device and times every encoding on its frames
+   void runCodecBench(const Tokens &c);
+
+   //interprets "configure preload FILE" and "configure cache (clear)"
+   void interpretBitstreamCommand(const Tokens &c);
+
+   //interprets "batch (stop) STATEMENT; STATEMENT; ..."
+   void interpretBatchCommand(const string &command, const Tokens &c);
+   //interprets "macro (define|run|show|delete|list) ..."
+   void interpretMacroCommand(const string &command, const Tokens &c);
+   //runs a batch (or macro) with vars set, and sends its packed response
+   void sendBatch(const string &text, map<string, string> &vars, bool stopOnError);
+   //runs a parsed batch's statements; returns false once it has stopped
+   bool runBatch(const vector<BatchStep> &steps, map<string, string> &vars,
+      bool stopOnError, int depth, BatchHeader &h);
+   //runs one command of a batch, or a "macro run" in it
+   bool runBatchCommand(const string &text, bool stopOnError, int depth,
+      BatchHeader &h);
+   //records a statement of a batch that could not be run as a failed
+   //command, stopping the batch (returning false) if stop is set
+   bool failBatch(const char *error, bool stop, BatchHeader &h);
+   //adds a response to the batch being run instead of queueing it
+   void captureResponse(const Response &r);
+
+   //interprets "events (subscribe|unsubscribe|status|threshold) ..."
+   void interpretEventsCommand(const Tokens &c);
+   //subscribes the current session to the event bus
+   void subscribeEvents(const Tokens &c);
+   //sets or clears an XADC threshold on the current device
+   void setXadcThreshold(const Tokens &c);
+   //publishes a CRC register's value if it differs from the last read of it
+   void noteCrc(int reg, u32 value);
+   //publishes a fault injected on the current device
+   void publishInjection(u32 frameAddress, u32 word, u32 bit, u32 numBits,
+      u32 source, u32 flags);
+
+   //interprets "job (run|status|cancel|result|list) ..." and "jobs"
+   void interpretJobCommand(const string &command, const Tokens &c);
+   //queues "job run (deadline S) COMMAND..." on the current device
+   void submitJob(const string &command, const Tokens &c);
+   //works out what a job's command (the words after "job run") does.
+   //Returns false, with the reason in error, if it can't be run as a job.
+   bool planJob(const Tokens &c, JobPlan &plan, string &error);
+   //runs a job on the job thread, holding the chain lock a chunk at a time
+   void runJob(const shared_ptr<Job> &job);
+   //reads numFrames frames from firstIndex, a chunk at a time, handing each
+   //to write. Stops (returning false, with the reason in error) if the job
+   //is cancelled or passes its deadline, or a read or write fails.
+   bool readJobFrames(Job &job, int firstIndex, int numFrames,
+      function<bool(int index, int n, const u32 *frames)> write, string &error);
+
+   //runs a fault injection campaign and streams back its records
+   void interpretCampaignCommand(const Tokens &c);
+   //fills targets from "logic", "all", or a comma separated list of frame
+   //addresses and address ranges (e.g. "400-4ff,1000"). Returns false if
+   //the list is invalid.
+   bool parseCampaignTargets(const Token &s, vector<u32> &targets);
+
+   //converts a word to an int of base 10 or 16
+   int getInt(const Token &s, int base);
 
    //gets the internet address
    void * get_in_addr(struct sockaddr *sa);
@@ -115,47 +389,105 @@ private:
 
    //sends a string to the buffer
    void sendStrToBuf(const char* s);
+   //sends a string saying why the command failed; a batch run with stop on
+   //error stops after it
+   void sendErrToBuf(const char* s);
+   //keeps a response for "resend"
+   void rememberResponse(const Response &r);
+
+   //starts a response of totalLen bytes whose data is then sent in pieces
+   //with sendChunk(); the pieces must add up to exactly totalLen
+   void beginStream(u32 totalLen, char header = PACKET_TYPE_BINARY);
+   //sends the next piece of a response started with beginStream()
+   void sendChunk(void *data, int len);
+   //keeps a response saying the last one can't be resent, for responses
+   //sent in pieces
+   void rememberNoResend();
+   //waits for another device's stream to the current session to finish
+   void waitForStream();
+   //takes cur->lock once no other device is streaming to the session
+   void lockSession();
+   //waits for the current session's client to read if too much is waiting
+   void waitForBacklog();
+   //releases the current session if this device was streaming to it
+   void endStream();
+   //sends the contents of an open file with sendfile(); takes ownership of fd
+   void sendFileToBuf(int fd, size_t len, char header = PACKET_TYPE_BINARY);
+
+   //interprets all readback commands
+   void interpretReadbackCommand(const Tokens &c);
+   //reads back the whole device and streams it to the client as it is read
+   void streamReadback(bool readBram);
+   //sends the frames that changed since an epoch (see jcm_frame_checksums.h)
+   void sendReadbackDelta(u32 since, bool readBram, bool cached);
+   //reads numFrames frames, starting at firstIndex in the frame address
+   //array, through the pipeline. Each chunk is handed to deliver on the
+   //pipeline thread; by default it is sent as part of a stream.
+   void readFramesPipelined(int firstIndex, int numFrames,
+      function<void(FrameChunk &)> deliver = NULL);
+
+   //interprets all golden image commands
+   void interpretGoldenCommand(const Tokens &c);
+   //reads the whole device into a new golden image file and loads it
+   void captureGolden(const char *path, bool readBram);
+   //reads the device and sends every bit that differs from the golden image
+   void compareToGolden(bool readBram);
 
 private:
    //DATA MEMBERS
 
-   //Pointer to raw data to send. The listener thread performs the client's
-   //request on the fpga and then loads the result data into this. The sender
-   //thread then sends and clears its contents.
-   void * sendDataPtr;
-   //Length of the data to send
-   u32 sendDataLen;
-   //Type of data to send (text or binary)
-   u32 sendDataHeader[2];
-
-   //address of the client connected to the jcm
-   char clientAddr[INET6_ADDRSTRLEN];
-   //File descriptor of the new socket connection
-   int new_fd;
+   //Every device, by number, each with its own executor thread
+   vector<DeviceContext *> contexts;
+   //the chains the devices are on, and their locks
+   vector<JcmDevice *> chains;
+   vector<TicketLock *> chainLocks;
+   //Every job, on every device
+   JobManager jobManager;
+   //Macros, for every session and device
+   MacroTable macros;
+   //Bit files staged in RAM for "configure FILE", for every device
+   BitstreamCache bitstreams;
+   //Events from every device, and the sessions subscribed to them
+   EventBus eventBus;
+
+   //The rest of these are set by each executor thread for the command it is
+   //running, so they are per thread.
+   //The device the command is for
+   static thread_local DeviceContext * ctx;
+   //The session whose command is being run. Responses from sendToBuf are
+   //queued on it.
+   static thread_local Session * cur;
+   //The request id of the command being run, echoed back in its responses
+   static thread_local u32 curRequestId;
+   //Set while running a batch; responses are added to it instead of queued
+   static thread_local BatchCapture * capture;
+   //Set by sendErrToBuf, so a batch knows the command failed
+   static thread_local bool cmdFailed;
+   //Set on executor threads, the only ones that wait for a slow client...
+   static thread_local bool onExecutor;
+   //...and while the command holds its chain lock, which is let go for the
+   //wait
+   static thread_local bool holdsChain;
+
+   //Every connected client, by socket file descriptor (reactor thread only)
+   map<int, shared_ptr<Session> > sessions;
+   //epoll instance the reactor waits on
+   int epfd;
+   //eventfd the executor writes to when it has queued a response
+   int wakeFd;
    int port; //the port to use
 
-   //if it can process a command (false until all already processed data
-   //has been sent)
-   bool readyToProcessCommand;
-   //if the sender is ready to send more data
-   bool readyToSendData;
-   // command interpreter sets this if "exit" sent/socket closed
-   bool exitThread;
-
    //the last command received from someone
    string lastCommand;
 
-   //Option variables
-   //if jtagToHighZ is true
-   bool jtagHZ = false;
-
    //Utility functions object
    CppUtils * util;
-   //Connection to the fpga and all functions
-   XilinxTopLibrary * xTopLib;
+   //Sessions streaming XADC samples, and the thresholds samples are checked
+   //against, protected by xadcSubsLock
+   vector<XadcSubscription> xadcSubs;
+   vector<XadcThreshold> xadcThresholds;
+   pthread_mutex_t xadcSubsLock;
 
-   //the log file that is to be written to
-   FILE * logFilePtr;
    //the name of the log file
    const char* fileName = LOG_FILE;
 
@@ -178,7 +510,8 @@ private:
    const char* sendErr1Str = "Specify which operation";
 
    const char* sendHelpStr = "Operations: injectfault (normal (no correction),"
-      "random, multiframe), scrub (NYI)";
+      "random, multiframe), scrub (blind, readback, hybrid, stop, status), "
+      "campaign, xadc (start, stop, status, subscribe, unsubscribe), codecbench";
 
    const char* optErr0Str = "Unknown option";
    const char* optErr1Str = "Specify which option to change";
@@ -193,13 +526,57 @@ private:
    const char* helpString = "Connected to the jcm server. Commands:\n"
    	 "setup: \t\tsets up the connected FPGA; must be run first\n"
    	 "configure: \tconfigures the FPGA with the bit file specified in AutoConfig.txt\n"
+   	 "configure FILE: configures it with FILE, read from a copy kept in RAM\n"
+   	 "configure preload FILE: copies FILE into RAM ahead of \"configure FILE\"\n"
+   	 "configure cache (clear): lists the bit files in RAM and an estimate of\n"
+   	 "\tthe time they saved, or drops them\n"
    	 "readback: \tretrieves a golden readback copy from the FPGA\n"
-   	 "scrub -type: \tperforms scrubbing on the FPGA and outputs results.\n"
-   	 "\tTypes: -c (continuous), -b (blind), -h (hybrid)\n"
+   	 "readback stream (bram): sends a full readback as it is read\n"
+   	 "readback file (bram): reads back into " READBACK_FILE " and sends it\n"
+   	 "readback delta (EPOCH) (bram) (cached): reads back and sends only the frames\n"
+   	 "\tthat changed since EPOCH (0, the default, sends them all) and the\n"
+   	 "\tepoch to ask for next time. Cached only rereads the frames already\n"
+   	 "\tknown to have changed, by the scrubber or earlier reads.\n"
+   	 "@N [command]: runs the command on device N. Type \"devices\" for a list.\n"
+   	 "golden [info|capture|load|frame]: manages the golden image. Type \"golden help\".\n"
+   	 "op scrub blind: rewrites the whole configuration once\n"
+   	 "op scrub [readback|hybrid] (rate N) (order sequential|reverse|random)\n"
+   	 "\t(blind S) (bram): scrubs in the background, repairing frames that\n"
+   	 "\tdiffer from golden at up to N frames/s. Hybrid also blind scrubs\n"
+   	 "\tevery S seconds.\n"
+   	 "op scrub [stop|status]: stops the scrubber or shows its statistics\n"
+   	 "op campaign N (seed S) (bits B) (dwell US) (observe crc,status,bscanK)\n"
+   	 "\t(targets logic|all|FAR-FAR,...): runs N fault injections, repairing\n"
+   	 "\teach one, and sends back a binary record for each\n"
+   	 "op xadc start (MS)|stop|status: samples the XADC in the background\n"
+   	 "\tevery MS ms, so \"read xadc\" doesn't have to use JTAG\n"
+   	 "op xadc subscribe (window MS): streams every sample (or min/mean/max\n"
+   	 "\tover each MS ms) as binary records; \"op xadc unsubscribe\" stops\n"
+   	 "op codecbench (bram): reads the device and times each frame encoding\n"
+   	 "events subscribe (types upset,scrub,blind,inject,crc,xadc) (device N|all):\n"
+   	 "\tsends upsets, scrub passes, blind scrubs, fault injections, CRC\n"
+   	 "\tchanges and XADC threshold crossings as binary events as they happen\n"
+   	 "events unsubscribe|status: stops them, or shows every subscriber\n"
+   	 "events threshold temp|vccint|vccaux LOW HIGH|off: publishes an event\n"
+   	 "\twhen the XADC sampler finds the value leaving or entering the range\n"
+   	 "batch (stop) CMD; CMD; ...: runs the commands back to back and sends all\n"
+   	 "\ttheir responses as one binary reply. Stop stops at the first that\n"
+   	 "\tfails. Also takes \"set NAME VALUE\" ($NAME is then VALUE), \"repeat N;\n"
+   	 "\t...; end\" and \"for NAME 400-40f,1000; ...; end\".\n"
+   	 "macro define NAME BODY|run (stop) NAME (ARGS)|show NAME|delete NAME|list:\n"
+   	 "\tkeeps a batch under a name; $1, $2, ... are its arguments\n"
+   	 "job run (deadline S) COMMAND: runs configure (FILE), readback (bram),\n"
+   	 "\tread frame, golden capture or op scrub blind in the background and\n"
+   	 "\tanswers with its job number. It is stopped if it is still running\n"
+   	 "\tS seconds after it starts.\n"
+   	 "job status|cancel|result N: shows a job's progress, stops it, or sends\n"
+   	 "\twhat it read. \"jobs\" lists them.\n"
    	 "fault: \t\tbegin injecting faults\n"
    	 "read [reg]: \treads the specified register. Type \"read help\".\n"
    	 "write [reg]: \twrites the specified register. Type \"write help\".\n"
    	 "options [o]: \tchange various device options. Type \"options help\".\n"
+   	 "stats (reset|export FILE (S)|export off): shows latency statistics, or\n"
+   	 "\twrites them to FILE in the Prometheus format every S seconds\n"
    	 "echo 'message': repeats back message for testing\n"
    	 "exit: \t\tend this session\n"
    	 "? or help: \tshow this dialogue";
@@ -207,11 +584,14 @@ private:
    const char* helpReadString = "The read (r) command reads the value of a "
    	"register on the "
    	"fpga. Supported registers:\nfar\nctrl0\ncrc\ncrchw\ncrcsw\ncrclive\n"
-   	"status\ncor1\ncmd\nxadc ([reg]) displays a list of several "
+   	"status\ncor1\ncmd\nSeveral at once, e.g. \"read far,status,crc\", are read "
+   	"together and sent as packed u32s in that order.\nxadc ([reg]) displays a list of several "
    	"temperatures and voltages. A specific register value may be retrieved "
    	"by appending one of the following to this command:\n\tcurtemp\n\tvccint\n\t"
-   	"vccaux\n\tvoltage.\n"
-   	"frame [address] (-n [number of frames])\n"
+   	"vccaux\n\tvoltage\n\thistory (N): the last N samples as binary records.\n"
+   	"While the XADC sampler runs, these come from its latest sample.\n"
+   	"frame [address] (-n) ([number of frames])\n"
+   	"fradlist: every frame address, split into its fields, as binary records\n"
    	"bscan [bscan # (1-4)] [# words to read]";
 
    const char* helpWriteString = "The write (w) command writes the value of a "
@@ -220,9 +600,27 @@ private:
    	"(1-4)] [# of words to write] [value to write]\n"
       "glutmask [0/1] Sets or clears the glut mask";
 
+   const char* helpGoldenString = "The golden image is a known good copy of "
+   	"the configuration frames, kept in a file. Commands:\n"
+   	"golden info:\t\t\tdescribes the loaded golden image\n"
+   	"golden capture (file) (bram):\treads the device into a new golden image\n"
+   	"golden load (file):\t\tloads a golden image file\n"
+   	"golden frame [address]:\tsends the golden copy of a frame\n"
+   	"golden compare (bram):\treads the device and lists the bits that "
+   	"differ from golden\n"
+   	"golden mask [file|off]:\tignores the bits set in a mask image when comparing\n"
+   	"(file defaults to " GOLDEN_FILE ")";
+
    const char* helpOptionsString = "Supported options:\n"
    	"jtagtohighz [on/off]:\tenables or disables this\n"
-   	"activedevice [#]:\tsets the active device index\n"
+   	"activedevice [#]:\tsets the device this session's commands go to when\n"
+   	"\t\t\tthey don't start with @N\n"
+   	"verifyreads [on/off]:\treads frames twice and compares the reads\n"
+   	"diffkernel [simd/scalar]:\tframe compare implementation to use\n"
+   	"loglevel [debug/info/warn/error]:\tleast important messages logged\n"
+   	"encoding [raw/rle/xor/lz]:\thow \"read frame\" and \"readback stream\"\n"
+   	"\t\t\tsend frames; anything but raw sends a series of\n"
+   	"\t\t\tencoded blocks. xor needs the golden image.\n"
    	"view:\t\tdisplays current settings";
 
    //sending this string to the client indicates success, but the client does not
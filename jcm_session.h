@@ -0,0 +1,163 @@
+/*
+ * Per-connection state for the JCM server. Every client that connects gets
+ * its own Session, so several clients (e.g. a dashboard and an operator
+ * console) can be attached at once without overwriting each other's options
+ * or responses.
+ */
+
+#ifndef JCM_SESSION
+#define JCM_SESSION
+
+#include <pthread.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+
+#include "XilinxTopLibrary.h"
+
+//Which wire protocol a session speaks. Until the first bytes arrive we don't
+//know yet.
+#define PROTOCOL_UNKNOWN 0
+//Original protocol: each command is plain text, either one per recv() or
+//terminated by '\n', and each response starts with [u32 type][u32 length].
+#define PROTOCOL_TEXT 1
+//Framed protocol: the client first sends PROTOCOL_V2_MAGIC, then every
+//request is [u32 request id][u32 length][length bytes of command text] and
+//every response starts with [u32 type][u32 length][u32 request id]. Requests
+//may be pipelined; the client matches replies to requests by id.
+#define PROTOCOL_V2 2
+
+#define PROTOCOL_V2_MAGIC "JCM2"
+#define PROTOCOL_V2_MAGIC_LEN 4
+//size of the [u32 request id][u32 length] prefix on each v2 request
+#define PROTOCOL_V2_REQUEST_HEADER_LEN 8
+
+//An open file whose contents are sent straight from the page cache with
+//sendfile(). The file is closed once the response is gone.
+struct ResponseFile {
+   ResponseFile(int fd, off_t offset, size_t length) :
+      fd(fd), offset(offset), length(length), modified() {}
+   ~ResponseFile() { close(fd); }
+
+   int fd;
+   off_t offset;
+   size_t length;
+   //the file's mtime when it was queued, so "resend" can tell whether it
+   //has been rewritten since
+   struct timespec modified;
+};
+
+//A single reply to the client: the header (type, length, and the request id
+//it answers) and its own copy of the data, so the executor can move on to
+//the next command while earlier replies are still being sent.
+struct Response {
+   Response() : continuation(false), queuedNs(0) {}
+
+   //type, length, request id (only sent to PROTOCOL_V2 sessions)
+   u32 header[3];
+   std::vector<char> data;
+   //if set, the data is sent from this file instead of from data
+   std::shared_ptr<ResponseFile> file;
+   //if set, no header is sent: the data continues the response before it.
+   //Used to stream responses too large to build in memory.
+   bool continuation;
+   //when it was queued (monotonicNs()), to time how long sending takes
+   uint64_t queuedNs;
+};
+
+struct Session : public std::enable_shared_from_this<Session> {
+
+   Session(int fd, const char *addr) : fd(fd), jtagHZ(false), verifyReads(false),
+      device(0), encoding(0), protocol(PROTOCOL_UNKNOWN), sawNewline(false),
+      stalled(false), events(0),
+      closing(false), closed(false), outOffset(0), outBytes(0), streamOwner(-1) {
+      strncpy(clientAddr, addr, sizeof clientAddr);
+      clientAddr[sizeof clientAddr - 1] = '\0';
+      pthread_mutex_init(&lock, NULL);
+      pthread_cond_init(&drained, NULL);
+      pthread_cond_init(&streamDone, NULL);
+   }
+
+   ~Session() {
+      pthread_cond_destroy(&streamDone);
+      pthread_cond_destroy(&drained);
+      pthread_mutex_destroy(&lock);
+   }
+
+   //File descriptor of the client's socket
+   int fd;
+   //address of the client
+   char clientAddr[INET6_ADDRSTRLEN];
+
+   //Option variables. Each device has its own executor thread, so they may
+   //be touched by several at once.
+   //if jtagToHighZ is true
+   std::atomic<bool> jtagHZ;
+   //if frames are read twice and compared when reading frames
+   std::atomic<bool> verifyReads;
+   //the device commands not starting with "@N" go to. Only the reactor sets
+   //it, as it reads "options activedevice".
+   std::atomic<int> device;
+   //how frame reads are sent (ENCODING_* from jcm_codec.h)
+   std::atomic<int> encoding;
+
+   //Everything below (up to lock) is only touched by the reactor thread.
+   //PROTOCOL_UNKNOWN, PROTOCOL_TEXT or PROTOCOL_V2
+   int protocol;
+   //Bytes the client has sent that have not been queued as commands yet
+   std::string inBuf;
+   //if a PROTOCOL_TEXT client has ever terminated a command with '\n'.
+   //Until it does, every recv() is taken to be one whole command.
+   bool sawNewline;
+   //set while the command queue is full; we stop reading from the socket
+   //until the executor catches up
+   bool stalled;
+   //epoll events currently registered for this socket
+   u32 events;
+
+   //Everything below is shared by the reactor and the executor thread and
+   //must only be touched while holding lock.
+   pthread_mutex_t lock;
+   //set when the client sends "exit"; the reactor closes the connection
+   //once everything queued has been sent
+   bool closing;
+   //set by the reactor once the connection is gone
+   bool closed;
+   //Responses waiting to be written to the socket
+   std::deque<Response> outQueue;
+   //Bytes of the front response (header included) already written
+   size_t outOffset;
+   //Data bytes in outQueue not yet written, used to stop the executor from
+   //queueing without limit for a client that isn't reading
+   size_t outBytes;
+   //The last response queued, kept so "resend" can queue it again
+   Response lastResponse;
+   //signalled by the reactor whenever it writes to the socket
+   pthread_cond_t drained;
+   //Index of the device whose executor is streaming a response to this
+   //session, or -1. Continuation responses have no header, so while one
+   //device streams, every other device's responses to this session wait.
+   int streamOwner;
+   //signalled when streamOwner is cleared
+   pthread_cond_t streamDone;
+};
+
+//A command waiting for the executor thread, along with the session that
+//sent it and should receive its response.
+struct Command {
+   std::shared_ptr<Session> session;
+   std::string text;
+   //id the client gave the request (PROTOCOL_V2 only, otherwise 0)
+   u32 requestId;
+   //when the reactor received it (monotonicNs()), to time queueing
+   uint64_t receivedNs;
+};
+
+#endif
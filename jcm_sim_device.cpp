@@ -0,0 +1,358 @@
+/*
+ * Simulated fpga (see jcm_sim_device.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "jcm_sim_device.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+//The whole number keys, and the values each may take. The frame address
+//fields bound the geometry (5 bits of row, 10 of column, 7 of minor).
+static const struct {
+	const char *key;
+	u32 SimConfig::*field;
+	double min, max;
+} simKeys[] = {
+	{ "rows", &SimConfig::rows, 1, 32 },
+	{ "columns", &SimConfig::columns, 1, 1024 },
+	{ "minors", &SimConfig::minors, 1, 128 },
+	{ "bramcolumns", &SimConfig::bramColumns, 0, 1024 },
+	{ "bramminors", &SimConfig::bramMinors, 0, 128 },
+	{ "wordsperframe", &SimConfig::wordsPerFrame, 1, 4096 },
+	{ "idcode", &SimConfig::idCode, 0, 0xffffffffu },
+	{ "tck", &SimConfig::tckHz, 0, 0xffffffffu },
+	{ "overheadus", &SimConfig::overheadUs, 0, 0xffffffffu },
+	{ "seed", &SimConfig::seed, 0, 0xffffffffu },
+};
+#define NUM_SIM_KEYS (sizeof simKeys / sizeof simKeys[0])
+
+bool SimConfig::load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("sim config");
+		return false;
+	}
+
+	char line[256], key[64];
+	double value;
+	bool ok = true;
+	while (ok && fgets(line, sizeof line, f) != NULL) {
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+		if (sscanf(line, "%63s %lf", key, &value) != 2)
+			continue;
+
+		if (strcmp(key, "upsetrate") == 0) {
+			ok = value >= 0;
+			if (ok)
+				upsetRate = value;
+			else
+				fprintf(stderr, "sim config: upsetrate can't be negative\n");
+			continue;
+		}
+		size_t k = 0;
+		while (k < NUM_SIM_KEYS && strcmp(key, simKeys[k].key) != 0)
+			k++;
+		if (k == NUM_SIM_KEYS) {
+			fprintf(stderr, "sim config: unknown key '%s'\n", key);
+			continue;
+		}
+		ok = value >= simKeys[k].min && value <= simKeys[k].max &&
+			value == floor(value);
+		if (ok)
+			this->*simKeys[k].field = value;
+		else
+			fprintf(stderr, "sim config: %s must be a whole number from %.0f to "
+				"%.0f\n", key, simKeys[k].min, simKeys[k].max);
+	}
+	fclose(f);
+	return ok;
+}
+
+//7 series frame address: block type, top/bottom, row, column, minor
+static u32 frameAddress(u32 blockType, u32 row, u32 column, u32 minor) {
+	return (blockType << 23) | (row << 17) | (column << 7) | minor;
+}
+
+SimulatedDevice::SimulatedDevice(const SimConfig &config) : config(config),
+		far(0), ctrl0(0), crcSw(0), status(STATUS_CONFIGURED), cor1(0),
+		cmd(0), configuredCrc(0), liveCrc(0), activeDevice(0),
+		rng(config.seed * 2654435761ULL + 1), nextUpsetNs(0), numUpsets(0) {
+	for (u32 r = 0; r < config.rows; r++)
+		for (u32 c = 0; c < config.columns; c++)
+			for (u32 m = 0; m < config.minors; m++)
+				fradArray.push_back(frameAddress(0, r, c, m));
+	numLogicFrames = fradArray.size();
+	for (u32 r = 0; r < config.rows; r++)
+		for (u32 c = 0; c < config.bramColumns; c++)
+			for (u32 m = 0; m < config.bramMinors; m++)
+				fradArray.push_back(frameAddress(1, r, c, m));
+	numFrames = fradArray.size();
+
+	frames.resize((size_t) numFrames * config.wordsPerFrame);
+	design.resize(frames.size());
+	readBuf.resize(frames.size());
+	loadDesign(config.seed);
+
+	if (config.upsetRate > 0)
+		nextUpsetNs = monotonicNs();
+}
+
+u32 SimulatedDevice::random() {
+	//xorshift64*
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (rng * 2685821657736338717ULL) >> 32;
+}
+
+void SimulatedDevice::loadDesign(u32 seed) {
+	//mostly zeros with some set bits, like a real partly used design
+	uint64_t saved = rng;
+	rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+	for (size_t i = 0; i < design.size(); i++)
+		design[i] = random() & random() & random();
+	rng = saved;
+
+	frames = design;
+	configuredCrc = 0;
+	for (size_t i = 0; i < frames.size(); i++)
+		configuredCrc ^= (frames[i] << (i % 32)) | (frames[i] >> ((32 - i % 32) % 32));
+	liveCrc = configuredCrc;
+}
+
+void SimulatedDevice::flip(size_t word, u32 mask) {
+	frames[word] ^= mask;
+	//the checksum is the xor of every word rotated by its position, so it
+	//changes by the flipped bits rotated the same way
+	liveCrc ^= (mask << (word % 32)) | (mask >> ((32 - word % 32) % 32));
+}
+
+void SimulatedDevice::shift(uint64_t numBits) {
+	upset();
+	if (config.tckHz == 0)
+		return;
+	uint64_t ns = config.overheadUs * 1000ULL + numBits * 1000000000ULL / config.tckHz;
+	struct timespec t;
+	t.tv_sec = ns / 1000000000ULL;
+	t.tv_nsec = ns % 1000000000ULL;
+	nanosleep(&t, NULL);
+}
+
+void SimulatedDevice::upset() {
+	if (nextUpsetNs == 0)
+		return;
+	uint64_t now = monotonicNs();
+	while (nextUpsetNs <= now) {
+		size_t word = random() % frames.size();
+		flip(word, 1u << (random() % 32));
+		numUpsets++;
+		//upsets arrive as a Poisson process: exponential gaps between them
+		double u = (random() + 1.0) / 4294967297.0;
+		nextUpsetNs += (uint64_t) (-log(u) / config.upsetRate * 1e9) + 1;
+	}
+}
+
+int SimulatedDevice::frameIndex(u32 frameAddress) {
+	//logic and BRAM frames are each in ascending order
+	vector<u32>::iterator begin = fradArray.begin(), end = fradArray.end();
+	vector<u32>::iterator mid = begin + numLogicFrames;
+	vector<u32>::iterator it = lower_bound(begin, mid, frameAddress);
+	if (it != mid && *it == frameAddress)
+		return it - begin;
+	it = lower_bound(mid, end, frameAddress);
+	if (it != end && *it == frameAddress)
+		return it - begin;
+	return -1;
+}
+
+u32 SimulatedDevice::readRegister(u32 value) {
+	shift(COMMAND_BITS);
+	return value;
+}
+
+u32 SimulatedDevice::writeRegister(u32 value) {
+	shift(COMMAND_BITS);
+	return value;
+}
+
+u32 SimulatedDevice::readStatus(bool /*jtagHZ*/) {
+	u32 crcError = liveCrc != configuredCrc ? STATUS_CRC_ERROR : 0;
+	return readRegister(status | crcError);
+}
+
+void SimulatedDevice::readRegisters(const int *regs, int n, u32 *values,
+		bool /*jtagHZ*/) {
+	//XilinxTopLibrary has no batched register read, so on a real device
+	//every register is a command of its own, overhead and all
+	for (int i = 0; i < n; i++)
+		shift(COMMAND_BITS);
+	for (int i = 0; i < n; i++) {
+		switch (regs[i]) {
+		case JCM_REG_FAR: values[i] = far; break;
+		case JCM_REG_IDCODE: values[i] = config.idCode; break;
+		case JCM_REG_CTRL0: values[i] = ctrl0; break;
+		case JCM_REG_CRC: values[i] = liveCrc; break;
+		case JCM_REG_CRCHW: values[i] = configuredCrc; break;
+		case JCM_REG_CRCSW: values[i] = crcSw; break;
+		case JCM_REG_CRCLIVE: values[i] = liveCrc; break;
+		case JCM_REG_STATUS:
+			values[i] = status | (liveCrc != configuredCrc ? STATUS_CRC_ERROR : 0);
+			break;
+		case JCM_REG_COR1: values[i] = cor1; break;
+		case JCM_REG_CMD: values[i] = cmd; break;
+		default: values[i] = 0;
+		}
+	}
+}
+
+u32 * SimulatedDevice::readFrames(u32 frameAddress, int n, bool /*jtagHZ*/) {
+	int index = frameIndex(frameAddress);
+	if (index < 0 || n < 0 || index + n > numFrames)
+		return NULL;
+
+	//a pad frame is shifted out ahead of the data
+	shift(COMMAND_BITS + (uint64_t) (n + 1) * config.wordsPerFrame * 32);
+	size_t first = (size_t) index * config.wordsPerFrame;
+	size_t len = (size_t) n * config.wordsPerFrame;
+	memcpy(&readBuf[0], &frames[first], len * sizeof(u32));
+	far = index + n < numFrames ? fradArray[index + n] : fradArray[index + n - 1];
+	return &readBuf[0];
+}
+
+u32 * SimulatedDevice::readFullDevice(const char *path, bool readBram,
+		bool /*clearGlutMask*/, bool /*issueCapture*/, bool jtagHZ) {
+	int n = readBram ? numFrames : numLogicFrames;
+	u32 *data = readFrames(fradArray[0], n, jtagHZ);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		perror("sim readback");
+		return data;
+	}
+	fwrite(data, sizeof(u32), (size_t) n * config.wordsPerFrame, f);
+	fclose(f);
+	return data;
+}
+
+bool SimulatedDevice::configure(string bitFile) {
+	//the same bit file always gives the same design
+	u32 seed = config.seed;
+	for (size_t i = 0; i < bitFile.size(); i++)
+		seed = seed * 31 + bitFile[i];
+	shift(COMMAND_BITS + (uint64_t) frames.size() * 32);
+	loadDesign(seed);
+	design = frames;
+	status = STATUS_CONFIGURED;
+	return true;
+}
+
+void SimulatedDevice::blindScrub(bool /*a*/, bool /*b*/, bool /*jtagHZ*/) {
+	//rewrites every frame from the design
+	shift(COMMAND_BITS + (uint64_t) frames.size() * 32);
+	for (size_t i = 0; i < frames.size(); i++)
+		if (frames[i] != design[i])
+			flip(i, frames[i] ^ design[i]);
+}
+
+bool SimulatedDevice::injectFault(u32 frameAddress, int word, int bit,
+		int numBits, bool /*a*/, bool /*b*/, bool /*jtagHZ*/) {
+	int index = frameIndex(frameAddress);
+	if (index < 0 || word < 0 || word >= (int) config.wordsPerFrame ||
+			bit < 0 || bit > 31 || numBits < 1 || bit + numBits > 32)
+		return false;
+
+	//read the frame, flip the bits and write it back
+	shift(2 * (COMMAND_BITS + 2ULL * config.wordsPerFrame * 32));
+	u32 mask = numBits == 32 ? 0xffffffff : ((1u << numBits) - 1) << bit;
+	flip((size_t) index * config.wordsPerFrame + word, mask);
+	return true;
+}
+
+bool SimulatedDevice::injectRandomFault(int numBits, bool a, bool repairFault,
+		bool b, bool jtagHZ) {
+	if (numBits < 1 || numBits > 32)
+		return false;
+	u32 frameAddress = fradArray[random() % numLogicFrames];
+	int word = random() % config.wordsPerFrame;
+	int bit = random() % (33 - numBits);
+	if (!injectFault(frameAddress, word, bit, numBits, a, b, jtagHZ))
+		return false;
+	if (repairFault)
+		injectFault(frameAddress, word, bit, numBits, a, b, jtagHZ);
+	return true;
+}
+
+void SimulatedDevice::injectMultiFrameFault(u32 frameAddress, u32 commandReg,
+		bool /*jtagHZ*/) {
+	//writes the frame's contents (with its first bit flipped) to the
+	//frames after it too
+	int index = frameIndex(frameAddress);
+	if (index < 0)
+		return;
+	int n = min(numFrames - index, 8);
+	shift(COMMAND_BITS + (uint64_t) (n + 1) * config.wordsPerFrame * 32);
+	size_t wpf = config.wordsPerFrame;
+	for (int k = 0; k < n; k++)
+		for (size_t w = 0; w < wpf; w++) {
+			size_t i = (index + k) * wpf + w;
+			u32 value = frames[index * wpf + w] ^ (w == 0 ? 1 : 0);
+			if (frames[i] != value)
+				flip(i, frames[i] ^ value);
+		}
+	cmd = commandReg;
+}
+
+void SimulatedDevice::issueProg(u32 /*wbStarAddr*/, bool /*jtagHZ*/) {
+	//PROGRAM_B clears the configuration; it comes back on "configure"
+	shift(COMMAND_BITS);
+	for (size_t i = 0; i < frames.size(); i++)
+		if (frames[i] != 0)
+			flip(i, frames[i]);
+	status = STATUS_CONFIGURED & ~0x4000;
+}
+
+u32 * SimulatedDevice::readBscan(int number, int numBits, bool /*jtagHZ*/) {
+	//The user design's output: a fold of the first frames of the device,
+	//so upsets there show up on the scan chain
+	int numWords = (numBits + 31) / 32;
+	if (number < 1 || number > 4 || numWords < 1 || numWords > (int) readBuf.size())
+		return NULL;
+	shift(COMMAND_BITS + numBits);
+	size_t span = min(frames.size(), (size_t) 16 * config.wordsPerFrame);
+	for (int w = 0; w < numWords; w++) {
+		u32 v = number;
+		for (size_t i = w; i < span; i += numWords)
+			v = v * 31 + frames[i];
+		readBuf[w] = v;
+	}
+	return &readBuf[0];
+}
+
+float SimulatedDevice::readXadcTemp(u32 readCommand) {
+	shift(COMMAND_BITS);
+	float noise = (random() % 100) / 100.0f;
+	return readCommand == JCM_XILINX_READ_MAX_TEMP ? 52.0f : 45.0f + noise;
+}
+
+float SimulatedDevice::readXadcVoltage(u32 readCommand) {
+	shift(COMMAND_BITS);
+	float noise = (random() % 100) / 10.0f;
+	switch (readCommand) {
+	case JCM_XILINX_READ_VCCINT:
+		return 995.0f + noise;
+	case JCM_XILINX_READ_MAX_VCCINT:
+		return 1012.0f;
+	case JCM_XILINX_READ_VCCAUX:
+		return 1795.0f + noise;
+	default:
+		return 1810.0f;
+	}
+}
@@ -0,0 +1,157 @@
+/*
+ * A simulated fpga, for profiling and load testing the server on a plain
+ * Linux box. The configuration memory is kept in memory, sized from a small
+ * config file, and filled with a pseudo-random "design". Every operation
+ * sleeps for as long as the JTAG shifts it would take on a real board (a
+ * fixed per-operation overhead plus the bits shifted at the TCK rate), and
+ * single event upsets flip random bits at a configurable rate.
+ *
+ * Config file: one "key value" pair per line, '#' starts a comment. Keys
+ * (defaults are roughly a ZedBoard's XC7Z020):
+ *    rows, columns, minors        logic frames (rows * columns * minors)
+ *    bramcolumns, bramminors      BRAM frames (rows * bramcolumns * bramminors)
+ *    wordsperframe, idcode
+ *    tck                          JTAG clock in Hz (0 for no delays at all)
+ *    overheadus                   fixed cost of every JTAG operation
+ *    upsetrate                    upsets per second (0 for none)
+ *    seed                         seeds the design and the upsets
+ * A value a real device couldn't have (no rows, a frame address field
+ * overflowing, a negative rate) is refused and the server doesn't start.
+ */
+
+#ifndef JCM_SIM_DEVICE
+#define JCM_SIM_DEVICE
+
+#include <stdint.h>
+#include <vector>
+
+#include "jcm_device.h"
+
+struct SimConfig {
+   SimConfig() : rows(3), columns(75), minors(36), bramColumns(5),
+      bramMinors(128), wordsPerFrame(101), idCode(0x03727093),
+      tckHz(30000000), overheadUs(100), upsetRate(0), seed(1) {}
+
+   //Reads the settings in a config file over the defaults. Returns false if
+   //it can't be read or a value is out of range.
+   bool load(const char *path);
+
+   u32 rows;
+   u32 columns;
+   u32 minors;
+   u32 bramColumns;
+   u32 bramMinors;
+   u32 wordsPerFrame;
+   u32 idCode;
+   u32 tckHz;
+   u32 overheadUs;
+   double upsetRate;
+   u32 seed;
+};
+
+class SimulatedDevice : public JcmDevice {
+
+public:
+
+   SimulatedDevice(const SimConfig &config);
+
+   int getWordsPerFrame() { return config.wordsPerFrame; }
+   int getNumLogicFrames() { return numLogicFrames; }
+   int getNumBramFrames() { return numFrames - numLogicFrames; }
+   int getTotalFrames() { return numFrames; }
+   u32 * getFrameAddressArray() { return &fradArray[0]; }
+   void setActiveDeviceIndex(int index) { activeDevice = index; }
+
+   u32 * readFrames(u32 frameAddress, int numFrames, bool jtagHZ);
+   u32 * readFullDevice(const char *path, bool readBram, bool clearGlutMask,
+      bool issueCapture, bool jtagHZ);
+   bool configure(std::string bitFile);
+   void blindScrub(bool a, bool b, bool jtagHZ);
+
+   bool injectFault(u32 frameAddress, int word, int bit, int numBits, bool a,
+      bool b, bool jtagHZ);
+   bool injectRandomFault(int numBits, bool a, bool repairFault, bool b,
+      bool jtagHZ);
+   void injectMultiFrameFault(u32 frameAddress, u32 commandReg, bool jtagHZ);
+
+   u32 readFar(bool /*jtagHZ*/) { return readRegister(far); }
+   u32 readIdCode(bool /*jtagHZ*/) { return readRegister(config.idCode); }
+   u32 readCtrl0() { return readRegister(ctrl0); }
+   u32 readCrc(bool /*jtagHZ*/) { return readRegister(liveCrc); }
+   u32 readCrcHw(bool /*jtagHZ*/) { return readRegister(configuredCrc); }
+   u32 readCrcSw(bool /*jtagHZ*/) { return readRegister(crcSw); }
+   u32 readCrcLive() { return readRegister(liveCrc); }
+   u32 readStatus(bool jtagHZ);
+   u32 readCor1(bool /*jtagHZ*/) { return readRegister(cor1); }
+   u32 readCmd(bool /*jtagHZ*/) { return readRegister(cmd); }
+   void writeFar(u32 value, bool /*jtagHZ*/) { far = writeRegister(value); }
+   void writeCor1(u32 value, bool /*jtagHZ*/) { cor1 = writeRegister(value); }
+   void writeCrcSw(u32 value, bool /*jtagHZ*/) { crcSw = writeRegister(value); }
+   void setGlutMaskBit(bool /*jtagHZ*/) {
+      ctrl0 = writeRegister(ctrl0 | CTRL0_GLUTMASK);
+   }
+   void clearGlutMaskBit(bool /*jtagHZ*/) {
+      ctrl0 = writeRegister(ctrl0 & ~CTRL0_GLUTMASK);
+   }
+   void issueCapture(bool /*jtagHZ*/) { writeRegister(0); }
+   void issueProg(u32 wbStarAddr, bool jtagHZ);
+   //costs what reading them one at a time does, but the values are all
+   //taken at the same moment
+   void readRegisters(const int *regs, int n, u32 *values, bool jtagHZ);
+
+   u32 * readBscan(int number, int numBits, bool jtagHZ);
+   float readXadcTemp(u32 readCommand);
+   float readXadcVoltage(u32 readCommand);
+   float readXadcCurTemp() { return readXadcTemp(JCM_XILINX_READ_TEMP); }
+   float readXadcVccInt() { return readXadcVoltage(JCM_XILINX_READ_VCCINT); }
+   float readXadcVccAux() { return readXadcVoltage(JCM_XILINX_READ_VCCAUX); }
+
+   //Number of upsets the simulation has caused so far
+   uint64_t upsets() { return numUpsets; }
+
+private:
+
+   //CTRL0 bit that masks LUT RAM/SRL frames on readback
+   static const u32 CTRL0_GLUTMASK = 0x100;
+   //STATUS with DONE (bit 14) set, as after a successful configuration
+   static const u32 STATUS_CONFIGURED = 0x401079fc;
+   //STATUS bit set when the configuration no longer matches its CRC
+   static const u32 STATUS_CRC_ERROR = 0x1;
+   //bits shifted to send a command packet or read back a register
+   static const u32 COMMAND_BITS = 512;
+
+   //Sleeps as long as shifting numBits would take
+   void shift(uint64_t numBits);
+   //Causes every upset that should have happened by now
+   void upset();
+   //The pseudo-random design the device is configured with
+   void loadDesign(u32 seed);
+   //index in fradArray of a frame address, or -1 if there is no such frame
+   int frameIndex(u32 frameAddress);
+   u32 readRegister(u32 value);
+   u32 writeRegister(u32 value);
+   //Flips the bits set in mask in one word of the configuration memory
+   void flip(size_t word, u32 mask);
+   u32 random();
+
+   SimConfig config;
+   int numLogicFrames;
+   int numFrames;
+   std::vector<u32> fradArray;
+   std::vector<u32> frames;
+   std::vector<u32> design;
+   std::vector<u32> readBuf;
+   u32 far, ctrl0, crcSw, status, cor1, cmd;
+   //A checksum of the configuration memory as configured and as it is now.
+   //It is kept up to date as bits flip, so reading it is cheap.
+   u32 configuredCrc;
+   u32 liveCrc;
+   int activeDevice;
+
+   uint64_t rng;
+   //when the next upset is due (monotonic ns), 0 if upsets are off
+   uint64_t nextUpsetNs;
+   uint64_t numUpsets;
+};
+
+#endif
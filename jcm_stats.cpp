@@ -0,0 +1,216 @@
+/*
+ * Latency statistics (see jcm_stats.h).
+ */
+#include <stdio.h>
+
+#include "jcm_stats.h"
+
+using namespace std;
+
+Stats jcmStats;
+
+Histogram::Histogram() {
+	reset();
+}
+
+int Histogram::bucketOf(uint64_t ns) {
+	if (ns < STATS_SUB_BUCKETS)
+		return ns;
+	int e = 63 - __builtin_clzll(ns);
+	if (e > STATS_MAX_EXPONENT)
+		return STATS_NUM_BUCKETS - 1;
+	int sub = (ns >> (e - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1);
+	return (e - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::bucketTop(int bucket) {
+	if (bucket < STATS_SUB_BUCKETS)
+		return bucket;
+	int e = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+	uint64_t sub = bucket % STATS_SUB_BUCKETS;
+	int shift = e - STATS_SUB_BUCKET_BITS;
+	return ((STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t ns) {
+	buckets[bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+	total.fetch_add(1, memory_order_relaxed);
+	sumNs.fetch_add(ns, memory_order_relaxed);
+	uint64_t m = maxNs.load(memory_order_relaxed);
+	while (ns > m && !maxNs.compare_exchange_weak(m, ns, memory_order_relaxed));
+}
+
+void Histogram::reset() {
+	for (int i = 0; i < STATS_NUM_BUCKETS; i++)
+		buckets[i].store(0, memory_order_relaxed);
+	total.store(0, memory_order_relaxed);
+	sumNs.store(0, memory_order_relaxed);
+	maxNs.store(0, memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double q) const {
+	uint64_t n = count();
+	if (n == 0)
+		return 0;
+	uint64_t rank = (uint64_t) (q * n + 0.5), seen = 0;
+	if (rank < 1)
+		rank = 1;
+	for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+		seen += buckets[i].load(memory_order_relaxed);
+		if (seen >= rank) {
+			uint64_t top = bucketTop(i);
+			return top < max() ? top : max();
+		}
+	}
+	return max();
+}
+
+static void * exportThreadStaticStub(void *s) {
+	return ((Stats*) s)->exportThread();
+}
+
+Stats::Stats() : numEntries(0), exportInterval(STATS_EXPORT_INTERVAL),
+		exporting(false) {
+	pthread_mutex_init(&addLock, NULL);
+	pthread_mutex_init(&exportLock, NULL);
+	pthread_cond_init(&exportWake, NULL);
+	exportPath[0] = '\0';
+	//where everything goes once the table is full
+	strcpy(entries[0].name, "other");
+	entries[0].len = 5;
+	numEntries.store(1);
+}
+
+Stats::~Stats() {
+	stopExport();
+	pthread_cond_destroy(&exportWake);
+	pthread_mutex_destroy(&exportLock);
+	pthread_mutex_destroy(&addLock);
+}
+
+Histogram * Stats::histogram(const char *name, size_t len) {
+	if (len >= STATS_MAX_NAME)
+		len = STATS_MAX_NAME - 1;
+
+	int n = numEntries.load(memory_order_acquire);
+	for (int i = 0; i < n; i++)
+		if (entries[i].len == len && memcmp(entries[i].name, name, len) == 0)
+			return &entries[i].h;
+
+	pthread_mutex_lock(&addLock);
+	//someone may have added it while we waited for the lock
+	n = numEntries.load(memory_order_relaxed);
+	for (int i = 0; i < n; i++)
+		if (entries[i].len == len && memcmp(entries[i].name, name, len) == 0) {
+			pthread_mutex_unlock(&addLock);
+			return &entries[i].h;
+		}
+	Histogram *h = &entries[0].h;
+	if (n < STATS_MAX_HISTOGRAMS) {
+		memcpy(entries[n].name, name, len);
+		entries[n].name[len] = '\0';
+		entries[n].len = len;
+		h = &entries[n].h;
+		numEntries.store(n + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&addLock);
+	return h;
+}
+
+void Stats::reset() {
+	int n = numEntries.load(memory_order_acquire);
+	for (int i = 0; i < n; i++)
+		entries[i].h.reset();
+}
+
+string Stats::report() {
+	string s;
+	char line[160];
+	snprintf(line, sizeof line, "%-28s %10s %10s %10s %10s %10s %10s\n", "(us)",
+		"count", "mean", "p50", "p90", "p99", "max");
+	s += line;
+
+	int n = numEntries.load(memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		const Histogram &h = entries[i].h;
+		uint64_t count = h.count();
+		if (count == 0)
+			continue;
+		snprintf(line, sizeof line,
+			"%-28s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", entries[i].name,
+			(unsigned long long) count, h.sum() / 1000.0 / count,
+			h.percentile(0.5) / 1000.0, h.percentile(0.9) / 1000.0,
+			h.percentile(0.99) / 1000.0, h.max() / 1000.0);
+		s += line;
+	}
+	return s;
+}
+
+bool Stats::writePrometheus(const char *path) {
+	//written to a temporary file and renamed, so a scraper never sees half
+	//a file
+	char tmpPath[sizeof exportPath + 8];
+	snprintf(tmpPath, sizeof tmpPath, "%s.tmp", path);
+	FILE *f = fopen(tmpPath, "w");
+	if (f == NULL)
+		return false;
+
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	fprintf(f, "# HELP jcm_latency_seconds Time taken by commands, command "
+		"stages and fpga library calls.\n# TYPE jcm_latency_seconds summary\n");
+	int n = numEntries.load(memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		const Histogram &h = entries[i].h;
+		for (size_t q = 0; q < sizeof quantiles / sizeof quantiles[0]; q++)
+			fprintf(f, "jcm_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+				entries[i].name, quantiles[q], h.percentile(quantiles[q]) / 1e9);
+		fprintf(f, "jcm_latency_seconds_sum{op=\"%s\"} %.9f\n", entries[i].name,
+			h.sum() / 1e9);
+		fprintf(f, "jcm_latency_seconds_count{op=\"%s\"} %llu\n", entries[i].name,
+			(unsigned long long) h.count());
+	}
+
+	bool ok = fclose(f) == 0;
+	return ok && rename(tmpPath, path) == 0;
+}
+
+void Stats::startExport(const char *path, int interval) {
+	stopExport();
+	pthread_mutex_lock(&exportLock);
+	strncpy(exportPath, path, sizeof exportPath);
+	exportPath[sizeof exportPath - 1] = '\0';
+	exportInterval = interval > 0 ? interval : STATS_EXPORT_INTERVAL;
+	exporting = true;
+	pthread_create(&exportTh, NULL, &exportThreadStaticStub, this);
+	pthread_mutex_unlock(&exportLock);
+}
+
+void Stats::stopExport() {
+	pthread_mutex_lock(&exportLock);
+	if (!exporting) {
+		pthread_mutex_unlock(&exportLock);
+		return;
+	}
+	exporting = false;
+	pthread_cond_broadcast(&exportWake);
+	pthread_mutex_unlock(&exportLock);
+	pthread_join(exportTh, NULL);
+}
+
+void * Stats::exportThread() {
+	pthread_mutex_lock(&exportLock);
+	while (exporting) {
+		pthread_mutex_unlock(&exportLock);
+		if (!writePrometheus(exportPath))
+			perror("stats export");
+		pthread_mutex_lock(&exportLock);
+
+		struct timespec next;
+		clock_gettime(CLOCK_REALTIME, &next);
+		next.tv_sec += exportInterval;
+		while (exporting &&
+			pthread_cond_timedwait(&exportWake, &exportLock, &next) == 0);
+	}
+	pthread_mutex_unlock(&exportLock);
+	return NULL;
+}
@@ -0,0 +1,150 @@
+/*
+ * Latency statistics. Each thing we time (a command verb, a stage of
+ * handling a command, a call into the fpga library) gets a Histogram with
+ * logarithmic buckets, in the style of HdrHistogram: values are kept to
+ * within about 6% at any scale, from nanoseconds to minutes, in a fixed
+ * amount of memory. Recording is a couple of atomic adds, so any thread can
+ * record without a lock.
+ */
+
+#ifndef JCM_STATS
+#define JCM_STATS
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+
+//each power of 2 is split into 2^STATS_SUB_BUCKET_BITS buckets
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+//values (in ns) up to 2^STATS_MAX_EXPONENT (about 18 minutes) are kept apart
+#define STATS_MAX_EXPONENT 40
+#define STATS_NUM_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BUCKET_BITS + 2) * \
+   STATS_SUB_BUCKETS)
+//max number of histograms; anything past this is counted under "other"
+#define STATS_MAX_HISTOGRAMS 96
+#define STATS_MAX_NAME 48
+//seconds between writes of the Prometheus file
+#define STATS_EXPORT_INTERVAL 10
+
+class Histogram {
+
+public:
+
+   Histogram();
+
+   //Adds one value, in nanoseconds
+   void record(uint64_t ns);
+   void reset();
+
+   uint64_t count() const { return total.load(std::memory_order_relaxed); }
+   uint64_t sum() const { return sumNs.load(std::memory_order_relaxed); }
+   uint64_t max() const { return maxNs.load(std::memory_order_relaxed); }
+   //Value (ns) that fraction q of the recorded values are at or below
+   uint64_t percentile(double q) const;
+
+private:
+
+   static int bucketOf(uint64_t ns);
+   //largest value that falls in a bucket
+   static uint64_t bucketTop(int bucket);
+
+   std::atomic<uint64_t> buckets[STATS_NUM_BUCKETS];
+   std::atomic<uint64_t> total;
+   std::atomic<uint64_t> sumNs;
+   std::atomic<uint64_t> maxNs;
+};
+
+class Stats {
+
+public:
+
+   Stats();
+   ~Stats();
+
+   //The histogram with the given name, added if there isn't one yet.
+   //Lookups don't take a lock; only adding one does.
+   Histogram * histogram(const char *name, size_t len);
+   Histogram * histogram(const char *name) {
+      return histogram(name, strlen(name));
+   }
+
+   //Clears every histogram
+   void reset();
+   //A table of every histogram (count, mean and percentiles in us)
+   std::string report();
+   //Writes every histogram to path in the Prometheus text format
+   bool writePrometheus(const char *path);
+
+   //Starts a thread that writes the Prometheus file every interval seconds
+   void startExport(const char *path, int interval);
+   void stopExport();
+
+   //This needs to be public so the static stub function can access it.
+   void * exportThread();
+
+private:
+
+   struct Entry {
+      char name[STATS_MAX_NAME];
+      size_t len;
+      Histogram h;
+   };
+
+   Entry entries[STATS_MAX_HISTOGRAMS];
+   //entries in use; an entry is complete before this counts it
+   std::atomic<int> numEntries;
+   pthread_mutex_t addLock;
+
+   char exportPath[256];
+   int exportInterval;
+   bool exporting;
+   pthread_t exportTh;
+   pthread_mutex_t exportLock;
+   pthread_cond_t exportWake;
+};
+
+//The server's statistics, usable from every thread
+extern Stats jcmStats;
+
+//Nanoseconds on the monotonic clock
+inline uint64_t monotonicNs() {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+//Records the time from construction to destruction
+class ScopedTimer {
+
+public:
+
+   ScopedTimer(Histogram *h) : h(h), start(monotonicNs()) {}
+   ~ScopedTimer() { h->record(monotonicNs() - start); }
+
+private:
+
+   Histogram *h;
+   uint64_t start;
+};
+
+//Calls f, recording how long it took, and returns what it returned
+template <typename F>
+auto timeCall(Histogram *h, F f) -> decltype(f()) {
+   ScopedTimer t(h);
+   return f();
+}
+
+//The histogram for a fixed name, looked up only the first time through
+#define STAT_HISTOGRAM(name) ([]() -> Histogram * { \
+   static Histogram *h = jcmStats.histogram(name); return h; }())
+
+//Evaluates an expression (e.g. a call into the fpga library), recording how
+//long it took under name: TIMED("jtag.readFar", xTopLib->readFar(hz))
+#define TIMED(name, ...) timeCall(STAT_HISTOGRAM(name), [&]() { \
+   return __VA_ARGS__; })
+
+#endif
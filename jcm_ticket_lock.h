@@ -0,0 +1,63 @@
+/*
+ * A fair (first come, first served) lock. Threads get the lock in the order
+ * they asked for it, so a thread that releases and immediately re-takes the
+ * lock in a loop (like the scrubber, between chunks) can't starve the others
+ * the way it can with a plain mutex.
+ */
+
+#ifndef JCM_TICKET_LOCK
+#define JCM_TICKET_LOCK
+
+#include <pthread.h>
+
+class TicketLock {
+
+public:
+
+   TicketLock() : nextTicket(0), nowServing(0) {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&turn, NULL);
+   }
+
+   ~TicketLock() {
+      pthread_cond_destroy(&turn);
+      pthread_mutex_destroy(&mutex);
+   }
+
+   void lock() {
+      pthread_mutex_lock(&mutex);
+      unsigned long ticket = nextTicket++;
+      while (ticket != nowServing)
+         pthread_cond_wait(&turn, &mutex);
+      pthread_mutex_unlock(&mutex);
+   }
+
+   void unlock() {
+      pthread_mutex_lock(&mutex);
+      nowServing++;
+      pthread_cond_broadcast(&turn);
+      pthread_mutex_unlock(&mutex);
+   }
+
+private:
+
+   unsigned long nextTicket;
+   unsigned long nowServing;
+   pthread_mutex_t mutex;
+   pthread_cond_t turn;
+};
+
+//Holds a TicketLock for as long as it is in scope
+class TicketLockGuard {
+
+public:
+
+   TicketLockGuard(TicketLock &l) : l(l) { l.lock(); }
+   ~TicketLockGuard() { l.unlock(); }
+
+private:
+
+   TicketLock &l;
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Background XADC sampler (see jcm_xadc.h).
+ */
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#include "jcm_xadc.h"
+#include "jcm_stats.h"
+
+using namespace std;
+
+static void * samplerThreadStaticStub(void *s) {
+	return ((XadcSampler*) s)->samplerThread();
+}
+
+void XadcWindow::reset() {
+	memset(&sum, 0, sizeof sum);
+	tempTotal = vccIntTotal = vccAuxTotal = 0;
+}
+
+void XadcWindow::add(const XadcSample &s) {
+	if (sum.numSamples == 0) {
+		sum.startUs = s.timeUs;
+		sum.tempMin = sum.tempMax = s.temp;
+		sum.vccIntMin = sum.vccIntMax = s.vccInt;
+		sum.vccAuxMin = sum.vccAuxMax = s.vccAux;
+	}
+	sum.numSamples++;
+	sum.tempMin = min(sum.tempMin, s.temp);
+	sum.tempMax = max(sum.tempMax, s.temp);
+	sum.vccIntMin = min(sum.vccIntMin, s.vccInt);
+	sum.vccIntMax = max(sum.vccIntMax, s.vccInt);
+	sum.vccAuxMin = min(sum.vccAuxMin, s.vccAux);
+	sum.vccAuxMax = max(sum.vccAuxMax, s.vccAux);
+	tempTotal += s.temp;
+	vccIntTotal += s.vccInt;
+	vccAuxTotal += s.vccAux;
+}
+
+XadcSummary XadcWindow::summary() const {
+	XadcSummary s = sum;
+	if (s.numSamples > 0) {
+		s.tempMean = tempTotal / s.numSamples;
+		s.vccIntMean = vccIntTotal / s.numSamples;
+		s.vccAuxMean = vccAuxTotal / s.numSamples;
+	}
+	return s;
+}
+
+XadcSampler::XadcSampler(JcmDevice *device, TicketLock *deviceLock,
+		function<void(const XadcSample &)> onSample) : device(device),
+		deviceLock(deviceLock), onSample(onSample), isRunning(false),
+		stopping(false), intervalMs(0), numSamples(0) {
+	pthread_mutex_init(&lock, NULL);
+	//sleeps are timed on the monotonic clock, like the scrubber's
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+XadcSampler::~XadcSampler() {
+	stop();
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+bool XadcSampler::start(u32 interval) {
+	pthread_mutex_lock(&lock);
+	if (isRunning) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	intervalMs = interval;
+	isRunning = true;
+	stopping = false;
+	pthread_create(&samplerTh, NULL, &samplerThreadStaticStub, this);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+void XadcSampler::stop() {
+	pthread_mutex_lock(&lock);
+	if (!isRunning) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(samplerTh, NULL);
+
+	pthread_mutex_lock(&lock);
+	isRunning = false;
+	pthread_mutex_unlock(&lock);
+}
+
+bool XadcSampler::running() {
+	pthread_mutex_lock(&lock);
+	bool r = isRunning;
+	pthread_mutex_unlock(&lock);
+	return r;
+}
+
+u32 XadcSampler::interval() {
+	pthread_mutex_lock(&lock);
+	u32 i = intervalMs;
+	pthread_mutex_unlock(&lock);
+	return i;
+}
+
+bool XadcSampler::latest(XadcSample &sample) {
+	pthread_mutex_lock(&lock);
+	bool have = numSamples > 0;
+	if (have)
+		sample = samples[(numSamples - 1) % XADC_HISTORY];
+	pthread_mutex_unlock(&lock);
+	return have;
+}
+
+void XadcSampler::history(int n, vector<XadcSample> &out) {
+	pthread_mutex_lock(&lock);
+	uint64_t count = min((uint64_t) n, min(numSamples, (uint64_t) XADC_HISTORY));
+	out.resize(count);
+	for (uint64_t i = 0; i < count; i++)
+		out[i] = samples[(numSamples - count + i) % XADC_HISTORY];
+	pthread_mutex_unlock(&lock);
+}
+
+void XadcSampler::readDevice(JcmDevice *device, XadcSample &s) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	s.timeUs = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	s.temp = TIMED("jtag.readXadcTemp",
+		device->readXadcTemp(JCM_XILINX_READ_TEMP));
+	s.maxTemp = TIMED("jtag.readXadcTemp",
+		device->readXadcTemp(JCM_XILINX_READ_MAX_TEMP));
+	s.vccInt = TIMED("jtag.readXadcVoltage",
+		device->readXadcVoltage(JCM_XILINX_READ_VCCINT));
+	s.maxVccInt = TIMED("jtag.readXadcVoltage",
+		device->readXadcVoltage(JCM_XILINX_READ_MAX_VCCINT));
+	s.vccAux = TIMED("jtag.readXadcVoltage",
+		device->readXadcVoltage(JCM_XILINX_READ_VCCAUX));
+	s.maxVccAux = TIMED("jtag.readXadcVoltage",
+		device->readXadcVoltage(JCM_XILINX_READ_MAX_VCCAUX));
+}
+
+void * XadcSampler::samplerThread() {
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (true) {
+		XadcSample s;
+		deviceLock->lock();
+		readDevice(device, s);
+		deviceLock->unlock();
+
+		pthread_mutex_lock(&lock);
+		samples[numSamples % XADC_HISTORY] = s;
+		numSamples++;
+		pthread_mutex_unlock(&lock);
+		if (onSample)
+			onSample(s);
+
+		//samples are due at fixed times, however long reading took
+		next.tv_sec += intervalMs / 1000;
+		next.tv_nsec += (intervalMs % 1000) * 1000000L;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		//if reading took longer than the interval, don't try to catch up
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (next.tv_sec < now.tv_sec ||
+				(next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec))
+			next = now;
+		pthread_mutex_lock(&lock);
+		while (!stopping && pthread_cond_timedwait(&wake, &lock, &next) == 0);
+		bool stop = stopping;
+		pthread_mutex_unlock(&lock);
+		if (stop)
+			break;
+	}
+	return NULL;
+}
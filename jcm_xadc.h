@@ -0,0 +1,123 @@
+/*
+ * Background XADC sampler. A thread reads the fpga's temperature and supply
+ * voltages at a fixed interval into a ring buffer of timestamped samples, so
+ * "read xadc" can answer from the latest sample without touching JTAG, and
+ * dashboards polling it don't take bandwidth away from scrubbing. Each new
+ * sample is also handed to a callback, which the server uses to stream
+ * samples (or summaries of them) to subscribed clients.
+ */
+
+#ifndef JCM_XADC
+#define JCM_XADC
+
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include "jcm_device.h"
+#include "jcm_ticket_lock.h"
+
+//number of samples kept
+#define XADC_HISTORY 4096
+//default ms between samples
+#define XADC_DEFAULT_INTERVAL_MS 1000
+//fastest allowed sampling, in ms between samples
+#define XADC_MIN_INTERVAL_MS 10
+
+//One reading of every XADC value, as sent to clients (32 bytes)
+struct XadcSample {
+   //when it was taken, in microseconds since the epoch
+   uint64_t timeUs;
+   //degrees C
+   float temp;
+   float maxTemp;
+   //mV
+   float vccInt;
+   float maxVccInt;
+   float vccAux;
+   float maxVccAux;
+};
+
+//min, mean and max of each value over a window of samples, as sent to
+//clients (48 bytes)
+struct XadcSummary {
+   //time of the first sample in the window, in microseconds since the epoch
+   uint64_t startUs;
+   uint32_t numSamples;
+   float tempMin, tempMean, tempMax;
+   float vccIntMin, vccIntMean, vccIntMax;
+   float vccAuxMin, vccAuxMean, vccAuxMax;
+};
+
+//Adds up samples into an XadcSummary
+class XadcWindow {
+
+public:
+
+   XadcWindow() { reset(); }
+
+   void reset();
+   void add(const XadcSample &s);
+   uint32_t count() const { return sum.numSamples; }
+   uint64_t startUs() const { return sum.startUs; }
+   //min, mean and max of everything added since the last reset
+   XadcSummary summary() const;
+
+private:
+
+   XadcSummary sum;
+   double tempTotal, vccIntTotal, vccAuxTotal;
+};
+
+class XadcSampler {
+
+public:
+
+   //onSample is called on the sampler thread after each sample
+   XadcSampler(JcmDevice *device, TicketLock *deviceLock,
+      std::function<void(const XadcSample &)> onSample);
+   ~XadcSampler();
+
+   //Starts sampling every intervalMs. Returns false if it already is.
+   bool start(u32 intervalMs);
+   //Stops sampling and waits for the sampler thread to exit. The caller
+   //must not hold the device lock.
+   void stop();
+   bool running();
+   u32 interval();
+
+   //Copies the newest sample. Returns false if there is none yet.
+   bool latest(XadcSample &sample);
+   //Copies up to n of the newest samples, oldest first
+   void history(int n, std::vector<XadcSample> &samples);
+
+   //Reads every value straight from the device (the caller must own it)
+   static void readDevice(JcmDevice *device, XadcSample &sample);
+
+   //This needs to be public so the static stub function can access it.
+   void * samplerThread();
+
+private:
+
+   JcmDevice *device;
+   TicketLock *deviceLock;
+   std::function<void(const XadcSample &)> onSample;
+
+   //protects everything below
+   pthread_mutex_t lock;
+   //signalled to wake the sampler thread early when stopping
+   pthread_cond_t wake;
+   bool isRunning;
+   bool stopping;
+   u32 intervalMs;
+   pthread_t samplerTh;
+
+   //ring buffer of the last XADC_HISTORY samples
+   XadcSample samples[XADC_HISTORY];
+   //number of samples ever taken; the newest is at (numSamples - 1) %
+   //XADC_HISTORY
+   uint64_t numSamples;
+};
+
+#endif
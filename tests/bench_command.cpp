@@ -0,0 +1,277 @@
+/*
+ * Microbenchmark of command parsing and dispatch: heap allocations and time
+ * per command, the way the server used to do it (a stringstream split into
+ * a vector of strings, passed by value down if/else chains of string
+ * compares) against the way it does now (Tokens pointing into the command
+ * and switches on verbHash, which checks the word against the verb its hash
+ * belongs to). Both dispatch the same verbs and sub-verbs to empty
+ * handlers, so only the parsing and dispatch are timed. Exits 1 if the new
+ * way allocates at all or a command goes to the wrong handler.
+ *
+ * Build from the top of the repo:
+ *    g++ -std=c++11 -O2 -I. tests/bench_command.cpp jcm_command.cpp \
+ *       -o bench_command
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "jcm_command.h"
+
+using namespace std;
+
+//times each command is parsed and dispatched
+#define BENCH_REPS 200000
+
+//every allocation made while a benchmark runs
+static size_t allocations = 0;
+
+void * operator new(size_t n) {
+	allocations++;
+	void *p = malloc(n ? n : 1);
+	if (p == NULL)
+		throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+static const char *commands[] = {
+	"read frame 0x00400000 -n 3",
+	"read idcode",
+	"r crc",
+	"write bscan 1 0xdeadbeef",
+	"options encoding rle",
+	"op codecbench",
+	"op campaign 100 seed 7 bits 2 observe crc,status",
+	"golden compare",
+	"jobs status",
+	"nosuchverb at all",
+};
+#define NUM_COMMANDS (sizeof commands / sizeof commands[0])
+
+//handler each command should reach, numbered in the order they are tested
+//below
+static const int expectedHandler[NUM_COMMANDS] = { 1, 2, 3, 5, 6, 8, 9, 11, 12,
+	0 };
+
+//what the handlers were reached with, so none of it can be optimised away
+static volatile int handled;
+static volatile size_t words;
+
+//the old way
+
+static vector<string> parseByWhiteSpace(string command) {
+	stringstream iss(command);
+	vector<string> v;
+	string tmp;
+	while (iss >> tmp)
+		v.push_back(tmp);
+	return v;
+}
+
+static void oldHandle(int h, vector<string> c) {
+	handled = h;
+	words = c.size();
+}
+
+static void oldRead(vector<string> c) {
+	if (c[1] == "frame" || c[1] == "f")
+		oldHandle(1, c);
+	else if (c[1] == "idcode")
+		oldHandle(2, c);
+	else if (c[1] == "crc")
+		oldHandle(3, c);
+	else if (c[1] == "status")
+		oldHandle(4, c);
+	else
+		oldHandle(0, c);
+}
+
+static void oldOperation(vector<string> c) {
+	if (c[1] == "blindscrub")
+		oldHandle(7, c);
+	else if (c[1] == "codecbench")
+		oldHandle(8, c);
+	else if (c[1] == "campaign")
+		oldHandle(9, c);
+	else
+		oldHandle(0, c);
+}
+
+static void oldCommand(string command) {
+	vector<string> c = parseByWhiteSpace(command);
+	if (c.size() < 2)
+		oldHandle(0, c);
+	else if (c[0] == "read" || c[0] == "r")
+		oldRead(c);
+	else if (c[0] == "write" || c[0] == "w")
+		oldHandle(c[1] == "bscan" ? 5 : 0, c);
+	else if (c[0] == "options" || c[0] == "o")
+		oldHandle(6, c);
+	else if (c[0] == "op")
+		oldOperation(c);
+	else if (c[0] == "golden")
+		oldHandle(c[1] == "capture" ? 10 : c[1] == "compare" ? 11 : 0, c);
+	else if (c[0] == "jobs")
+		oldHandle(12, c);
+	else
+		oldHandle(0, c);
+}
+
+//the new way
+
+static void newHandle(int h, const Tokens &c) {
+	handled = h;
+	words = c.size();
+}
+
+static void newRead(const Tokens &c) {
+	switch (verbHash(c[1])) {
+	case verbHash("frame"):
+	case verbHash("f"):
+		newHandle(1, c);
+		break;
+	case verbHash("idcode"):
+		newHandle(2, c);
+		break;
+	case verbHash("crc"):
+		newHandle(3, c);
+		break;
+	case verbHash("status"):
+		newHandle(4, c);
+		break;
+	default:
+		newHandle(0, c);
+	}
+}
+
+static void newOperation(const Tokens &c) {
+	switch (verbHash(c[1])) {
+	case verbHash("blindscrub"):
+		newHandle(7, c);
+		break;
+	case verbHash("codecbench"):
+		newHandle(8, c);
+		break;
+	case verbHash("campaign"):
+		newHandle(9, c);
+		break;
+	default:
+		newHandle(0, c);
+	}
+}
+
+static void newCommand(const char *command, size_t len) {
+	Tokens c;
+	if (!tokenize(command, len, c) || c.size() < 2) {
+		newHandle(0, c);
+		return;
+	}
+	switch (verbHash(c[0])) {
+	case verbHash("read"):
+	case verbHash("r"):
+		newRead(c);
+		break;
+	case verbHash("write"):
+	case verbHash("w"):
+		newHandle(c[1] == "bscan" ? 5 : 0, c);
+		break;
+	case verbHash("options"):
+	case verbHash("o"):
+		newHandle(6, c);
+		break;
+	case verbHash("op"):
+		newOperation(c);
+		break;
+	case verbHash("golden"):
+		newHandle(c[1] == "capture" ? 10 : c[1] == "compare" ? 11 : 0, c);
+		break;
+	case verbHash("jobs"):
+		newHandle(12, c);
+		break;
+	default:
+		newHandle(0, c);
+	}
+}
+
+static uint64_t nowNs() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int main() {
+	//the old way was handed a string made from the receive buffer
+	vector<string> asStrings(commands, commands + NUM_COMMANDS);
+	size_t lengths[NUM_COMMANDS];
+	for (size_t i = 0; i < NUM_COMMANDS; i++)
+		lengths[i] = strlen(commands[i]);
+
+	//a word holding a NUL is only equal to all of itself
+	static const char withNul[] = "ab\0cd";
+	if (Token(withNul, 5) == "ab" || Token(withNul, 2) != "ab" ||
+			Token(withNul, 2) == "abc") {
+		printf("FAIL: Token compares past the end of a word or a string\n");
+		return 1;
+	}
+
+	//only a word that is a verb is switched on as one
+	if (verbHash(Token("read", 4)) != verbHash("read") ||
+			verbHash(Token("reads", 5)) != 0 || verbHash(Token("rea", 3)) != 0 ||
+			verbHash(Token("read\0", 5)) != 0) {
+		printf("FAIL: verbHash takes a word that isn't a verb for one\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < NUM_COMMANDS; i++) {
+		oldCommand(asStrings[i]);
+		int oldHandler = handled;
+		newCommand(commands[i], lengths[i]);
+		if (oldHandler != expectedHandler[i] || handled != expectedHandler[i]) {
+			printf("FAIL: \"%s\" went to handler %d the old way and %d the new "
+				"way, not %d\n", commands[i], oldHandler, handled,
+				expectedHandler[i]);
+			return 1;
+		}
+	}
+
+	size_t numCommands = (size_t) BENCH_REPS * NUM_COMMANDS;
+	allocations = 0;
+	uint64_t begin = nowNs();
+	for (int rep = 0; rep < BENCH_REPS; rep++)
+		for (size_t i = 0; i < NUM_COMMANDS; i++)
+			oldCommand(asStrings[i]);
+	uint64_t oldNs = nowNs() - begin;
+	size_t oldAllocations = allocations;
+
+	allocations = 0;
+	begin = nowNs();
+	for (int rep = 0; rep < BENCH_REPS; rep++)
+		for (size_t i = 0; i < NUM_COMMANDS; i++)
+			newCommand(commands[i], lengths[i]);
+	uint64_t newNs = nowNs() - begin;
+	size_t newAllocations = allocations;
+
+	printf("%zu commands each way\n", numCommands);
+	printf("%-28s %14s %12s\n", "", "allocs/command", "ns/command");
+	printf("%-28s %14.1f %12.1f\n", "stringstream, if/else", (double)
+		oldAllocations / numCommands, (double) oldNs / numCommands);
+	printf("%-28s %14.1f %12.1f\n", "Tokens, verbHash switch", (double)
+		newAllocations / numCommands, (double) newNs / numCommands);
+
+	if (newAllocations != 0) {
+		printf("FAIL: tokenizing and dispatching allocated %zu times\n",
+			newAllocations);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Round trips every frame encoding: frames encoded then decoded must come
+ * back exactly, for lengths from nothing to a whole pipeline chunk and for
+ * data that is all zeros, mostly zeros, repeating, random and (for xor)
+ * golden with a few bits flipped. Each encoded block is also decoded with
+ * its last byte cut off, which must be rejected. Exits 1 on the first
+ * failure.
+ *
+ * Build from the top of the repo:
+ *    g++ -std=c++11 -O2 -I. tests/test_codec.cpp jcm_codec.cpp -o test_codec
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "jcm_codec.h"
+
+using namespace std;
+
+//words in a 7 series frame, and frames in a pipeline chunk
+#define TEST_FRAME_WORDS 101
+#define TEST_CHUNK_FRAMES 64
+//random blocks tried of each kind of data at each length
+#define CASES_PER_LENGTH 20
+
+#define DATA_ZEROS 0
+#define DATA_SPARSE 1
+#define DATA_REPEATING 2
+#define DATA_RANDOM 3
+#define DATA_NEAR_GOLDEN 4
+#define NUM_DATA_KINDS 5
+
+static const char *dataNames[NUM_DATA_KINDS] = { "zeros", "sparse", "repeating",
+	"random", "near golden" };
+
+static uint32_t randomWord(unsigned int *seed) {
+	return rand_r(seed) ^ ((uint32_t) rand_r(seed) << 16);
+}
+
+//ref is the golden copy xor encodes against
+static void makeData(unsigned int *seed, int kind, size_t numWords,
+		vector<uint32_t> &words, vector<uint32_t> &ref) {
+	words.assign(numWords, 0);
+	ref.resize(numWords);
+	for (size_t i = 0; i < numWords; i++)
+		ref[i] = rand_r(seed) % 3 == 0 ? randomWord(seed) : 0;
+	switch (kind) {
+	case DATA_SPARSE:
+		for (size_t i = 0; i < numWords; i++)
+			if (rand_r(seed) % 16 == 0)
+				words[i] = randomWord(seed);
+		break;
+	case DATA_REPEATING:
+		//the same frame over and over, as in unused parts of the device
+		for (size_t i = 0; i < numWords; i++)
+			words[i] = i < TEST_FRAME_WORDS ? randomWord(seed) :
+				words[i - TEST_FRAME_WORDS];
+		break;
+	case DATA_RANDOM:
+		for (size_t i = 0; i < numWords; i++)
+			words[i] = randomWord(seed);
+		break;
+	case DATA_NEAR_GOLDEN:
+		words = ref;
+		for (int flips = numWords ? rand_r(seed) % 4 : 0; flips > 0; flips--)
+			words[rand_r(seed) % numWords] ^= 1u << (rand_r(seed) % 32);
+		break;
+	}
+}
+
+int main() {
+	size_t lengths[] = { 0, 1, 2, 3, 4, 5, 16, 17, TEST_FRAME_WORDS,
+		2 * TEST_FRAME_WORDS + 7, 8 * TEST_FRAME_WORDS,
+		TEST_CHUNK_FRAMES * TEST_FRAME_WORDS };
+	unsigned int seed = 1;
+	vector<uint32_t> words, ref, scratch, decoded;
+	vector<uint8_t> block;
+	//so no buffer is ever NULL, even when there are no words
+	scratch.reserve(1);
+	block.reserve(1);
+	int cases = 0;
+	for (size_t l = 0; l < sizeof lengths / sizeof lengths[0]; l++) {
+		size_t numWords = lengths[l];
+		for (int kind = 0; kind < NUM_DATA_KINDS; kind++)
+			for (int c = 0; c < CASES_PER_LENGTH; c++) {
+				makeData(&seed, kind, numWords, words, ref);
+				words.reserve(1);
+				ref.reserve(1);
+				for (int e = 0; e < NUM_ENCODINGS; e++) {
+					block.clear();
+					encodeFrames(e, words.data(), numWords, ref.data(), scratch, block);
+					//a sentinel either side of the output catches overruns
+					decoded.assign(numWords + 2, 0xdeadbeef);
+					bool ok = decodeFrames(e, block.data(), block.size(), ref.data(),
+						&decoded[1], numWords);
+					bool same = ok && decoded[0] == 0xdeadbeef &&
+						decoded[numWords + 1] == 0xdeadbeef &&
+						memcmp(&decoded[1], words.data(), numWords * sizeof(uint32_t)) == 0;
+					//cutting off the last byte always loses data, except for an
+					//empty lz block, which is one token byte saying so
+					bool truncatedOk = !block.empty() &&
+						(e != ENCODING_LZ || numWords > 0) &&
+						decodeFrames(e, block.data(), block.size() - 1, ref.data(),
+							&decoded[1], numWords);
+					if (!same || truncatedOk) {
+						printf("FAIL: %s: %zu words of %s data, case %d: %s\n",
+							encodingName(e), numWords, dataNames[kind], c,
+							!ok ? "didn't decode" : !same ? "decoded differently" :
+							"decoded with its last byte missing");
+						return 1;
+					}
+				}
+				cases++;
+			}
+	}
+
+	//and the names go both ways
+	for (int e = 0; e < NUM_ENCODINGS; e++)
+		if (parseEncoding(encodingName(e)) != e) {
+			printf("FAIL: encoding %d is called %s, which parses as %d\n", e,
+				encodingName(e), parseEncoding(encodingName(e)));
+			return 1;
+		}
+
+	printf("PASS: %d cases round tripped in every encoding\n", cases);
+	return 0;
+}
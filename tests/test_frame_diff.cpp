@@ -0,0 +1,109 @@
+/*
+ * Checks every frame compare kernel this cpu can run against the scalar
+ * reference: the same count and the same upsets, in the same order, for
+ * random frames of every length around the 16 word blocks the vector
+ * versions work in, with and without a mask. Exits 1 on the first
+ * difference.
+ *
+ * Build from the top of the repo:
+ *    g++ -std=c++11 -O2 -I. tests/test_frame_diff.cpp jcm_frame_diff.cpp \
+ *       -o test_frame_diff
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "jcm_frame_diff.h"
+
+using namespace std;
+
+//number of random frames tried at each length
+#define CASES_PER_LENGTH 200
+//longest frame tried, in words (a 7 series frame is 101)
+#define MAX_TEST_WORDS 140
+
+static bool sameUpsets(const vector<Upset> &a, const vector<Upset> &b) {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++)
+		if (a[i].frameAddress != b[i].frameAddress || a[i].word != b[i].word ||
+				a[i].bit != b[i].bit || a[i].value != b[i].value)
+			return false;
+	return true;
+}
+
+//golden is random; frame is golden with a few bits flipped (or, now and
+//then, every word different), so both the skip and the pick apart paths of
+//the vector versions are taken
+static void makeFrames(unsigned int *seed, int numWords, vector<uint32_t> &frame,
+		vector<uint32_t> &golden, vector<uint32_t> &mask) {
+	golden.resize(numWords);
+	mask.resize(numWords);
+	for (int w = 0; w < numWords; w++) {
+		golden[w] = rand_r(seed) ^ (rand_r(seed) << 16);
+		mask[w] = rand_r(seed) % 4 == 0 ? rand_r(seed) : 0;
+	}
+	frame = golden;
+	if (numWords == 0)
+		return;
+	if (rand_r(seed) % 8 == 0)
+		for (int w = 0; w < numWords; w++)
+			frame[w] = rand_r(seed);
+	else
+		for (int flips = rand_r(seed) % 6; flips > 0; flips--)
+			frame[rand_r(seed) % numWords] ^= 1u << (rand_r(seed) % 32);
+}
+
+int main() {
+	vector<pair<const char *, DiffFunction> > kernels;
+	diffKernels(kernels);
+	printf("kernels:");
+	for (size_t k = 0; k < kernels.size(); k++)
+		printf(" %s", kernels[k].first);
+	printf("\n");
+
+	unsigned int seed = 1;
+	vector<uint32_t> frame, golden, mask;
+	vector<Upset> expected, got;
+	int cases = 0;
+	for (int numWords = 0; numWords <= MAX_TEST_WORDS; numWords++)
+		for (int c = 0; c < CASES_PER_LENGTH; c++) {
+			makeFrames(&seed, numWords, frame, golden, mask);
+			uint32_t frameAddress = rand_r(&seed);
+			const uint32_t *m = c % 2 ? &mask[0] : NULL;
+			//keeps the vectors' data non-NULL when numWords is 0
+			frame.push_back(0);
+			golden.push_back(0);
+
+			expected.clear();
+			int n = diffFrameScalar(frameAddress, &frame[0], &golden[0], m, numWords,
+				&expected);
+			for (size_t k = 1; k < kernels.size(); k++) {
+				got.clear();
+				int gotN = kernels[k].second(frameAddress, &frame[0], &golden[0], m,
+					numWords, &got);
+				int countOnly = kernels[k].second(frameAddress, &frame[0], &golden[0],
+					m, numWords, NULL);
+				if (gotN != n || countOnly != n || !sameUpsets(expected, got)) {
+					printf("FAIL: %s: %d words, case %d, %s mask: %d bits (%d "
+						"counting only), scalar %d\n", kernels[k].first, numWords, c,
+						m ? "with" : "no", gotN, countOnly, n);
+					return 1;
+				}
+			}
+			cases++;
+		}
+
+	//and diffFrame goes through whichever is selected
+	setDiffKernel(DIFF_KERNEL_SCALAR);
+	if (strcmp(diffKernelName(), "scalar") != 0) {
+		printf("FAIL: selecting the scalar kernel gave %s\n", diffKernelName());
+		return 1;
+	}
+	setDiffKernel(DIFF_KERNEL_SIMD);
+	printf("diffFrame uses %s\n", diffKernelName());
+
+	printf("PASS: %d cases, every kernel agrees with scalar\n", cases);
+	return 0;
+}